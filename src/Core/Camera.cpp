@@ -77,20 +77,27 @@ bool Camera::loadImageWithOpenCV()
 {
 	if (img.empty())
 	{
-		VLOG(1) << "Loading image '" << imageName << "'";
-		img = cv::imread(imageName, cv::IMREAD_COLOR);
-
+		img = readImageWithOpenCV();
 		if (img.empty())
-		{
-			LOG(WARNING) << "Loading image '" << imageName << "' failed.";
 			return false;
-		}
 	}
 
 	return true;
 }
 
 
+cv::Mat Camera::readImageWithOpenCV() const
+{
+	VLOG(1) << "Loading image '" << imageName << "'";
+	cv::Mat image = cv::imread(imageName, cv::IMREAD_COLOR);
+
+	if (image.empty())
+		LOG(WARNING) << "Loading image '" << imageName << "' failed.";
+
+	return image;
+}
+
+
 Eigen::Matrix4f Camera::getProjection44()
 {
 	Eigen::Matrix4f _P;
@@ -75,6 +75,9 @@ public:
 
 	bool loadImageWithOpenCV();
 
+	// Reads the image from disk without keeping it in the camera (empty if reading failed).
+	cv::Mat readImageWithOpenCV() const;
+
 	inline cv::Mat getImage() const { return img; }
 	inline void setImage(cv::Mat _img) { img = _img; }
 
@@ -80,6 +80,7 @@ CameraSetupDataset::~CameraSetupDataset()
 	// Clear flows.
 	forwardFlows.clear();
 	backwardFlows.clear();
+	flowConsistency.clear();
 
 	//TODO: point cloud?
 }
@@ -185,6 +186,31 @@ bool CameraSetupDataset::loadFromCache(CameraSetupSettings* settings)
 
 	settings->downsampleFlow = root["Dataset"]["Flow"]["Downsampled"].asInt();
 
+	// Older datasets only know whether the flows have half resolution.
+	settings->flowResolution = settings->downsampleFlow > 0 ? 0.5f : 1.f;
+	if (root["Dataset"]["Flow"].isMember("Resolution"))
+		settings->flowResolution = root["Dataset"]["Flow"]["Resolution"].asFloat();
+
+	// Flows of equirectangular images may only cover a band of latitudes.
+	settings->flowMaxLatitude = 90.f;
+	if (root["Dataset"]["Flow"].isMember("MaxLatitude"))
+		settings->flowMaxLatitude = root["Dataset"]["Flow"]["MaxLatitude"].asFloat();
+
+	// The flow archive is stored relative to the cache folder, so it moves along with it.
+	flowArchive.clear();
+	if (root["Dataset"]["Flow"].isMember("Archive"))
+		flowArchive = pathToCacheFolder + "/" + root["Dataset"]["Flow"]["Archive"].asString();
+
+	// The confidence images are also stored relative to the cache folder.
+	flowConsistency.clear();
+	for (auto& value : root["Dataset"]["Flow"]["Consistency"])
+	{
+		FlowPairConsistency pair = FlowPairConsistency::fromJson(value);
+		pair.forwardConfidence = pathToCacheFolder + "/" + pair.forwardConfidence;
+		pair.backwardConfidence = pathToCacheFolder + "/" + pair.backwardConfidence;
+		flowConsistency.push_back(pair);
+	}
+
 	// Read the fitted camera circle.
 	auto& camera_circle_json = root["Dataset"]["CameraCircle"];
 	Vector3f centroid = json_to_eigen_vec(camera_circle_json["Centroid"],  "X",  "Y",  "Z");
@@ -314,7 +340,18 @@ void CameraSetupDataset::save(CameraSetupSettings* settings)
 	root["Dataset"]["Flow"]["Brox"]["OuterIterations"] = settings->broxFlowParams.outerIterations;
 	root["Dataset"]["Flow"]["Brox"]["ScaleFactor"] = settings->broxFlowParams.scaleFactor;
 	root["Dataset"]["Flow"]["Brox"]["SolverIterations"] = settings->broxFlowParams.solverIterations;
-	root["Dataset"]["Flow"]["Downsampled"] = settings->downsampleFlow;
+	root["Dataset"]["Flow"]["Downsampled"] = settings->flowResolution == 0.5f ? 1 : 0;
+	root["Dataset"]["Flow"]["Resolution"] = settings->flowResolution;
+	if (settings->useEquirectCamera && settings->flowMaxLatitude < 90.f)
+		root["Dataset"]["Flow"]["MaxLatitude"] = settings->flowMaxLatitude;
+	if (!flowArchive.empty())
+		root["Dataset"]["Flow"]["Archive"] = fs::path(flowArchive).filename().generic_string();
+	for (FlowPairConsistency pair : flowConsistency)
+	{
+		pair.forwardConfidence = fs::path(pair.forwardConfidence).filename().generic_string();
+		pair.backwardConfidence = fs::path(pair.backwardConfidence).filename().generic_string();
+		root["Dataset"]["Flow"]["Consistency"].append(pair.toJson());
+	}
 
 	// Write JSON
 	std::ofstream file(filename.c_str(), std::ios::trunc);
@@ -617,6 +654,15 @@ std::string CameraSetupDataset::generateCacheFilename()
 }
 
 
+std::string CameraSetupDataset::generateProfileFilename()
+{
+	std::stringstream ss;
+	ss << std::setw(4) << std::setfill('0') << getCameraSetup()->getNumberOfCameras();
+	std::string jsonFilename = pathToCacheFolder + "/PreprocessingProfile-" + ss.str() + ".json";
+	return jsonFilename;
+}
+
+
 void CameraSetupDataset::centreDatasetAtOrigin()
 {
 	Eigen::IOFormat CleanFmt(4, 0, ", ", "\n", "[", "]");
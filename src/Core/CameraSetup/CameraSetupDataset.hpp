@@ -5,6 +5,7 @@
 #include "Core/Geometry/Cylinder.hpp"
 #include "Core/Geometry/PointCloud.hpp"
 #include "Core/Geometry/Sphere.hpp"
+#include "Core/OpticalFlow/FlowConsistency.hpp"
 
 
 /** 
@@ -51,12 +52,19 @@ public:
 	std::vector<std::string> forwardFlows;
 	std::vector<std::string> backwardFlows;
 
+	//path to the packed flow archive (empty if there is none), preferred by the FlowLoader
+	std::string flowArchive;
+
+	//forward-backward consistency of the flows of each neighbouring pair (empty if not computed)
+	std::vector<FlowPairConsistency> flowConsistency;
+
 	inline void setSfmLoader(std::shared_ptr<MultiViewDataLoader> _sfmLoader) { sfmLoader = _sfmLoader; }
 
 	inline std::shared_ptr<PointCloud> getWorldPointCloud() const { return worldPointCloud; }
 	inline void setWorldPointCloud(std::shared_ptr<PointCloud> wpc) { worldPointCloud = wpc; }
 
 	std::string generateCacheFilename();
+	std::string generateProfileFilename(); // profiling report of the preprocessing, next to the cache file
 	void sortCameras();
 	void centreDatasetAtOrigin();
 
@@ -45,10 +45,46 @@ int CameraSetupSettings::readSettingsFromFile(const string& pathToFile, CameraSe
 	fs["Preprocessing"]["ChangeBasis"] >> changeBasis;
 	fs["Preprocessing"]["ShapeFit"] >> shapeFit;
 	fs["Preprocessing"]["DownsampleFlow"] >> downsampleFlow;
+	flowResolution = downsampleFlow > 0 ? 0.5f : 1.f;
 	fs["Preprocessing"]["ComputeOpticalFlow"] >> computeOpticalFlow;
 	if (computeOpticalFlow > 0)
 	{
 		fs["Preprocessing"]["OpticalFlowMethod"] >> opticalFlowMethod;
+		if (!fs["Preprocessing"]["OpticalFlowThreads"].empty())
+			fs["Preprocessing"]["OpticalFlowThreads"] >> opticalFlowThreads;
+		if (!fs["Preprocessing"]["OpticalFlowQueueDepth"].empty())
+			fs["Preprocessing"]["OpticalFlowQueueDepth"] >> opticalFlowQueueDepth;
+		if (!fs["Preprocessing"]["UseFlowCache"].empty())
+			fs["Preprocessing"]["UseFlowCache"] >> useFlowCache;
+		if (!fs["Preprocessing"]["DISWarmStart"].empty())
+			fs["Preprocessing"]["DISWarmStart"] >> disWarmStart;
+		if (!fs["Preprocessing"]["FlowFileFormat"].empty())
+			fs["Preprocessing"]["FlowFileFormat"] >> flowFileFormat;
+		if (!fs["Preprocessing"]["FlowArchive"].empty())
+			fs["Preprocessing"]["FlowArchive"] >> flowArchive;
+		if (!fs["Preprocessing"]["StreamImages"].empty())
+			fs["Preprocessing"]["StreamImages"] >> streamImages;
+		if (!fs["Preprocessing"]["ImagePrefetch"].empty())
+			fs["Preprocessing"]["ImagePrefetch"] >> imagePrefetch;
+		if (!fs["Preprocessing"]["FlowTileSize"].empty())
+			fs["Preprocessing"]["FlowTileSize"] >> flowTileSize;
+		if (!fs["Preprocessing"]["FlowTileOverlap"].empty())
+			fs["Preprocessing"]["FlowTileOverlap"] >> flowTileOverlap;
+		if (!fs["Preprocessing"]["FlowMaxConcurrentTiles"].empty())
+			fs["Preprocessing"]["FlowMaxConcurrentTiles"] >> flowMaxConcurrentTiles;
+		if (!fs["Preprocessing"]["FlowMaxLatitude"].empty())
+			fs["Preprocessing"]["FlowMaxLatitude"] >> flowMaxLatitude;
+		if (!fs["Preprocessing"]["FlowConsistency"].empty())
+			fs["Preprocessing"]["FlowConsistency"] >> flowConsistency;
+		if (!fs["Preprocessing"]["FlowResolution"].empty())
+		{
+			float resolution = 0;
+			fs["Preprocessing"]["FlowResolution"] >> resolution;
+			if (resolution > 0)
+				flowResolution = resolution;
+		}
+		if (!fs["Preprocessing"]["FlowMegapixels"].empty())
+			fs["Preprocessing"]["FlowMegapixels"] >> flowMegapixels;
 
 		// TODO: This overwrites the default values if the settings are missing in the config file.
 		fs["Preprocessing"]["FlowOCVBrox2004Parameters"]["Alpha"] >> broxFlowParams.alpha;
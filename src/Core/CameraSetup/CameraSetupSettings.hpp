@@ -59,6 +59,38 @@ public:
 	VideoParameters videoParams;
 	BroxFlowParameters broxFlowParams;
 	int downsampleFlow;
+	// Resolution of the flows relative to the images (0.5 with DownsampleFlow).
+	float flowResolution = 1.f;
+	// Compute the flows at this many megapixels instead (0 = use flowResolution).
+	float flowMegapixels = 0.f;
+
+	// Number of flow pairs computed in parallel (0 = one per hardware thread).
+	int opticalFlowThreads = 0;
+	// Number of image pairs buffered between the flow pipeline stages (0 = number of threads).
+	int opticalFlowQueueDepth = 0;
+	// Reuse flows of previously seen image pairs from the shared flow cache in the Cache folder.
+	int useFlowCache = 1;
+	// Initialise DIS with the flow of the previous pair (faster, slightly different flows; disables the flow cache).
+	int disWarmStart = 0;
+	// File format of the individual flow fields (.floss, or the losslessly compressed .flz).
+	std::string flowFileFormat = ".floss";
+	// Also pack all flows into a single archive in the cache folder, which the viewer memory-maps.
+	int flowArchive = 1;
+	// Read images from disk during the flow computation instead of loading all of them up front.
+	int streamImages = 0;
+	// Number of images decoded ahead of the flow computation when streaming images.
+	int imagePrefetch = 2;
+	// Compute the flow of larger images in overlapping tiles of this size to bound memory (0 = never).
+	int flowTileSize = 0;
+	// Overlap between neighbouring flow tiles in pixels (larger than the largest expected flow).
+	int flowTileOverlap = 128;
+	// Number of tiles of one pair computed at the same time (0 = one per thread). The pairs are
+	// already computed in parallel, so more tiles at a time mostly cost memory.
+	int flowMaxConcurrentTiles = 1;
+	// Only compute the flow of equirectangular images up to this latitude in degrees (90 = full height).
+	float flowMaxLatitude = 90.f;
+	// Check the forward and backward flow of each pair against each other and save confidence images.
+	int flowConsistency = 1;
 
 	// Geometry
 	float max3DPointError = -1.0f;
@@ -49,6 +49,8 @@ struct DisplaySettings
 
 	bool opticalFlowLoaded = false;
 	int useOpticalFlow = 0;
+	float flowScale = 1.0f; // converts values of the flow textures to pixels (for fixed-point flows)
+	Eigen::Vector2f flowRegion = { 0.f, 1.f }; // rows covered by the flow textures, as [top, bottom) in texture coordinates
     
 	float lookAtDirection = 0.0f; // [deg]
 	float lookAtDistance = 1000.0f; // [cm]
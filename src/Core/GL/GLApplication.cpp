@@ -1,6 +1,7 @@
 #include "GLApplication.hpp"
 
 #include "Utils/Logger.hpp"
+#include "Utils/Trace.hpp"
 
 #ifdef WITH_OPENVR
 	#include "Core/GUI/VRInterface.hpp"
@@ -106,6 +107,8 @@ void GLApplication::postRender()
 */
 void GLApplication::render()
 {
+	TRACE_SCOPE("GLApplication::render");
+
 #ifdef WITH_OPENVR
 	if (enableVR) // use OpenVR for VR rendering
 	{
@@ -31,6 +31,7 @@ GLenum getGLType(const string& in)
 	if (in == "GL_UNSIGNED_BYTE")  return GL_UNSIGNED_BYTE;
 	if (in == "GL_FLOAT")          return GL_FLOAT;
 	if (in == "GL_UNSIGNED_SHORT") return GL_UNSIGNED_SHORT;
+	if (in == "GL_SHORT")          return GL_SHORT;
 	// clang-format on
 
 	LOG(WARNING) << "Couldn't find GL constant for the image type for the string: " << in;
@@ -50,6 +51,7 @@ GLuint getGLInternalFormat(const string& in)
 	if (in == "GL_RGB8")    return GL_RGB8;
 
 	if (in == "GL_RG16F")   return GL_RG16F;
+	if (in == "GL_RG16_SNORM") return GL_RG16_SNORM;
 
 	if (in == "GL_R32F")    return GL_R32F;
 	if (in == "GL_R16F")    return GL_R16F;
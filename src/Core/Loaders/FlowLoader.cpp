@@ -3,26 +3,28 @@
 #include "3rdParty/fs_std.hpp"
 
 #include "Core/GL/GLFormats.hpp"
+#include "Core/OpticalFlow/FlowParameters.hpp"
 
 #include "Utils/ErrorChecking.hpp"
 #include "Utils/FlowIO.hpp"
 #include "Utils/Logger.hpp"
 #include "Utils/Timer.hpp"
+#include "Utils/Trace.hpp"
 #include "Utils/cvutils.hpp"
 
 
-FlowLoader::FlowLoader(bool _downsampleFlow, const Eigen::Vector2i& _imgDims)
+FlowLoader::FlowLoader(float _flowResolution, const Eigen::Vector2i& _imgDims)
 {
-	downsampleFlow = _downsampleFlow;
+	flowResolution = _flowResolution;
 	imgDims = _imgDims;
 	numberOfFlows = 1;
 }
 
 
-FlowLoader::FlowLoader(bool _downsampleFlow, const Eigen::Vector2i& _imgDims,
+FlowLoader::FlowLoader(float _flowResolution, const Eigen::Vector2i& _imgDims,
                        std::vector<std::string>* _forwardFlowFiles,
                        std::vector<std::string>* _backwardFlowFiles) :
-    FlowLoader(_downsampleFlow, _imgDims)
+    FlowLoader(_flowResolution, _imgDims)
 {
 	if (_forwardFlowFiles != nullptr && _backwardFlowFiles != nullptr)
 	{
@@ -44,6 +46,14 @@ FlowLoader::FlowLoader(bool _downsampleFlow, const Eigen::Vector2i& _imgDims,
 }
 
 
+FlowLoader::FlowLoader(float _flowResolution, const Eigen::Vector2i& _imgDims, const std::string& _flowArchiveFile) :
+    FlowLoader(_flowResolution, _imgDims)
+{
+	flowArchiveFile = _flowArchiveFile;
+	flowArchive = new FlowArchive();
+}
+
+
 FlowLoader::~FlowLoader()
 {
 	releaseCPUMemory();
@@ -53,7 +63,18 @@ FlowLoader::~FlowLoader()
 
 void FlowLoader::loadTextures()
 {
-	if (forwardFlowFiles.size() > 0 && backwardFlowFiles.size() > 0)
+	TRACE_SCOPE("FlowLoader::loadTextures");
+	if (flowArchive)
+	{
+		// Nothing to read: the layers are uploaded straight from the mapped archive.
+		ScopedTimer timer;
+		if (!flowArchive->isOpen())
+			flowArchive->open(flowArchiveFile);
+
+		LOG(INFO) << "Mapped " << flowArchive->getNumberOfLayers() << " flow fields from '" << flowArchiveFile << "' in "
+		          << std::fixed << std::setprecision(2) << timer.getElapsedSeconds() << "s";
+	}
+	else if (forwardFlowFiles.size() > 0 && backwardFlowFiles.size() > 0)
 	{
 		assert(forwardFlowFiles.size() == backwardFlowFiles.size());
 		ScopedTimer timer;
@@ -66,13 +87,20 @@ void FlowLoader::loadTextures()
 #endif
 		for (int i = 0; i < forwardFlowFiles.size(); i++)
 		{
+			TRACE_SCOPE("FlowLoader::loadFlows");
 			LOG(INFO) << "Loading flow (" << (i + 1) << " of " << forwardFlowFiles.size() << ")";
 
-			cv::Mat2f forwardFlow = readFlowFile(forwardFlowFiles[i]);
-			cv::Mat2f backwardFlow = readFlowFile(backwardFlowFiles[i]);
-
-			forwardFlows_list->at(i) = forwardFlow;
-			backwardFlows_list->at(i) = backwardFlow;
+			if (fixedPointFlows)
+			{
+				// Keep .floss/.flz flows in 16-bit fixed point, which halves memory and upload bandwidth.
+				forwardFlows_list->at(i) = readFixedPointFlowFile(forwardFlowFiles[i]);
+				backwardFlows_list->at(i) = readFixedPointFlowFile(backwardFlowFiles[i]);
+			}
+			else
+			{
+				forwardFlows_list->at(i) = readFlowFile(forwardFlowFiles[i]);
+				backwardFlows_list->at(i) = readFlowFile(backwardFlowFiles[i]);
+			}
 		}
 
 		LOG(INFO) << "Loaded " << (forwardFlowFiles.size() + backwardFlowFiles.size()) << " flow fields in "
@@ -81,11 +109,30 @@ void FlowLoader::loadTextures()
 }
 
 
+Eigen::Vector2i FlowLoader::getFlowDims() const
+{
+	const int width = getFlowLength(imgDims.x(), flowResolution);
+	const int height = getFlowLength(imgDims.y(), flowResolution);
+	return Eigen::Vector2i(width, height - 2 * getPoleRows(height, maxLatitude));
+}
+
+
+Eigen::Vector2f FlowLoader::getFlowRegion() const
+{
+	const int height = getFlowLength(imgDims.y(), flowResolution);
+	const float poleRows = (float)getPoleRows(height, maxLatitude);
+	return Eigen::Vector2f(poleRows / height, 1.f - poleRows / height);
+}
+
+
 void FlowLoader::initTextures()
 {
-	Eigen::Vector2i flowDims = imgDims;
-	if (downsampleFlow)
-		flowDims /= 2;
+	const Eigen::Vector2i flowDims = getFlowDims();
+
+	// Fixed-point flows stay in 16 bits, which the shader rescales using getFlowScale().
+	const bool fixedPoint = flowArchive || fixedPointFlows;
+	const char* flowType = fixedPoint ? "GL_SHORT" : "GL_FLOAT";
+	const char* flowInternalFormat = fixedPoint ? "GL_RG16_SNORM" : "GL_RG16F";
 
 	// Forward flow
 	ErrorChecking::checkGLError();
@@ -95,7 +142,7 @@ void FlowLoader::initTextures()
 	}
 	else
 	{
-		GLMemoryLayout memLayout = GLMemoryLayout(numberOfFlows, 2, "GL_RG", "GL_FLOAT", "GL_RG16F"); // these are settings from config.yaml
+		GLMemoryLayout memLayout = GLMemoryLayout(numberOfFlows, 2, "GL_RG", flowType, flowInternalFormat);
 		GLTextureLayout texLayout = GLTextureLayout(memLayout, flowDims, "set in app", -1);
 		forwardFlowTexture = new GLTexture(texLayout, "GL_TEXTURE_2D_ARRAY");
 	}
@@ -110,7 +157,7 @@ void FlowLoader::initTextures()
 
 	glTexStorage3D(GL_TEXTURE_2D_ARRAY,
 	               1,
-	               getGLInternalFormat(forwardFlowTexture->layout.mem.internalFormat), // "GL_RG16F"
+	               getGLInternalFormat(forwardFlowTexture->layout.mem.internalFormat), // "GL_RG16F" or "GL_RG16_SNORM"
 	               forwardFlowTexture->layout.resolution.x(),
 	               forwardFlowTexture->layout.resolution.y(),
 	               (GLsizei)forwardFlowTexture->layout.mem.elements);
@@ -129,7 +176,7 @@ void FlowLoader::initTextures()
 	}
 	else
 	{
-		GLMemoryLayout memLayout = GLMemoryLayout(numberOfFlows, 2, "GL_RG", "GL_FLOAT", "GL_RG16F"); // these are settings from config.yaml
+		GLMemoryLayout memLayout = GLMemoryLayout(numberOfFlows, 2, "GL_RG", flowType, flowInternalFormat);
 		GLTextureLayout texLayout = GLTextureLayout(memLayout, flowDims, "set in app", -1);
 		backwardFlowTexture = new GLTexture(texLayout, "GL_TEXTURE_2D_ARRAY");
 	}
@@ -144,7 +191,7 @@ void FlowLoader::initTextures()
 
 	glTexStorage3D(GL_TEXTURE_2D_ARRAY,
 	               1,
-	               getGLInternalFormat(backwardFlowTexture->layout.mem.internalFormat), // "GL_RG16F"
+	               getGLInternalFormat(backwardFlowTexture->layout.mem.internalFormat), // "GL_RG16F" or "GL_RG16_SNORM"
 	               backwardFlowTexture->layout.resolution.x(),
 	               backwardFlowTexture->layout.resolution.y(),
 	               (GLsizei)backwardFlowTexture->layout.mem.elements);
@@ -161,7 +208,22 @@ void FlowLoader::initTextures()
 void FlowLoader::fillTextures()
 {
 	ScopedTimer timer;
-	if (forwardFlowFiles.size() > 0)
+	if (flowArchive && flowArchive->isOpen())
+	{
+		const int width = flowArchive->getWidth();
+		const int height = flowArchive->getHeight();
+
+		for (int i = 0; i < numberOfFlows; i++)
+		{
+			VLOG(1) << "Filling flow texture (" << (i + 1) << " of " << numberOfFlows << ")";
+
+			uploadFlowToOpenGLTexture(flowArchive->getLayer(FlowArchive::getForwardLayer(i, numberOfFlows)), width, height, forwardFlowTexture, i);
+			uploadFlowToOpenGLTexture(flowArchive->getLayer(FlowArchive::getBackwardLayer(i, numberOfFlows)), width, height, backwardFlowTexture, i);
+		}
+
+		ErrorChecking::checkGLError();
+	}
+	else if (forwardFlowFiles.size() > 0)
 	{
 		assert(forwardFlowFiles.size() == backwardFlowFiles.size());
 
@@ -183,6 +245,12 @@ void FlowLoader::fillTextures()
 
 void FlowLoader::releaseCPUMemory()
 {
+	if (flowArchive)
+	{
+		delete flowArchive;
+		flowArchive = nullptr;
+	}
+
 	if (forwardFlows)
 	{
 		delete forwardFlows;
@@ -215,6 +283,35 @@ void FlowLoader::releaseGPUMemory()
 
 bool FlowLoader::checkAvailability()
 {
+	if (flowArchive)
+	{
+		// Mapping the archive is cheap and validates its header and index.
+		if (!flowArchive->isOpen() && !flowArchive->open(flowArchiveFile))
+			return false;
+
+		const Eigen::Vector2i flowDims = getFlowDims();
+		if (flowArchive->getWidth() != flowDims.x() || flowArchive->getHeight() != flowDims.y())
+		{
+			LOG(WARNING) << "Flows in " << flowArchiveFile << " are " << flowArchive->getWidth() << "x" << flowArchive->getHeight()
+			             << " instead of " << flowDims.x() << "x" << flowDims.y() << ".";
+			return false;
+		}
+
+		flowScale = getSnormFlowScale(flowArchive->getFixedPointScale());
+
+		numberOfFlows = flowArchive->getNumberOfLayers() / 2;
+		for (int layer = 0; layer < 2 * numberOfFlows; layer++)
+		{
+			if (!flowArchive->getLayer(layer))
+			{
+				LOG(WARNING) << "Flow " << layer << " is missing from " << flowArchiveFile << ".";
+				return false;
+			}
+		}
+
+		return numberOfFlows > 0;
+	}
+
 	// 0) check number of files
 	if (forwardFlowFiles.size() == 0)
 	{
@@ -253,15 +350,32 @@ bool FlowLoader::checkAvailability()
 		}
 	}
 
+	// 2) .floss and .flz files can be uploaded without conversion to floating point
+	fixedPointFlows = true;
+	for (int i = 0; i < forwardFlowFiles.size(); i++)
+		if (!isFixedPointFlowFile(forwardFlowFiles[i]) || !isFixedPointFlowFile(backwardFlowFiles[i]))
+			fixedPointFlows = false;
+	flowScale = fixedPointFlows ? getSnormFlowScale() : 1.f;
+
 	return true;
 }
 
 
+void FlowLoader::uploadFlowToOpenGLTexture(const void* flow, int width, int height, GLTexture* texture, int layer)
+{
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture->gl_ID);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1,
+	                getGLFormat(texture->layout.mem.format), // GL_RG
+	                getGLType(texture->layout.mem.type),     // GL_SHORT
+	                flow);
+}
+
+
 void FlowLoader::uploadFlowToOpenGLTexture(cv::Mat& flow, GLTexture* texture, int layer)
 {
 	glBindTexture(GL_TEXTURE_2D_ARRAY, texture->gl_ID);
 	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, flow.cols, flow.rows, 1,
 	                getGLFormat(texture->layout.mem.format), // GL_RG
-	                getGLType(texture->layout.mem.type),     // GL_FLOAT
+	                getGLType(texture->layout.mem.type),     // GL_FLOAT or GL_SHORT
 	                (void*)flow.ptr());
 }
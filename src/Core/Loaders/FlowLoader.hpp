@@ -3,13 +3,17 @@
 #include "Core/GL/GLTexture.hpp"
 #include "Core/Loaders/Loader.hpp"
 
+#include "Utils/FlowArchive.hpp"
+
 
 class FlowLoader: public Loader
 {
 public:
-	FlowLoader(bool _downsampleFlow, const Eigen::Vector2i& _imgDims);
-	FlowLoader(bool _downsampleFlow, const Eigen::Vector2i& _imgDims,
+	FlowLoader(float _flowResolution, const Eigen::Vector2i& _imgDims);
+	FlowLoader(float _flowResolution, const Eigen::Vector2i& _imgDims,
 	           std::vector<std::string>* _forwardFlowFiles, std::vector<std::string>* _backwardFlowFiles);
+	// Loads all flows from a packed flow archive (see FlowArchive) instead of individual files.
+	FlowLoader(float _flowResolution, const Eigen::Vector2i& _imgDims, const std::string& _flowArchiveFile);
 	~FlowLoader();
 
 
@@ -32,6 +36,15 @@ public:
 	// Check the availability of optical flow files.
 	bool checkAvailability();
 
+	// Factor that converts values sampled from the flow textures to pixels.
+	inline float getFlowScale() const { return flowScale; }
+
+	// Flows of equirectangular images may only cover the latitudes up to 'maxLatitude' (see getPoleRows()).
+	inline void setMaxLatitude(float _maxLatitude) { maxLatitude = _maxLatitude; }
+
+	// Rows of the images covered by the flows, as [top, bottom) in texture coordinates (origin top-left).
+	Eigen::Vector2f getFlowRegion() const;
+
 	inline GLTexture* getForwardFlowsTexture() const { return forwardFlowTexture; }
 	inline GLTexture* getBackwardFlowsTexture() const { return backwardFlowTexture; }
 
@@ -46,6 +59,10 @@ private:
 	std::vector<std::string> forwardFlowFiles;
 	std::vector<std::string> backwardFlowFiles;
 
+	// optical flow archive path, and its memory mapping (used instead of the files above)
+	std::string flowArchiveFile;
+	FlowArchive* flowArchive = nullptr;
+
 	// CPU memory resources
 	std::vector<cv::Mat>* forwardFlows = nullptr;
 	std::vector<cv::Mat>* backwardFlows = nullptr;
@@ -56,7 +73,17 @@ private:
 
 	Eigen::Vector2i imgDims;
 
-	bool downsampleFlow = false;
+	// resolution of the flows relative to the images (see getFlowLength())
+	float flowResolution = 1.f;
+	float maxLatitude = 90.f;
+
+	// Dimensions of the flow fields.
+	Eigen::Vector2i getFlowDims() const;
+
+	// flows are kept in 16-bit fixed point (.floss/.flz files or archive), see getFlowScale()
+	bool fixedPointFlows = false;
+	float flowScale = 1.f;
 
 	static void uploadFlowToOpenGLTexture(cv::Mat& flow, GLTexture* texture, int layer);
+	static void uploadFlowToOpenGLTexture(const void* flow, int width, int height, GLTexture* texture, int layer);
 };
@@ -8,6 +8,7 @@
 #include "Utils/Exceptions.hpp"
 #include "Utils/Logger.hpp"
 #include "Utils/Timer.hpp"
+#include "Utils/Trace.hpp"
 #include "Utils/Utils.hpp"
 #include "Utils/cvutils.hpp"
 
@@ -178,6 +179,7 @@ bool ImageLoader::loadImages()
 	if (!checkTextureFormat())
 		return false;
 
+	TRACE_SCOPE("ImageLoader::loadImages");
 	ScopedTimer timer;
 	int imagesLoaded = 0;
 	std::vector<Camera*>& camera_list = *cameras;
@@ -187,6 +189,7 @@ bool ImageLoader::loadImages()
 #endif
 	for (int i = 0; i < camera_list.size(); ++i)
 	{
+		TRACE_SCOPE("ImageLoader::loadImage");
 		LOG(INFO) << "Loading image (" << (i + 1) << " of " << camera_list.size() << ")";
 		Camera* camera = camera_list[i];
 		if (camera->loadImageWithOpenCV())
@@ -227,6 +230,7 @@ bool ImageLoader::loadImages()
 
 void ImageLoader::loadTextures()
 {
+	TRACE_SCOPE("ImageLoader::loadTextures");
 	if (!loadImages())
 		LOG(ERROR) << "Failed to load all images";
 }
@@ -0,0 +1,536 @@
+#include "DISFlow.hpp"
+
+#include "Utils/Exceptions.hpp"
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp> // VariationalRefinement
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define DISFLOW_SIMD_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#include <arm_neon.h>
+	#define DISFLOW_SIMD_NEON
+#endif
+
+
+using namespace std;
+
+
+namespace
+{
+#if defined(DISFLOW_SIMD_SSE2)
+	// Minimal 4-wide float vector for the patch inverse search.
+	struct Float4
+	{
+		__m128 v;
+		Float4(__m128 _v) : v(_v) {}
+		explicit Float4(float x) : v(_mm_set1_ps(x)) {}
+		static Float4 load(const float* p) { return Float4(_mm_loadu_ps(p)); }
+		Float4 operator+(const Float4& b) const { return Float4(_mm_add_ps(v, b.v)); }
+		Float4 operator-(const Float4& b) const { return Float4(_mm_sub_ps(v, b.v)); }
+		Float4 operator*(const Float4& b) const { return Float4(_mm_mul_ps(v, b.v)); }
+		float sum() const
+		{
+			__m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+			s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+			return _mm_cvtss_f32(s);
+		}
+	};
+	#define DISFLOW_SIMD
+#elif defined(DISFLOW_SIMD_NEON)
+	struct Float4
+	{
+		float32x4_t v;
+		Float4(float32x4_t _v) : v(_v) {}
+		explicit Float4(float x) : v(vdupq_n_f32(x)) {}
+		static Float4 load(const float* p) { return Float4(vld1q_f32(p)); }
+		Float4 operator+(const Float4& b) const { return Float4(vaddq_f32(v, b.v)); }
+		Float4 operator-(const Float4& b) const { return Float4(vsubq_f32(v, b.v)); }
+		Float4 operator*(const Float4& b) const { return Float4(vmulq_f32(v, b.v)); }
+		float sum() const
+		{
+			float32x2_t s = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+			return vget_lane_f32(vpadd_f32(s, s), 0);
+		}
+	};
+	#define DISFLOW_SIMD
+#endif
+
+
+	// Sums over a patch needed for one Gauss-Newton step of the inverse search.
+	struct PatchSums
+	{
+		float d = 0;   // sum of differences
+		float d2 = 0;  // sum of squared differences
+		float gxd = 0; // sum of horizontal gradient times difference
+		float gyd = 0; // sum of vertical gradient times difference
+	};
+
+
+	// Compares the template patch 'T' (size P x P, with gradients 'Gx' and 'Gy') to the patch of
+	// 'image' with its top-left corner at 'row' + (fx, fy), using bilinear interpolation.
+	// As the subpixel offset is the same for all pixels of the patch, the interpolation weights are
+	// constant, which makes this straightforward to vectorise.
+	inline PatchSums comparePatch(const float* row, size_t step, float fx, float fy,
+	                              const float* T, const float* Gx, const float* Gy, int P)
+	{
+		const float w00 = (1 - fx) * (1 - fy);
+		const float w01 = fx * (1 - fy);
+		const float w10 = (1 - fx) * fy;
+		const float w11 = fx * fy;
+
+		PatchSums sums;
+
+#ifdef DISFLOW_SIMD
+		if (P % 4 == 0)
+		{
+			const Float4 W00(w00), W01(w01), W10(w10), W11(w11);
+			Float4 d(0.f), d2(0.f), gxd(0.f), gyd(0.f);
+
+			for (int r = 0; r < P; r++, row += step, T += P, Gx += P, Gy += P)
+			{
+				for (int c = 0; c < P; c += 4)
+				{
+					const Float4 value = Float4::load(row + c) * W00 + Float4::load(row + c + 1) * W01
+					                     + Float4::load(row + step + c) * W10 + Float4::load(row + step + c + 1) * W11;
+					const Float4 diff = value - Float4::load(T + c);
+					d = d + diff;
+					d2 = d2 + diff * diff;
+					gxd = gxd + Float4::load(Gx + c) * diff;
+					gyd = gyd + Float4::load(Gy + c) * diff;
+				}
+			}
+
+			sums.d = d.sum();
+			sums.d2 = d2.sum();
+			sums.gxd = gxd.sum();
+			sums.gyd = gyd.sum();
+			return sums;
+		}
+#endif
+
+		for (int r = 0; r < P; r++, row += step, T += P, Gx += P, Gy += P)
+		{
+			for (int c = 0; c < P; c++)
+			{
+				const float value = row[c] * w00 + row[c + 1] * w01 + row[step + c] * w10 + row[step + c + 1] * w11;
+				const float diff = value - T[c];
+				sums.d += diff;
+				sums.d2 += diff * diff;
+				sums.gxd += Gx[c] * diff;
+				sums.gyd += Gy[c] * diff;
+			}
+		}
+		return sums;
+	}
+
+
+	// Bilinear lookup in a padded pyramid level at unpadded coordinates (x, y), clamped to the padding.
+	inline float sampleBilinear(const cv::Mat1f& image, int border, float x, float y)
+	{
+		x = std::min(std::max(x + border, 0.f), image.cols - 1.001f);
+		y = std::min(std::max(y + border, 0.f), image.rows - 1.001f);
+		const int ix = (int)x;
+		const int iy = (int)y;
+		const float fx = x - ix;
+		const float fy = y - iy;
+
+		const float* r0 = image.ptr<float>(iy) + ix;
+		const float* r1 = image.ptr<float>(iy + 1) + ix;
+		return (1 - fy) * ((1 - fx) * r0[0] + fx * r0[1]) + fy * ((1 - fx) * r1[0] + fx * r1[1]);
+	}
+} // namespace
+
+
+DISFlow::DISFlow(int preset)
+{
+	// Same parameters as the presets of cv::DISOpticalFlow.
+	switch (preset)
+	{
+		case 0: // ultrafast
+			finestScale = 2;
+			patchSize = 8;
+			patchStride = 4;
+			gradientDescentIterations = 12;
+			variationalRefinementIterations = 0;
+			break;
+		case 1: // fast
+			finestScale = 2;
+			patchSize = 8;
+			patchStride = 4;
+			gradientDescentIterations = 16;
+			variationalRefinementIterations = 5;
+			break;
+		default: // medium
+			finestScale = 1;
+			patchSize = 12;
+			patchStride = 8;
+			gradientDescentIterations = 25;
+			variationalRefinementIterations = 5;
+			break;
+	}
+}
+
+
+int DISFlow::getCoarsestScale(cv::Size size) const
+{
+	// Same heuristic as cv::DISOpticalFlow: a few patches across the coarsest level.
+	const int maxSide = std::max(size.width, size.height);
+	const int minSide = std::min(size.width, size.height);
+	const int coarsest = std::min(
+	    (int)(std::log(maxSide / (4.0 * patchSize)) / std::log(2.0) + 0.5),
+	    (int)(std::log(minSide / (double)patchSize) / std::log(2.0)));
+	return std::max(0, coarsest);
+}
+
+
+std::shared_ptr<DISPyramid> DISFlow::buildPyramid(const cv::Mat& image) const
+{
+	if (image.type() != CV_8UC1)
+		RUNTIME_EXCEPTION("DISFlow::buildPyramid(): expected an 8-bit grayscale image.");
+
+	auto pyramid = std::make_shared<DISPyramid>();
+	pyramid->border = patchSize;
+
+	const int coarsest = getCoarsestScale(image.size());
+	const int finest = std::min(finestScale, coarsest);
+
+	cv::Mat level = image;
+	for (int l = 0; l <= coarsest; l++)
+	{
+		if (l > 0)
+			cv::resize(level, level, cv::Size(level.cols / 2, level.rows / 2), 0, 0, cv::INTER_AREA); // rounded down like cv::DISOpticalFlow
+		pyramid->sizes.push_back(level.size());
+
+		// Levels finer than the finest scale are never used.
+		if (l < finest)
+		{
+			pyramid->images.push_back(cv::Mat1f());
+			pyramid->gradientsX.push_back(cv::Mat1f());
+			pyramid->gradientsY.push_back(cv::Mat1f());
+			pyramid->levels.push_back(cv::Mat1b());
+			continue;
+		}
+
+		// Pad the level, so patches may move outside the image without bounds checks.
+		cv::Mat padded;
+		cv::copyMakeBorder(level, padded, pyramid->border, pyramid->border, pyramid->border, pyramid->border, cv::BORDER_REPLICATE);
+
+		cv::Mat1f intensities;
+		padded.convertTo(intensities, CV_32F);
+
+		// The Sobel filter is scaled by 1/8 to approximate the image derivatives.
+		cv::Mat1f gx, gy;
+		cv::Sobel(intensities, gx, CV_32F, 1, 0, 3, 1.0 / 8.0, 0, cv::BORDER_REPLICATE);
+		cv::Sobel(intensities, gy, CV_32F, 0, 1, 3, 1.0 / 8.0, 0, cv::BORDER_REPLICATE);
+
+		pyramid->images.push_back(intensities);
+		pyramid->gradientsX.push_back(gx);
+		pyramid->gradientsY.push_back(gy);
+		pyramid->levels.push_back(level);
+	}
+
+	return pyramid;
+}
+
+
+std::vector<int> DISFlow::getPatchPositions(int length) const
+{
+	// Regular grid, plus a last patch flush with the end, so that every pixel is covered.
+	std::vector<int> positions;
+	for (int p = 0; p + patchSize <= length; p += patchStride)
+		positions.push_back(p);
+	if (!positions.empty() && positions.back() + patchSize < length)
+		positions.push_back(length - patchSize);
+	return positions;
+}
+
+
+void DISFlow::calc(const cv::Mat& from, const cv::Mat& to, cv::Mat& flow) const
+{
+	calc(*buildPyramid(from), *buildPyramid(to), flow);
+}
+
+
+void DISFlow::calc(const DISPyramid& from, const DISPyramid& to, cv::Mat& flow) const
+{
+	if (from.sizes != to.sizes)
+		RUNTIME_EXCEPTION("DISFlow::calc(): the pyramids of both images must have the same sizes.");
+
+	const int coarsest = (int)from.sizes.size() - 1;
+	const int finest = std::min(finestScale, coarsest);
+	if (from.images[finest].empty())
+		RUNTIME_EXCEPTION("DISFlow::calc(): pyramid was built for a different finest scale.");
+
+	cv::Mat1f denseX = cv::Mat1f::zeros(from.sizes[coarsest]);
+	cv::Mat1f denseY = cv::Mat1f::zeros(from.sizes[coarsest]);
+
+	for (int level = coarsest; level >= finest; level--)
+	{
+		const cv::Size size = from.sizes[level];
+
+		// Initialise with the flow of the next coarser level.
+		if (level < coarsest)
+		{
+			cv::resize(denseX, denseX, size, 0, 0, cv::INTER_LINEAR);
+			cv::resize(denseY, denseY, size, 0, 0, cv::INTER_LINEAR);
+			denseX *= 2;
+			denseY *= 2;
+		}
+
+		const std::vector<int> xs = getPatchPositions(size.width);
+		const std::vector<int> ys = getPatchPositions(size.height);
+		if (xs.empty() || ys.empty())
+			continue; // image smaller than a patch
+
+		std::vector<float> patchX, patchY;
+		searchPatches(from, to, level, xs, ys, denseX, denseY, patchX, patchY);
+		densify(from, to, level, xs, ys, patchX, patchY, denseX, denseY);
+
+		if (variationalRefinementIterations > 0)
+		{
+			// Same settings as cv::DISOpticalFlow, which refines the flow of each level in the same way.
+			cv::Ptr<cv::VariationalRefinement> refinement = cv::VariationalRefinement::create();
+			refinement->setAlpha(variationalRefinementAlpha);
+			refinement->setDelta(variationalRefinementDelta);
+			refinement->setGamma(variationalRefinementGamma);
+			refinement->setSorIterations(5);
+			refinement->setFixedPointIterations(variationalRefinementIterations);
+			refinement->calcUV(from.levels[level], to.levels[level], denseX, denseY);
+		}
+	}
+
+	// Upsample the flow from the finest scale to the full resolution.
+	if (finest > 0)
+	{
+		cv::resize(denseX, denseX, from.sizes[0], 0, 0, cv::INTER_LINEAR);
+		cv::resize(denseY, denseY, from.sizes[0], 0, 0, cv::INTER_LINEAR);
+		denseX *= (float)(1 << finest);
+		denseY *= (float)(1 << finest);
+	}
+
+	std::vector<cv::Mat> channels = { denseX, denseY };
+	cv::merge(channels, flow);
+}
+
+
+void DISFlow::searchPatches(const DISPyramid& from, const DISPyramid& to, int level,
+                            const std::vector<int>& xs, const std::vector<int>& ys,
+                            const cv::Mat1f& denseX, const cv::Mat1f& denseY,
+                            std::vector<float>& patchX, std::vector<float>& patchY) const
+{
+	const int P = patchSize;
+	const int B = from.border;
+	const float n = (float)(P * P);
+	const cv::Size size = from.sizes[level];
+
+	const cv::Mat1f& I0 = from.images[level];
+	const cv::Mat1f& I0x = from.gradientsX[level];
+	const cv::Mat1f& I0y = from.gradientsY[level];
+	const cv::Mat1f& I1 = to.images[level];
+	const size_t step = I1.step1();
+
+	// Range of top-left patch corners (unpadded) whose bilinear footprint stays inside the padding.
+	const float minX = (float)-B, maxX = size.width + B - P - 1.001f;
+	const float minY = (float)-B, maxY = size.height + B - P - 1.001f;
+
+	const int nx = (int)xs.size();
+	const int ny = (int)ys.size();
+	patchX.resize(nx * ny);
+	patchY.resize(nx * ny);
+
+	// Like cv::DISOpticalFlow, the search makes two passes over the patches, forwards and then
+	// backwards, each with half of the iterations. Before its iterations, a patch tries the flows of
+	// the neighbouring patches already visited in the same pass (spatial propagation). The patch rows
+	// are split into stripes, which are processed in parallel and do not propagate between each other.
+	const int passes = 2;
+	const int iterations = std::max(1, gradientDescentIterations / passes);
+	const int stripeRows = 8;
+	const int stripes = (ny + stripeRows - 1) / stripeRows;
+
+	cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range& range) {
+		std::vector<float> T(P * P), Gx(P * P), Gy(P * P);
+
+		for (int stripe = range.start; stripe < range.end; stripe++)
+		{
+			const int firstRow = stripe * stripeRows;
+			const int lastRow = std::min(ny, firstRow + stripeRows) - 1;
+
+			for (int pass = 0; pass < passes; pass++)
+			{
+				const int direction = pass == 0 ? 1 : -1;
+				for (int r = 0; r <= lastRow - firstRow; r++)
+				{
+					const int j = pass == 0 ? firstRow + r : lastRow - r;
+					for (int c = 0; c < nx; c++)
+					{
+						const int i = pass == 0 ? c : nx - 1 - c;
+						const int px = xs[i];
+						const int py = ys[j];
+
+						// Copy the template patch and its gradients, and set up the (mean-normalised) Hessian.
+						float sumGx = 0, sumGy = 0, Hxx = 0, Hxy = 0, Hyy = 0;
+						for (int y = 0; y < P; y++)
+						{
+							const float* t = I0.ptr<float>(py + y + B) + px + B;
+							const float* gx = I0x.ptr<float>(py + y + B) + px + B;
+							const float* gy = I0y.ptr<float>(py + y + B) + px + B;
+							for (int x = 0; x < P; x++)
+							{
+								T[y * P + x] = t[x];
+								Gx[y * P + x] = gx[x];
+								Gy[y * P + x] = gy[x];
+								sumGx += gx[x];
+								sumGy += gy[x];
+								Hxx += gx[x] * gx[x];
+								Hxy += gx[x] * gy[x];
+								Hyy += gy[x] * gy[x];
+							}
+						}
+						Hxx -= sumGx * sumGx / n;
+						Hxy -= sumGx * sumGy / n;
+						Hyy -= sumGy * sumGy / n;
+						const float det = Hxx * Hyy - Hxy * Hxy;
+
+						auto compare = [&](float ux, float uy) -> PatchSums {
+							const float x = std::min(std::max(px + ux, minX), maxX);
+							const float y = std::min(std::max(py + uy, minY), maxY);
+							const int ix = (int)std::floor(x);
+							const int iy = (int)std::floor(y);
+							return comparePatch(I1.ptr<float>(iy + B) + ix + B, step, x - ix, y - iy, T.data(), Gx.data(), Gy.data(), P);
+						};
+
+						// Patch difference with the mean removed (robust to brightness changes).
+						auto getError = [n](const PatchSums& sums) -> float { return sums.d2 - sums.d * sums.d / n; };
+
+						// Start from the flow of the next coarser level (first pass) or of the first pass, or
+						// from the flow of a neighbour if that matches better.
+						const int k = j * nx + i;
+						float startX = pass == 0 ? denseX(py + P / 2, px + P / 2) : patchX[k];
+						float startY = pass == 0 ? denseY(py + P / 2, px + P / 2) : patchY[k];
+						float startError = getError(compare(startX, startY));
+						auto tryNeighbour = [&](int neighbour) {
+							const float error = getError(compare(patchX[neighbour], patchY[neighbour]));
+							if (error < startError)
+							{
+								startX = patchX[neighbour];
+								startY = patchY[neighbour];
+								startError = error;
+							}
+						};
+						if (i - direction >= 0 && i - direction < nx)
+							tryNeighbour(k - direction);
+						if (j - direction >= firstRow && j - direction <= lastRow)
+							tryNeighbour(k - direction * nx);
+
+						float ux = startX;
+						float uy = startY;
+						if (det > 1e-6f)
+						{
+							// Inverse compositional Gauss-Newton; the last iteration only evaluates the error.
+							float error = startError;
+							for (int it = 0; it <= iterations; it++)
+							{
+								const PatchSums sums = compare(ux, uy);
+								error = getError(sums);
+								if (it == iterations)
+									break;
+
+								const float bx = sums.gxd - sumGx * sums.d / n;
+								const float by = sums.gyd - sumGy * sums.d / n;
+								const float dx = (Hyy * bx - Hxy * by) / det;
+								const float dy = (Hxx * by - Hxy * bx) / det;
+								ux -= dx;
+								uy -= dy;
+							}
+
+							// Keep the start if the search did not improve the match, or (like cv::DISOpticalFlow)
+							// moved further than a patch size.
+							if (error > startError || std::hypot(ux - startX, uy - startY) > P)
+							{
+								ux = startX;
+								uy = startY;
+							}
+						}
+
+						patchX[k] = ux;
+						patchY[k] = uy;
+					}
+				}
+			}
+		}
+	});
+}
+
+
+void DISFlow::densify(const DISPyramid& from, const DISPyramid& to, int level,
+                      const std::vector<int>& xs, const std::vector<int>& ys,
+                      const std::vector<float>& patchX, const std::vector<float>& patchY,
+                      cv::Mat1f& denseX, cv::Mat1f& denseY) const
+{
+	const int P = patchSize;
+	const int B = from.border;
+	const cv::Size size = from.sizes[level];
+	const cv::Mat1f& I0 = from.images[level];
+	const cv::Mat1f& I1 = to.images[level];
+	const int nx = (int)xs.size();
+
+	// For each column/row, the range of patches covering it (positions are sorted).
+	auto coverage = [P](const std::vector<int>& positions, int length, std::vector<int>& first, std::vector<int>& last) {
+		first.assign(length, 0);
+		last.assign(length, -1);
+		int f = 0;
+		for (int x = 0; x < length; x++)
+		{
+			while (f < (int)positions.size() && positions[f] + P <= x)
+				f++;
+			first[x] = f;
+			int l = f;
+			while (l + 1 < (int)positions.size() && positions[l + 1] <= x)
+				l++;
+			last[x] = l;
+		}
+	};
+	std::vector<int> firstX, lastX, firstY, lastY;
+	coverage(xs, size.width, firstX, lastX);
+	coverage(ys, size.height, firstY, lastY);
+
+	// Weighted average of the flows of all patches covering a pixel, where patches that match
+	// the pixel poorly get lower weights.
+	cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range& range) {
+		for (int y = range.start; y < range.end; y++)
+		{
+			const float* i0 = I0.ptr<float>(y + B) + B;
+			float* outX = denseX.ptr<float>(y);
+			float* outY = denseY.ptr<float>(y);
+
+			for (int x = 0; x < size.width; x++)
+			{
+				float sumW = 0, sumX = 0, sumY = 0;
+				for (int j = firstY[y]; j <= lastY[y]; j++)
+				{
+					for (int i = firstX[x]; i <= lastX[x]; i++)
+					{
+						const float ux = patchX[j * nx + i];
+						const float uy = patchY[j * nx + i];
+						const float diff = std::abs(sampleBilinear(I1, B, x + ux, y + uy) - i0[x]);
+						const float w = 1.f / std::max(1.f, diff);
+						sumW += w;
+						sumX += w * ux;
+						sumY += w * uy;
+					}
+				}
+
+				if (sumW > 0)
+				{
+					outX[x] = sumX / sumW;
+					outY[x] = sumY / sumW;
+				}
+			}
+		}
+	});
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+#include <memory>
+#include <vector>
+
+
+/**
+ * Image pyramid with gradients as used by DISFlow.
+ *
+ * Building it is independent of the other image of a pair, so it can be shared by all flow
+ * computations involving the image (forward and backward, as left and right image of two pairs).
+ */
+struct DISPyramid
+{
+	/** Unpadded size of each level. */
+	std::vector<cv::Size> sizes;
+
+	/** Intensities (0-255) per level, padded by 'border' pixels on each side. Empty below the finest scale. */
+	std::vector<cv::Mat1f> images;
+
+	/** Horizontal and vertical gradients per level, with the same layout as 'images'. */
+	std::vector<cv::Mat1f> gradientsX;
+	std::vector<cv::Mat1f> gradientsY;
+
+	/** Unpadded 8-bit intensities per level, for the variational refinement. Empty below the finest scale. */
+	std::vector<cv::Mat1b> levels;
+
+	int border = 0;
+};
+
+
+/**
+ * Dense Inverse Search optical flow (Kroeger et al., ECCV 2016).
+ *
+ * Follows the algorithm and presets of cv::DISOpticalFlow (coarse-to-fine patch inverse search with
+ * mean-normalised patches and spatial propagation, weighted densification and variational
+ * refinement), but works on pyramids that are built once per image with buildPyramid(). The patch
+ * inverse search uses 4-wide SIMD (SSE2/NEON), which fits the 8 and 12 pixel wide patch rows of all
+ * presets, and stripes of patch rows are processed in parallel.
+ *
+ * Remaining differences to cv::DISOpticalFlow: a last patch flush with the image end in each row and
+ * column, stripes of fixed height (independent of the number of threads), and keeping the best
+ * initial flow of a patch if the search makes its match worse.
+ *
+ * Tolerance: with the same preset, the mean end-point error to cv::DISOpticalFlow is below 0.5 px
+ * on textured synthetic images (see DISFlowTest in OpticalFlowTest).
+ */
+class DISFlow
+{
+public:
+	/** Uses the parameters of cv::DISOpticalFlow::PRESET_ULTRAFAST (0), PRESET_FAST (1) or PRESET_MEDIUM (2). */
+	DISFlow(int preset = 2);
+
+	/** Builds the pyramid of an 8-bit grayscale image with all levels needed by calc(). */
+	std::shared_ptr<DISPyramid> buildPyramid(const cv::Mat& image) const;
+
+	/** Computes the flow (CV_32FC2, full resolution) from the image of 'from' to the image of 'to'. */
+	void calc(const DISPyramid& from, const DISPyramid& to, cv::Mat& flow) const;
+
+	/** Convenience version that builds both pyramids first. */
+	void calc(const cv::Mat& from, const cv::Mat& to, cv::Mat& flow) const;
+
+	int finestScale;
+	int patchSize;
+	int patchStride;
+	int gradientDescentIterations;
+
+	// Fixed-point iterations of cv::VariationalRefinement per level (0 = off), and its weights.
+	int variationalRefinementIterations;
+	float variationalRefinementAlpha = 20.f;
+	float variationalRefinementDelta = 5.f;
+	float variationalRefinementGamma = 10.f;
+
+private:
+	int getCoarsestScale(cv::Size size) const;
+
+	std::vector<int> getPatchPositions(int length) const;
+
+	void searchPatches(const DISPyramid& from, const DISPyramid& to, int level,
+	                   const std::vector<int>& xs, const std::vector<int>& ys,
+	                   const cv::Mat1f& denseX, const cv::Mat1f& denseY,
+	                   std::vector<float>& patchX, std::vector<float>& patchY) const;
+
+	void densify(const DISPyramid& from, const DISPyramid& to, int level,
+	             const std::vector<int>& xs, const std::vector<int>& ys,
+	             const std::vector<float>& patchX, const std::vector<float>& patchY,
+	             cv::Mat1f& denseX, cv::Mat1f& denseY) const;
+};
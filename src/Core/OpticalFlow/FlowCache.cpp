@@ -0,0 +1,167 @@
+#include "FlowCache.hpp"
+
+#include "3rdParty/fs_std.hpp"
+
+#include "Utils/Logger.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+
+using namespace std;
+
+
+namespace
+{
+	// FNV-1a style hashing, but on 64-bit words (with extra mixing) for speed on large images.
+	const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+	const uint64_t FNV_PRIME = 1099511628211ULL;
+
+	inline uint64_t hashBytes(const unsigned char* data, size_t count, uint64_t hash)
+	{
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, data + i, 8);
+			hash = (hash ^ word) * FNV_PRIME;
+			hash ^= hash >> 29;
+		}
+		for (; i < count; i++)
+			hash = (hash ^ data[i]) * FNV_PRIME;
+		return hash;
+	}
+
+	// Final avalanche step (from MurmurHash3), so that small changes affect all bits of the key.
+	inline uint64_t finalise(uint64_t hash)
+	{
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 33;
+		hash *= 0xc4ceb9fe1a85ec53ULL;
+		hash ^= hash >> 33;
+		return hash;
+	}
+
+	inline uint64_t hashValue(uint64_t value, uint64_t hash)
+	{
+		return hashBytes(reinterpret_cast<const unsigned char*>(&value), sizeof(value), hash);
+	}
+
+	// Hard links 'to' to 'from', so the cache does not hold a second copy of each flow. Falls back to
+	// copying, e.g. if both are on different file systems.
+	bool linkOrCopy(const std::string& from, const std::string& to, std::error_code& ec)
+	{
+		fs::remove(to, ec);
+		fs::create_hard_link(from, to, ec);
+		if (ec)
+			fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+		return !ec;
+	}
+
+
+	std::string toHex(uint64_t value)
+	{
+		std::stringstream ss;
+		ss << std::hex << std::setw(16) << std::setfill('0') << value;
+		return ss.str();
+	}
+} // namespace
+
+
+FlowCache::FlowCache(const std::string& _directory) :
+    directory(_directory),
+    hits(0),
+    misses(0)
+{
+	if (!fs::exists(directory))
+		fs::create_directories(directory);
+}
+
+
+uint64_t FlowCache::hashImage(const cv::Mat& image)
+{
+	uint64_t hash = FNV_OFFSET;
+	hash = hashValue((uint64_t)image.cols, hash);
+	hash = hashValue((uint64_t)image.rows, hash);
+	hash = hashValue((uint64_t)image.type(), hash);
+
+	const size_t rowBytes = image.cols * image.elemSize();
+	for (int y = 0; y < image.rows; y++)
+		hash = hashBytes(image.ptr<unsigned char>(y), rowBytes, hash);
+
+	return finalise(hash);
+}
+
+
+std::string FlowCache::makeKey(uint64_t leftHash, uint64_t rightHash, const std::string& parameters)
+{
+	uint64_t parameterHash = finalise(hashBytes(reinterpret_cast<const unsigned char*>(parameters.data()), parameters.size(), FNV_OFFSET));
+	return toHex(leftHash) + toHex(rightHash) + toHex(parameterHash);
+}
+
+
+std::string FlowCache::getEntryPath(const std::string& key, size_t file, const std::string& outputPath) const
+{
+	// Keep the original extension, so cached files can still be opened with the usual tools.
+	std::string extension = fs::path(outputPath).extension().generic_string();
+	return (fs::path(directory) / (key + "-" + std::to_string(file) + extension)).generic_string();
+}
+
+
+bool FlowCache::fetch(const std::string& key, const std::vector<std::string>& outputPaths)
+{
+	for (size_t i = 0; i < outputPaths.size(); i++)
+	{
+		if (!fs::exists(getEntryPath(key, i, outputPaths[i])))
+		{
+			misses++;
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < outputPaths.size(); i++)
+	{
+		std::error_code ec;
+		if (!linkOrCopy(getEntryPath(key, i, outputPaths[i]), outputPaths[i], ec))
+		{
+			LOG(WARNING) << "Failed to copy cached flow to '" << outputPaths[i] << "': " << ec.message();
+			misses++;
+			return false;
+		}
+	}
+
+	hits++;
+	return true;
+}
+
+
+void FlowCache::store(const std::string& key, const std::vector<std::string>& outputPaths)
+{
+	for (size_t i = 0; i < outputPaths.size(); i++)
+	{
+		// Link (or copy) to a temporary file first and then rename it, so that other processes never
+		// see partially written entries.
+		const std::string entryPath = getEntryPath(key, i, outputPaths[i]);
+		const std::string tempPath = entryPath + ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+
+		std::error_code ec;
+		if (linkOrCopy(outputPaths[i], tempPath, ec))
+			fs::rename(tempPath, entryPath, ec);
+
+		if (ec)
+		{
+			LOG(WARNING) << "Failed to add '" << outputPaths[i] << "' to the flow cache: " << ec.message();
+			fs::remove(tempPath, ec);
+			return;
+		}
+	}
+}
+
+
+void FlowCache::logStatistics() const
+{
+	LOG(INFO) << "Flow cache '" << directory << "': " << hits << " hit(s), " << misses << " miss(es)";
+}
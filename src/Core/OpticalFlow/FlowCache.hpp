@@ -0,0 +1,50 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+/**
+ * Persistent, content-addressed store of previously computed flow fields.
+ *
+ * Entries are keyed by a hash of both input images and a description of all flow parameters,
+ * so a pair of images is only ever computed once per parameter set, no matter which cache folder
+ * or sub-sampling of the dataset it belongs to. Each entry consists of one or more files (e.g. the
+ * forward and backward flow), which are hard links of the output files (or copies, where linking
+ * fails). Output files must therefore be replaced instead of overwritten in place, so that writing
+ * them does not change the cache entries. All methods are thread-safe.
+ */
+class FlowCache
+{
+public:
+	FlowCache(const std::string& _directory);
+
+	/** Hashes the size, type and pixels of an image. Stable across runs and platforms. */
+	static uint64_t hashImage(const cv::Mat& image);
+
+	/** Combines the hashes of both images and the flow parameters into a cache key. */
+	static std::string makeKey(uint64_t leftHash, uint64_t rightHash, const std::string& parameters);
+
+	/** Links the cached files of 'key' to 'outputPaths'. Returns false if the entry is not (fully) cached. */
+	bool fetch(const std::string& key, const std::vector<std::string>& outputPaths);
+
+	/** Adds the files at 'outputPaths' to the cache as the entry 'key'. */
+	void store(const std::string& key, const std::vector<std::string>& outputPaths);
+
+	int getHits() const { return hits; }
+	int getMisses() const { return misses; }
+
+	void logStatistics() const;
+
+	const std::string directory;
+
+private:
+	std::string getEntryPath(const std::string& key, size_t file, const std::string& outputPath) const;
+
+	std::atomic<int> hits;
+	std::atomic<int> misses;
+};
@@ -0,0 +1,140 @@
+#include "FlowConsistency.hpp"
+
+#include "Utils/Exceptions.hpp"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+
+using namespace std;
+
+
+namespace
+{
+	Json::Value statisticsToJson(const FlowConsistencyStatistics& statistics)
+	{
+		Json::Value value;
+		value["MeanError"] = statistics.meanError;
+		value["MedianError"] = statistics.medianError;
+		value["P95Error"] = statistics.p95Error;
+		value["InconsistentFraction"] = statistics.inconsistentFraction;
+		return value;
+	}
+
+
+	FlowConsistencyStatistics statisticsFromJson(const Json::Value& value)
+	{
+		FlowConsistencyStatistics statistics;
+		statistics.meanError = value["MeanError"].asFloat();
+		statistics.medianError = value["MedianError"].asFloat();
+		statistics.p95Error = value["P95Error"].asFloat();
+		statistics.inconsistentFraction = value["InconsistentFraction"].asFloat();
+		return statistics;
+	}
+} // namespace
+
+
+Json::Value FlowPairConsistency::toJson() const
+{
+	Json::Value value;
+	value["Left"] = left;
+	value["Right"] = right;
+	value["ForwardConfidence"] = forwardConfidence;
+	value["BackwardConfidence"] = backwardConfidence;
+	value["Forward"] = statisticsToJson(forward);
+	value["Backward"] = statisticsToJson(backward);
+	return value;
+}
+
+
+FlowPairConsistency FlowPairConsistency::fromJson(const Json::Value& value)
+{
+	FlowPairConsistency pair;
+	pair.left = value["Left"].asInt();
+	pair.right = value["Right"].asInt();
+	pair.forwardConfidence = value["ForwardConfidence"].asString();
+	pair.backwardConfidence = value["BackwardConfidence"].asString();
+	pair.forward = statisticsFromJson(value["Forward"]);
+	pair.backward = statisticsFromJson(value["Backward"]);
+	return pair;
+}
+
+
+cv::Mat1b checkFlowConsistency(const cv::Mat2f& forward, const cv::Mat2f& backward, bool wraparound,
+                               FlowConsistencyStatistics& statistics)
+{
+	if (forward.size() != backward.size())
+		RUNTIME_EXCEPTION("checkFlowConsistency: the flows have different sizes.");
+
+	const int width = forward.cols;
+	const int height = forward.rows;
+
+	// Where each pixel ends up following the forward flow.
+	cv::Mat1f mapX(forward.size()), mapY(forward.size());
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const cv::Vec2f& f = forward(y, x);
+			float targetX = x + f[0];
+			if (wraparound)
+				targetX -= width * std::floor(targetX / width);
+			mapX(y, x) = targetX;
+			mapY(y, x) = y + f[1];
+		}
+	}
+
+	// With wraparound, targets between the last and the first column interpolate against a copy of the
+	// first column appended on the right.
+	cv::Mat2f source = backward;
+	if (wraparound)
+		cv::hconcat(backward, backward.col(0), source);
+
+	cv::Mat2f warpedBackward;
+	cv::remap(source, warpedBackward, mapX, mapY, cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+
+	cv::Mat1b confidence(forward.size());
+	std::vector<float> errors;
+	errors.reserve(forward.total());
+	double errorSum = 0;
+	size_t inconsistent = 0;
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const cv::Vec2f& f = forward(y, x);
+			const cv::Vec2f& b = warpedBackward(y, x);
+			const float squaredError = (float)(f + b).dot(f + b);
+			const float tolerance = 0.01f * (float)(f.dot(f) + b.dot(b)) + 0.5f;
+
+			const float ratio = squaredError / tolerance;
+			confidence(y, x) = cv::saturate_cast<uchar>(255.f * (1.f - ratio));
+			if (ratio >= 1.f)
+				inconsistent++;
+
+			errors.push_back(std::sqrt(squaredError));
+			errorSum += errors.back();
+		}
+	}
+
+	statistics = FlowConsistencyStatistics();
+	if (!errors.empty())
+	{
+		statistics.meanError = (float)(errorSum / errors.size());
+		statistics.inconsistentFraction = (float)inconsistent / errors.size();
+
+		auto median = errors.begin() + errors.size() / 2;
+		std::nth_element(errors.begin(), median, errors.end());
+		statistics.medianError = *median;
+
+		// The 95th percentile lies above the median.
+		auto p95 = errors.begin() + std::min(errors.size() - 1, (size_t)(0.95 * errors.size()));
+		std::nth_element(median, p95, errors.end());
+		statistics.p95Error = *p95;
+	}
+
+	return confidence;
+}
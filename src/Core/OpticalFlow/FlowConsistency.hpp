@@ -0,0 +1,52 @@
+#pragma once
+
+#include "3rdParty/json/json.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <string>
+
+
+/** Summary of the forward-backward error of one flow field, in pixels of the flow. */
+struct FlowConsistencyStatistics
+{
+	float meanError = 0;
+	float medianError = 0;
+	float p95Error = 0;
+
+	// Fraction of pixels whose flow is inconsistent, mostly due to occlusions.
+	float inconsistentFraction = 0;
+};
+
+
+/** Forward-backward consistency of the flows between a pair of neighbouring cameras. */
+struct FlowPairConsistency
+{
+	int left = 0;
+	int right = 0;
+
+	// 8-bit confidence images of the forward (left to right) and backward flow, see checkFlowConsistency().
+	std::string forwardConfidence;
+	std::string backwardConfidence;
+
+	FlowConsistencyStatistics forward;
+	FlowConsistencyStatistics backward;
+
+	Json::Value toJson() const;
+	static FlowPairConsistency fromJson(const Json::Value& value);
+};
+
+
+/**
+ * Checks the flow 'forward' against the flow 'backward' in the opposite direction, following
+ * Sundaram et al., "Dense Point Trajectories by GPU-accelerated Large Displacement Optical Flow"
+ * (ECCV 2010): following the forward flow and then the backward flow should end where it started,
+ * up to a tolerance of 0.01 (|F|^2 + |B|^2) + 0.5 squared pixels. Occluded pixels exceed it.
+ *
+ * Returns an 8-bit confidence per pixel of 'forward', which falls linearly from 255 for perfectly
+ * consistent flow to 0 at the tolerance (so 0 marks inconsistent pixels), and summarises the errors
+ * in 'statistics'. With 'wraparound', flows may cross the left and right border of equirectangular
+ * images.
+ */
+cv::Mat1b checkFlowConsistency(const cv::Mat2f& forward, const cv::Mat2f& backward, bool wraparound,
+                               FlowConsistencyStatistics& statistics);
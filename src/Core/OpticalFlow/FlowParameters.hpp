@@ -1,11 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+
 
 enum class FlowMethod
 {
 	BroxCUDA  = 0,
 	DIS       = 1,
-	Farneback = 2
+	Farneback = 2,
+	NativeDIS = 3  // DISFlow, sharing image pyramids between pairs
 };
 
 
@@ -19,3 +23,26 @@ struct BroxFlowParameters
 	int outerIterations = 150;
 	int solverIterations = 5;
 };
+
+
+/**
+ * Width or height of the flow fields of images with the given width or height, when flows are
+ * computed at 'resolution' times the image resolution (e.g. 0.5 for half resolution).
+ */
+inline int getFlowLength(int imageLength, float resolution)
+{
+	return std::max(1, (int)std::lround(imageLength * (double)resolution));
+}
+
+
+/**
+ * Number of rows at the top and bottom of an equirectangular image of the given height that lie
+ * beyond the latitude band [-maxLatitude, maxLatitude] (in degrees). Flows of equirectangular
+ * images are only computed and stored for the rows in between, as the polar regions are heavily
+ * oversampled and matter little for the viewer.
+ */
+inline int getPoleRows(int height, float maxLatitude)
+{
+	const int rows = (int)std::lround(height * (90.f - maxLatitude) / 180.f);
+	return std::max(0, std::min(rows, (height - 1) / 2));
+}
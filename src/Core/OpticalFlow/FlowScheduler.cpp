@@ -0,0 +1,444 @@
+#include "FlowScheduler.hpp"
+
+#include "3rdParty/fs_std.hpp"
+
+#include "Utils/BoundedQueue.hpp"
+#include "Utils/FlowIO.hpp"
+#include "Utils/Logger.hpp"
+#include "Utils/MemoryUsage.hpp"
+#include "Utils/ResourceUsage.hpp"
+#include "Utils/Trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+
+using namespace std;
+
+
+namespace
+{
+	double getWallTime()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+
+	uint64_t getTotalFileSize(const std::vector<std::string>& files)
+	{
+		uint64_t total = 0;
+		for (auto& file : files)
+		{
+			std::error_code ec;
+			const auto size = fs::file_size(file, ec);
+			if (!ec)
+				total += size;
+		}
+		return total;
+	}
+} // namespace
+
+
+FlowScheduler::FlowScheduler(WorkerFactory _createWorker, int _numberOfWorkers, int _queueDepth) :
+    numberOfWorkers(_numberOfWorkers),
+    queueDepth(_queueDepth),
+    createWorker(_createWorker)
+{
+}
+
+
+int FlowScheduler::getNumberOfWorkers(int numberOfPairs) const
+{
+	int workers = numberOfWorkers;
+	if (workers <= 0)
+		workers = (int)std::thread::hardware_concurrency();
+
+	// No point in having idle workers, but always use at least one.
+	return std::max(1, std::min(workers, numberOfPairs));
+}
+
+
+void FlowScheduler::run(std::vector<Camera*>& cameras)
+{
+	std::vector<int> pairs(cameras.size());
+	for (size_t i = 0; i < pairs.size(); i++)
+		pairs[i] = (int)i;
+	run(cameras, pairs);
+}
+
+
+void FlowScheduler::run(std::vector<Camera*>& cameras, const std::vector<int>& pairs)
+{
+	const int size = (int)cameras.size();
+	const int numberOfPairs = (int)pairs.size();
+	forwardFlows.assign(size, "");
+	backwardFlows.assign(size, "");
+	if (numberOfPairs == 0)
+		return;
+
+	const int workers = getNumberOfWorkers(numberOfPairs);
+	const int depth = queueDepth > 0 ? queueDepth : workers;
+	LOG(INFO) << "Computing optical flow for " << numberOfPairs << " pairs using " << workers
+	          << " worker thread(s) and a queue depth of " << depth;
+
+	// Provides the (const) preparation and serialisation options shared by the first and last stage.
+	std::unique_ptr<OpticalFlowApp> options(createWorker());
+
+	// With DIS warm start, each worker needs to process consecutive pairs, so the ring is split into
+	// one contiguous chunk per worker, each with its own queue. Otherwise, all workers share a queue.
+	const bool contiguousChunks = options->warmStart && options->method == FlowMethod::DIS && workers > 1;
+	std::vector<int> worker(size, 0); // which worker (queue) processes each pair
+	std::vector<int> order;           // order in which the pairs are prepared
+	if (contiguousChunks)
+	{
+		std::vector<std::vector<int>> chunks(workers);
+		for (int k = 0; k < numberOfPairs; k++)
+		{
+			worker[pairs[k]] = (k * workers) / numberOfPairs;
+			chunks[worker[pairs[k]]].push_back(pairs[k]);
+		}
+
+		// Interleave the chunks, so that all workers can start straight away.
+		for (size_t k = 0; order.size() < (size_t)numberOfPairs; k++)
+			for (auto& chunk : chunks)
+				if (k < chunk.size())
+					order.push_back(chunk[k]);
+	}
+	else
+	{
+		order = pairs;
+	}
+
+	// Number of pairs each camera's image is part of.
+	std::vector<int> uses(size, 0);
+	for (int i : pairs)
+	{
+		uses[i]++;
+		uses[(i + 1) % size]++;
+	}
+
+	std::vector<std::unique_ptr<BoundedQueue<FlowJob>>> preparedQueues;
+	for (int q = 0; q < (contiguousChunks ? workers : 1); q++)
+		preparedQueues.emplace_back(new BoundedQueue<FlowJob>(contiguousChunks ? std::max(1, depth / workers) : depth));
+	BoundedQueue<FlowJob> computedPairs(depth);
+
+	// The first error stops the whole pipeline; it is rethrown once all threads have finished.
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	auto fail = [&](std::exception_ptr e) {
+		std::lock_guard<std::mutex> lock(errorMutex);
+		if (!error)
+			error = e;
+		for (auto& preparedPairs : preparedQueues)
+			preparedPairs->abort();
+		computedPairs.abort();
+	};
+
+	std::atomic<int> pairsDone(0);
+	// A warm-started flow depends on the flows of all preceding pairs of its chunk, and on which of them
+	// were computed at all, so it cannot be reused for other subsets of the cameras.
+	const bool warmStarted = options->warmStart && options->method == FlowMethod::DIS;
+	const bool useCache = cache && options->writeFlowIntoFile && !warmStarted;
+	if (cache && warmStarted)
+		LOG(INFO) << "Not using the flow cache, as warm-started flows depend on the preceding pairs";
+	std::vector<bool> fetchedFromCache(size, false); // only written by the preparation stage
+	const std::string parameters = options->describeParameters();
+
+	// Profiles by pair index; each is completed by the stage that finishes its pair.
+	std::vector<PairProfile> profiles(size);
+
+	// When streaming, images are decoded in the order in which the pairs are prepared, and every
+	// image is dropped once both of its pairs have been prepared (or fetched from the cache).
+	std::unique_ptr<ImagePrefetcher> prefetcher;
+	if (streamImages)
+	{
+		std::vector<int> sequence;
+		for (int i : order)
+		{
+			sequence.push_back(i);
+			sequence.push_back((i + 1) % size);
+		}
+		prefetcher.reset(new ImagePrefetcher(cameras, sequence, uses, prefetchImages));
+	}
+
+	auto getImage = [&](int c) -> cv::Mat {
+		return prefetcher ? prefetcher->get(c) : cameras[c]->getImage();
+	};
+
+	// Every camera is the left image of one pair and the right image of another, so its image
+	// is prepared once and kept until both pairs have been queued.
+	PreparedImageCache preparedImages(
+	    [&](int c) -> PreparedImage {
+		    PreparedImage prepared;
+		    prepared.image = options->prepareImage(getImage(c));
+		    prepared.pyramid = options->buildPyramid(prepared.image);
+		    return prepared;
+	    },
+	    uses);
+
+	// Stage 1: prepare the images of each pair (or fetch its flows from the cache).
+	auto preparePairs = [&]() {
+		TRACE_THREAD_NAME("Flow preparation");
+		try
+		{
+			// Every image is part of two pairs, so only hash it once.
+			std::vector<uint64_t> imageHashes(size);
+			std::vector<bool> hashed(size, false);
+			auto getImageHash = [&](int c) -> uint64_t {
+				if (!hashed[c])
+				{
+					imageHashes[c] = FlowCache::hashImage(getImage(c));
+					hashed[c] = true;
+				}
+				return imageHashes[c];
+			};
+
+			// The decoded images of a pair are no longer needed once it has been prepared.
+			auto releaseImages = [&](int i) {
+				if (prefetcher)
+				{
+					prefetcher->release(i);
+					prefetcher->release((i + 1) % size);
+				}
+			};
+
+			// Streamed images are attributed to the first pair that reads them.
+			std::vector<bool> streamed(size, false);
+
+			for (int i : order)
+			{
+				Camera& camLeft = *cameras[i];
+				Camera& camRight = *cameras[(i + 1) % size];
+
+				TRACE_SCOPE("FlowScheduler::preparePair");
+				FlowJob job;
+				job.index = i;
+				job.profile.index = i;
+				const double wallStart = getWallTime();
+				const double cpuStart = getThreadCPUTime();
+				for (int c : { i, (i + 1) % size })
+				{
+					if (prefetcher && !streamed[c])
+					{
+						job.profile.bytesRead += getTotalFileSize({ cameras[c]->imageName });
+						streamed[c] = true;
+					}
+				}
+				options->getFlowPaths(camLeft.imageName, camRight.imageName, job.pathToFlowLR, job.pathToFlowRL);
+
+				if (useCache)
+				{
+					job.cacheKey = FlowCache::makeKey(getImageHash(i), getImageHash((i + 1) % size), parameters);
+					const std::vector<std::string> outputFiles = options->getOutputFiles(job.pathToFlowLR, job.pathToFlowRL);
+					if (cache->fetch(job.cacheKey, outputFiles))
+					{
+						forwardFlows[i] = job.pathToFlowLR;
+						backwardFlows[i] = job.pathToFlowRL;
+						fetchedFromCache[i] = true;
+						preparedImages.skip(i);
+						preparedImages.skip((i + 1) % size);
+						releaseImages(i);
+
+						PairProfile& profile = profiles[i];
+						profile = job.profile;
+						profile.cached = true;
+						profile.bytesRead += getTotalFileSize(outputFiles);
+						profile.bytesWritten = getTotalFileSize(outputFiles);
+						profile.prepareSeconds = getWallTime() - wallStart;
+						profile.prepareCPUSeconds = getThreadCPUTime() - cpuStart;
+						profile.peakMemory = getPeakMemoryUsage();
+
+						LOG(INFO) << "Fetched optical flow from cache (" << ++pairsDone << " of " << numberOfPairs << ")";
+						continue;
+					}
+				}
+
+				job.left = preparedImages.acquire(i);
+				job.right = preparedImages.acquire((i + 1) % size);
+				releaseImages(i);
+				job.profile.prepareSeconds = getWallTime() - wallStart;
+				job.profile.prepareCPUSeconds = getThreadCPUTime() - cpuStart;
+
+				if (!preparedQueues[worker[i]]->push(std::move(job)))
+					break;
+			}
+
+			for (auto& preparedPairs : preparedQueues)
+				preparedPairs->close();
+		}
+		catch (...)
+		{
+			fail(std::current_exception());
+		}
+	};
+
+	// Stage 2: compute the forward and backward flow of each pair.
+	std::atomic<int> activeWorkers(workers);
+	auto computeFlows = [&](int w) {
+		TRACE_THREAD_NAME("Flow worker " + std::to_string(w));
+		try
+		{
+			std::unique_ptr<OpticalFlowApp> opticalFlow(createWorker());
+			BoundedQueue<FlowJob>& preparedPairs = *preparedQueues[contiguousChunks ? w : 0];
+
+			int previousIndex = -2;
+			FlowJob job;
+			while (preparedPairs.pop(job))
+			{
+				// Only warm-start from the flow of the directly preceding pair.
+				if (job.index != previousIndex + 1)
+					opticalFlow->resetWarmStart();
+				previousIndex = job.index;
+
+				const double wallStart = getWallTime();
+				const double cpuStart = getThreadCPUTime();
+				opticalFlow->setPreparedPair(job.left.image, job.right.image, job.left.pyramid, job.right.pyramid);
+				job.left = PreparedImage();
+				job.right = PreparedImage();
+
+				if (opticalFlow->readyToComputeFlowFields)
+					opticalFlow->computeFlows();
+
+				if (!opticalFlow->flowFieldsComputed)
+				{
+					LOG(WARNING) << "Optical flow for pair " << job.index << " was not computed.";
+					continue;
+				}
+
+				opticalFlow->takeFlows(job.flowLR, job.flowRL);
+				job.profile.computeSeconds = getWallTime() - wallStart;
+				job.profile.computeCPUSeconds = getThreadCPUTime() - cpuStart;
+
+				if (!computedPairs.push(std::move(job)))
+					break;
+			}
+		}
+		catch (...)
+		{
+			fail(std::current_exception());
+		}
+
+		// The last worker to finish tells the serialisation stage that no more flows are coming.
+		if (--activeWorkers == 0)
+			computedPairs.close();
+	};
+
+	// Stage 3: write the flows to disk.
+	auto writeFlows = [&]() {
+		try
+		{
+			FlowJob job;
+			while (computedPairs.pop(job))
+			{
+				TRACE_SCOPE("FlowScheduler::writeFlows");
+				const double wallStart = getWallTime();
+				const double cpuStart = getThreadCPUTime();
+				if (options->writeFlowIntoFile)
+				{
+					options->cropWraparound(job.flowLR);
+					options->cropWraparound(job.flowRL);
+					options->writeFlows(job.flowLR, job.flowRL, job.pathToFlowLR, job.pathToFlowRL);
+					job.profile.bytesWritten = getTotalFileSize(options->getOutputFiles(job.pathToFlowLR, job.pathToFlowRL));
+
+					if (useCache)
+						cache->store(job.cacheKey, options->getOutputFiles(job.pathToFlowLR, job.pathToFlowRL));
+				}
+
+				if (archive)
+				{
+					archive->writeLayer(2 * job.index, cv::Mat2f(job.flowLR));
+					archive->writeLayer(2 * job.index + 1, cv::Mat2f(job.flowRL));
+				}
+
+				forwardFlows[job.index] = job.pathToFlowLR;
+				backwardFlows[job.index] = job.pathToFlowRL;
+
+				job.profile.writeSeconds = getWallTime() - wallStart;
+				job.profile.writeCPUSeconds = getThreadCPUTime() - cpuStart;
+				job.profile.peakMemory = getPeakMemoryUsage();
+				profiles[job.index] = job.profile;
+
+				LOG(INFO) << "Computed optical flow (" << ++pairsDone << " of " << numberOfPairs << ")";
+			}
+		}
+		catch (...)
+		{
+			fail(std::current_exception());
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.emplace_back(preparePairs);
+	for (int w = 0; w < workers; w++)
+		threads.emplace_back(computeFlows, w);
+	writeFlows(); // serialise on the calling thread
+	for (auto& thread : threads)
+		thread.join();
+
+	if (error)
+		std::rethrow_exception(error);
+
+	for (int i : pairs)
+		if (profiles[i].index >= 0)
+			pairProfiles.push_back(profiles[i]);
+
+	// Cached pairs bypassed the pipeline, so add their flows to the archive from the fetched files.
+	if (archive)
+	{
+		for (int i : pairs)
+		{
+			if (!fetchedFromCache[i])
+				continue;
+			archive->writeLayer(2 * i, readFlowFile(forwardFlows[i]));
+			archive->writeLayer(2 * i + 1, readFlowFile(backwardFlows[i]));
+		}
+	}
+
+	LOG(INFO) << "Prepared " << preparedImages.getNumberOfPreparedImages() << " images for flow computation ("
+	          << preparedImages.getPeakNumberOfResidentImages() << " resident at most)";
+	if (prefetcher)
+		LOG(INFO) << "Streamed " << prefetcher->getNumberOfDecodedImages() << " images from disk ("
+		          << prefetcher->getPeakNumberOfResidentImages() << " decoded images resident at most)";
+
+	if (useCache)
+		cache->logStatistics();
+}
+
+
+void FlowScheduler::collect(std::vector<Camera*>& cameras)
+{
+	const int size = (int)cameras.size();
+	forwardFlows.assign(size, "");
+	backwardFlows.assign(size, "");
+
+	std::unique_ptr<OpticalFlowApp> options(createWorker());
+
+	int missing = 0;
+	for (int i = 0; i < size; i++)
+	{
+		std::string pathToFlowLR, pathToFlowRL;
+		options->getFlowPaths(cameras[i]->imageName, cameras[(i + 1) % size]->imageName, pathToFlowLR, pathToFlowRL);
+		if (!fs::exists(pathToFlowLR) || !fs::exists(pathToFlowRL))
+		{
+			LOG(WARNING) << "Optical flow for pair " << i << " is missing.";
+			missing++;
+			continue;
+		}
+
+		forwardFlows[i] = pathToFlowLR;
+		backwardFlows[i] = pathToFlowRL;
+
+		if (archive)
+		{
+			archive->writeLayer(2 * i, readFlowFile(pathToFlowLR));
+			archive->writeLayer(2 * i + 1, readFlowFile(pathToFlowRL));
+		}
+	}
+
+	LOG(INFO) << "Collected optical flow for " << (size - missing) << " of " << size << " pairs";
+}
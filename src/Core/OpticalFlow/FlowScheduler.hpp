@@ -0,0 +1,132 @@
+#pragma once
+
+#include "FlowCache.hpp"
+#include "ImagePrefetcher.hpp"
+#include "OpticalFlowApp.hpp"
+#include "PreparedImageCache.hpp"
+
+#include "Core/Camera.hpp"
+
+#include "Utils/FlowArchive.hpp"
+
+#include <opencv2/core/core.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+
+/**
+ * Computes the optical flow between all neighbouring pairs (i, i+1) of a closed camera ring.
+ *
+ * The work is organised as a pipeline of three stages that are connected by bounded queues:
+ *   1. image preparation (resizing, grayscale conversion, wraparound padding), once per camera,
+ *   2. flow computation on a pool of worker threads, and
+ *   3. serialisation of the flow fields (and their visualisations) to disk.
+ * This overlaps disk and CPU work, while the queue depth bounds the number of images and flow
+ * fields held in memory. Every flow worker owns its own OpticalFlowApp (and hence its own
+ * DIS/Farneback engine), which is created using the factory passed to the constructor.
+ * The resulting flow paths are stored by pair index, so their order does not depend on the
+ * order in which the pairs finish. If a FlowCache is set, pairs found in it skip the pipeline.
+ * With DIS warm start, every worker processes a contiguous chunk of the ring, so that it can
+ * initialise each pair with the flow of the preceding one.
+ * If a FlowArchiveWriter is set, all flows (computed or cached) are also packed into it, with the
+ * forward and backward flow of pair i as layers 2i and 2i+1.
+ * With streamImages, the images are not taken from the cameras, but read from disk by an
+ * ImagePrefetcher just ahead of their preparation, and dropped once both of their pairs have
+ * been prepared. This bounds the memory for very long captures.
+ * The time, I/O and memory used for every pair are recorded for profiling (see getPairProfiles).
+ */
+class FlowScheduler
+{
+public:
+	/** Creates a fully configured OpticalFlowApp for one worker thread. */
+	typedef std::function<OpticalFlowApp*()> WorkerFactory;
+
+	/** Resources used for one pair of cameras. */
+	struct PairProfile
+	{
+		int index = -1;
+		bool cached = false; // fetched from the flow cache instead of computed
+
+		// Wall and CPU time of each pipeline stage for this pair. The CPU time is that of the stage's
+		// own thread, so it does not include work that OpenCV distributes to its thread pool.
+		double prepareSeconds = 0, prepareCPUSeconds = 0;
+		double computeSeconds = 0, computeCPUSeconds = 0;
+		double writeSeconds = 0, writeCPUSeconds = 0;
+
+		uint64_t bytesRead = 0;    // images streamed for this pair and flow files fetched from the cache
+		uint64_t bytesWritten = 0; // flow files (and visualisations) written
+		size_t peakMemory = 0;     // peak resident memory of the process once the pair was done
+	};
+
+	FlowScheduler(WorkerFactory _createWorker, int _numberOfWorkers = 0, int _queueDepth = 0);
+
+	/** Computes the forward and backward flows for all pairs of cameras in the ring. */
+	void run(std::vector<Camera*>& cameras);
+
+	/** Only computes the flows of the given pairs (i, i+1), e.g. the share of one process. */
+	void run(std::vector<Camera*>& cameras, const std::vector<int>& pairs);
+
+	/**
+	 * Collects the flows of all pairs from their files instead of computing them, e.g. after
+	 * other processes computed them. Pairs without flow files are reported and left empty.
+	 */
+	void collect(std::vector<Camera*>& cameras);
+
+	/** Flow from camera i to camera i+1 (empty for pairs that were not computed). */
+	std::vector<std::string> getForwardFlows() const { return forwardFlows; }
+
+	/** Flow from camera i+1 to camera i, i.e. not yet shifted to the previous camera. */
+	std::vector<std::string> getBackwardFlows() const { return backwardFlows; }
+
+	/** Profiles of all pairs computed or fetched from the cache by this scheduler, over all runs. */
+	const std::vector<PairProfile>& getPairProfiles() const { return pairProfiles; }
+
+	/** Number of flow worker threads. Zero or less uses one worker per hardware thread. */
+	int numberOfWorkers = 0;
+
+	/** Maximum number of pairs waiting between two stages. Zero or less uses the number of workers. */
+	int queueDepth = 0;
+
+	/** Optional cache of previously computed flows; pairs found in it are not recomputed. Not used for warm-started flows. */
+	FlowCache* cache = nullptr;
+
+	/** Optional archive that receives all flows of the ring (2 layers per pair). */
+	FlowArchiveWriter* archive = nullptr;
+
+	/** Read the images from disk during the run instead of using the images held by the cameras. */
+	bool streamImages = false;
+
+	/** Number of images decoded ahead of their use when streaming images. */
+	int prefetchImages = 2;
+
+private:
+	/** A pair of images travelling through the pipeline. */
+	struct FlowJob
+	{
+		int index = -1;
+
+		PreparedImage left;
+		PreparedImage right;
+
+		cv::Mat flowLR;
+		cv::Mat flowRL;
+
+		std::string pathToFlowLR;
+		std::string pathToFlowRL;
+
+		std::string cacheKey;
+
+		PairProfile profile;
+	};
+
+	int getNumberOfWorkers(int numberOfPairs) const;
+
+	WorkerFactory createWorker;
+
+	std::vector<std::string> forwardFlows;
+	std::vector<std::string> backwardFlows;
+	std::vector<PairProfile> pairProfiles;
+};
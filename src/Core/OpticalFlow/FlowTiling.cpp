@@ -0,0 +1,126 @@
+#include "FlowTiling.hpp"
+
+#include "Utils/Exceptions.hpp"
+
+#include <opencv2/core/utility.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+
+using namespace std;
+
+
+FlowTiling::FlowTiling(cv::Size _imageSize, int _tileSize, int _overlap, int _maxConcurrentTiles) :
+    imageSize(_imageSize)
+{
+	if (_tileSize <= 0)
+		RUNTIME_EXCEPTION("FlowTiling: the tile size must be positive.");
+
+	// The ramps at both ends of a tile must not meet.
+	overlap = std::max(0, std::min(_overlap, _tileSize / 2));
+
+	columns = split(imageSize.width, _tileSize, overlap);
+	rows = split(imageSize.height, _tileSize, overlap);
+	for (auto& r : rows)
+		for (auto& c : columns)
+			tiles.push_back(cv::Rect(c.start, r.start, c.size(), r.size()));
+
+	slots = _maxConcurrentTiles > 0 ? _maxConcurrentTiles : cv::getNumThreads();
+	slots = std::max(1, std::min(slots, (int)tiles.size()));
+}
+
+
+vector<cv::Range> FlowTiling::split(int length, int tileSize, int overlap)
+{
+	if (length <= tileSize)
+		return { cv::Range(0, length) };
+
+	const int count = (int)std::ceil((double)(length - overlap) / (tileSize - overlap));
+
+	vector<cv::Range> ranges;
+	for (int i = 0; i < count; i++)
+	{
+		const int start = (int)std::lround((double)i * (length - tileSize) / (count - 1));
+		ranges.push_back(cv::Range(start, start + tileSize));
+	}
+	return ranges;
+}
+
+
+vector<float> FlowTiling::ramp(const cv::Range& range, int length) const
+{
+	vector<float> weights(range.size(), 1.f);
+	if (overlap == 0)
+		return weights;
+
+	// Edges at the image border are not faded, as there is no other tile to blend with.
+	for (int i = 0; i < range.size(); i++)
+	{
+		if (range.start > 0)
+			weights[i] = std::min(weights[i], (i + 0.5f) / overlap);
+		if (range.end < length)
+			weights[i] = std::min(weights[i], (range.size() - i - 0.5f) / overlap);
+	}
+	return weights;
+}
+
+
+cv::Mat2f FlowTiling::computeFlow(const cv::Mat& from, const cv::Mat& to, const TileFlow& tileFlow, const cv::Mat& initialFlow) const
+{
+	vector<cv::Mat> tileFlows(tiles.size());
+	std::atomic<int> nextTile(0);
+	cv::parallel_for_(cv::Range(0, slots), [&](const cv::Range& range) {
+		for (int slot = range.start; slot < range.end; slot++)
+		{
+			// Continuous copies, as flow methods may not support sub-matrices. The slot's tiles
+			// reuse the buffers.
+			cv::Mat tileFrom, tileTo;
+			for (int t = nextTile++; t < (int)tiles.size(); t = nextTile++)
+			{
+				from(tiles[t]).copyTo(tileFrom);
+				to(tiles[t]).copyTo(tileTo);
+				if (!initialFlow.empty())
+					tileFlows[t] = initialFlow(tiles[t]).clone();
+				tileFlow(slot, tileFrom, tileTo, tileFlows[t]);
+			}
+		}
+	}, slots);
+
+	return blend(tileFlows);
+}
+
+
+cv::Mat2f FlowTiling::blend(const vector<cv::Mat>& tileFlows) const
+{
+	cv::Mat2f flow(imageSize, cv::Vec2f(0.f, 0.f));
+	cv::Mat1f weightSum(imageSize, 0.f);
+	for (size_t t = 0; t < tiles.size(); t++)
+	{
+		const cv::Rect& tile = tiles[t];
+		const vector<float> weightsX = ramp(columns[t % columns.size()], imageSize.width);
+		const vector<float> weightsY = ramp(rows[t / columns.size()], imageSize.height);
+		const cv::Mat2f tileFlow = tileFlows[t];
+
+		for (int y = 0; y < tile.height; y++)
+		{
+			const cv::Vec2f* source = tileFlow[y];
+			cv::Vec2f* target = flow[tile.y + y] + tile.x;
+			float* targetWeight = weightSum[tile.y + y] + tile.x;
+			for (int x = 0; x < tile.width; x++)
+			{
+				const float weight = weightsX[x] * weightsY[y];
+				target[x] += weight * source[x];
+				targetWeight[x] += weight;
+			}
+		}
+	}
+
+	// Every pixel is covered by at least one tile with a positive weight.
+	for (int y = 0; y < imageSize.height; y++)
+		for (int x = 0; x < imageSize.width; x++)
+			flow(y, x) /= weightSum(y, x);
+
+	return flow;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+#include <functional>
+#include <vector>
+
+
+/**
+ * Computes the flow between two large images in overlapping tiles, so that the memory needed by
+ * the flow method (e.g. DIS image pyramids) is bounded by the tile size instead of the image size.
+ *
+ * The tiles are spread evenly over the image, with at least 'overlap' pixels shared between
+ * neighbouring tiles. They are computed independently, at most 'maxConcurrentTiles' at a time
+ * (using cv::parallel_for_), and blended with weights that ramp up linearly over 'overlap' pixels from each tile edge inside
+ * the image. The weights are normalised, so the flow is continuous across tile borders, and the
+ * less reliable flow near a tile's edge gets little weight.
+ *
+ * The overlap should be larger than the largest expected displacement, as the flow method cannot
+ * find correspondences outside of a tile.
+ *
+ * Each concurrently running computation is a 'slot' that computes one tile after another, so the
+ * flow method can keep one engine per slot instead of creating one per tile. When the pairs
+ * themselves are already computed in parallel (e.g. by FlowScheduler's workers), one slot avoids
+ * oversubscribing the cores and bounds the memory to one tile per worker.
+ */
+class FlowTiling
+{
+public:
+	/**
+	 * Computes the flow from 'from' to 'to' (both of the tile's size). 'flow' may hold an initial flow.
+	 * 'slot' (below getNumberOfSlots()) is never used by two tiles at the same time.
+	 */
+	typedef std::function<void(int slot, const cv::Mat& from, const cv::Mat& to, cv::Mat& flow)> TileFlow;
+
+	/** Computes at most '_maxConcurrentTiles' tiles at a time (0: one per OpenCV thread). */
+	FlowTiling(cv::Size _imageSize, int _tileSize, int _overlap, int _maxConcurrentTiles = 0);
+
+	/**
+	 * Computes the flow from 'from' to 'to' tile by tile and blends the tiles. If 'initialFlow' is
+	 * given, each tile's flow starts from its part of it.
+	 */
+	cv::Mat2f computeFlow(const cv::Mat& from, const cv::Mat& to, const TileFlow& tileFlow, const cv::Mat& initialFlow = cv::Mat()) const;
+
+	/** Blends flows of all tiles (in the order of getTiles()) into one flow of the image size. */
+	cv::Mat2f blend(const std::vector<cv::Mat>& tileFlows) const;
+
+	inline const std::vector<cv::Rect>& getTiles() const { return tiles; }
+
+	/** Number of tiles computed at the same time, i.e. the number of slots. */
+	inline int getNumberOfSlots() const { return slots; }
+
+private:
+	/** Start and end of the tiles along one axis. */
+	static std::vector<cv::Range> split(int length, int tileSize, int overlap);
+
+	/** Blending weights along one axis of a tile spanning 'range' of 'length' pixels. */
+	std::vector<float> ramp(const cv::Range& range, int length) const;
+
+	cv::Size imageSize;
+	int overlap;
+	int slots;
+	std::vector<cv::Range> columns;
+	std::vector<cv::Range> rows;
+	std::vector<cv::Rect> tiles;
+};
@@ -0,0 +1,149 @@
+#include "ImagePrefetcher.hpp"
+
+#include "Utils/Exceptions.hpp"
+#include "Utils/Logger.hpp"
+#include "Utils/Trace.hpp"
+
+#include <algorithm>
+#include <exception>
+
+
+using namespace std;
+
+
+ImagePrefetcher::ImagePrefetcher(const std::vector<Camera*>& _cameras, const std::vector<int>& _sequence, const std::vector<int>& _uses, int _prefetch) :
+    cameras(_cameras),
+    sequence(_sequence),
+    remainingUses(_uses),
+    prefetch(std::max(1, _prefetch)),
+    states(_cameras.size(), State::Pending),
+    images(_cameras.size()),
+    requested(_cameras.size(), false)
+{
+	for (size_t c = 0; c < cameras.size(); c++)
+		if (remainingUses[c] <= 0)
+			states[c] = State::Evicted;
+
+	decoder = std::thread(&ImagePrefetcher::decodeAhead, this);
+}
+
+
+ImagePrefetcher::~ImagePrefetcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopped = true;
+	}
+	changed.notify_all();
+	decoder.join();
+}
+
+
+cv::Mat ImagePrefetcher::get(int camera)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	if (!requested[camera])
+	{
+		requested[camera] = true;
+		if (states[camera] == State::Resident)
+		{
+			numberOfPrefetchedImages--;
+			changed.notify_all(); // room for the next prefetch
+		}
+	}
+
+	// Not prefetched (yet): decode it right here rather than waiting for the decoder thread.
+	cv::Mat image;
+	if (states[camera] == State::Pending || states[camera] == State::Evicted)
+	{
+		image = decode(camera, lock);
+	}
+	else
+	{
+		changed.wait(lock, [&] { return states[camera] != State::Decoding; });
+		image = images[camera];
+	}
+
+	if (image.empty())
+		RUNTIME_EXCEPTION("Could not read image '" + cameras[camera]->imageName + "'.");
+
+	return image;
+}
+
+
+void ImagePrefetcher::release(int camera)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (--remainingUses[camera] > 0)
+		return;
+
+	// A camera that is still being decoded is evicted as soon as it is done.
+	if (states[camera] == State::Resident)
+	{
+		images[camera].release();
+		numberOfResidentImages--;
+		if (!requested[camera])
+			numberOfPrefetchedImages--;
+		changed.notify_all();
+	}
+
+	if (states[camera] != State::Decoding)
+		states[camera] = State::Evicted;
+}
+
+
+void ImagePrefetcher::decodeAhead()
+{
+	TRACE_THREAD_NAME("Image prefetcher");
+	std::unique_lock<std::mutex> lock(mutex);
+	for (int camera : sequence)
+	{
+		changed.wait(lock, [&] { return stopped || numberOfPrefetchedImages < prefetch; });
+		if (stopped)
+			return;
+
+		if (states[camera] == State::Pending)
+			decode(camera, lock);
+	}
+}
+
+
+// Decodes the image of 'camera' without holding the lock; expects the lock to be held on entry.
+cv::Mat ImagePrefetcher::decode(int camera, std::unique_lock<std::mutex>& lock)
+{
+	states[camera] = State::Decoding;
+	lock.unlock();
+
+	cv::Mat image;
+	try
+	{
+		TRACE_SCOPE("ImagePrefetcher::decode");
+		image = cameras[camera]->readImageWithOpenCV();
+	}
+	catch (const std::exception& e)
+	{
+		LOG(WARNING) << "Reading image '" << cameras[camera]->imageName << "' failed: " << e.what();
+	}
+
+	lock.lock();
+	numberOfDecodedImages++;
+
+	if (remainingUses[camera] <= 0)
+	{
+		// All uses were released while decoding.
+		states[camera] = State::Evicted;
+	}
+	else
+	{
+		images[camera] = image;
+		states[camera] = State::Resident;
+		numberOfResidentImages++;
+		peakNumberOfResidentImages = std::max(peakNumberOfResidentImages, numberOfResidentImages);
+		if (!requested[camera])
+			numberOfPrefetchedImages++;
+	}
+
+	changed.notify_all();
+	return image;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Core/Camera.hpp"
+
+#include <opencv2/core/core.hpp>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * Streams camera images from disk instead of keeping all of them in memory.
+ *
+ * A background thread decodes the images in the order in which they will be needed, staying at
+ * most 'prefetch' images ahead of the consumer. Every camera has a known number of uses (two in a
+ * closed ring), and its image is evicted after its last use. So only the images of the pairs in
+ * flight plus the prefetched ones are resident, independent of the number of cameras.
+ *
+ * The images are never stored in the Camera objects.
+ */
+class ImagePrefetcher
+{
+public:
+	/**
+	 * @param _cameras Cameras whose images are read.
+	 * @param _sequence Order in which the images are first needed.
+	 * @param _uses Number of uses of each camera's image; unused images are never read.
+	 * @param _prefetch Number of images decoded ahead of their first use.
+	 */
+	ImagePrefetcher(const std::vector<Camera*>& _cameras, const std::vector<int>& _sequence, const std::vector<int>& _uses, int _prefetch);
+	~ImagePrefetcher();
+
+	ImagePrefetcher(const ImagePrefetcher&) = delete;
+	ImagePrefetcher& operator=(const ImagePrefetcher&) = delete;
+
+	/** Returns the image of 'camera', waiting for it to be decoded if needed. Throws if reading fails. */
+	cv::Mat get(int camera);
+
+	/** Counts one use of 'camera'; the image is evicted after its last use. */
+	void release(int camera);
+
+	int getNumberOfDecodedImages() const { return numberOfDecodedImages; }
+	int getPeakNumberOfResidentImages() const { return peakNumberOfResidentImages; }
+
+private:
+	enum class State
+	{
+		Pending,
+		Decoding,
+		Resident,
+		Evicted
+	};
+
+	void decodeAhead();
+	cv::Mat decode(int camera, std::unique_lock<std::mutex>& lock);
+
+	std::vector<Camera*> cameras;
+	std::vector<int> sequence;
+	std::vector<int> remainingUses;
+	int prefetch;
+
+	std::vector<State> states;
+	std::vector<cv::Mat> images;
+	std::vector<bool> requested; // whether an image was asked for since it was decoded
+	int numberOfPrefetchedImages = 0; // resident, but not requested yet
+	int numberOfResidentImages = 0;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool stopped = false;
+	std::thread decoder;
+
+	int numberOfDecodedImages = 0;
+	int peakNumberOfResidentImages = 0;
+};
@@ -1,12 +1,24 @@
 #include "OpticalFlowApp.hpp"
 
+#include "FlowTiling.hpp"
+
+#include "3rdParty/fs_std.hpp"
+
 #include "Utils/Exceptions.hpp"
 #include "Utils/FlowIO.hpp"
 #include "Utils/FlowVisualisation.hpp"
 #include "Utils/Logger.hpp"
+#include "Utils/Timer.hpp"
+#include "Utils/Trace.hpp"
 #include "Utils/Utils.hpp"
 #include "Utils/cvutils.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+
 #ifdef USE_CUDA
 	#include <opencv2/cudaarithm.hpp>
 	#include <opencv2/cudaoptflow.hpp>
@@ -19,14 +31,51 @@ using namespace cv;
 using namespace std;
 
 
-OpticalFlowApp::OpticalFlowApp(FlowMethod _method, bool _downsampleFlow) :
+namespace
+{
+	// Writes a file under a temporary name and then renames it into place, so that other processes
+	// never read a partially written file, or write into the same file at once. Renaming also replaces
+	// hard links to flow cache entries instead of writing through them.
+	void writeAndRename(const string& path, const std::function<void(const string&)>& write)
+	{
+		// Keep the extension, which selects the file format.
+		fs::path tempPath = path;
+		tempPath.replace_extension(".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + fs::path(path).extension().string());
+		write(tempPath.string());
+
+		std::error_code ec;
+		fs::rename(tempPath, path, ec);
+		if (ec)
+		{
+			LOG(WARNING) << "Could not write '" << path << "': " << ec.message();
+			fs::remove(tempPath, ec);
+		}
+	}
+
+
+	void calcFarneback(const Mat& left, const Mat& right, Mat& flow)
+	{
+		cv::calcOpticalFlowFarneback(left, right, flow, 0.5, 3, 15, 3, 5, 1.2, 0);
+	}
+
+
+	// Equirectangular images are padded by 1/8-th of their width on the left and right.
+	int getWraparoundPadding(int width)
+	{
+		return width / 8;
+	}
+} // namespace
+
+
+OpticalFlowApp::OpticalFlowApp(FlowMethod _method, float _resolutionScale) :
+    resolutionScale(_resolutionScale),
     method(_method)
 {
 }
 
 
-OpticalFlowApp::OpticalFlowApp(FlowMethod _method, int _preset, bool _downsampleFlow) :
-    OpticalFlowApp(_method, _downsampleFlow)
+OpticalFlowApp::OpticalFlowApp(FlowMethod _method, int _preset, float _resolutionScale) :
+    OpticalFlowApp(_method, _resolutionScale)
 {
 	init(_method, _preset);
 }
@@ -52,6 +101,7 @@ int OpticalFlowApp::init(FlowMethod _method, int _preset, BroxFlowParameters* pa
 				LOG(INFO) << "Using standard Brox parameters since no argument was passed";
 				params = new BroxFlowParameters();
 			}
+			broxParams = *params;
 
 #ifdef USE_CUDA
 			brox = cuda::BroxOpticalFlow::create(
@@ -70,7 +120,14 @@ int OpticalFlowApp::init(FlowMethod _method, int _preset, BroxFlowParameters* pa
 
 		case FlowMethod::DIS:
 		{
+			disflowPreset = _preset;
 			disflow = cv::DISOpticalFlow::create(_preset);
+			tileDisflows.clear();
+
+			// Starting from the previous pair's flow, half the gradient descent iterations suffice.
+			disflowWarmStart = cv::DISOpticalFlow::create(_preset);
+			disflowWarmStart->setUseInitialFlow(true);
+			disflowWarmStart->setGradientDescentIterations(std::max(1, disflow->getGradientDescentIterations() / 2));
 			LOG(INFO) << "Flow method: DIS CPU";
 			break;
 		}
@@ -81,6 +138,14 @@ int OpticalFlowApp::init(FlowMethod _method, int _preset, BroxFlowParameters* pa
 			LOG(INFO) << "Flow method: Farneback CPU";
 			break;
 		}
+
+		case FlowMethod::NativeDIS:
+		{
+			disflowPreset = _preset;
+			nativeDisflow = std::make_shared<DISFlow>(_preset);
+			LOG(INFO) << "Flow method: native DIS CPU";
+			break;
+		}
 	}
 
 	return 0;
@@ -100,6 +165,8 @@ int OpticalFlowApp::init()
 
 void OpticalFlowApp::run()
 {
+	TRACE_SCOPE("OpticalFlowApp::run");
+
 	if (!readyToComputeFlowFields)
 	{
 		LOG(WARNING) << "Not ready to compute flow fields.";
@@ -108,54 +175,155 @@ void OpticalFlowApp::run()
 
 	if (!flowFieldsComputed)
 	{
-		switch (method)
-		{
-			case FlowMethod::BroxCUDA:
-			{
-#ifdef USE_CUDA
-				computeFlowsCUDA();
-				deleteCUDA();
-#endif
-				break;
-			}
-			case FlowMethod::DIS:
-			{
-				computeFlowsDIS();
-				break;
-			}
-			case FlowMethod::Farneback:
-			{
-				computeFlowsFarneback();
-				break;
-			}
-		}
+		computeFlows();
 
 		if (writeFlowIntoFile)
 		{
-			if (equirectWraparound)
-			{
-				// Remove the wraparound padding from equirectangular images.
-				// We have padded the input images by 1/8-th on the left and right, so now the flow
-				// fields are "10/8-th" wide and we just crop off 1/10-th on the left and right.
-				flowLR = flowLR.colRange(flowLR.cols / 10, (9 * flowLR.cols) / 10);
-				flowRL = flowRL.colRange(flowRL.cols / 10, (9 * flowRL.cols) / 10);
-			}
+			cropWraparound(flowLR);
+			cropWraparound(flowRL);
 
-			writeFlowFile(pathToFlowLR, flowLR);
+			writeFlows(flowLR, flowRL, pathToFlowLR, pathToFlowRL);
 			forwardFlows.push_back(pathToFlowLR);
-			writeFlowFile(pathToFlowRL, flowRL);
 			backwardFlows.push_back(pathToFlowRL);
+		}
+	}
+}
 
-			if (writeColorCodedFlowToFile)
-			{
-				string pathLR = stripExtensionFromFilename(pathToFlowLR) + ".jpg";
-				string pathRL = stripExtensionFromFilename(pathToFlowRL) + ".jpg";
 
-				imwrite(pathLR, colourCodeFlow(flowLR));
-				imwrite(pathRL, colourCodeFlow(flowRL));
-			}
+void OpticalFlowApp::computeFlows()
+{
+	TRACE_SCOPE("OpticalFlowApp::computeFlows");
+
+	if (usesTiles(imgL.size()))
+	{
+		computeFlowsTiled();
+		return;
+	}
+
+	switch (method)
+	{
+		case FlowMethod::BroxCUDA:
+		{
+#ifdef USE_CUDA
+			computeFlowsCUDA();
+			deleteCUDA();
+#endif
+			break;
 		}
+		case FlowMethod::DIS:
+		{
+			computeFlowsDIS();
+			break;
+		}
+		case FlowMethod::Farneback:
+		{
+			computeFlowsFarneback();
+			break;
+		}
+		case FlowMethod::NativeDIS:
+		{
+			computeFlowsNativeDIS();
+			break;
+		}
+	}
+}
+
+
+void OpticalFlowApp::cropWraparound(cv::Mat& flow) const
+{
+	if (equirectWraparound)
+	{
+		// Remove the wraparound padding from equirectangular images.
+		// We have padded the input images by 1/8-th on the left and right (rounded down), so find
+		// the image width that gives the padded width. It is about 8/10-th of the padded width,
+		// but not exactly unless the image width is a multiple of 8.
+		int width = (8 * flow.cols) / 10;
+		while (width + 2 * getWraparoundPadding(width) < flow.cols)
+			width++;
+		while (width + 2 * getWraparoundPadding(width) > flow.cols)
+			width--;
+
+		const int padding = getWraparoundPadding(width);
+		flow = flow.colRange(padding, padding + width);
+	}
+}
+
+
+void OpticalFlowApp::writeFlows(const cv::Mat& _flowLR, const cv::Mat& _flowRL, const string& _pathLR, const string& _pathRL) const
+{
+	writeAndRename(_pathLR, [&](const string& path) { writeFlowFile(path, _flowLR); });
+	writeAndRename(_pathRL, [&](const string& path) { writeFlowFile(path, _flowRL); });
+
+	if (writeColorCodedFlowToFile)
+	{
+		string pathLR = stripExtensionFromFilename(_pathLR) + ".jpg";
+		string pathRL = stripExtensionFromFilename(_pathRL) + ".jpg";
+
+		writeAndRename(pathLR, [&](const string& path) { imwrite(path, colourCodeFlow(_flowLR)); });
+		writeAndRename(pathRL, [&](const string& path) { imwrite(path, colourCodeFlow(_flowRL)); });
+	}
+}
+
+
+std::vector<string> OpticalFlowApp::getOutputFiles(const string& _pathLR, const string& _pathRL) const
+{
+	std::vector<string> files = { _pathLR, _pathRL };
+
+	if (writeColorCodedFlowToFile)
+	{
+		files.push_back(stripExtensionFromFilename(_pathLR) + ".jpg");
+		files.push_back(stripExtensionFromFilename(_pathRL) + ".jpg");
 	}
+
+	return files;
+}
+
+
+string OpticalFlowApp::describeParameters() const
+{
+	stringstream ss;
+	ss << "method=" << (int)method;
+
+	switch (method)
+	{
+		case FlowMethod::BroxCUDA:
+			ss << ";alpha=" << broxParams.alpha
+			   << ";gamma=" << broxParams.gamma
+			   << ";scaleFactor=" << broxParams.scaleFactor
+			   << ";innerIterations=" << broxParams.innerIterations
+			   << ";outerIterations=" << broxParams.outerIterations
+			   << ";solverIterations=" << broxParams.solverIterations;
+			break;
+		case FlowMethod::DIS:
+		case FlowMethod::NativeDIS:
+			ss << ";preset=" << disflowPreset;
+			break;
+		case FlowMethod::Farneback:
+			break;
+	}
+
+	// Warm-started flows also depend on the previous pairs (see FlowScheduler, which does not cache them).
+	if (method == FlowMethod::DIS && warmStart)
+		ss << ";warmStart=1";
+
+	// Half resolution used to be a flag, whose description is kept so that cached flows stay valid.
+	if (resolutionScale == 1.f || resolutionScale == 0.5f)
+		ss << ";downsample=" << (resolutionScale == 0.5f);
+	else
+		ss << ";resolution=" << resolutionScale;
+
+	ss << ";grayscale=" << convertToGrayscale
+	   << ";wraparound=" << equirectWraparound
+	   << ";format=" << fileExtension;
+
+	if (equirectWraparound && maxLatitude < 90.f)
+		ss << ";maxLatitude=" << maxLatitude;
+
+	// Tiled flows differ slightly near tile borders.
+	if (tileSize > 0 && method != FlowMethod::BroxCUDA)
+		ss << ";tileSize=" << tileSize << ";tileOverlap=" << tileOverlap;
+
+	return ss.str();
 }
 
 
@@ -168,50 +336,97 @@ void OpticalFlowApp::setPair(string _left, string _right)
 	right_pathToFile = _right;
 	readyToComputeFlowFields = prepareComputingFlow();
 
-	string leftFile;
-	splitFilename(_left, &workingDirectory, &leftFile);
-	string rightFile;
-	splitFilename(_right, &workingDirectory, &rightFile);
+	getFlowPaths(_left, _right, pathToFlowLR, pathToFlowRL);
+}
 
+
+void OpticalFlowApp::setPair(Camera& camLeft, Camera& camRight)
+{
+	setPreparedPair(prepareImage(camLeft.getImage()), prepareImage(camRight.getImage()));
+
+	getFlowPaths(camLeft.imageName, camRight.imageName, pathToFlowLR, pathToFlowRL);
+}
+
+
+void OpticalFlowApp::setPreparedPair(const cv::Mat& left, const cv::Mat& right,
+                                     std::shared_ptr<const DISPyramid> leftPyramid,
+                                     std::shared_ptr<const DISPyramid> rightPyramid)
+{
+	imgL = left;
+	imgR = right;
+	pyramidL = leftPyramid;
+	pyramidR = rightPyramid;
+	readyToComputeFlowFields = prepareComputingFlow(false);
+}
+
+
+std::shared_ptr<const DISPyramid> OpticalFlowApp::buildPyramid(const cv::Mat& preparedImage) const
+{
+	// Tiles use their own, smaller pyramids.
+	if (nativeDisflow && !usesTiles(preparedImage.size()))
+		return nativeDisflow->buildPyramid(preparedImage);
+	return nullptr;
+}
+
+
+void OpticalFlowApp::getFlowPaths(const string& leftImage, const string& rightImage, string& pathLR, string& pathRL) const
+{
 	// TB: you always assume first image left, second image right, forward flow from left to right
 	if (writeFlowIntoFile)
 	{
+		string directory;
+		string leftFile;
+		splitFilename(leftImage, &directory, &leftFile);
+		string rightFile;
+		splitFilename(rightImage, &directory, &rightFile);
+
 		leftFile = stripExtensionFromFilename(leftFile);
-		pathToFlowLR = outputDirectory + "/" + leftFile + "-FlowToNext" + fileExtension;
+		pathLR = outputDirectory + "/" + leftFile + "-FlowToNext" + fileExtension;
 
 		rightFile = stripExtensionFromFilename(rightFile);
-		pathToFlowRL = outputDirectory + "/" + rightFile + "-FlowToPrevious" + fileExtension;
+		pathRL = outputDirectory + "/" + rightFile + "-FlowToPrevious" + fileExtension;
 	}
 }
 
 
-void OpticalFlowApp::setPair(Camera& camLeft, Camera& camRight)
+cv::Mat OpticalFlowApp::prepareImage(const cv::Mat& image, int grayConversion) const
 {
-	imgL = camLeft.getImage().clone();
-	imgR = camRight.getImage().clone();
+	cv::Mat img = image;
 
-	if (downsampleFlow)
+	if (resolutionScale != 1.f)
 	{
-		cv::resize(imgL, imgL, cv::Size(0, 0), 0.5, 0.5, cv::INTER_LINEAR_EXACT);
-		cv::resize(imgR, imgR, cv::Size(0, 0), 0.5, 0.5, cv::INTER_LINEAR_EXACT);
+		// Area averaging avoids aliasing when shrinking images by more than half.
+		const cv::Size size(getFlowLength(img.cols, resolutionScale), getFlowLength(img.rows, resolutionScale));
+		cv::resize(img, img, size, 0, 0, resolutionScale < 0.5f ? cv::INTER_AREA : cv::INTER_LINEAR_EXACT);
 	}
 
-	readyToComputeFlowFields = prepareComputingFlow(false);
+	if (equirectWraparound)
+	{
+		// Crop the poles before anything else touches their pixels.
+		const int poleRows = getPoleRows(img.rows, maxLatitude);
+		img = img.rowRange(poleRows, img.rows - poleRows);
+	}
 
-	string leftFile;
-	splitFilename(camLeft.imageName, &workingDirectory, &leftFile);
-	string rightFile;
-	splitFilename(camRight.imageName, &workingDirectory, &rightFile);
+	if (convertToGrayscale)
+		cv::cvtColor(img, img, grayConversion);
 
-	// TB: you always assume first image left, second image right, forward flow from left to right
-	if (writeFlowIntoFile)
+	if (equirectWraparound)
 	{
-		leftFile = stripExtensionFromFilename(leftFile);
-		pathToFlowLR = outputDirectory + "/" + leftFile + "-FlowToNext" + fileExtension;
-
-		rightFile = stripExtensionFromFilename(rightFile);
-		pathToFlowRL = outputDirectory + "/" + rightFile + "-FlowToPrevious" + fileExtension;
+		// Pad the input images for equirectangular wraparound (if desired).
+		// Copy 1/8-th of the image from the right/left edge for wraparound padding
+		// on the left/right side of the equirectangular image.
+		const int padding = getWraparoundPadding(img.cols);
+		img = cv::concat(
+		    img.colRange(img.cols - padding, img.cols), // right 1/8-th of the image (wraparound #1)
+		    img,                                        // full image in the middle
+		    img.colRange(0, padding), 1);               // left 1/8-th of the image (wraparound #2)
 	}
+
+	// Never hand out the caller's pixels, as they may be modified later.
+	if (img.data == image.data)
+		img = img.clone();
+
+	return img;
 }
 
 
@@ -224,6 +439,16 @@ cv::Mat OpticalFlowApp::getFlow(bool forward)
 }
 
 
+void OpticalFlowApp::takeFlows(cv::Mat& forward, cv::Mat& backward)
+{
+	forward = flowLR;
+	backward = flowRL;
+	flowLR.release();
+	flowRL.release();
+	flowFieldsComputed = false;
+}
+
+
 bool OpticalFlowApp::prepareComputingFlow(bool loadFromDisk)
 {
 	//try to read images from "left" and "right
@@ -231,23 +456,16 @@ bool OpticalFlowApp::prepareComputingFlow(bool loadFromDisk)
 	{
 		if (loadFromDisk)
 		{
+			pyramidL.reset();
+			pyramidR.reset();
 			imgL = imread(left_pathToFile, IMREAD_COLOR);
 			imgR = imread(right_pathToFile, IMREAD_COLOR);
 			if ((imgL.cols != imgR.cols) || (imgL.rows != imgR.rows))
 				RUNTIME_EXCEPTION("OpticalFlowApp image dimensions wrong!");
 
-			if (downsampleFlow)
-			{
-				cv::resize(imgL, imgL, Size(0, 0), 0.5, 0.5, INTER_LINEAR);
-				cv::resize(imgR, imgR, Size(0, 0), 0.5, 0.5, INTER_LINEAR);
-			}
-
-			if (convertToGrayscale)
-			{
-				//convert to gray images
-				cv::cvtColor(imgL, imgL, cv::COLOR_BGR2GRAY);
-				cv::cvtColor(imgR, imgR, cv::COLOR_BGR2GRAY);
-			}
+			// imread returns BGR images.
+			imgL = prepareImage(imgL, cv::COLOR_BGR2GRAY);
+			imgR = prepareImage(imgR, cv::COLOR_BGR2GRAY);
 
 			//TB: do other colour corrections here as well.
 			// Or do all this stuff in dedicated dataset preparation step?
@@ -259,27 +477,6 @@ bool OpticalFlowApp::prepareComputingFlow(bool loadFromDisk)
 				RUNTIME_EXCEPTION("OpticalFlowApp: images not set.");
 		}
 
-		if (convertToGrayscale)
-		{
-			cv::cvtColor(imgL, imgL, cv::COLOR_RGB2GRAY);
-			cv::cvtColor(imgR, imgR, cv::COLOR_RGB2GRAY);
-		}
-
-		if (equirectWraparound)
-		{
-			// Pad the input images for equirectangular wraparound (if desired).
-			// Copy 1/8-th of the image from the right/left edge for wraparound padding
-			// on the left/right side of the equirectangular image.
-			imgL = cv::concat(
-			    imgL.colRange((7 * imgL.cols) / 8, imgL.cols), // right 1/8-th of the image (wraparound #1)
-			    imgL,                                          // full image in the middle
-			    imgL.colRange(0, imgL.cols / 8), 1);           // left 1/8-th of the image (wraparound #2)
-			imgR = cv::concat(
-			    imgR.colRange((7 * imgR.cols) / 8, imgR.cols),
-			    imgR,
-			    imgR.colRange(0, imgR.cols / 8), 1);
-		}
-
 		if (method == FlowMethod::BroxCUDA)
 		{
 #ifdef USE_CUDA
@@ -300,7 +497,7 @@ bool OpticalFlowApp::prepareComputingFlow(bool loadFromDisk)
 
 void OpticalFlowApp::computeFarneback(Mat& left, Mat& right, Mat& flow)
 {
-	cv::calcOpticalFlowFarneback(left, right, flow, 0.5, 3, 15, 3, 5, 1.2, 0);
+	calcFarneback(left, right, flow);
 	flowFieldsComputed = true;
 }
 
@@ -314,8 +511,147 @@ void OpticalFlowApp::computeFlowsFarneback()
 
 void OpticalFlowApp::computeFlowsDIS()
 {
-	computeDISFlow(imgL, imgR, flowLR);
-	computeDISFlow(imgR, imgL, flowRL);
+	if (warmStart && !previousFlowLR.empty() && previousFlowLR.size() == imgL.size())
+	{
+		computeFlowsDISWarmStart();
+	}
+	else
+	{
+		computeDISFlow(imgL, imgR, flowLR);
+		computeDISFlow(imgR, imgL, flowRL);
+	}
+
+	if (warmStart)
+	{
+		// Only read from here on, so no need to copy.
+		previousFlowLR = flowLR;
+		previousFlowRL = flowRL;
+	}
+}
+
+
+void OpticalFlowApp::computeFlowsDISWarmStart()
+{
+	// DIS overwrites the initial flow, which may still be written to disk elsewhere.
+	flowLR = previousFlowLR.clone();
+	flowRL = previousFlowRL.clone();
+
+	if (!warmStartValidated)
+	{
+		// Compare the first warm-started flow against a cold start to report the benefit.
+		Timer timer;
+		timer.startTiming();
+		Mat coldFlow;
+		disflow->calc(imgL, imgR, coldFlow);
+		const double coldSeconds = timer.getElapsedSeconds();
+		disflowWarmStart->calc(imgL, imgR, flowLR);
+		const double warmSeconds = timer.getElapsedSeconds();
+
+		const double coldError = computeWarpError(imgL, imgR, coldFlow);
+		const double warmError = computeWarpError(imgL, imgR, flowLR);
+		LOG(INFO) << "DIS warm start: " << std::fixed << std::setprecision(2) << (coldSeconds / warmSeconds) << "x speedup ("
+		          << (1000 * coldSeconds) << "ms -> " << (1000 * warmSeconds) << "ms), mean warp error "
+		          << coldError << " -> " << warmError << " (" << std::showpos << (100 * (warmError - coldError) / coldError) << "%)";
+		warmStartValidated = true;
+	}
+	else
+	{
+		disflowWarmStart->calc(imgL, imgR, flowLR);
+	}
+
+	disflowWarmStart->calc(imgR, imgL, flowRL);
+	flowFieldsComputed = true;
+}
+
+
+void OpticalFlowApp::computeFlowsNativeDIS()
+{
+	// The pyramids are normally built once per image and shared between pairs.
+	if (!pyramidL)
+		pyramidL = nativeDisflow->buildPyramid(imgL);
+	if (!pyramidR)
+		pyramidR = nativeDisflow->buildPyramid(imgR);
+
+	nativeDisflow->calc(*pyramidL, *pyramidR, flowLR);
+	nativeDisflow->calc(*pyramidR, *pyramidL, flowRL);
+	flowFieldsComputed = true;
+}
+
+
+bool OpticalFlowApp::usesTiles(const cv::Size& imageSize) const
+{
+	return tileSize > 0 && method != FlowMethod::BroxCUDA
+	       && (imageSize.width > tileSize || imageSize.height > tileSize);
+}
+
+
+void OpticalFlowApp::computeFlowsTiled()
+{
+	const FlowTiling tiling(imgL.size(), tileSize, tileOverlap, maxConcurrentTiles);
+	const bool warmStarted = method == FlowMethod::DIS && warmStart
+	                         && !previousFlowLR.empty() && previousFlowLR.size() == imgL.size();
+
+	// Concurrent tiles need their own DIS instance, so there is one per slot (DISFlow::calc is const).
+	FlowTiling::TileFlow tileFlow;
+	switch (method)
+	{
+		case FlowMethod::DIS:
+		{
+			while ((int)tileDisflows.size() < tiling.getNumberOfSlots())
+				tileDisflows.push_back(cv::DISOpticalFlow::create(disflowPreset));
+			for (auto& dis : tileDisflows)
+			{
+				dis->setUseInitialFlow(warmStarted);
+				dis->setGradientDescentIterations((warmStarted ? disflowWarmStart : disflow)->getGradientDescentIterations());
+			}
+			const std::vector<cv::Ptr<cv::DISOpticalFlow>> dis = tileDisflows;
+			tileFlow = [dis](int slot, const Mat& from, const Mat& to, Mat& flow) {
+				dis[slot]->calc(from, to, flow);
+			};
+			break;
+		}
+		case FlowMethod::NativeDIS:
+		{
+			const std::shared_ptr<DISFlow> dis = nativeDisflow;
+			tileFlow = [dis](int, const Mat& from, const Mat& to, Mat& flow) {
+				dis->calc(from, to, flow);
+			};
+			break;
+		}
+		case FlowMethod::Farneback:
+			tileFlow = [](int, const Mat& from, const Mat& to, Mat& flow) { calcFarneback(from, to, flow); };
+			break;
+		case FlowMethod::BroxCUDA:
+			RUNTIME_EXCEPTION("OpticalFlowApp: Brox CUDA does not support tiles.");
+	}
+
+	flowLR = tiling.computeFlow(imgL, imgR, tileFlow, warmStarted ? previousFlowLR : Mat());
+	flowRL = tiling.computeFlow(imgR, imgL, tileFlow, warmStarted ? previousFlowRL : Mat());
+
+	if (method == FlowMethod::DIS && warmStart)
+	{
+		previousFlowLR = flowLR;
+		previousFlowRL = flowRL;
+	}
+
+	flowFieldsComputed = true;
+}
+
+
+void OpticalFlowApp::resetWarmStart()
+{
+	previousFlowLR.release();
+	previousFlowRL.release();
+}
+
+
+double OpticalFlowApp::computeWarpError(const cv::Mat& left, const cv::Mat& right, const cv::Mat& flow) const
+{
+	// Mean absolute difference between the left image and the right image warped by the flow.
+	Mat warped = cv::remap(right, convertFlowToAbsolute(flow), INTER_LINEAR, BORDER_REPLICATE);
+	Mat difference;
+	cv::absdiff(left, warped, difference);
+	return cv::mean(difference)[0];
 }
 
 
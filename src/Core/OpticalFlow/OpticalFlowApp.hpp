@@ -1,14 +1,18 @@
 #pragma once
 
+#include "DISFlow.hpp"
 #include "FlowParameters.hpp"
 
 #include "Core/Application.hpp"
 #include "Core/Camera.hpp"
 
 #include <opencv2/core/core.hpp>
+#include <opencv2/imgproc.hpp>
 #include <opencv2/video/tracking.hpp> // DISOpticalFlow
 
+#include <memory>
 #include <string>
+#include <vector>
 
 
 #ifdef USE_CUDA
@@ -20,10 +24,10 @@
 class OpticalFlowApp : public Application
 {
 public:
-	OpticalFlowApp(FlowMethod _method, bool _downsampleFlow = false);
+	OpticalFlowApp(FlowMethod _method, float _resolutionScale = 1.f);
 
 	// Constructor to create DIS Optical Flow
-	OpticalFlowApp(FlowMethod _method, int _preset, bool _downsampleFlow = false);
+	OpticalFlowApp(FlowMethod _method, int _preset, float _resolutionScale = 1.f);
 
 	virtual ~OpticalFlowApp();
 
@@ -36,10 +40,35 @@ public:
 	void setPair(std::string _left, std::string _right);
 	void setPair(Camera& camLeft, Camera& camRight);
 
+	// The building blocks of setPair() and run(), which can be used independently, e.g. in a pipeline.
+	/** Resizes, converts and pads an input image as required for computing flow. */
+	cv::Mat prepareImage(const cv::Mat& image, int grayConversion = cv::COLOR_RGB2GRAY) const;
+	/** Builds the image pyramid of a prepared image if the flow method can reuse it (nullptr otherwise). */
+	std::shared_ptr<const DISPyramid> buildPyramid(const cv::Mat& preparedImage) const;
+	/** Sets a pair of images that have already been prepared using prepareImage() (and buildPyramid()). */
+	void setPreparedPair(const cv::Mat& left, const cv::Mat& right,
+	                     std::shared_ptr<const DISPyramid> leftPyramid = nullptr,
+	                     std::shared_ptr<const DISPyramid> rightPyramid = nullptr);
+	/** Determines where the flows between the two images are written to. */
+	void getFlowPaths(const std::string& leftImage, const std::string& rightImage, std::string& pathLR, std::string& pathRL) const;
+	/** Computes the forward and backward flow for the current pair, without writing them. */
+	void computeFlows();
+	/** Removes the equirectangular wraparound padding from a flow field (no copy). */
+	void cropWraparound(cv::Mat& flow) const;
+	/** Writes the forward and backward flow (and their visualisations if enabled) to disk, each via a temporary file. */
+	void writeFlows(const cv::Mat& _flowLR, const cv::Mat& _flowRL, const std::string& _pathLR, const std::string& _pathRL) const;
+	/** All files written by writeFlows() for the given flow paths. */
+	std::vector<std::string> getOutputFiles(const std::string& _pathLR, const std::string& _pathRL) const;
+	/** Describes all options that influence the computed flows, e.g. for caching. */
+	std::string describeParameters() const;
+
 	void computeDISFlow(cv::Mat& left, cv::Mat& right, cv::Mat& flow);
 
 	cv::Mat getFlow(bool forward);
 
+	/** Hands over the computed flows, so that computing the next pair does not overwrite them. */
+	void takeFlows(cv::Mat& forward, cv::Mat& backward);
+
 	std::vector<std::string> getForwardFlows() const { return forwardFlows; }
 	std::vector<std::string> getBackwardFlows() const { return backwardFlows; }
 
@@ -50,18 +79,49 @@ public:
 	// Options
 	bool writeFlowIntoFile = false;
 	bool writeColorCodedFlowToFile = false;
-	bool downsampleFlow = false;
 	bool convertToGrayscale = true;
 	bool equirectWraparound = false;
 
+	/** Resolution of the flows relative to the images, e.g. 0.5 for half resolution (see getFlowLength()). */
+	float resolutionScale = 1.f;
+
+	/**
+	 * Seed DIS with the flows of the previous pair (only used with FlowMethod::DIS).
+	 * Consecutive pairs of a camera ring have very similar flows, so fewer gradient descent
+	 * iterations are needed. Call resetWarmStart() whenever the next pair is not a neighbour.
+	 */
+	bool warmStart = false;
+	void resetWarmStart();
+
+	/**
+	 * Compute the flows of images larger than this in overlapping square tiles of this size, which
+	 * bounds the memory needed per pair (0: never). The overlap should exceed the largest expected
+	 * displacement. Not supported by FlowMethod::BroxCUDA.
+	 */
+	int tileSize = 0;
+	int tileOverlap = 128;
+
+	/**
+	 * Number of tiles of a pair computed at the same time (0: one per OpenCV thread). Use 1 when
+	 * several pairs are computed in parallel already, e.g. by FlowScheduler's workers.
+	 */
+	int maxConcurrentTiles = 0;
+
+	/**
+	 * Only compute the flows of equirectangular images between these latitudes (in degrees, see
+	 * getPoleRows()), so the flows are that much shorter than the images. Only used with
+	 * equirectWraparound.
+	 */
+	float maxLatitude = 90.f;
+
 	std::string outputDirectory;
 
 	// DIS_flow preset values PRESET_ULTRAFAST:0, PRESET_FAST:1, PRESET_MEDIUM:3
-	int disflowPreset;
+	int disflowPreset = 0;
 
 	FlowMethod method;
 
-	/** The file format used for storing optical flow fields (.flo, .floss, .F). */
+	/** The file format used for storing optical flow fields (.flo, .floss, .flz, .F). */
 	std::string fileExtension = ".floss";
 
 	std::string pathToFlowLR;
@@ -76,6 +136,14 @@ private:
 
 	// Compute DIS Optical Flow
 	void computeFlowsDIS();
+	void computeFlowsDISWarmStart();
+	// Compute DIS Optical Flow with our own implementation
+	void computeFlowsNativeDIS();
+	// Compute the flows tile by tile with any of the CPU methods.
+	bool usesTiles(const cv::Size& imageSize) const;
+	void computeFlowsTiled();
+
+	double computeWarpError(const cv::Mat& left, const cv::Mat& right, const cv::Mat& flow) const;
 
 #ifdef USE_CUDA
 	void prepareFlowCUDA();
@@ -89,6 +157,21 @@ private:
 
 	cv::Ptr<cv::DISOpticalFlow> disflow;
 
+	// DIS refining the previous pair's flows, and those flows.
+	cv::Ptr<cv::DISOpticalFlow> disflowWarmStart;
+	cv::Mat previousFlowLR;
+	cv::Mat previousFlowRL;
+	bool warmStartValidated = false;
+
+	// One DIS instance per tile slot (see FlowTiling), reused by all tiles and pairs.
+	std::vector<cv::Ptr<cv::DISOpticalFlow>> tileDisflows;
+
+	std::shared_ptr<DISFlow> nativeDisflow;
+	std::shared_ptr<const DISPyramid> pyramidL;
+	std::shared_ptr<const DISPyramid> pyramidR;
+
+	BroxFlowParameters broxParams;
+
 	// used to determine where to write flow fields
 	std::string workingDirectory;
 
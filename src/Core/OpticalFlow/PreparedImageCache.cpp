@@ -0,0 +1,46 @@
+#include "PreparedImageCache.hpp"
+
+#include <algorithm>
+
+
+using namespace std;
+
+
+PreparedImageCache::PreparedImageCache(PrepareFunction _prepare, const std::vector<int>& _uses) :
+    prepare(_prepare),
+    remainingUses(_uses)
+{
+}
+
+
+PreparedImage PreparedImageCache::acquire(int camera)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto it = images.find(camera);
+	if (it == images.end())
+	{
+		it = images.insert(std::make_pair(camera, prepare(camera))).first;
+		numberOfPreparedImages++;
+		peakNumberOfResidentImages = std::max(peakNumberOfResidentImages, (int)images.size());
+	}
+
+	// Keep a reference, as the cache entry may be evicted now.
+	PreparedImage image = it->second;
+	countUse(camera);
+	return image;
+}
+
+
+void PreparedImageCache::skip(int camera)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	countUse(camera);
+}
+
+
+void PreparedImageCache::countUse(int camera)
+{
+	if (--remainingUses[camera] <= 0)
+		images.erase(camera);
+}
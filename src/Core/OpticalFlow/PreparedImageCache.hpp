@@ -0,0 +1,59 @@
+#pragma once
+
+#include "DISFlow.hpp"
+
+#include <opencv2/core/core.hpp>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+/** An image prepared for flow computation, and its pyramid if the flow method can reuse it. */
+struct PreparedImage
+{
+	cv::Mat image;
+	std::shared_ptr<const DISPyramid> pyramid;
+};
+
+
+/**
+ * Holds the images prepared for flow computation (resized, grayscale, wraparound-padded, and
+ * optionally their pyramids), so that each camera's image is only prepared once, although it is
+ * part of two pairs.
+ *
+ * Every camera has a known number of uses (two in a closed ring). An image is prepared on its
+ * first use and evicted after its last one, so only the images of the pairs currently in flight
+ * stay resident. The returned matrices are shared between pairs and must not be modified.
+ */
+class PreparedImageCache
+{
+public:
+	/** Prepares the image of the given camera. */
+	typedef std::function<PreparedImage(int)> PrepareFunction;
+
+	PreparedImageCache(PrepareFunction _prepare, const std::vector<int>& _uses);
+
+	/** Returns the prepared image of 'camera' and counts one use. */
+	PreparedImage acquire(int camera);
+
+	/** Counts one use of 'camera' without needing its image, e.g. if a pair was cached. */
+	void skip(int camera);
+
+	int getNumberOfPreparedImages() const { return numberOfPreparedImages; }
+	int getPeakNumberOfResidentImages() const { return peakNumberOfResidentImages; }
+
+private:
+	void countUse(int camera);
+
+	PrepareFunction prepare;
+
+	std::map<int, PreparedImage> images;
+	std::vector<int> remainingUses;
+	std::mutex mutex;
+
+	int numberOfPreparedImages = 0;
+	int peakNumberOfResidentImages = 0;
+};
@@ -8,6 +8,7 @@
 #include "Utils/Exceptions.hpp"
 #include "Utils/IOTools.hpp"
 #include "Utils/Logger.hpp"
+#include "Utils/Trace.hpp"
 
 
 // The app needs to be global.
@@ -23,6 +24,13 @@ int main(int argc, char* argv[])
 	options.add_options()
 		("f, config-file", "Path to a YAML config file.", cxxopts::value<std::string>())
 		("h, help", "Print help.")
+		("headless", "Run without any dialogs, e.g. on machines without a display.", cxxopts::value<bool>()->default_value("false"))
+		("y, overwrite", "Overwrite an existing cache folder without asking.", cxxopts::value<bool>()->default_value("false"))
+		("r, resume", "Keep an existing cache folder and only rerun the stages whose inputs changed.", cxxopts::value<bool>()->default_value("false"))
+		("coordinator", "Share the optical flow with worker processes through a work queue in the cache folder.", cxxopts::value<bool>()->default_value("false"))
+		("worker", "Compute optical flow for the work queue of a coordinator with the same config file.", cxxopts::value<bool>()->default_value("false"))
+		("queue-timeout", "Seconds after which unfinished work queue tasks are handed out again.", cxxopts::value<double>()->default_value("3600"))
+		("trace", "Write a Chrome trace (chrome://tracing) of the threads to this file.", cxxopts::value<std::string>()->default_value(""))
 		("v, verbose", "Verbose output.", cxxopts::value<bool>()->default_value("false"));
 
 	options.parse_positional({ "f" });
@@ -51,6 +59,26 @@ int main(int argc, char* argv[])
 	// e.g. "config-preprocessing.yaml_Preprocessing-20200505-164200.log".
 	string logFilename = configFilename + "_" + fs::path(argv[0]).stem().string();
 
+	bool coordinator = vm["coordinator"].as<bool>();
+	bool worker = vm["worker"].as<bool>();
+	if (coordinator && worker)
+	{
+		std::cout << "Error: A process cannot be both coordinator and worker." << std::endl;
+		return -__LINE__;
+	}
+	if (worker)
+		logFilename += "-worker";
+
+	// Recording trace events is compiled out by default.
+	string traceFilename = vm["trace"].as<string>();
+#ifndef WITH_TRACING
+	if (!traceFilename.empty())
+	{
+		std::cout << "Error: Tracing is not enabled. Option --trace is not available." << std::endl;
+		return -__LINE__;
+	}
+#endif
+
 	// Set log level to verbose (optional).
 	bool verbose = vm["verbose"].as<bool>();
 	if (verbose) FLAGS_v = 10;
@@ -65,8 +93,18 @@ int main(int argc, char* argv[])
 		ss << "  Argument " << i << "/" << argc << " : '" << argv[i] << "'\n";
 	LOG(INFO) << "Startup information:\n" << ss.str() << "\n";
 
+	// Preprocessing never creates an OpenGL context; headless mode also suppresses all dialogs.
 	app = new PreprocessingApp(configFilename);
-
+	app->headless = vm["headless"].as<bool>();
+	app->overwriteCache = vm["overwrite"].as<bool>();
+	app->resume = vm["resume"].as<bool>();
+	app->queueTimeout = vm["queue-timeout"].as<double>();
+	if (coordinator)
+		app->queueRole = PreprocessingApp::QueueRole::Coordinator;
+	else if (worker)
+		app->queueRole = PreprocessingApp::QueueRole::Worker;
+
+	TRACE_THREAD_NAME("Main");
 	try
 	{
 		int returnCode = app->init(); // there is no 'run'; 'init' does everything
@@ -78,9 +116,14 @@ int main(int argc, char* argv[])
 	catch (const exception& e)
 	{
 		LOG(ERROR) << "Exception raised: " << endl << e.what();
+		if (!traceFilename.empty())
+			writeTrace(traceFilename);
 		return -__LINE__;
 	}
 
+	if (!traceFilename.empty())
+		writeTrace(traceFilename);
+
 	// Clean up.
 	delete app;
 	LOG(INFO) << "Finished main()";
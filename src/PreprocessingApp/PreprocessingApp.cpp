@@ -1,28 +1,67 @@
 #include "PreprocessingApp.hpp"
 
-#ifdef USE_CERES
-	#include "SphereFitting.hpp"
-#endif
+#include "GitVersion.hpp"
+
+#include "SphereFitting.hpp"
 
 #include "3rdParty/fs_std.hpp"
 
 #include "Core/GUI/Dialog.hpp"
 #include "Core/Loaders/ColmapLoader.hpp"
 #include "Core/Loaders/OpenVSLAMLoader.hpp"
+#include "Core/OpticalFlow/FlowConsistency.hpp"
+#include "Core/OpticalFlow/FlowScheduler.hpp"
 #include "Core/OpticalFlow/OpticalFlowApp.hpp"
 
 #include "Utils/Exceptions.hpp"
+#include "Utils/FlowArchive.hpp"
+#include "Utils/FlowIO.hpp"
 #include "Utils/IOTools.hpp"
 #include "Utils/Logger.hpp"
+#include "Utils/MemoryUsage.hpp"
+#include "Utils/ResourceUsage.hpp"
 #include "Utils/Timer.hpp"
+#include "Utils/Trace.hpp"
 #include "Utils/Utils.hpp"
-
+#include "Utils/WorkQueue.hpp"
+
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <thread>
 
 
 using namespace std;
 
 
+namespace
+{
+	Json::Value toJson(const ResourceUsage& usage)
+	{
+		Json::Value value;
+		value["WallSeconds"] = usage.wallSeconds;
+		value["CPUSeconds"] = usage.cpuSeconds;
+		value["PeakMemoryBytes"] = (Json::UInt64)usage.peakMemory;
+		value["BytesRead"] = (Json::UInt64)usage.bytesRead;
+		value["BytesWritten"] = (Json::UInt64)usage.bytesWritten;
+		return value;
+	}
+} // namespace
+
+
 PreprocessingApp::PreprocessingApp(const std::string& pathToConfigYaml)
 {
 	appDataset = new CameraSetupDataset();
@@ -51,6 +90,10 @@ int PreprocessingApp::init()
 	appSettings.readSettingsFromFile(appDataset->pathToConfigYAML, appDataset);
 	appDataset->setCameraSetup(new CameraSetup(appSettings));
 
+	// With a work queue, each process only reads the images of the pairs it computes.
+	if (queueRole != QueueRole::None)
+		appSettings.streamImages = 1;
+
 	// Initialise the multi-view geometry data loader object.
 	switch (appSettings.sfmFormat)
 	{
@@ -110,14 +153,20 @@ void PreprocessingApp::initDataset()
 	if (!sfmLoad)
 		RUNTIME_EXCEPTION("SfM loading failed");
 
-	// Make sure the cache directory exists.
-	if (fs::exists(appDataset->pathToCacheFolder))
+	// Make sure the cache directory exists. Queue workers share the coordinator's cache directory,
+	// and resuming reuses the results in an existing one.
+	if (queueRole != QueueRole::Worker && !resume && fs::exists(appDataset->pathToCacheFolder))
 	{
-		string question = "The following cache folder already exists:\n" + appDataset->pathToCacheFolder + "\n\nDo you want to overwrite it?";
-		QuestionDialog qDialog = QuestionDialog(question);
-		qDialog.title = "Overwrite cache folder?";
-		(void)qDialog.run();
-		bool answer = qDialog.getBResult();
+		bool answer = overwriteCache;
+		if (!answer && !headless)
+		{
+			string question = "The following cache folder already exists:\n" + appDataset->pathToCacheFolder + "\n\nDo you want to overwrite it?";
+			QuestionDialog qDialog = QuestionDialog(question);
+			qDialog.title = "Overwrite cache folder?";
+			(void)qDialog.run();
+			answer = qDialog.getBResult();
+		}
+
 		if (answer)
 		{
 			LOG(INFO) << "Deleting cache directory: " << appDataset->pathToCacheFolder;
@@ -136,11 +185,11 @@ void PreprocessingApp::initDataset()
 		}
 		else
 		{
-			RUNTIME_EXCEPTION("Not overwriting existing cache directory. Choose a different name.");
+			RUNTIME_EXCEPTION("Not overwriting existing cache directory '" + appDataset->pathToCacheFolder + "'. Choose a different name" + (headless ? " or allow overwriting." : "."));
 		}
 	}
 
-	if (!fs::create_directories(appDataset->pathToCacheFolder))
+	if (queueRole != QueueRole::Worker && !fs::exists(appDataset->pathToCacheFolder) && !fs::create_directories(appDataset->pathToCacheFolder))
 		LOG(FATAL) << "Cache directory '" << appDataset->pathToCacheFolder << "' could not be created";
 
 	appActiveDataset = new CameraSetupDataset(appDataset);
@@ -149,8 +198,8 @@ void PreprocessingApp::initDataset()
 	updateCircle();
 	rescaleDataset();
 
-	// Set up TextureLoader.
-	textureLoader = make_shared<TextureLoader>(new ImageLoader(appActiveDataset->getCameraSetup()->getCameras()));
+	// Set up the image loader. Images are only needed in CPU memory, so no OpenGL context is required.
+	imageLoader = std::unique_ptr<ImageLoader>(new ImageLoader(appActiveDataset->getCameraSetup()->getCameras()));
 }
 
 
@@ -179,38 +228,227 @@ void PreprocessingApp::rescaleDataset()
 
 void PreprocessingApp::processDataset() //automatic preprocessing executes this
 {
-	// Sorting and subsampling of cameras.
-	updateNumberOfCameras();
+	// Queue workers only contribute optical flow to the coordinator's dataset.
+	if (queueRole == QueueRole::Worker)
+	{
+		updateNumberOfCameras();
+		computeOpticalFlow();
+		return;
+	}
 
-#ifdef USE_CERES
-	// Scene-adaptive proxy goemetry fitting.
-	if (sphereFittingSettings.enabled)
-		fitSphereMesh();
-#endif
+	const ResourceUsage start = ResourceUsage::current();
+
+	// The stages of the preprocessing and their dependencies. Each stage's results are checkpointed
+	// in the cache folder, so that resuming only reruns the stages whose inputs changed.
+	StageGraph stages(appDataset->pathToCacheFolder + "/Stages");
+
+	// Sorting and subsampling of cameras (cheap, so it always runs).
+	PreprocessingStage cameras;
+	cameras.name = "Cameras";
+	cameras.run = [this]() -> Json::Value {
+		updateNumberOfCameras();
+		return Json::Value();
+	};
+	stages.addStage(cameras);
 
 	// Compute optical flow between pairs of images.
-	computeOpticalFlow();
+	PreprocessingStage opticalFlow;
+	opticalFlow.name = "OpticalFlow";
+	opticalFlow.dependencies = { "Cameras" };
+	opticalFlow.describeInputs = [this]() -> std::string { return describeOpticalFlowInputs(); };
+	opticalFlow.run = [this]() -> Json::Value {
+		computeOpticalFlow();
+		return getOpticalFlowResults();
+	};
+	opticalFlow.restore = [this](const Json::Value& results) -> bool { return restoreOpticalFlowResults(results); };
+	stages.addStage(opticalFlow);
+
+	// Check the flows of each pair against each other.
+	PreprocessingStage flowConsistency;
+	flowConsistency.name = "FlowConsistency";
+	flowConsistency.dependencies = { "OpticalFlow" };
+	flowConsistency.describeInputs = [this]() -> std::string {
+		return "enabled=" + std::to_string(appSettings.flowConsistency) + ";wraparound=" + std::to_string(appSettings.useEquirectCamera);
+	};
+	flowConsistency.run = [this]() -> Json::Value {
+		computeFlowConsistency();
+		return getFlowConsistencyResults();
+	};
+	flowConsistency.restore = [this](const Json::Value& results) -> bool { return restoreFlowConsistencyResults(results); };
+	stages.addStage(flowConsistency);
+
+	PreprocessingStage save;
+	save.name = "Save";
+	save.dependencies = { "FlowConsistency" };
+	save.run = [this]() -> Json::Value {
+		appActiveDataset->save(&appSettings);
+		return Json::Value();
+	};
+
+	// Scene-adaptive proxy goemetry fitting, which is independent of the optical flow.
+	if (sphereFittingSettings.enabled)
+	{
+		PreprocessingStage sphereFitting;
+		sphereFitting.name = "SphereFitting";
+		sphereFitting.dependencies = { "Cameras" };
+		sphereFitting.describeInputs = [this]() -> std::string { return describeSphereFittingInputs(); };
+		sphereFitting.run = [this]() -> Json::Value {
+			fitSphereMesh();
+			return getSphereFittingResults();
+		};
+		sphereFitting.restore = [this](const Json::Value& results) -> bool { return restoreSphereFittingResults(results); };
+		stages.addStage(sphereFitting);
+		save.dependencies.push_back("SphereFitting");
+	}
+
+	stages.addStage(save);
+	stages.run(resume);
 
-	// Save dataset.
-	appActiveDataset->save(&appSettings);
+	if (!stages.getRestoredStages().empty())
+		LOG(INFO) << "Restored " << stages.getRestoredStages().size() << " stage(s) from checkpoints and ran "
+		          << stages.getExecutedStages().size();
+
+	writeProfile(stages, ResourceUsage::current().since(start));
+	LOG(INFO) << "Peak memory usage: " << formatMemorySize(getPeakMemoryUsage());
 }
 
 
-void PreprocessingApp::computeOpticalFlow()
+void PreprocessingApp::addFlowPairProfiles(const FlowScheduler& scheduler)
+{
+	for (auto& profile : scheduler.getPairProfiles())
+	{
+		Json::Value pair;
+		pair["Index"] = profile.index;
+		pair["Cached"] = profile.cached;
+		pair["WallSeconds"] = profile.prepareSeconds + profile.computeSeconds + profile.writeSeconds;
+		pair["CPUSeconds"] = profile.prepareCPUSeconds + profile.computeCPUSeconds + profile.writeCPUSeconds;
+		pair["PeakMemoryBytes"] = (Json::UInt64)profile.peakMemory;
+		pair["BytesRead"] = (Json::UInt64)profile.bytesRead;
+		pair["BytesWritten"] = (Json::UInt64)profile.bytesWritten;
+		pair["Prepare"]["WallSeconds"] = profile.prepareSeconds;
+		pair["Prepare"]["CPUSeconds"] = profile.prepareCPUSeconds;
+		pair["Compute"]["WallSeconds"] = profile.computeSeconds;
+		pair["Compute"]["CPUSeconds"] = profile.computeCPUSeconds;
+		pair["Write"]["WallSeconds"] = profile.writeSeconds;
+		pair["Write"]["CPUSeconds"] = profile.writeCPUSeconds;
+		flowPairProfiles.append(pair);
+	}
+}
+
+
+void PreprocessingApp::writeProfile(const StageGraph& stages, const ResourceUsage& total)
+{
+	Json::Value root;
+	root["Version"] = g_GIT_VERSION;
+	root["Config"] = appDataset->pathToConfigYAML;
+	root["NumberOfCameras"] = appActiveDataset->getCameraSetup()->getNumberOfCameras();
+	root["Total"] = toJson(total);
+
+	// Stage usage is measured for the whole process, so concurrent stages include each other's usage.
+	root["Stages"] = Json::Value(Json::arrayValue);
+	for (auto& profile : stages.getProfiles())
+	{
+		Json::Value stage = toJson(profile.usage);
+		stage["Name"] = profile.name;
+		stage["Restored"] = profile.restored;
+		stage["StartSeconds"] = profile.startSeconds;
+		root["Stages"].append(stage);
+	}
+
+	// Only the pairs computed by this process; queue workers do not report theirs.
+	root["FlowPairs"] = flowPairProfiles.isNull() ? Json::Value(Json::arrayValue) : flowPairProfiles;
+
+	const std::string filename = appActiveDataset->generateProfileFilename();
+	std::ofstream file(filename.c_str(), std::ios::trunc);
+	file << root;
+	if (file)
+		LOG(INFO) << "Wrote profiling report: " << filename;
+	else
+		LOG(WARNING) << "Could not write profiling report '" << filename << "'";
+}
+
+
+std::string PreprocessingApp::describeOpticalFlowInputs()
 {
 	if (appSettings.computeOpticalFlow == 0)
+		return "disabled";
+
+	resolveFlowResolution();
+
+	stringstream ss;
+	std::unique_ptr<OpticalFlowApp> opticalFlow(createOpticalFlow());
+	ss << opticalFlow->describeParameters() << ";archive=" << appSettings.flowArchive << "\n";
+
+	// The images, identified by name, size and modification time rather than their contents.
+	for (Camera* camera : *appActiveDataset->getCameraSetup()->getCameras())
 	{
-		LOG(INFO) << "Skipping optical flow computation";
-		return;
+		std::error_code ec;
+		ss << camera->imageName << ";" << fs::file_size(camera->imageName, ec) << ";"
+		   << fs::last_write_time(camera->imageName, ec).time_since_epoch().count() << "\n";
+	}
+
+	return ss.str();
+}
+
+
+Json::Value PreprocessingApp::getOpticalFlowResults()
+{
+	Json::Value results(Json::objectValue);
+	if (appSettings.computeOpticalFlow == 0)
+		return results;
+
+	// Flows that could not be computed must be computed again.
+	const int size = appActiveDataset->getCameraSetup()->getNumberOfCameras();
+	if ((int)appActiveDataset->forwardFlows.size() != size || (int)appActiveDataset->backwardFlows.size() != size)
+		return Json::Value();
+
+	for (int i = 0; i < size; i++)
+	{
+		if (appActiveDataset->forwardFlows[i].empty() || appActiveDataset->backwardFlows[i].empty())
+			return Json::Value();
+		results["Forward"].append(appActiveDataset->forwardFlows[i]);
+		results["Backward"].append(appActiveDataset->backwardFlows[i]);
 	}
+	results["Archive"] = appActiveDataset->flowArchive;
+
+	return results;
+}
+
 
+bool PreprocessingApp::restoreOpticalFlowResults(const Json::Value& results)
+{
+	std::vector<std::string> forwardFlows, backwardFlows;
+	for (auto& flow : results["Forward"])
+		forwardFlows.push_back(flow.asString());
+	for (auto& flow : results["Backward"])
+		backwardFlows.push_back(flow.asString());
+	const std::string flowArchive = results["Archive"].asString();
+
+	for (auto& flow : forwardFlows)
+		if (!fs::exists(flow))
+			return false;
+	for (auto& flow : backwardFlows)
+		if (!fs::exists(flow))
+			return false;
+	if (!flowArchive.empty() && !fs::exists(flowArchive))
+		return false;
+
+	appActiveDataset->forwardFlows = forwardFlows;
+	appActiveDataset->backwardFlows = backwardFlows;
+	appActiveDataset->flowArchive = flowArchive;
+	return true;
+}
+
+
+OpticalFlowApp* PreprocessingApp::createOpticalFlow()
+{
 	FlowMethod _method = appSettings.opticalFlowMethod;
 
 	int preset = 0;
-	if (_method == FlowMethod::DIS)
+	if (_method == FlowMethod::DIS || _method == FlowMethod::NativeDIS)
 		preset = 2;
 
-	OpticalFlowApp* opticalFlow = new OpticalFlowApp(_method, preset, appSettings.downsampleFlow > 0);
+	OpticalFlowApp* opticalFlow = new OpticalFlowApp(_method, preset, appSettings.flowResolution);
 
 	if (_method == FlowMethod::BroxCUDA)
 		opticalFlow->init(_method, 0, &appSettings.broxFlowParams);
@@ -220,34 +458,142 @@ void PreprocessingApp::computeOpticalFlow()
 	opticalFlow->flowFieldsComputed = false;
 	opticalFlow->shouldShutdown = false;
 	opticalFlow->writeFlowIntoFile = true;
+	opticalFlow->fileExtension = appSettings.flowFileFormat;
 	opticalFlow->equirectWraparound = appSettings.useEquirectCamera;
+	opticalFlow->warmStart = appSettings.disWarmStart > 0;
+	opticalFlow->tileSize = appSettings.flowTileSize;
+	opticalFlow->tileOverlap = appSettings.flowTileOverlap;
+	opticalFlow->maxConcurrentTiles = appSettings.flowMaxConcurrentTiles;
+	opticalFlow->maxLatitude = appSettings.flowMaxLatitude;
 
-	if (appSettings.downsampleFlow == 1)
-		opticalFlow->downsampleFlow = true;
-	else
-		opticalFlow->downsampleFlow = false;
+	return opticalFlow;
+}
+
+
+void PreprocessingApp::resolveFlowResolution()
+{
+	if (appSettings.flowMegapixels <= 0 || flowResolutionResolved)
+		return;
+
+	// All images have the same size, so the first one determines the resolution.
+	Camera* camera = appActiveDataset->getCameraSetup()->getCameras()->at(0);
+	cv::Mat image = camera->getImage();
+	if (image.empty())
+		image = camera->readImageWithOpenCV();
+	if (image.empty())
+		RUNTIME_EXCEPTION("Could not read '" + camera->imageName + "' to determine the flow resolution.");
+
+	appSettings.flowResolution = std::min(1.f, std::sqrt(1e6f * appSettings.flowMegapixels / image.total()));
+	flowResolutionResolved = true;
+	LOG(INFO) << "Computing flows at " << std::setprecision(3) << appSettings.flowResolution << "x the image resolution ("
+	          << appSettings.flowMegapixels << " megapixels)";
+}
+
+
+void PreprocessingApp::computeOpticalFlow()
+{
+	TRACE_SCOPE("PreprocessingApp::computeOpticalFlow");
+
+	if (appSettings.computeOpticalFlow == 0)
+	{
+		LOG(INFO) << "Skipping optical flow computation";
+		return;
+	}
+
+	// Load images, unless they are read from disk just before they are needed.
+	if (appSettings.streamImages > 0)
+		LOG(INFO) << "Streaming images during optical flow computation";
+	else if (!imageLoader->loadImages())
+		RUNTIME_EXCEPTION("Couldn't load all images.");
+
+	FlowMethod _method = appSettings.opticalFlowMethod;
+	resolveFlowResolution();
+
+	// Each worker thread gets its own flow engine, as they are not thread-safe.
+	auto createWorker = [this]() -> OpticalFlowApp* { return createOpticalFlow(); };
+
+	// Brox flow runs on the GPU, so there is nothing to gain from several workers.
+	int numberOfWorkers = appSettings.opticalFlowThreads;
+	if (_method == FlowMethod::BroxCUDA)
+		numberOfWorkers = 1;
+
+	FlowScheduler scheduler(createWorker, numberOfWorkers, appSettings.opticalFlowQueueDepth);
+	scheduler.streamImages = appSettings.streamImages > 0;
+	scheduler.prefetchImages = appSettings.imagePrefetch;
+
+	// The flow cache lives next to the individual cache folders, so that it is shared between them
+	// and survives overwriting a cache folder.
+	std::unique_ptr<FlowCache> flowCache;
+	if (appSettings.useFlowCache)
+	{
+		flowCache.reset(new FlowCache(appDataset->workingDirectory + "/Cache/FlowCache"));
+		scheduler.cache = flowCache.get();
+	}
+
+	if (queueRole == QueueRole::Worker)
+	{
+		// The coordinator creates the queue once it has set up the dataset. A queue without recent
+		// heartbeats was left behind by a coordinator that stopped, and is replaced by the next one.
+		WorkQueue queue(appDataset->pathToCacheFolder + "/FlowQueue");
+		while (true)
+		{
+			LOG(INFO) << "Waiting for the work queue " << queue.getDirectory();
+			bool loggedStale = false;
+			for (int waited = 0; !queue.attach() || queue.getSecondsSinceHeartbeat() > queueTimeout; waited++)
+			{
+				if (queue.exists() && !loggedStale)
+				{
+					LOG(WARNING) << "Ignoring the work queue " << queue.getDirectory() << ", whose coordinator stopped "
+					             << std::fixed << std::setprecision(0) << queue.getSecondsSinceHeartbeat() << "s ago";
+					loggedStale = true;
+				}
+				if (waited > queueTimeout)
+					RUNTIME_EXCEPTION("Work queue '" + queue.getDirectory() + "' was not created in time.");
+				std::this_thread::sleep_for(std::chrono::seconds(1));
+			}
+
+			processFlowQueue(scheduler, queue);
+
+			// The coordinator removes the queue once all pairs are done, but a new coordinator replaces it.
+			if (!queue.exists() || queue.isCurrent())
+				break;
+			LOG(INFO) << "The work queue was replaced by a new coordinator";
+		}
+		return;
+	}
 
 	int size = appActiveDataset->getCameraSetup()->getNumberOfCameras();
 
-	Timer t1;
+	// All flows are also packed into one archive, so the viewer only needs to map a single file.
+	std::unique_ptr<FlowArchiveWriter> flowArchive;
+	appActiveDataset->flowArchive.clear();
+	if (appSettings.flowArchive)
+	{
+		flowArchive.reset(new FlowArchiveWriter(appDataset->pathToCacheFolder + "/Flows.flowpack", 2 * size));
+		scheduler.archive = flowArchive.get();
+	}
+
 	try
 	{
 		ScopedTimer timer;
 		std::vector<Camera*>& cameras = *appActiveDataset->getCameraSetup()->getCameras();
 
-		for (int i = 0; i < size; i++)
-		{
-			LOG(INFO) << "Computing optical flow (" << (i + 1) << " of " << size << ")";
-			opticalFlow->setPair(*cameras[i], *cameras[(i + 1) % size]);
-			opticalFlow->run();
-			opticalFlow->flowFieldsComputed = false;
-		}
+		if (queueRole == QueueRole::Coordinator)
+			computeOpticalFlowWithQueue(scheduler);
+		else
+			scheduler.run(cameras);
+		addFlowPairProfiles(scheduler);
+
+		if (flowArchive && flowArchive->finish())
+			appActiveDataset->flowArchive = flowArchive->getFilename();
 
 		LOG(INFO) << "Computed " << (2 * size) << " flow fields in "
 		          << std::fixed << std::setprecision(2) << timer.getElapsedSeconds() << "s";
+		LOG(INFO) << "Memory usage after optical flow: " << formatMemorySize(getCurrentMemoryUsage())
+		          << " (peak " << formatMemorySize(getPeakMemoryUsage()) << ")";
 
-		appActiveDataset->forwardFlows = opticalFlow->getForwardFlows();
-		appActiveDataset->backwardFlows = opticalFlow->getBackwardFlows();
+		appActiveDataset->forwardFlows = scheduler.getForwardFlows();
+		appActiveDataset->backwardFlows = scheduler.getBackwardFlows();
 
 		// The backward flows are from the next to the current frame, but need
 		// them to be the backward flows from the current to the previous frames.
@@ -257,8 +603,6 @@ void PreprocessingApp::computeOpticalFlow()
 		for (int k = 0; k < size - 1; k++)
 			tmpBWFlows.push_back(appActiveDataset->backwardFlows[k]);
 		appActiveDataset->backwardFlows = tmpBWFlows;
-
-		opticalFlow->shouldShutdown = true;
 	}
 	catch (const std::exception& e)
 	{
@@ -267,6 +611,247 @@ void PreprocessingApp::computeOpticalFlow()
 }
 
 
+void PreprocessingApp::computeFlowConsistency()
+{
+	TRACE_SCOPE("PreprocessingApp::computeFlowConsistency");
+
+	appActiveDataset->flowConsistency.clear();
+	if (appSettings.computeOpticalFlow == 0 || appSettings.flowConsistency == 0)
+		return;
+
+	const std::vector<string>& forwardFlows = appActiveDataset->forwardFlows;
+	const std::vector<string>& backwardFlows = appActiveDataset->backwardFlows;
+	const int size = appActiveDataset->getCameraSetup()->getNumberOfCameras();
+	if ((int)forwardFlows.size() != size || (int)backwardFlows.size() != size)
+	{
+		LOG(WARNING) << "Skipping the flow consistency check, as not all flows were computed.";
+		return;
+	}
+
+	ScopedTimer timer;
+	std::vector<FlowPairConsistency> pairs(size);
+	std::vector<char> succeeded(size, false); // not vector<bool>, which is written concurrently
+	const bool wraparound = appSettings.useEquirectCamera > 0;
+
+	// The confidence images are written next to the flows, as "<flow>-Confidence.png".
+	auto getConfidenceFilename = [this](const string& flow) -> string {
+		return appDataset->pathToCacheFolder + "/" + fs::path(flow).stem().string() + "-Confidence.png";
+	};
+
+	cv::parallel_for_(cv::Range(0, size), [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; i++)
+		{
+			TRACE_SCOPE("FlowConsistency::pair");
+			FlowPairConsistency& pair = pairs[i];
+			pair.left = i;
+			pair.right = (i + 1) % size;
+
+			// The backward flows go from each camera to the previous one.
+			const cv::Mat2f forward = readFlowFile(forwardFlows[pair.left]);
+			const cv::Mat2f backward = readFlowFile(backwardFlows[pair.right]);
+			if (forward.empty() || backward.empty() || forward.size() != backward.size())
+				continue;
+
+			pair.forwardConfidence = getConfidenceFilename(forwardFlows[pair.left]);
+			pair.backwardConfidence = getConfidenceFilename(backwardFlows[pair.right]);
+			succeeded[i] = cv::imwrite(pair.forwardConfidence, checkFlowConsistency(forward, backward, wraparound, pair.forward))
+			               && cv::imwrite(pair.backwardConfidence, checkFlowConsistency(backward, forward, wraparound, pair.backward));
+		}
+	});
+
+	for (int i = 0; i < size; i++)
+	{
+		if (!succeeded[i])
+		{
+			LOG(WARNING) << "Could not check the consistency of the flows between cameras " << i << " and " << ((i + 1) % size) << ".";
+			return;
+		}
+	}
+	appActiveDataset->flowConsistency = pairs;
+
+	// The least consistent pairs are the first to look at when the result has artefacts.
+	auto worst = std::max_element(pairs.begin(), pairs.end(), [](const FlowPairConsistency& a, const FlowPairConsistency& b) {
+		return a.forward.inconsistentFraction + a.backward.inconsistentFraction < b.forward.inconsistentFraction + b.backward.inconsistentFraction;
+	});
+	float inconsistent = 0;
+	for (auto& pair : pairs)
+		inconsistent += (pair.forward.inconsistentFraction + pair.backward.inconsistentFraction) / (2 * size);
+
+	LOG(INFO) << "Checked the consistency of " << size << " flow pairs in " << std::fixed << std::setprecision(2) << timer.getElapsedSeconds()
+	          << "s: " << (100 * inconsistent) << "% of pixels inconsistent, most in cameras " << worst->left << " and " << worst->right
+	          << " (" << (50 * (worst->forward.inconsistentFraction + worst->backward.inconsistentFraction)) << "%)";
+}
+
+
+Json::Value PreprocessingApp::getFlowConsistencyResults()
+{
+	Json::Value results(Json::arrayValue);
+	for (auto& pair : appActiveDataset->flowConsistency)
+		results.append(pair.toJson());
+	return results;
+}
+
+
+bool PreprocessingApp::restoreFlowConsistencyResults(const Json::Value& results)
+{
+	std::vector<FlowPairConsistency> pairs;
+	for (auto& value : results)
+	{
+		pairs.push_back(FlowPairConsistency::fromJson(value));
+		if (!fs::exists(pairs.back().forwardConfidence) || !fs::exists(pairs.back().backwardConfidence))
+			return false;
+	}
+
+	appActiveDataset->flowConsistency = pairs;
+	return true;
+}
+
+
+void PreprocessingApp::computeOpticalFlowWithQueue(FlowScheduler& scheduler)
+{
+	std::vector<Camera*>& cameras = *appActiveDataset->getCameraSetup()->getCameras();
+	const int size = (int)cameras.size();
+
+	// One task per pair: its index and image names, one per line.
+	std::map<std::string, std::string> tasks;
+	for (int i = 0; i < size; i++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "pair-%05d", i);
+		tasks[name] = std::to_string(i) + "\n" + cameras[i]->imageName + "\n" + cameras[(i + 1) % size]->imageName + "\n";
+	}
+
+	WorkQueue queue(appDataset->pathToCacheFolder + "/FlowQueue");
+	if (!queue.create(tasks))
+		RUNTIME_EXCEPTION("Could not create the work queue '" + queue.getDirectory() + "'.");
+	LOG(INFO) << "Created a work queue of " << size << " flow pairs in " << queue.getDirectory()
+	          << ". Further processes can help with: Preprocessing " << appDataset->pathToConfigYAML << " --worker";
+
+	// The archive is filled from the flow files once all pairs are done.
+	FlowArchiveWriter* archive = scheduler.archive;
+	scheduler.archive = nullptr;
+
+	// Work on the queue, too, then wait for the workers to finish the remaining pairs.
+	processFlowQueue(scheduler, queue);
+	for (int waited = 1; !queue.isFinished(); waited++)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		queue.heartbeat();
+		if (waited % 30 == 0)
+			LOG(INFO) << "Waiting for workers: " << queue.getNumberOfDoneTasks() << " of " << size << " flow pairs done";
+
+		// Pairs of workers that died are computed here.
+		if (queue.requeueStaleTasks(queueTimeout) > 0)
+			processFlowQueue(scheduler, queue);
+	}
+
+	scheduler.archive = archive;
+	const int failed = queue.getNumberOfFailedTasks();
+	queue.remove();
+	if (failed > 0)
+		RUNTIME_EXCEPTION("The optical flow of " + std::to_string(failed) + " pair(s) could not be computed; see the logs of the processes that claimed them.");
+	scheduler.collect(cameras);
+}
+
+
+void PreprocessingApp::processFlowQueue(FlowScheduler& scheduler, WorkQueue& queue)
+{
+	std::vector<Camera*>& cameras = *appActiveDataset->getCameraSetup()->getCameras();
+	const int size = (int)cameras.size();
+
+	// Claim as many pairs at a time as there are flow threads, to keep all of them busy.
+	int batchSize = appSettings.opticalFlowThreads;
+	if (batchSize <= 0)
+		batchSize = (int)std::thread::hardware_concurrency();
+	batchSize = std::max(1, batchSize);
+
+	while (true)
+	{
+		std::vector<std::string> names;
+		std::vector<int> pairs;
+		std::string name, contents;
+		while ((int)names.size() < batchSize && queue.claim(name, contents))
+		{
+			names.push_back(name);
+
+			std::stringstream ss(contents);
+			std::string index, leftImage, rightImage;
+			std::getline(ss, index);
+			std::getline(ss, leftImage);
+			std::getline(ss, rightImage);
+
+			// All processes must have sampled the same cameras from the same config.
+			const int i = atoi(index.c_str());
+			if (index.empty() || i < 0 || i >= size || cameras[i]->imageName != leftImage || cameras[(i + 1) % size]->imageName != rightImage)
+			{
+				for (auto& task : names)
+					queue.release(task);
+				RUNTIME_EXCEPTION("Task '" + name + "' does not match the cameras of this process. Do all processes use the same config?");
+			}
+
+			pairs.push_back(i);
+		}
+
+		if (names.empty())
+			break;
+
+		// Refresh the claims while computing, so that the pairs are not handed to another process
+		// after the queue timeout (and the coordinator's heartbeat, so that workers keep attaching).
+		std::mutex heartbeatMutex;
+		std::condition_variable heartbeatCondition;
+		bool computed = false;
+		std::thread heartbeat([&]() {
+			const std::chrono::duration<double> interval(std::max(1., queueTimeout / 4));
+			std::unique_lock<std::mutex> lock(heartbeatMutex);
+			while (!heartbeatCondition.wait_for(lock, interval, [&]() { return computed; }))
+			{
+				for (auto& task : names)
+					queue.refresh(task);
+				if (queueRole == QueueRole::Coordinator)
+					queue.heartbeat();
+			}
+		});
+		auto stopHeartbeat = [&]() {
+			{
+				std::lock_guard<std::mutex> lock(heartbeatMutex);
+				computed = true;
+			}
+			heartbeatCondition.notify_all();
+			heartbeat.join();
+		};
+
+		try
+		{
+			scheduler.run(cameras, pairs);
+		}
+		catch (...)
+		{
+			stopHeartbeat();
+			for (auto& task : names)
+				queue.release(task);
+			throw;
+		}
+		stopHeartbeat();
+
+		// Pairs whose flow was not computed (e.g. an image failed to load) are not done.
+		const std::vector<std::string> forwardFlows = scheduler.getForwardFlows();
+		const std::vector<std::string> backwardFlows = scheduler.getBackwardFlows();
+		for (size_t k = 0; k < names.size(); k++)
+		{
+			if (!forwardFlows[pairs[k]].empty() && !backwardFlows[pairs[k]].empty())
+			{
+				queue.complete(names[k]);
+			}
+			else
+			{
+				LOG(WARNING) << "No optical flow for pair " << pairs[k] << ", so marking task '" << names[k] << "' as failed.";
+				queue.fail(names[k]);
+			}
+		}
+	}
+}
+
+
 void PreprocessingApp::updateNumberOfCameras() //sub-sample camera setup
 {
 	LOG(INFO) << "Entering updateNumberOfCameras().";
@@ -376,10 +961,11 @@ void PreprocessingApp::updateNumberOfCameras() //sub-sample camera setup
 	if (load3DPoints)
 		rescalePointCloud();
 
-	// Load images.
-	textureLoader->setCameras(appActiveDataset->getCameraSetup()->getCameras());
-	if (!textureLoader->load())
-		RUNTIME_EXCEPTION("Couldn't load all images.");
+	// The images are only loaded by the optical flow, which needs them, but make sure they exist.
+	imageLoader->setCameras(appActiveDataset->getCameraSetup()->getCameras());
+	for (Camera* camera : *appActiveDataset->getCameraSetup()->getCameras())
+		if (!fs::exists(camera->imageName))
+			RUNTIME_EXCEPTION("Image '" + camera->imageName + "' does not exist.");
 }
 
 
@@ -842,10 +1428,11 @@ void PreprocessingApp::sampleCameraCircleCreatePath(std::vector<Camera*>* _camer
 }
 
 
-#ifdef USE_CERES
-
 void PreprocessingApp::fitSphereMesh()
 {
+	TRACE_SCOPE("PreprocessingApp::fitSphereMesh");
+	sphereFittingFiles.clear();
+
 	if (appActiveDataset == nullptr || appActiveDataset->getWorldPointCloud().get() == nullptr)
 	{
 		LOG(WARNING) << "Cannot fit sphere mesh -- no point cloud loaded";
@@ -873,7 +1460,13 @@ void PreprocessingApp::fitSphereMesh()
 		LOG(INFO) << "Skipped " << points_skipped << " points ("
 		          << std::fixed << std::setprecision(2) << (100. * points_skipped) / points3D.size() << "%)";
 
-	// Run sphere fitting for all combinations of settings.
+	// The points only need to be assigned to the mesh once for all combinations of settings.
+	auto samples = std::make_shared<const std::vector<SpherePointSample>>(
+	    SphereFitting::samplePoints(points_disparity, sphereFittingSettings.polar_steps, sphereFittingSettings.azimuth_steps));
+
+	// Set up sphere fitting for all combinations of settings.
+	std::vector<SphereFitting> fits;
+	std::vector<std::string> suffixes;
 	for (auto robust_loss : sphereFittingSettings.robust_data_loss)
 	{
 		for (double robust_scale : sphereFittingSettings.robust_data_loss_scale)
@@ -884,55 +1477,136 @@ void PreprocessingApp::fitSphereMesh()
 				{
 					for (double prior_weight : sphereFittingSettings.prior_weight)
 					{
-						// Apply sphere fitting settings.
+						// Apply sphere fitting settings; solve using inverse depth.
 						SphereFitting fit(sphereFittingSettings.polar_steps, sphereFittingSettings.azimuth_steps);
 						fit.robust_data_loss = static_cast<SphereFitting::RobustLoss>(robust_loss);
 						fit.robust_data_loss_scale = robust_scale;
 						fit.data_weight = data_weight;
 						fit.smoothness_weight = smoothness_weight;
 						fit.prior_weight = prior_weight;
+						fit.aggregate_data_term = sphereFittingSettings.aggregate_data_term;
+						fit.backend = static_cast<SphereFitting::Backend>(sphereFittingSettings.backend);
+						fit.pyramid_levels = sphereFittingSettings.pyramid_levels;
+						fit.adaptive_mesh = sphereFittingSettings.adaptive_mesh;
+						fit.adaptive_max_cell_size = sphereFittingSettings.adaptive_max_cell_size;
+						fit.adaptive_max_points = sphereFittingSettings.adaptive_max_points;
+						fit.adaptive_max_depth_variation = sphereFittingSettings.adaptive_max_depth_variation;
+						fit.samples = samples;
+						fits.push_back(fit);
 
 						// Encode all settings in filename.
 						stringstream suffix;
-						//suffix << "-" << sphereFittingSettings.azimuth_steps << "x" << sphereFittingSettings.polar_steps;
 						suffix << "-loss" << robust_loss;
 						suffix << "-scale" << robust_scale;
 						suffix << "-data" << data_weight;
 						suffix << "-sm" << smoothness_weight;
 						suffix << "-pr" << prior_weight;
-
-						//{
-						//	// First solve for points directly.
-						//	fit.points = points;
-						//	fit.solveProblem();
-
-						//	string filename_prefix = (fs::path(appDataset->pathToCacheFolder) / ("spherefit-depth" + suffix.str())).generic_string();
-						//	fit.exportSphereMeshAndPoints(fit.est_depth_map, fit.points, filename_prefix, 50, 2000);
-						//}
-
-						{
-							// Then solve using inverse depth.
-							fit.points = points_disparity;
-							fit.solveProblem();
-
-							//string filename_prefix = (fs::path(appDataset->pathToCacheFolder) / ("spherefit-disparity" + params)).generic_string();
-							//fit.exportSphereMeshAndPoints(fit.est_depth_map, fit.points, filename_prefix);
-
-							// Convert from disparity (inverse depth) to depth map.
-							auto depth_map = fit.est_depth_map.cwiseInverse();
-							string filename_prefix = (fs::path(appDataset->pathToCacheFolder) / ("spherefit-d2d" + suffix.str())).generic_string();
-							fit.exportSphereMeshAndPoints(depth_map, points, filename_prefix, 50, 2000);
-
-							//// Clamp depth to 1..20 metres.
-							//auto clamped_depth_map = depth_map.cwiseMax(100).cwiseMin(2000);
-							//filename_prefix = fs::path(appDataset->pathToCacheFolder) / ("spherefit-disparity2depth-clamped" + params);
-							//fit.exportSphereMeshAndPoints(depth_map, points, filename_prefix);
-						}
+						suffixes.push_back(suffix.str());
 					}
 				}
 			}
 		}
 	}
+
+	// Solve the fits on a bounded number of workers, and split the cores between their solvers.
+	const int cores = std::max(1, (int)std::thread::hardware_concurrency());
+	const int maxWorkers = sphereFittingSettings.threads > 0 ? sphereFittingSettings.threads : cores;
+	const int workers = std::max(1, std::min((int)fits.size(), maxWorkers));
+	LOG(INFO) << "Fitting " << fits.size() << " sphere meshes on " << workers << " worker(s)";
+
+	std::atomic<size_t> nextFit(0);
+	std::mutex errorMutex;
+	std::exception_ptr error;
+	auto work = [&](int worker) {
+		TRACE_THREAD_NAME("Sphere fitting " + std::to_string(worker));
+		for (size_t i = nextFit++; i < fits.size(); i = nextFit++)
+		{
+			try
+			{
+				fits[i].num_threads = std::max(1, cores / workers);
+				fits[i].log_progress = (workers == 1);
+				fits[i].solveProblem();
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (!error)
+					error = std::current_exception();
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int worker = 1; worker < workers; worker++)
+		threads.emplace_back(work, worker);
+	work(0);
+	for (auto& thread : threads)
+		thread.join();
+
+	if (error)
+		std::rethrow_exception(error);
+
+	// Export in the order of the settings, so the output does not depend on scheduling.
+	for (size_t i = 0; i < fits.size(); i++)
+	{
+		// Convert from disparity (inverse depth) to depth map.
+		auto depth_map = fits[i].est_depth_map.cwiseInverse();
+		string filename_prefix = (fs::path(appDataset->pathToCacheFolder) / ("spherefit-d2d" + suffixes[i])).generic_string();
+		for (const std::string& file : SphereFitting::exportSphereMeshAndPoints(depth_map, points, filename_prefix, 50, 2000, fits[i].mesh_cells))
+			sphereFittingFiles.push_back(fs::path(file).filename().string());
+	}
 }
 
-#endif // USE_CERES
+
+
+std::string PreprocessingApp::describeSphereFittingInputs()
+{
+	stringstream ss;
+	ss << sphereFittingSettings.polar_steps << "x" << sphereFittingSettings.azimuth_steps;
+	auto describe = [&](const char* name, const std::vector<double>& values) {
+		ss << ";" << name << "=";
+		for (double value : values)
+			ss << value << ",";
+	};
+	describe("data", sphereFittingSettings.data_weight);
+	describe("loss", std::vector<double>(sphereFittingSettings.robust_data_loss.begin(), sphereFittingSettings.robust_data_loss.end()));
+	describe("scale", sphereFittingSettings.robust_data_loss_scale);
+	describe("smoothness", sphereFittingSettings.smoothness_weight);
+	describe("prior", sphereFittingSettings.prior_weight);
+	ss << ";aggregate=" << sphereFittingSettings.aggregate_data_term;
+	ss << ";backend=" << sphereFittingSettings.backend;
+	ss << ";levels=" << sphereFittingSettings.pyramid_levels;
+	ss << ";adaptive=" << sphereFittingSettings.adaptive_mesh << "," << sphereFittingSettings.adaptive_max_cell_size << ","
+	   << sphereFittingSettings.adaptive_max_points << "," << sphereFittingSettings.adaptive_max_depth_variation;
+	ss << "\n";
+
+	// The (rescaled) point positions, in binary.
+	std::string description = ss.str();
+	if (appActiveDataset->getWorldPointCloud())
+		for (auto& point : *appActiveDataset->getWorldPointCloud()->getPoints())
+			description.append(reinterpret_cast<const char*>(point->pos.data()), 3 * sizeof(float));
+
+	return description;
+}
+
+
+Json::Value PreprocessingApp::getSphereFittingResults()
+{
+	// The files written by this run of fitSphereMesh, not those left by runs with other settings.
+	Json::Value results(Json::objectValue);
+	results["Files"] = Json::Value(Json::arrayValue);
+	for (const std::string& file : sphereFittingFiles)
+		results["Files"].append(file);
+
+	return results;
+}
+
+
+bool PreprocessingApp::restoreSphereFittingResults(const Json::Value& results)
+{
+	for (auto& file : results["Files"])
+		if (!fs::exists(fs::path(appDataset->pathToCacheFolder) / file.asString()))
+			return false;
+
+	return true;
+}
@@ -1,14 +1,19 @@
 #pragma once
 
 #include "SphereFittingSettings.hpp"
+#include "StageGraph.hpp"
 
 #include "Core/Application.hpp"
 #include "Core/CameraSetup/CameraSetupDataset.hpp"
 #include "Core/CameraSetup/CameraSetupSettings.hpp"
 #include "Core/Loaders/ImageLoader.hpp"
-#include "Core/Loaders/TextureLoader.hpp"
 
+#include <memory>
+
+class FlowScheduler;
 class MultiViewDataLoader;
+class OpticalFlowApp;
+class WorkQueue;
 
 
 /**
@@ -34,18 +39,39 @@ public:
 	 * After construction with app = new PreprocessingApp(pathToYaml), the initialisation now takes
 	 * the path and passes it to appDataset as well as appSettings.
 	 * 
-	 * initDataset is then called, from where appDataset loads the data using appSettings.
-	 *
-	 * initOpenGL is called to set appWindow. initOpenGL also calls initTextures to construct
-	 * textureLoader (set in GLApplication.hpp).
+	 * initDataset is then called, from where appDataset loads the data using appSettings,
+	 * followed by processDataset, which does all the preprocessing and saves the results.
 	 *
-	 * Shaders are then initialised in initPrograms.
+	 * Preprocessing runs entirely on the CPU: no window or OpenGL context is created, and images
+	 * are only loaded into CPU memory. With 'headless' set, no dialogs are shown either.
 	 * 
 	 * @return int error code when it feels like it.
 	 */
 	int init() override;
 	void run() override {};
 
+	// Never show any dialogs, e.g. for running on machines without a display.
+	bool headless = false;
+
+	// Overwrite an existing cache folder without asking (required in headless mode).
+	bool overwriteCache = false;
+
+	// Role of this process if the optical flow is shared between several Preprocessing processes
+	// through a work queue in the cache folder.
+	enum class QueueRole
+	{
+		None,        // computes all flows itself
+		Coordinator, // creates the queue, works on it, and assembles and saves the dataset
+		Worker       // only computes flows for the coordinator's queue
+	};
+	QueueRole queueRole = QueueRole::None;
+
+	// Seconds after which tasks that were claimed, but not finished, are handed out again.
+	double queueTimeout = 3600;
+
+	// Keep an existing cache folder and only rerun the stages whose inputs changed since their checkpoints.
+	bool resume = false;
+
 	void initDataset();
 	void rescalePointCloud();
 	void rescaleDataset();
@@ -56,10 +82,9 @@ public:
 	void fitCircleToCameras();
 	void updateCircle();
 	void computeOpticalFlow();
+	void computeFlowConsistency(); // forward-backward consistency of the flows of every pair
 
-#ifdef USE_CERES
 	void fitSphereMesh();
-#endif
 
 
 private:
@@ -70,7 +95,7 @@ private:
 	CameraSetupDataset* appActiveDataset = nullptr;
 
 	std::shared_ptr<MultiViewDataLoader> sfmLoader;
-	std::shared_ptr<TextureLoader> textureLoader;
+	std::unique_ptr<ImageLoader> imageLoader; // CPU memory only, no textures
 
 	bool initialRun = true;
 	std::vector<Eigen::Vector3f> centroids;
@@ -79,6 +104,28 @@ private:
 	Eigen::Matrix3f svdBase;
 	Eigen::Vector3f svdValues;
 
+	OpticalFlowApp* createOpticalFlow();
+	void resolveFlowResolution();
+	bool flowResolutionResolved = false;
+	void computeOpticalFlowWithQueue(FlowScheduler& scheduler);
+	void processFlowQueue(FlowScheduler& scheduler, WorkQueue& queue);
+
+	// Profiling report written next to the dataset's cache file: resources used per stage and per flow pair.
+	Json::Value flowPairProfiles;
+	void addFlowPairProfiles(const FlowScheduler& scheduler);
+	void writeProfile(const StageGraph& stages, const ResourceUsage& total);
+
+	// Fingerprints and checkpointed results of the stages of processDataset.
+	std::string describeOpticalFlowInputs();
+	Json::Value getOpticalFlowResults();
+	bool restoreOpticalFlowResults(const Json::Value& results);
+	Json::Value getFlowConsistencyResults();
+	bool restoreFlowConsistencyResults(const Json::Value& results);
+	std::string describeSphereFittingInputs();
+	std::vector<std::string> sphereFittingFiles; // written by fitSphereMesh, in the cache folder
+	Json::Value getSphereFittingResults();
+	bool restoreSphereFittingResults(const Json::Value& results);
+
 	void sampleCameraCirclePhi(std::vector<Camera*>* _cameras, int M, float* phis);
 	void sampleCameraCirclePhiAndEuclideanDistance(std::vector<Camera*>* _cameras, int M, float* phis, int neighbourhood, float maxDist);
 	void sampleCameraCircleCreatePath(std::vector<Camera*>* _cameras, int M, float* phis, int neighbourhood, float minScore);
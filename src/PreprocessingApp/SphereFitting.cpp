@@ -4,22 +4,37 @@
 #include "Core/LinearAlgebra.hpp"
 #include "Utils/DepthIO.hpp"
 #include "Utils/Logger.hpp"
+#include "Utils/Trace.hpp"
 #include "Utils/cvutils.hpp"
 
-#include <ceres/ceres.h>
+#ifdef USE_CERES
+	#include <ceres/ceres.h>
+#endif
+#include <Eigen/SparseCholesky>
 #include <opencv2/core/eigen.hpp>
+#include <opencv2/core/utility.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <fstream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <utility>
 
 
+#ifdef USE_CERES
 using namespace ceres;
+#endif
 using namespace cv;
 using namespace Eigen;
 
 #define USE_NORMALISED_RESIDUALS 1
 
 
+#ifdef USE_CERES
+
 //---- Cost terms for sphere fitting -----------------------------------------//
 
 
@@ -129,6 +144,67 @@ struct SphereFittingHalfwayDataTerm
 };
 
 
+struct SphereFittingAggregatedDataTerm
+{
+	typedef AutoDiffCostFunction<SphereFittingAggregatedDataTerm, 3, 1, 1, 1> SphereFittingAggregatedTriangleFunction;
+	typedef AutoDiffCostFunction<SphereFittingAggregatedDataTerm, 2, 1, 1> SphereFittingAggregatedHalfwayFunction;
+
+	// residual = sqrt_A_ * x - b_, where x are the depths of the triangle's vertices
+	Eigen::Matrix3d sqrt_A_ = Eigen::Matrix3d::Zero();
+	Eigen::Vector3d b_ = Eigen::Vector3d::Zero();
+
+	template <typename T>
+	bool operator()(
+	    const T* const a,
+	    const T* const b,
+	    const T* const c,
+	    T* residual) const
+	{
+		for (int k = 0; k < 3; k++)
+			residual[k] = sqrt_A_(k, 0) * (*a) + sqrt_A_(k, 1) * (*b) + sqrt_A_(k, 2) * (*c) - b_(k);
+
+		return true;
+	}
+
+	template <typename T>
+	bool operator()(
+	    const T* const a,
+	    const T* const b,
+	    T* residual) const
+	{
+		for (int k = 0; k < 2; k++)
+			residual[k] = sqrt_A_(k, 0) * (*a) + sqrt_A_(k, 1) * (*b) - b_(k);
+
+		return true;
+	}
+
+	// Creates the residual of the quadratic x^T A x - 2 g^T x (up to a constant) over 'vertices' vertices.
+	static CostFunction* Create(const Eigen::Matrix3d& A, const Eigen::Vector3d& g, int vertices)
+	{
+		// With A = V diag(lambda) V^T, |diag(sqrt(lambda)) V^T x - diag(1 / sqrt(lambda)) V^T g|^2 is the quadratic.
+		// Directions without any points (lambda ~ 0), e.g. if all points lie on an edge, are left to the other terms.
+		Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen(A.topLeftCorner(vertices, vertices));
+		const double threshold = 1e-12 * eigen.eigenvalues().maxCoeff();
+
+		SphereFittingAggregatedDataTerm* term = new SphereFittingAggregatedDataTerm();
+		for (int k = 0; k < vertices; k++)
+		{
+			const double lambda = eigen.eigenvalues()(k);
+			if (lambda <= threshold)
+				continue;
+
+			const Eigen::VectorXd v = eigen.eigenvectors().col(k);
+			term->sqrt_A_.row(k).head(vertices) = sqrt(lambda) * v.transpose();
+			term->b_(k) = v.dot(g.head(vertices)) / sqrt(lambda);
+		}
+
+		if (vertices == 2)
+			return new SphereFittingAggregatedHalfwayFunction(term);
+		return new SphereFittingAggregatedTriangleFunction(term);
+	}
+};
+
+
 struct SphereFittingBinarySmoothnessCost
 {
 	typedef AutoDiffCostFunction<SphereFittingBinarySmoothnessCost, 1, 1, 1> SphereFittingBinarySmoothnessCostFunction;
@@ -219,6 +295,42 @@ struct SphereFitting1DLaplacianSmoothnessCost
 };
 
 
+namespace
+{
+	// Creates the robust loss of the data term (nullptr for L2).
+	LossFunction* createDataLoss(SphereFitting::RobustLoss robust_loss, double scale)
+	{
+		LossFunction* loss = nullptr;
+		switch (robust_loss)
+		{
+			case SphereFitting::RobustLoss::None:
+				// nothing to do
+				LOG(INFO) << "Using L2 data loss";
+				break;
+
+			case SphereFitting::RobustLoss::Huber:
+				loss = new HuberLoss(scale);
+				LOG(INFO) << "Using Huber data loss (scale: " << scale << ")";
+				break;
+
+			case SphereFitting::RobustLoss::SoftLOne:
+				loss = new SoftLOneLoss(scale);
+				LOG(INFO) << "Using SoftLOne data loss (scale: " << scale << ")";
+				break;
+
+			case SphereFitting::RobustLoss::Cauchy:
+				loss = new CauchyLoss(scale);
+				LOG(INFO) << "Using Cauchy data loss (scale: " << scale << ")";
+				break;
+		}
+
+		return loss;
+	}
+} // namespace
+
+#endif // USE_CERES
+
+
 //---- Sphere fitting class --------------------------------------------------//
 
 
@@ -230,186 +342,250 @@ SphereFitting::SphereFitting(int polar_steps, int azimuth_steps) :
 
 void SphereFitting::solveProblem()
 {
-	if (points.size() == 0)
+	TRACE_SCOPE("SphereFitting::solveProblem");
+
+	if (!samples)
+		samples = std::make_shared<const std::vector<SpherePointSample>>(samplePoints(points, polar_steps, azimuth_steps));
+
+	mesh_cells.clear();
+	solver_iterations = 0;
+	if (samples->size() == 0)
 	{
 		LOG(WARNING) << "No points given. Exiting early.";
 		return;
 	}
 
-	// Set up optimisation problem for Ceres
-	Problem problem;
-	LOG(INFO) << "Solving SphereFitting for " << points.size() << " points at " << azimuth_steps << "x" << polar_steps << " resolution";
+	LOG(INFO) << "Solving SphereFitting for " << samples->size() << " points at " << azimuth_steps << "x" << polar_steps << " resolution";
 	LOG(INFO) << "Using weights: data=" << data_weight << ", smoothness=" << smoothness_weight << ", prior=" << prior_weight;
 
 	// Initialise with a sphere that has the average distance of points as radius.
-	// TODO: Work out a better initial solution.
 	Vec2d accumulator;
-	for (auto& point : points)
-		accumulator += Vec2d(point.norm(), 1.0);
+	for (auto& sample : *samples)
+		accumulator += Vec2d(sample.radius, 1.0);
 	double average_radius = accumulator[0] / accumulator[1];
 	LOG(INFO) << "Average radius of points: " << average_radius;
 
 	est_depth_map = MatrixXd::Ones(polar_steps, azimuth_steps);
 	est_depth_map *= average_radius;
 
-	//// Add the residuals: data term on the sphere vertices only for now
-	//for (int i = 0; i < depth_map.rows(); i++)
-	//{
-	//	for (int j = 1; j < depth_map.cols() - 1; j++)
-	//	{
-	//		CostFunction* cost = new AutoDiffCostFunction<SphereFittingDataTerm, 1, 1>(
-	//			new SphereFittingDataTerm(depth_map(i, j)));
-	//		problem.AddResidualBlock(cost, loss, &est_depth_map(i, j));
-	//	}
-	//}
+	// Coarse-to-fine: initialise with the upsampled solution at half the resolution instead.
+	const int coarse_polar_steps = (polar_steps - 1) / 2 + 1; // keeps the poles
+	const int coarse_azimuth_steps = azimuth_steps / 2;
+	if (pyramid_levels > 1 && coarse_polar_steps >= 3 && coarse_azimuth_steps >= 4)
+	{
+		SphereFitting coarse(coarse_polar_steps, coarse_azimuth_steps);
+		coarse.data_weight = data_weight;
+		coarse.robust_data_loss = robust_data_loss;
+		coarse.robust_data_loss_scale = robust_data_loss_scale;
+		coarse.smoothness_weight = smoothness_weight;
+		coarse.prior_weight = prior_weight;
+		coarse.aggregate_data_term = aggregate_data_term;
+		coarse.backend = backend;
+		coarse.irls_iterations = irls_iterations;
+		coarse.irls_tolerance = irls_tolerance;
+		coarse.pyramid_levels = pyramid_levels - 1;
+		coarse.num_threads = num_threads;
+		coarse.log_progress = log_progress;
+		coarse.samples = std::make_shared<const std::vector<SpherePointSample>>(resampleSamples(*samples, coarse_polar_steps, coarse_azimuth_steps));
+		coarse.solveProblem();
+
+		est_depth_map = resampleDepthMap(coarse.est_depth_map, polar_steps, azimuth_steps);
+		LOG(INFO) << "Initialised SphereFitting at " << azimuth_steps << "x" << polar_steps << " from " << coarse_azimuth_steps << "x" << coarse_polar_steps << " resolution";
+	}
+
+	// Friendly information.
+	if (data_weight == 0) LOG(INFO) << "Ignoring data term as (data_weight == 0)";
+	if (smoothness_weight == 0) LOG(INFO) << "Ignoring smoothness term as (smoothness_weight == 0)";
+	if (prior_weight == 0) LOG(INFO) << "Ignoring prior term as (prior_weight == 0)";
 
-	if (data_weight == 0)
+	Backend solver_backend = backend;
+	if (solver_backend != Backend::Ceres && solver_backend != Backend::SparseCholesky)
 	{
-		LOG(INFO) << "Ignoring data term as (data_weight == 0)";
+		LOG(WARNING) << "Unknown sphere fitting backend " << int(solver_backend) << ", so using the sparse Cholesky backend";
+		solver_backend = Backend::SparseCholesky;
 	}
-	else
+#ifndef USE_CERES
+	if (solver_backend == Backend::Ceres)
+	{
+		LOG(WARNING) << "Built without Ceres, so using the sparse Cholesky backend for sphere fitting";
+		solver_backend = Backend::SparseCholesky;
+	}
+#endif
+
+	if (adaptive_mesh)
 	{
-		LossFunction* dataterm_loss = nullptr;
-		switch (robust_data_loss)
+		if (solver_backend != Backend::SparseCholesky)
 		{
-			case RobustLoss::None:
-				// nothing to do
-				LOG(INFO) << "Using L2 data loss";
-				break;
+			LOG(WARNING) << "The adaptive sphere mesh needs the sparse Cholesky backend";
+			solver_backend = Backend::SparseCholesky;
+		}
+		mesh_cells = buildAdaptiveMesh(*samples, est_depth_map, adaptive_max_cell_size, adaptive_max_points, adaptive_max_depth_variation);
+	}
 
-			case RobustLoss::Huber:
-				dataterm_loss = new HuberLoss(robust_data_loss_scale);
-				LOG(INFO) << "Using Huber data loss (scale: " << robust_data_loss_scale << ")";
-				break;
+	if (solver_backend == Backend::SparseCholesky)
+		solveSparseCholesky(average_radius);
+#ifdef USE_CERES
+	else
+		solveCeres(average_radius);
+#endif
+}
 
-			case RobustLoss::SoftLOne:
-				dataterm_loss = new SoftLOneLoss(robust_data_loss_scale);
-				LOG(INFO) << "Using SoftLOne data loss (scale: " << robust_data_loss_scale << ")";
-				break;
 
-			case RobustLoss::Cauchy:
-				dataterm_loss = new CauchyLoss(robust_data_loss_scale);
-				LOG(INFO) << "Using Cauchy data loss (scale: " << robust_data_loss_scale << ")";
-				break;
-		}
+void SphereFitting::bucketSamples(std::vector<int>& offsets, std::vector<int>& order) const
+{
+	const int triangles = 2 * polar_steps * azimuth_steps;
+	offsets.assign(triangles + 1, 0);
+	for (auto& sample : *samples)
+		if (sample.triangle >= 0)
+			offsets[sample.triangle + 1]++;
+	std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+	order.resize(offsets.back());
+	std::vector<int> next(offsets.begin(), offsets.end() - 1);
+	for (size_t i = 0; i < samples->size(); i++)
+		if ((*samples)[i].triangle >= 0)
+			order[next[(*samples)[i].triangle]++] = (int)i;
+}
+
 
-		// Add the residuals, normalised by number of points.
-		dataterm_loss = new ScaledLoss(dataterm_loss, data_weight / points.size(), TAKE_OWNERSHIP);
-		for (auto& point : points)
+#ifdef USE_CERES
+
+void SphereFitting::solveCeres(double average_radius)
+{
+	if (data_weight == 0 || !aggregate_data_term)
+	{
+		// Set up optimisation problem for Ceres
+		Problem problem;
+		if (data_weight != 0)
 		{
-			// Convert 3D point to spherical coordinates
-			Eigen::Vector3f spherical = cartesian2spherical(point);
-			float radius  = spherical.x();
-			float azimuth = spherical.y();
-			float polar   = spherical.z();
-
-			//LOG(INFO) << "Cartesian point: " << point.transpose();
-			//LOG(INFO) << "-> Spherical point: " << spherical.transpose();
-
-			// Find the quad this point falls into
-			int azimuth_index = (int)floor(azimuth / (2 * M_PI) * azimuth_steps - 0.5);
-			azimuth_index = (azimuth_index + azimuth_steps) % azimuth_steps; // positive remainder
-			//LOG(INFO) << "azimuth_index = " << azimuth_index;
-
-			int polar_index = int(polar / M_PI * (polar_steps - 1)); // NB: assuming caps!
-			//LOG(INFO) << "polar_index = " << polar_index;
-
-			// Indices of sphere mesh vertices to the left / right / top / bottom
-			int index_l = azimuth_index;
-			int index_r = (index_l + 1) % azimuth_steps;
-			int index_t = polar_index;
-			int index_b = min(index_t + 1, polar_steps - 1);
-			//LOG(INFO) << "indices: L=" << index_l << ", R=" << index_r << ", T=" << index_t << ", B=" << index_b;
-
-			// Point falls on the south pole = > special case
-			if (index_t == index_b)
-			{
-				LOG(INFO) << "Hit the South pole!";
-				//# The 4 corners of the quad are only two different points, as top = bottom.
-				//# So we pick both points with weight 0.5 and duplicate the last one,
-				//# but with a weight of 0.
-				//tri_face = [index_b, index_l, index_b, index_r, index_b, index_r]
-				//points_in_faces.append((i, tri_face, (0.5, 0.5, 0), points_radius[i]))
-				//
-				// CR: This gives a Ceres error -- cannot use parameter more than once in a residual
-				//problem.AddResidualBlock(
-				//	SphereFittingBarycentricDataTerm::Create(radius, Eigen::Vector3f(0.5f, 0.5f, 0)),
-				//	loss,
-				//	&est_depth_map(index_b, index_l),
-				//	&est_depth_map(index_b, index_r),
-				//	&est_depth_map(index_b, index_r));
-				problem.AddResidualBlock(
-				    SphereFittingHalfwayDataTerm::Create(radius),
-				    dataterm_loss,
-				    &est_depth_map(index_b, index_l),
-				    &est_depth_map(index_b, index_r));
-				continue;
-			}
+			// Add the residuals, normalised by number of points.
+			LossFunction* dataterm_loss = createDataLoss(robust_data_loss, robust_data_loss_scale);
+			addPointDataTerms(problem, new ScaledLoss(dataterm_loss, data_weight / samples->size(), TAKE_OWNERSHIP));
+		}
+		addRegularisationTerms(problem, average_radius);
+		solve(problem);
+		return;
+	}
 
-			Eigen::Vector3f sph_tl = depthmap2spherical(est_depth_map, index_l, index_t);
-			Eigen::Vector3f sph_bl = depthmap2spherical(est_depth_map, index_l, index_b);
-			Eigen::Vector3f sph_tr = depthmap2spherical(est_depth_map, index_r, index_t);
-			Eigen::Vector3f sph_br = depthmap2spherical(est_depth_map, index_r, index_b);
+	// Bucket the samples by triangle once for all iterations.
+	std::vector<int> offsets, order;
+	bucketSamples(offsets, order);
 
-			// We assume that b has a higher azimuth angle than a.
-			// If that is not the case, we have wrapped around and need to compensate.
-			// We do that by adding pi to the azimuth of all points + wrapping.
-			if (index_l > index_r)
-			{
-				//LOG(INFO) << "Wrap around!";
-				spherical.y() = fmod(fmod(spherical.y() + M_PI, 2 * M_PI), 2 * M_PI);
-				sph_tl.y() = fmod(fmod(sph_tl.y() + M_PI, 2 * M_PI), 2 * M_PI);
-				sph_bl.y() = fmod(fmod(sph_bl.y() + M_PI, 2 * M_PI), 2 * M_PI);
-				sph_tr.y() = fmod(fmod(sph_tr.y() + M_PI, 2 * M_PI), 2 * M_PI);
-				sph_br.y() = fmod(fmod(sph_br.y() + M_PI, 2 * M_PI), 2 * M_PI);
-			}
+	// Iteratively reweighted least squares: each iteration linearises the data term at the current
+	// solution, so the fixed point is a solution of the per-point problem.
+	std::unique_ptr<LossFunction> dataterm_loss(createDataLoss(robust_data_loss, robust_data_loss_scale));
+	for (int iteration = 0; iteration < std::max(1, irls_iterations); iteration++)
+	{
+		const MatrixXd previous_depth_map = est_depth_map;
 
-			// ignoring the radius of the barycentric coordinates
-			Eigen::Vector3f bary1 = computeBarycentricCoords(spherical.bottomRows(2), sph_tl.bottomRows(2), sph_tr.bottomRows(2), sph_bl.bottomRows(2)); // top-left tri (cw)
-			//LOG(INFO) << "bary1 = " << bary1.transpose();
+		Problem problem;
+		addAggregatedDataTerms(problem, dataterm_loss.get(), offsets, order);
+		addRegularisationTerms(problem, average_radius);
+		solve(problem);
 
-			if (bary1.x() >= -1e-6f && bary1.x() <= 1 &&
-				bary1.y() >= -1e-6f && bary1.y() <= 1 &&
-				bary1.z() >= -1e-6f && bary1.z() <= 1)
-			{
-				//LOG(INFO) << "good1";
-				problem.AddResidualBlock(
-				    SphereFittingBarycentricDataTerm::Create(radius, bary1),
-				    dataterm_loss,
-				    &est_depth_map(index_t, index_l),
-				    &est_depth_map(index_t, index_r),
-				    &est_depth_map(index_b, index_l));
+		const double change = ((est_depth_map - previous_depth_map).array().abs() / previous_depth_map.array().abs()).maxCoeff();
+		LOG(INFO) << "IRLS iteration " << iteration + 1 << ": maximum relative depth change " << change;
+		if (change < irls_tolerance)
+			break;
+	}
+}
 
-				continue;
-			}
 
-			Eigen::Vector3f bary2 = computeBarycentricCoords(spherical.bottomRows(2), sph_bl.bottomRows(2), sph_br.bottomRows(2), sph_tr.bottomRows(2)); // bottom-right tri (ccw)
-			//LOG(INFO) << "bary2 = " << bary2.transpose();
+void SphereFitting::addPointDataTerms(Problem& problem, LossFunction* loss)
+{
+	for (auto& sample : *samples)
+	{
+		const int* t = sample.polar_index;
+		const int* a = sample.azimuth_index;
+
+		if (sample.numberOfVertices == 2)
+		{
+			problem.AddResidualBlock(
+			    SphereFittingHalfwayDataTerm::Create(sample.radius),
+			    loss,
+			    &est_depth_map(t[0], a[0]),
+			    &est_depth_map(t[1], a[1]));
+		}
+		else if (sample.numberOfVertices == 3)
+		{
+			problem.AddResidualBlock(
+			    SphereFittingBarycentricDataTerm::Create(sample.radius, sample.weights),
+			    loss,
+			    &est_depth_map(t[0], a[0]),
+			    &est_depth_map(t[1], a[1]),
+			    &est_depth_map(t[2], a[2]));
+		}
+	}
+}
+
 
-			if (bary2.x() >= -1e-6f && bary2.x() <= 1 &&
-				bary2.y() >= -1e-6f && bary2.y() <= 1 &&
-				bary2.z() >= -1e-6f && bary2.z() <= 1)
+void SphereFitting::addAggregatedDataTerms(Problem& problem, const LossFunction* loss, const std::vector<int>& offsets, const std::vector<int>& order)
+{
+	// Same normalisation by the number of points as the per-point data term.
+	const double scale = data_weight / samples->size();
+	const int triangles = (int)offsets.size() - 1;
+
+	// Sum up the normal equations of each triangle: A = sum(c * w w^T) and g = sum(c * radius * w)
+	// for barycentric weights w, so that the cost is 1/2 sum(c * (radius - w^T x)^2) up to a constant.
+	std::vector<Eigen::Matrix3d> A(triangles, Eigen::Matrix3d::Zero());
+	std::vector<Eigen::Vector3d> g(triangles, Eigen::Vector3d::Zero());
+	cv::parallel_for_(cv::Range(0, triangles), [&](const cv::Range& range) {
+		for (int triangle = range.start; triangle < range.end; triangle++)
+		{
+			for (int i = offsets[triangle]; i < offsets[triangle + 1]; i++)
 			{
-				//LOG(INFO) << "good2";
-				problem.AddResidualBlock(
-				    SphereFittingBarycentricDataTerm::Create(radius, bary2),
-				    dataterm_loss,
-				    &est_depth_map(index_b, index_l),
-				    &est_depth_map(index_b, index_r),
-				    &est_depth_map(index_t, index_r));
+				const SpherePointSample& sample = (*samples)[order[i]];
+				const Eigen::Vector3d w = sample.weights.cast<double>();
+				double est_point_radius = 0;
+				for (int k = 0; k < sample.numberOfVertices; k++)
+					est_point_radius += w(k) * est_depth_map(sample.polar_index[k], sample.azimuth_index[k]);
 
-				continue;
-			}
+#if USE_NORMALISED_RESIDUALS
+				// The weight c matches the gradient of the normalised residual at the current solution.
+				const double denominator = sample.radius + est_point_radius;
+				if (denominator <= 0)
+					continue;
+				const double residual = (sample.radius - est_point_radius) / denominator;
+				double c = 2 * sample.radius / (denominator * denominator * denominator);
+#else
+				const double residual = sample.radius - est_point_radius;
+				double c = 1;
+#endif
 
-			LOG(WARNING) << "Missed triangle ... skipping point";
-		} // looping over all points
+				// Reweight by the derivative of the robust loss.
+				if (loss)
+				{
+					double rho[3];
+					loss->Evaluate(residual * residual, rho);
+					c *= rho[1];
+				}
 
-	} // data_weight != 0
+				A[triangle] += scale * c * w * w.transpose();
+				g[triangle] += scale * c * sample.radius * w;
+			}
+		}
+	});
+
+	for (int triangle = 0; triangle < triangles; triangle++)
+	{
+		if (offsets[triangle] == offsets[triangle + 1] || A[triangle].trace() <= 0)
+			continue;
+
+		const SpherePointSample& sample = (*samples)[order[offsets[triangle]]];
+		const int* t = sample.polar_index;
+		const int* a = sample.azimuth_index;
+		CostFunction* cost = SphereFittingAggregatedDataTerm::Create(A[triangle], g[triangle], sample.numberOfVertices);
+
+		if (sample.numberOfVertices == 2)
+			problem.AddResidualBlock(cost, nullptr, &est_depth_map(t[0], a[0]), &est_depth_map(t[1], a[1]));
+		else
+			problem.AddResidualBlock(cost, nullptr, &est_depth_map(t[0], a[0]), &est_depth_map(t[1], a[1]), &est_depth_map(t[2], a[2]));
+	}
+}
 
-	// Friendly information.
-	if (smoothness_weight == 0) LOG(INFO) << "Ignoring smoothness term as (smoothness_weight == 0)";
-	if (prior_weight == 0) LOG(INFO) << "Ignoring prior term as (prior_weight == 0)";
 
+void SphereFitting::addRegularisationTerms(Problem& problem, double average_radius)
+{
 	// The weight of the smoothness loss is the parameter smoothness_weight normalised by the number of mesh vertices.
 	LossFunction* smoothness_loss = new ScaledLoss(nullptr, smoothness_weight / (est_depth_map.rows() * est_depth_map.cols()), TAKE_OWNERSHIP);
 	LossFunction* prior_loss = new ScaledLoss(nullptr, prior_weight / (est_depth_map.rows() * est_depth_map.cols()), TAKE_OWNERSHIP);
@@ -475,21 +651,699 @@ void SphereFitting::solveProblem()
 			);
 		}
 	}
+}
+
 
+void SphereFitting::solve(Problem& problem)
+{
 	// Solve the problem
 	Solver::Options options;
 	Solver::Summary summary;
-	options.num_threads = 8;
+	options.num_threads = num_threads;
 	options.max_num_iterations = 100;
 	options.max_linear_solver_iterations = 10;
 	options.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
 	//options.linear_solver_type = ceres::CGNR; // faster for bigger problems
-	options.minimizer_progress_to_stdout = true;
+	options.minimizer_progress_to_stdout = log_progress;
 	ceres::Solve(options, &problem, &summary);
+	solver_iterations += summary.num_successful_steps + summary.num_unsuccessful_steps;
 	LOG(INFO) << "Full Ceres solver report:\n"
 	          << summary.FullReport() << "\n";
 }
 
+#endif // USE_CERES
+
+
+namespace
+{
+	// Evaluates a robust loss like Ceres: rho(s) and its derivative rho'(s) for a squared residual s.
+	void evaluateRobustLoss(SphereFitting::RobustLoss robust_loss, double a, double s, double& rho, double& rho1)
+	{
+		const double b = a * a;
+		switch (robust_loss)
+		{
+			case SphereFitting::RobustLoss::None:
+				rho = s;
+				rho1 = 1;
+				break;
+
+			case SphereFitting::RobustLoss::Huber:
+				if (s > b)
+				{
+					rho = 2 * a * sqrt(s) - b;
+					rho1 = a / sqrt(s);
+				}
+				else
+				{
+					rho = s;
+					rho1 = 1;
+				}
+				break;
+
+			case SphereFitting::RobustLoss::SoftLOne:
+				rho = 2 * b * (sqrt(1 + s / b) - 1);
+				rho1 = 1 / sqrt(1 + s / b);
+				break;
+
+			case SphereFitting::RobustLoss::Cauchy:
+				rho = b * log1p(s / b);
+				rho1 = 1 / (1 + s / b);
+				break;
+		}
+	}
+} // namespace
+
+
+void SphereFitting::solveSparseCholesky(double average_radius)
+{
+	TRACE_SCOPE("SphereFitting::solveSparseCholesky");
+
+	std::vector<int> offsets, order;
+	bucketSamples(offsets, order);
+
+	// Levenberg-Marquardt on the normal equations, which reweights the robust loss in every
+	// iteration (IRLS). The iteration limit and tolerance follow the Ceres backend.
+	const int max_iterations = 100;
+	const double function_tolerance = 1e-6;
+	const double max_lambda = 1e16;
+	double lambda = 1e-4;
+
+	// With an adaptive mesh, only its vertices are unknowns (x = P z) and the normal equations are
+	// reduced to P^T H P and P^T gradient.
+	Eigen::SparseMatrix<double> P;
+	if (!mesh_cells.empty())
+	{
+		const Eigen::MatrixXi vertices = getMeshVertices(mesh_cells, polar_steps, azimuth_steps);
+		P = getInterpolationMatrix(mesh_cells, vertices);
+
+		Eigen::VectorXd z(P.cols());
+		for (int i = 0; i < polar_steps; i++)
+			for (int j = 0; j < azimuth_steps; j++)
+				if (vertices(i, j) >= 0)
+					z(vertices(i, j)) = est_depth_map(i, j);
+		Eigen::Map<Eigen::VectorXd>(est_depth_map.data(), est_depth_map.size()) = P * z;
+
+		LOG(INFO) << "Adaptive mesh with " << mesh_cells.size() << " cells and " << P.cols() << " of " << P.rows() << " vertices";
+	}
+
+	Eigen::SparseMatrix<double> H;
+	Eigen::VectorXd gradient;
+	auto lineariseReduced = [&]() -> double {
+		const double cost = linearise(est_depth_map, average_radius, offsets, order, &H, &gradient);
+		if (P.size() > 0)
+		{
+			H = Eigen::SparseMatrix<double>(P.transpose() * H * P);
+			gradient = P.transpose() * gradient;
+		}
+		return cost;
+	};
+	double cost = lineariseReduced();
+	const double initial_cost = cost;
+
+	Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> solver;
+	int iteration = 0;
+	bool converged = false;
+	for (; iteration < max_iterations && !converged; iteration++)
+	{
+		bool accepted = false;
+		while (!accepted && lambda < max_lambda)
+		{
+			// Damp with the diagonal of H, which is zero for vertices without any terms.
+			Eigen::SparseMatrix<double> damped = H;
+			for (int k = 0; k < damped.rows(); k++)
+				damped.coeffRef(k, k) += lambda * std::max(H.coeff(k, k), 1e-12);
+
+			solver.compute(damped);
+			if (solver.info() != Eigen::Success)
+			{
+				lambda *= 10;
+				continue;
+			}
+
+			const Eigen::VectorXd step = solver.solve(-gradient);
+			MatrixXd candidate = est_depth_map;
+			if (P.size() > 0)
+				Eigen::Map<Eigen::VectorXd>(candidate.data(), candidate.size()) += P * step;
+			else
+				Eigen::Map<Eigen::VectorXd>(candidate.data(), candidate.size()) += step;
+
+			const double candidate_cost = linearise(candidate, average_radius, offsets, order, nullptr, nullptr);
+			if (!std::isfinite(candidate_cost) || candidate_cost >= cost)
+			{
+				lambda *= 10;
+				continue;
+			}
+
+			accepted = true;
+			converged = (cost - candidate_cost) < function_tolerance * cost;
+			est_depth_map = candidate;
+			lambda = std::max(lambda / 10, 1e-12);
+			cost = lineariseReduced();
+			if (log_progress)
+				LOG(INFO) << "Iteration " << iteration << ": cost = " << cost << ", lambda = " << lambda;
+		}
+
+		// No step reduces the cost any more.
+		if (!accepted)
+			break;
+	}
+
+	solver_iterations = iteration;
+	LOG(INFO) << "Sparse Cholesky solver: cost " << initial_cost << " -> " << cost << " in " << iteration << " iterations";
+}
+
+
+double SphereFitting::linearise(const Eigen::MatrixXd& depth_map, double average_radius, const std::vector<int>& offsets, const std::vector<int>& order, Eigen::SparseMatrix<double>* H, Eigen::VectorXd* gradient) const
+{
+	// Vertex indices follow the (column-major) storage order of the depth map.
+	auto index = [&](int polar_index, int azimuth_index) -> int { return polar_index + azimuth_index * polar_steps; };
+
+	// The cost is 1/2 sum(weight * rho(r^2)) over the same residuals as for Ceres. The normal equations
+	// are H = sum(weight * rho'(r^2) * J^T J) and gradient = sum(weight * rho'(r^2) * r * J^T).
+	double cost = 0;
+	std::vector<Eigen::Triplet<double>> triplets;
+	if (gradient)
+		gradient->setZero(depth_map.size());
+
+	// Adds a residual (without robust loss) with its Jacobian entries.
+	auto addResidual = [&](double weight, double r, const std::vector<std::pair<int, double>>& jacobian) {
+		cost += 0.5 * weight * r * r;
+		if (!H)
+			return;
+		for (auto& row : jacobian)
+		{
+			(*gradient)(row.first) += weight * r * row.second;
+			for (auto& column : jacobian)
+				triplets.emplace_back(row.first, column.first, weight * row.second * column.second);
+		}
+	};
+
+	// Data term, summed up per triangle in parallel.
+	if (data_weight != 0)
+	{
+		const double scale = data_weight / samples->size();
+		const int triangles = (int)offsets.size() - 1;
+		std::vector<Eigen::Matrix3d> A(triangles, Eigen::Matrix3d::Zero());
+		std::vector<Eigen::Vector3d> g(triangles, Eigen::Vector3d::Zero());
+		std::vector<double> costs(triangles, 0);
+		cv::parallel_for_(cv::Range(0, triangles), [&](const cv::Range& range) {
+			for (int triangle = range.start; triangle < range.end; triangle++)
+			{
+				for (int i = offsets[triangle]; i < offsets[triangle + 1]; i++)
+				{
+					const SpherePointSample& sample = (*samples)[order[i]];
+					const Eigen::Vector3d w = sample.weights.cast<double>();
+					double est_point_radius = 0;
+					for (int k = 0; k < sample.numberOfVertices; k++)
+						est_point_radius += w(k) * depth_map(sample.polar_index[k], sample.azimuth_index[k]);
+
+#if USE_NORMALISED_RESIDUALS
+					const double denominator = sample.radius + est_point_radius;
+					if (denominator <= 0)
+						continue;
+					const double r = (sample.radius - est_point_radius) / denominator;
+					const double dr = -2 * sample.radius / (denominator * denominator); // d r / d est_point_radius
+#else
+					const double r = sample.radius - est_point_radius;
+					const double dr = -1;
+#endif
+
+					double rho, rho1;
+					evaluateRobustLoss(robust_data_loss, robust_data_loss_scale, r * r, rho, rho1);
+					costs[triangle] += 0.5 * scale * rho;
+					A[triangle] += scale * rho1 * dr * dr * w * w.transpose();
+					g[triangle] += scale * rho1 * r * dr * w;
+				}
+			}
+		});
+
+		for (int triangle = 0; triangle < triangles; triangle++)
+		{
+			cost += costs[triangle];
+			if (!H || offsets[triangle] == offsets[triangle + 1])
+				continue;
+
+			const SpherePointSample& sample = (*samples)[order[offsets[triangle]]];
+			for (int k = 0; k < sample.numberOfVertices; k++)
+			{
+				const int row = index(sample.polar_index[k], sample.azimuth_index[k]);
+				(*gradient)(row) += g[triangle](k);
+				for (int l = 0; l < sample.numberOfVertices; l++)
+					triplets.emplace_back(row, index(sample.polar_index[l], sample.azimuth_index[l]), A[triangle](k, l));
+			}
+		}
+	}
+
+	// The weights of the smoothness and prior terms are normalised by the number of mesh vertices.
+	const double smoothness_scale = smoothness_weight / depth_map.size();
+	const double prior_scale = prior_weight / depth_map.size();
+
+	// Adds the residual sum(a_k * x_k) / sum(b_k * x_k) over the given vertices.
+	auto addRatio = [&](double weight, const std::vector<int>& vertices, const std::vector<double>& a, const std::vector<double>& b) {
+		double numerator = 0, denominator = 0;
+		for (size_t k = 0; k < vertices.size(); k++)
+		{
+			numerator += a[k] * depth_map.data()[vertices[k]];
+			denominator += b[k] * depth_map.data()[vertices[k]];
+		}
+
+		std::vector<std::pair<int, double>> jacobian(vertices.size());
+#if USE_NORMALISED_RESIDUALS
+		for (size_t k = 0; k < vertices.size(); k++)
+			jacobian[k] = std::make_pair(vertices[k], (a[k] * denominator - numerator * b[k]) / (denominator * denominator));
+		addResidual(weight, numerator / denominator, jacobian);
+#else
+		for (size_t k = 0; k < vertices.size(); k++)
+			jacobian[k] = std::make_pair(vertices[k], a[k]);
+		addResidual(weight, numerator, jacobian);
+#endif
+	};
+
+	for (int i = 1; i < polar_steps - 1; i++) // skip top and bottom rows (poles)
+	{
+		for (int j = 0; j < azimuth_steps; j++)
+		{
+			// Smoothness: central vertex vs the average of its top, right, bottom and left neighbours.
+			if (smoothness_weight != 0)
+				addRatio(smoothness_scale,
+				         { index(i, j), index(i - 1, j), index(i, (j + 1) % azimuth_steps), index(i + 1, j), index(i, (j - 1 + azimuth_steps) % azimuth_steps) },
+				         { 1, -0.25, -0.25, -0.25, -0.25 },
+				         { 1, 0.25, 0.25, 0.25, 0.25 });
+
+			// Prior: average radius vs central vertex.
+			if (prior_weight != 0)
+			{
+				const double x = depth_map(i, j);
+#if USE_NORMALISED_RESIDUALS
+				const double denominator = average_radius + x;
+				addResidual(prior_scale, (average_radius - x) / denominator, { std::make_pair(index(i, j), -2 * average_radius / (denominator * denominator)) });
+#else
+				addResidual(prior_scale, average_radius - x, { std::make_pair(index(i, j), -1.) });
+#endif
+			}
+		}
+	}
+
+	if (smoothness_weight != 0)
+	{
+		for (int j = 0; j < azimuth_steps; j++)
+		{
+			// Adjacent vertices at the poles.
+			addRatio(smoothness_scale, { index(0, j), index(0, (j + 1) % azimuth_steps) }, { 1, -1 }, { 1, 1 });
+			addRatio(smoothness_scale, { index(polar_steps - 1, j), index(polar_steps - 1, (j + 1) % azimuth_steps) }, { 1, -1 }, { 1, 1 });
+
+			// 1D Laplacian across the poles.
+			addRatio(smoothness_scale,
+			         { index(1, j), index(0, j), index(1, (j + azimuth_steps / 2) % azimuth_steps) },
+			         { 1, -2, 1 },
+			         { 1, 2, 1 });
+			addRatio(smoothness_scale,
+			         { index(polar_steps - 2, j), index(polar_steps - 1, j), index(polar_steps - 2, (j + azimuth_steps / 2) % azimuth_steps) },
+			         { 1, -2, 1 },
+			         { 1, 2, 1 });
+		}
+	}
+
+	if (H)
+	{
+		H->resize(depth_map.size(), depth_map.size());
+		H->setFromTriplets(triplets.begin(), triplets.end());
+	}
+
+	return cost;
+}
+
+
+std::vector<SpherePointSample> SphereFitting::samplePoints(const std::vector<Eigen::Vector3f>& points, int polar_steps, int azimuth_steps)
+{
+	std::vector<SpherePointSample> samples(points.size());
+	cv::parallel_for_(cv::Range(0, (int)points.size()), [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; i++)
+		{
+			// Convert 3D point to spherical coordinates
+			Eigen::Vector3f spherical = cartesian2spherical(points[i]);
+			samples[i].radius = spherical.x();
+			samples[i].azimuth = spherical.y();
+			samples[i].polar = spherical.z();
+			assignToMesh(samples[i], polar_steps, azimuth_steps);
+		}
+	});
+
+	return samples;
+}
+
+
+std::vector<SpherePointSample> SphereFitting::resampleSamples(const std::vector<SpherePointSample>& samples, int polar_steps, int azimuth_steps)
+{
+	std::vector<SpherePointSample> resampled(samples.size());
+	cv::parallel_for_(cv::Range(0, (int)samples.size()), [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; i++)
+		{
+			resampled[i].radius = samples[i].radius;
+			resampled[i].azimuth = samples[i].azimuth;
+			resampled[i].polar = samples[i].polar;
+			assignToMesh(resampled[i], polar_steps, azimuth_steps);
+		}
+	});
+
+	return resampled;
+}
+
+
+void SphereFitting::assignToMesh(SpherePointSample& sample, int polar_steps, int azimuth_steps)
+{
+	Eigen::Vector3f spherical(sample.radius, sample.azimuth, sample.polar);
+	float azimuth = sample.azimuth;
+	float polar   = sample.polar;
+
+	// Find the quad this point falls into
+	int azimuth_index = (int)floor(azimuth / (2 * M_PI) * azimuth_steps - 0.5);
+	azimuth_index = (azimuth_index + azimuth_steps) % azimuth_steps; // positive remainder
+
+	int polar_index = int(polar / M_PI * (polar_steps - 1)); // NB: assuming caps!
+
+	// Indices of sphere mesh vertices to the left / right / top / bottom
+	int index_l = azimuth_index;
+	int index_r = (index_l + 1) % azimuth_steps;
+	int index_t = polar_index;
+	int index_b = min(index_t + 1, polar_steps - 1);
+
+	// Point falls on the south pole = > special case
+	if (index_t == index_b)
+	{
+		LOG(INFO) << "Hit the South pole!";
+		// The 4 corners of the quad are only two different points, as top = bottom, which
+		// are weighted by 0.5 each (Ceres cannot use a parameter more than once in a residual).
+		sample.numberOfVertices = 2;
+		sample.polar_index[0] = index_b, sample.azimuth_index[0] = index_l;
+		sample.polar_index[1] = index_b, sample.azimuth_index[1] = index_r;
+		sample.weights = Eigen::Vector3f(0.5f, 0.5f, 0.f);
+		sample.triangle = 2 * (index_b * azimuth_steps + index_l);
+		return;
+	}
+
+	// Only the directions of the mesh vertices matter here, not their depth (see depthmap2spherical).
+	auto vertex = [&](int azimuth_index, int polar_index) -> Eigen::Vector3f {
+		return Eigen::Vector3f(1.f,
+		                       float((azimuth_index + 0.5f) / azimuth_steps * 2 * M_PI),
+		                       float(double(polar_index) / (polar_steps - 1.f) * M_PI));
+	};
+	Eigen::Vector3f sph_tl = vertex(index_l, index_t);
+	Eigen::Vector3f sph_bl = vertex(index_l, index_b);
+	Eigen::Vector3f sph_tr = vertex(index_r, index_t);
+	Eigen::Vector3f sph_br = vertex(index_r, index_b);
+
+	// We assume that b has a higher azimuth angle than a.
+	// If that is not the case, we have wrapped around and need to compensate.
+	// We do that by adding pi to the azimuth of all points + wrapping.
+	if (index_l > index_r)
+	{
+		spherical.y() = fmod(fmod(spherical.y() + M_PI, 2 * M_PI), 2 * M_PI);
+		sph_tl.y() = fmod(fmod(sph_tl.y() + M_PI, 2 * M_PI), 2 * M_PI);
+		sph_bl.y() = fmod(fmod(sph_bl.y() + M_PI, 2 * M_PI), 2 * M_PI);
+		sph_tr.y() = fmod(fmod(sph_tr.y() + M_PI, 2 * M_PI), 2 * M_PI);
+		sph_br.y() = fmod(fmod(sph_br.y() + M_PI, 2 * M_PI), 2 * M_PI);
+	}
+
+	auto inside = [](const Eigen::Vector3f& bary) -> bool {
+		return bary.x() >= -1e-6f && bary.x() <= 1 &&
+		       bary.y() >= -1e-6f && bary.y() <= 1 &&
+		       bary.z() >= -1e-6f && bary.z() <= 1;
+	};
+
+	// ignoring the radius of the barycentric coordinates
+	Eigen::Vector3f bary1 = computeBarycentricCoords(spherical.bottomRows(2), sph_tl.bottomRows(2), sph_tr.bottomRows(2), sph_bl.bottomRows(2)); // top-left tri (cw)
+	if (inside(bary1))
+	{
+		sample.numberOfVertices = 3;
+		sample.polar_index[0] = index_t, sample.azimuth_index[0] = index_l;
+		sample.polar_index[1] = index_t, sample.azimuth_index[1] = index_r;
+		sample.polar_index[2] = index_b, sample.azimuth_index[2] = index_l;
+		sample.weights = bary1;
+		sample.triangle = 2 * (index_t * azimuth_steps + index_l);
+		return;
+	}
+
+	Eigen::Vector3f bary2 = computeBarycentricCoords(spherical.bottomRows(2), sph_bl.bottomRows(2), sph_br.bottomRows(2), sph_tr.bottomRows(2)); // bottom-right tri (ccw)
+	if (inside(bary2))
+	{
+		sample.numberOfVertices = 3;
+		sample.polar_index[0] = index_b, sample.azimuth_index[0] = index_l;
+		sample.polar_index[1] = index_b, sample.azimuth_index[1] = index_r;
+		sample.polar_index[2] = index_t, sample.azimuth_index[2] = index_r;
+		sample.weights = bary2;
+		sample.triangle = 2 * (index_t * azimuth_steps + index_l) + 1;
+		return;
+	}
+
+	LOG(WARNING) << "Missed triangle ... skipping point";
+}
+
+
+Eigen::MatrixXd SphereFitting::resampleDepthMap(const Eigen::MatrixXd& depth_map, int polar_steps, int azimuth_steps)
+{
+	MatrixXd resampled(polar_steps, azimuth_steps);
+	for (int i = 0; i < polar_steps; i++)
+	{
+		// Same vertex positions as depthmap2spherical: poles at the first and last row, and
+		// azimuths offset by half a subdivision.
+		const double y = double(i) / (polar_steps - 1) * (depth_map.rows() - 1);
+		const int i0 = std::min(int(y), int(depth_map.rows()) - 2);
+		const double dy = y - i0;
+
+		for (int j = 0; j < azimuth_steps; j++)
+		{
+			const double x = (j + 0.5) / azimuth_steps * depth_map.cols() - 0.5;
+			const int j0 = int(floor(x));
+			const double dx = x - j0;
+			const int left = (j0 + int(depth_map.cols())) % int(depth_map.cols()); // wrap around
+			const int right = (j0 + 1) % int(depth_map.cols());
+
+			resampled(i, j) = (1 - dy) * ((1 - dx) * depth_map(i0, left) + dx * depth_map(i0, right))
+			                  + dy * ((1 - dx) * depth_map(i0 + 1, left) + dx * depth_map(i0 + 1, right));
+		}
+	}
+
+	return resampled;
+}
+
+
+std::vector<SphereMeshCell> SphereFitting::buildAdaptiveMesh(const std::vector<SpherePointSample>& samples, const Eigen::MatrixXd& depth_map, int max_cell_size, int max_points, double max_depth_variation)
+{
+	const int polar_steps = (int)depth_map.rows();
+	const int azimuth_steps = (int)depth_map.cols();
+	const int rows = polar_steps - 1; // rows of quads between the poles
+
+	// Summed-area table of the number of samples per quad.
+	Eigen::MatrixXi counts = Eigen::MatrixXi::Zero(rows + 1, azimuth_steps + 1);
+	for (auto& sample : samples)
+	{
+		if (sample.triangle < 0)
+			continue;
+		const int quad = sample.triangle / 2;
+		const int i = std::min(quad / azimuth_steps, rows - 1); // points on the south pole are in the last row
+		counts(i + 1, quad % azimuth_steps + 1)++;
+	}
+	for (int i = 1; i <= rows; i++)
+		for (int j = 1; j <= azimuth_steps; j++)
+			counts(i, j) += counts(i - 1, j) + counts(i, j - 1) - counts(i - 1, j - 1);
+
+	auto countPoints = [&](const SphereMeshCell& cell) -> int {
+		const int i0 = cell.polar_index, i1 = cell.polar_index + cell.polar_size;
+		const int j0 = cell.azimuth_index, j1 = cell.azimuth_index + cell.azimuth_size;
+		return counts(i1, j1) - counts(i0, j1) - counts(i1, j0) + counts(i0, j0);
+	};
+
+	auto getDepthVariation = [&](const SphereMeshCell& cell) -> double {
+		double min_depth = std::numeric_limits<double>::max();
+		double max_depth = std::numeric_limits<double>::lowest();
+		double sum = 0;
+		for (int i = 0; i <= cell.polar_size; i++)
+		{
+			for (int j = 0; j <= cell.azimuth_size; j++)
+			{
+				const double depth = depth_map(cell.polar_index + i, (cell.azimuth_index + j) % azimuth_steps);
+				min_depth = std::min(min_depth, depth);
+				max_depth = std::max(max_depth, depth);
+				sum += depth;
+			}
+		}
+		return (max_depth - min_depth) / (sum / ((cell.polar_size + 1) * (cell.azimuth_size + 1)));
+	};
+
+	// Start with the largest cells, and split them like a quadtree.
+	max_cell_size = std::max(1, max_cell_size);
+	std::vector<SphereMeshCell> pending;
+	for (int i = 0; i < rows; i += max_cell_size)
+	{
+		for (int j = 0; j < azimuth_steps; j += max_cell_size)
+		{
+			SphereMeshCell cell;
+			cell.polar_index = i;
+			cell.azimuth_index = j;
+			cell.polar_size = std::min(max_cell_size, rows - i);
+			cell.azimuth_size = std::min(max_cell_size, azimuth_steps - j);
+			pending.push_back(cell);
+		}
+	}
+
+	std::vector<SphereMeshCell> cells;
+	while (!pending.empty())
+	{
+		const SphereMeshCell cell = pending.back();
+		pending.pop_back();
+
+		const bool split = (cell.polar_size > 1 || cell.azimuth_size > 1)
+		                   && (countPoints(cell) > max_points || getDepthVariation(cell) > max_depth_variation);
+		if (!split)
+		{
+			cells.push_back(cell);
+			continue;
+		}
+
+		// Split into (up to) four children; cells of odd size are split unevenly.
+		const int polar_half = (cell.polar_size + 1) / 2;
+		const int azimuth_half = (cell.azimuth_size + 1) / 2;
+		for (int a = 0; a < 2; a++)
+		{
+			for (int b = 0; b < 2; b++)
+			{
+				SphereMeshCell child;
+				child.polar_index = cell.polar_index + a * polar_half;
+				child.azimuth_index = cell.azimuth_index + b * azimuth_half;
+				child.polar_size = a == 0 ? polar_half : cell.polar_size - polar_half;
+				child.azimuth_size = b == 0 ? azimuth_half : cell.azimuth_size - azimuth_half;
+				if (child.polar_size > 0 && child.azimuth_size > 0)
+					pending.push_back(child);
+			}
+		}
+	}
+
+	return cells;
+}
+
+
+Eigen::MatrixXi SphereFitting::getMeshVertices(const std::vector<SphereMeshCell>& cells, int polar_steps, int azimuth_steps)
+{
+	Eigen::MatrixXi vertices = Eigen::MatrixXi::Constant(polar_steps, azimuth_steps, -1);
+	for (auto& cell : cells)
+	{
+		const int right = (cell.azimuth_index + cell.azimuth_size) % azimuth_steps; // wrap around
+		vertices(cell.polar_index, cell.azimuth_index) = 0;
+		vertices(cell.polar_index, right) = 0;
+		vertices(cell.polar_index + cell.polar_size, cell.azimuth_index) = 0;
+		vertices(cell.polar_index + cell.polar_size, right) = 0;
+	}
+
+	int count = 0;
+	for (int i = 0; i < polar_steps; i++)
+		for (int j = 0; j < azimuth_steps; j++)
+			if (vertices(i, j) >= 0)
+				vertices(i, j) = count++;
+
+	return vertices;
+}
+
+
+Eigen::SparseMatrix<double> SphereFitting::getInterpolationMatrix(const std::vector<SphereMeshCell>& cells, const Eigen::MatrixXi& vertices)
+{
+	const int polar_steps = (int)vertices.rows();
+	const int azimuth_steps = (int)vertices.cols();
+
+	// The smallest cell that contains each vertex, including the vertices on its edges.
+	Eigen::MatrixXi owner = Eigen::MatrixXi::Constant(polar_steps, azimuth_steps, -1);
+	auto getArea = [&](int c) -> int { return cells[c].polar_size * cells[c].azimuth_size; };
+	for (int c = 0; c < (int)cells.size(); c++)
+	{
+		for (int i = 0; i <= cells[c].polar_size; i++)
+		{
+			for (int j = 0; j <= cells[c].azimuth_size; j++)
+			{
+				int& o = owner(cells[c].polar_index + i, (cells[c].azimuth_index + j) % azimuth_steps);
+				if (o < 0 || getArea(c) < getArea(o))
+					o = c;
+			}
+		}
+	}
+
+	std::vector<Eigen::Triplet<double>> triplets;
+	int count = 0;
+	for (int j = 0; j < azimuth_steps; j++)
+	{
+		for (int i = 0; i < polar_steps; i++)
+		{
+			const int index = i + j * polar_steps;
+			if (vertices(i, j) >= 0)
+			{
+				triplets.emplace_back(index, vertices(i, j), 1.);
+				count = std::max(count, vertices(i, j) + 1);
+				continue;
+			}
+
+			// Bilinear interpolation between the corners of the cell.
+			const SphereMeshCell& cell = cells[owner(i, j)];
+			const double y = double(i - cell.polar_index) / cell.polar_size;
+			const double x = double((j - cell.azimuth_index + azimuth_steps) % azimuth_steps) / cell.azimuth_size;
+			const int bottom = cell.polar_index + cell.polar_size;
+			const int right = (cell.azimuth_index + cell.azimuth_size) % azimuth_steps;
+			const double weights[4] = { (1 - y) * (1 - x), (1 - y) * x, y * (1 - x), y * x };
+			const int corners[4] = {
+				vertices(cell.polar_index, cell.azimuth_index), vertices(cell.polar_index, right),
+				vertices(bottom, cell.azimuth_index), vertices(bottom, right)
+			};
+			for (int k = 0; k < 4; k++)
+				if (weights[k] != 0)
+					triplets.emplace_back(index, corners[k], weights[k]);
+		}
+	}
+
+	Eigen::SparseMatrix<double> P(polar_steps * azimuth_steps, count);
+	P.setFromTriplets(triplets.begin(), triplets.end());
+	return P;
+}
+
+
+std::vector<Eigen::Vector3i> SphereFitting::triangulateAdaptiveMesh(const std::vector<SphereMeshCell>& cells, const Eigen::MatrixXi& vertices, std::vector<int>& centre_cells)
+{
+	const int azimuth_steps = (int)vertices.cols();
+	const int num_vertices = vertices.maxCoeff() + 1;
+
+	// A cell without vertices of smaller neighbouring cells on its edges is split like a quad of the
+	// full mesh. Otherwise, it is a triangle fan around an extra vertex at its centre, which includes
+	// all vertices on its edges, so that there are no T-junctions.
+	std::vector<Eigen::Vector3i> faces;
+	centre_cells.clear();
+	for (int c = 0; c < (int)cells.size(); c++)
+	{
+		const SphereMeshCell& cell = cells[c];
+		auto getIndex = [&](int i, int j) -> int {
+			return vertices(cell.polar_index + i, (cell.azimuth_index + j) % azimuth_steps);
+		};
+
+		// Vertices on the edges of the cell, clockwise from the top-left corner.
+		std::vector<int> edge;
+		for (int j = 0; j < cell.azimuth_size; j++) edge.push_back(getIndex(0, j));                  // top
+		for (int i = 0; i < cell.polar_size; i++) edge.push_back(getIndex(i, cell.azimuth_size));    // right
+		for (int j = cell.azimuth_size; j > 0; j--) edge.push_back(getIndex(cell.polar_size, j));    // bottom
+		for (int i = cell.polar_size; i > 0; i--) edge.push_back(getIndex(i, 0));                   // left
+		edge.erase(std::remove(edge.begin(), edge.end(), -1), edge.end());
+
+		if (edge.size() == 4)
+		{
+			faces.push_back(Eigen::Vector3i(edge[0], edge[1], edge[3])); // top-left triangle
+			faces.push_back(Eigen::Vector3i(edge[1], edge[2], edge[3])); // bottom-right triangle
+			continue;
+		}
+
+		const int centre = num_vertices + (int)centre_cells.size();
+		centre_cells.push_back(c);
+		for (size_t k = 0; k < edge.size(); k++)
+			faces.push_back(Eigen::Vector3i(centre, edge[k], edge[(k + 1) % edge.size()]));
+	}
+
+	return faces;
+}
+
 
 /** Converts from spherical coordinates (radius, azimuth, polar) to Cartesian coordinates (x, y, z).
 *    - azimuth: 0 is -z, pi / 2 is -x, pi is +z, 3pi / 4 is +x
@@ -568,7 +1422,7 @@ Eigen::Vector3f SphereFitting::computeBarycentricCoords(Eigen::Vector2f p, Eigen
 }
 
 
-void SphereFitting::writeSphereMesh(MatrixXd depth_map, std::string filename)
+void SphereFitting::writeSphereMesh(MatrixXd depth_map, std::string filename, const std::vector<SphereMeshCell>& cells)
 {
 	// Open the mesh file.
 	std::ofstream objFile;
@@ -576,6 +1430,47 @@ void SphereFitting::writeSphereMesh(MatrixXd depth_map, std::string filename)
 
 	// TODO: error handling ... overwrite existing file or not?
 
+	if (!cells.empty())
+	{
+		const Eigen::MatrixXi vertices = getMeshVertices(cells, depth_map.rows(), depth_map.cols());
+
+		// Write the vertices of the cells: "v x y z"
+		for (int i = 0; i < depth_map.rows(); i++)
+		{
+			for (int j = 0; j < depth_map.cols(); j++)
+			{
+				if (vertices(i, j) < 0)
+					continue;
+				Eigen::Vector3f vertex = spherical2cartesian(depthmap2spherical(depth_map, j, i));
+				objFile << "v " << vertex.x() << " " << vertex.y() << " " << vertex.z() << '\n';
+			}
+		}
+
+		// Centre vertices of the cells that are triangle fans, with the average depth of the cell's corners.
+		std::vector<int> centre_cells;
+		const std::vector<Eigen::Vector3i> faces = triangulateAdaptiveMesh(cells, vertices, centre_cells);
+		for (int c : centre_cells)
+		{
+			const SphereMeshCell& cell = cells[c];
+			const double depth = (depth_map(cell.polar_index, cell.azimuth_index)
+			                      + depth_map(cell.polar_index, (cell.azimuth_index + cell.azimuth_size) % depth_map.cols())
+			                      + depth_map(cell.polar_index + cell.polar_size, cell.azimuth_index)
+			                      + depth_map(cell.polar_index + cell.polar_size, (cell.azimuth_index + cell.azimuth_size) % depth_map.cols()))
+			                     / 4;
+			const double azimuth = (cell.azimuth_index + 0.5 * cell.azimuth_size + 0.5) / depth_map.cols() * 2 * M_PI;
+			const double polar = (cell.polar_index + 0.5 * cell.polar_size) / (depth_map.rows() - 1.) * M_PI;
+			const Eigen::Vector3f vertex = spherical2cartesian(Eigen::Vector3f(depth, azimuth, polar));
+			objFile << "v " << vertex.x() << " " << vertex.y() << " " << vertex.z() << '\n';
+		}
+
+		// Write triangle faces: "f i1 i2 i3"
+		for (auto& face : faces)
+			objFile << "f " << face.x() + 1 << " " << face.y() + 1 << " " << face.z() + 1 << '\n';
+
+		objFile.close();
+		return;
+	}
+
 	// Write vertices for depth map: "v x y z"
 	for (int i = 0; i < depth_map.rows(); i++)
 	{
@@ -645,10 +1540,11 @@ void SphereFitting::appendPointsToMesh(const std::vector<Eigen::Vector3f>& point
  * @param min_depth Minimum depth in scaled depth map.
  * @param max_depth Maximum depth in scaled depth map.
  */
-void SphereFitting::exportSphereMesh(const Eigen::MatrixXd& depth_map, std::string filename_prefix, float min_depth, float max_depth)
+std::vector<std::string> SphereFitting::exportSphereMesh(const Eigen::MatrixXd& depth_map, std::string filename_prefix, float min_depth, float max_depth, const std::vector<SphereMeshCell>& cells)
 {
 	// Save clean sphere-fit mesh.
-	writeSphereMesh(depth_map, filename_prefix + ".obj");
+	std::vector<std::string> files = { filename_prefix + ".obj" };
+	writeSphereMesh(depth_map, files.back(), cells);
 
 	// Save depth map in Sintel DPT format.
 	Mat1f depth_map_cv;
@@ -662,25 +1558,32 @@ void SphereFitting::exportSphereMesh(const Eigen::MatrixXd& depth_map, std::stri
 	if (min_depth == 0 && max_depth == 0)
 	{
 		// Save normalised log depth map.
-		writeNormalisedLogDepthMap(filename_prefix + "-log-norm-cm.png", depth_map_cv);
+		files.push_back(filename_prefix + "-log-norm-cm.png");
+		writeNormalisedLogDepthMap(files.back(), depth_map_cv);
 	}
 	else
 	{
 		// Save scaled log depth map.
-		writeLogDepthMap(filename_prefix + "-log-scaled-cm.png", depth_map_cv, min_depth, max_depth);
+		files.push_back(filename_prefix + "-log-scaled-cm.png");
+		writeLogDepthMap(files.back(), depth_map_cv, min_depth, max_depth);
 	}
+
+	return files;
 }
 
 
-void SphereFitting::exportSphereMeshAndPoints(const Eigen::MatrixXd& depth_map, const std::vector<Eigen::Vector3f>& points, std::string filename_prefix, float min_depth, float max_depth)
+std::vector<std::string> SphereFitting::exportSphereMeshAndPoints(const Eigen::MatrixXd& depth_map, const std::vector<Eigen::Vector3f>& points, std::string filename_prefix, float min_depth, float max_depth, const std::vector<SphereMeshCell>& cells)
 {
 	// Save clean sphere-fit mesh + depth map.
-	exportSphereMesh(depth_map, filename_prefix, min_depth, max_depth);
+	std::vector<std::string> files = exportSphereMesh(depth_map, filename_prefix, min_depth, max_depth, cells);
 
 	//// Save sphere-fit mesh with points.
 	//writeSphereMesh(depth_map, filename_prefix + "+points.obj");
 	//appendPointsToMesh(points, filename_prefix + "+points.obj");
 
 	// Save sphere-fit input points for debug.
-	appendPointsToMesh(points, filename_prefix + "-points.obj");
+	files.push_back(filename_prefix + "-points.obj");
+	appendPointsToMesh(points, files.back());
+
+	return files;
 }
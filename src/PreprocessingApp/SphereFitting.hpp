@@ -2,10 +2,59 @@
 
 #include "3rdParty/Eigen.hpp"
 
+#include <Eigen/SparseCore>
+
+#include <memory>
 #include <string>
 #include <vector>
 
 
+namespace ceres
+{
+	class LossFunction;
+	class Problem;
+} // namespace ceres
+
+
+/** A point fitted by the sphere mesh, and the mesh vertices its radius is interpolated from. */
+struct SpherePointSample
+{
+	// Spherical coordinates of the point.
+	float radius = 0;
+	float azimuth = 0;
+	float polar = 0;
+
+	// Number of vertices: 3 inside a triangle, 2 on the south pole (weighted 0.5 each) and 0 if
+	// the point missed all triangles.
+	int numberOfVertices = 0;
+
+	// Vertex indices into the depth map, and their barycentric weights.
+	int polar_index[3] = { 0, 0, 0 };
+	int azimuth_index[3] = { 0, 0, 0 };
+	Eigen::Vector3f weights = Eigen::Vector3f::Zero();
+
+	// Index of the mesh triangle, i.e. 2 * (polar_index * azimuth_steps + azimuth_index) + 0 for the
+	// top-left and 1 for the bottom-right triangle of a quad; -1 if the point missed all triangles.
+	int triangle = -1;
+};
+
+
+/**
+ * A cell of an adaptive sphere mesh: a block of quads of the uniform mesh, of which only the corners
+ * (and the corners of smaller neighbouring cells on its edges) are mesh vertices.
+ */
+struct SphereMeshCell
+{
+	// Top-left vertex of the cell.
+	int polar_index = 0;
+	int azimuth_index = 0;
+
+	// Number of quads of the uniform mesh covered by the cell.
+	int polar_size = 1;
+	int azimuth_size = 1;
+};
+
+
 class SphereFitting
 {
 public:
@@ -17,6 +66,41 @@ public:
 	 */
 	void solveProblem();
 
+	/**
+	 * Finds the mesh vertices of each point. They only depend on the direction of the point and
+	 * the mesh resolution, so fits of the same points at the same resolution can share them.
+	 */
+	static std::vector<SpherePointSample> samplePoints(const std::vector<Eigen::Vector3f>& points, int polar_steps, int azimuth_steps);
+
+	/** Assigns the samples of another mesh resolution to the mesh vertices of this resolution. */
+	static std::vector<SpherePointSample> resampleSamples(const std::vector<SpherePointSample>& samples, int polar_steps, int azimuth_steps);
+
+	/** Bilinearly interpolates a depth map to another mesh resolution, e.g. to initialise a finer mesh. */
+	static Eigen::MatrixXd resampleDepthMap(const Eigen::MatrixXd& depth_map, int polar_steps, int azimuth_steps);
+
+	/**
+	 * Splits the uniform mesh of the depth map into cells of at most 'max_cell_size' quads per side, and
+	 * splits cells like a quadtree while they contain more than 'max_points' samples or their depth
+	 * varies by more than 'max_depth_variation' (relative to their mean depth).
+	 */
+	static std::vector<SphereMeshCell> buildAdaptiveMesh(const std::vector<SpherePointSample>& samples, const Eigen::MatrixXd& depth_map, int max_cell_size, int max_points, double max_depth_variation);
+
+	/** Numbers the vertices of the uniform mesh that are vertices of the cells, in row-major order (-1 for the others). */
+	static Eigen::MatrixXi getMeshVertices(const std::vector<SphereMeshCell>& cells, int polar_steps, int azimuth_steps);
+
+	/**
+	 * Returns the matrix that interpolates all vertices of the uniform mesh (in column-major order)
+	 * from the mesh vertices of the cells. Each vertex is interpolated bilinearly within the smallest
+	 * cell that contains it, which keeps the surface continuous between cells of different sizes.
+	 */
+	static Eigen::SparseMatrix<double> getInterpolationMatrix(const std::vector<SphereMeshCell>& cells, const Eigen::MatrixXi& vertices);
+
+	/**
+	 * Triangulates the cells without T-junctions. Faces index the mesh vertices (see getMeshVertices()),
+	 * followed by an extra vertex at the centre of each cell listed in 'centre_cells'.
+	 */
+	static std::vector<Eigen::Vector3i> triangulateAdaptiveMesh(const std::vector<SphereMeshCell>& cells, const Eigen::MatrixXi& vertices, std::vector<int>& centre_cells);
+
 
 	static Eigen::Vector3f cartesian2spherical(Eigen::Vector3f point);
 	static Eigen::Vector3f spherical2cartesian(Eigen::Vector3f point);
@@ -25,10 +109,12 @@ public:
 
 	static Eigen::Vector3f computeBarycentricCoords(Eigen::Vector2f p, Eigen::Vector2f a, Eigen::Vector2f b, Eigen::Vector2f c);
 
-	static void writeSphereMesh(Eigen::MatrixXd depth_map, std::string filename);
+	// The mesh is uniform, unless the cells of an adaptive mesh are given.
+	static void writeSphereMesh(Eigen::MatrixXd depth_map, std::string filename, const std::vector<SphereMeshCell>& cells = std::vector<SphereMeshCell>());
 	static void appendPointsToMesh(const std::vector<Eigen::Vector3f>& points, std::string filename);
-	static void exportSphereMesh(const Eigen::MatrixXd& depth_map, std::string filename_prefix, float min_depth = 0.f, float max_depth = 0.f);
-	static void exportSphereMeshAndPoints(const Eigen::MatrixXd& depth_map, const std::vector<Eigen::Vector3f>& points, std::string filename_prefix, float min_depth = 0.f, float max_depth = 0.f);
+	// The export functions return the names of the files they wrote.
+	static std::vector<std::string> exportSphereMesh(const Eigen::MatrixXd& depth_map, std::string filename_prefix, float min_depth = 0.f, float max_depth = 0.f, const std::vector<SphereMeshCell>& cells = std::vector<SphereMeshCell>());
+	static std::vector<std::string> exportSphereMeshAndPoints(const Eigen::MatrixXd& depth_map, const std::vector<Eigen::Vector3f>& points, std::string filename_prefix, float min_depth = 0.f, float max_depth = 0.f, const std::vector<SphereMeshCell>& cells = std::vector<SphereMeshCell>());
 
 
 	// Number of mesh subdivisions along the polar angle, i.e. between the poles.
@@ -61,9 +147,94 @@ public:
 	// Weight of the prior term.
 	double prior_weight = 0;
 
+	/** Solvers for the sphere fitting problem. */
+	enum class Backend
+	{
+		Ceres = 0,          // only available in builds with Ceres
+		SparseCholesky = 1, // Levenberg-Marquardt on normal equations solved with Eigen's sparse Cholesky
+	};
+
+	// Solver to use.
+#ifdef USE_CERES
+	Backend backend = Backend::Ceres;
+#else
+	Backend backend = Backend::SparseCholesky;
+#endif
+
+	// Sums up the data term of all points in a mesh triangle into one residual block, and handles
+	// the robust loss and normalisation by iteratively reweighted least squares (IRLS). This is much
+	// faster for dense point clouds; otherwise, each point adds its own residual block. Only used
+	// by the Ceres backend, as the sparse Cholesky backend always sums up per triangle.
+	bool aggregate_data_term = false;
+
+	// Maximum number of IRLS iterations, which stop early once the depth map changes by less than
+	// 'irls_tolerance' (relative).
+	int irls_iterations = 10;
+	double irls_tolerance = 1e-4;
+
+	// Number of resolutions solved coarse-to-fine, each initialised with the solution of the previous
+	// one, which has half the subdivisions. 1 only solves at the final resolution.
+	int pyramid_levels = 1;
+
+	// Fits an adaptive mesh (see buildAdaptiveMesh()) at the final resolution, so that only the vertices
+	// of its cells are unknowns. The depth variation is measured on the solution of the coarser pyramid
+	// level, so with pyramid_levels = 1 only the points are considered. Requires the sparse Cholesky backend.
+	bool adaptive_mesh = false;
+	int adaptive_max_cell_size = 8;
+	int adaptive_max_points = 16;
+	double adaptive_max_depth_variation = 0.05;
+
 	// Points that the sphere mesh is fitted to.
 	std::vector<Eigen::Vector3f> points;
 
+	// Samples of the points (see samplePoints()), computed by solveProblem() if not set.
+	std::shared_ptr<const std::vector<SpherePointSample>> samples;
+
+	// Number of threads used by the Ceres solver.
+	int num_threads = 8;
+
+	// Print the progress of the solver to stdout.
+	bool log_progress = true;
+
 	// The estimated spherical depth map (per vertex depth, i.e. sphere radius).
 	Eigen::MatrixXd est_depth_map;
+
+	// Number of solver iterations at the final resolution (summed over the IRLS iterations).
+	int solver_iterations = 0;
+
+	// Cells of the adaptive mesh, if used; the depth map then contains the interpolated depths of all vertices.
+	std::vector<SphereMeshCell> mesh_cells;
+
+private:
+	/** Finds the mesh vertices of a sample from its spherical coordinates (see samplePoints()). */
+	static void assignToMesh(SpherePointSample& sample, int polar_steps, int azimuth_steps);
+
+	/** Lists the samples sorted by triangle in 'order'; the samples of a triangle start at 'offsets[triangle]'. */
+	void bucketSamples(std::vector<int>& offsets, std::vector<int>& order) const;
+
+	void solveSparseCholesky(double average_radius);
+
+	/**
+	 * Returns the cost of a depth map, and optionally the normal equations of the problem linearised
+	 * at the depth map: the Gauss-Newton Hessian 'H' and the gradient, with robust loss weights.
+	 */
+	double linearise(const Eigen::MatrixXd& depth_map, double average_radius, const std::vector<int>& offsets, const std::vector<int>& order, Eigen::SparseMatrix<double>* H, Eigen::VectorXd* gradient) const;
+
+#ifdef USE_CERES
+	void solveCeres(double average_radius);
+
+	/** Adds one residual block per point, using the robust loss directly. */
+	void addPointDataTerms(ceres::Problem& problem, ceres::LossFunction* loss);
+
+	/**
+	 * Adds one quadratic residual block per triangle, which sums up the data term of its points
+	 * linearised at 'est_depth_map' and reweighted by the robust loss (one IRLS step).
+	 */
+	void addAggregatedDataTerms(ceres::Problem& problem, const ceres::LossFunction* loss, const std::vector<int>& offsets, const std::vector<int>& order);
+
+	/** Adds the smoothness and prior terms. */
+	void addRegularisationTerms(ceres::Problem& problem, double average_radius);
+
+	void solve(ceres::Problem& problem);
+#endif // USE_CERES
 };
@@ -7,9 +7,17 @@ SphereFittingSettings::SphereFittingSettings() :
 	addEntry("Enabled",                   enabled);
 	addEntry("PolarSteps",                polar_steps);
 	addEntry("AzimuthSteps",              azimuth_steps);
+	addEntry("PyramidLevels",             pyramid_levels);
+	addEntry("Threads",                   threads);
 	addVectorEntry("DataWeight",          data_weight);
 	addVectorEntry("RobustDataLoss",      robust_data_loss);
 	addVectorEntry("RobustDataLossScale", robust_data_loss_scale);
 	addVectorEntry("SmoothnessWeight",    smoothness_weight);
 	addVectorEntry("PriorWeight",         prior_weight);
+	addEntry("AggregateDataTerm",         aggregate_data_term);
+	addEntry("Backend",                   backend);
+	addEntry("AdaptiveMesh",              adaptive_mesh);
+	addEntry("AdaptiveMaxCellSize",       adaptive_max_cell_size);
+	addEntry("AdaptiveMaxPoints",         adaptive_max_points);
+	addEntry("AdaptiveMaxDepthVariation", adaptive_max_depth_variation);
 }
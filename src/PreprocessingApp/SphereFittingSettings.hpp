@@ -18,6 +18,19 @@ public:
 	// Number of mesh subdivisions along the equator.
 	int azimuth_steps = 160;
 
+	// Solver: 0 = Ceres (only in builds with Ceres), 1 = sparse Cholesky (also used for other values).
+#ifdef USE_CERES
+	int backend = 0;
+#else
+	int backend = 1;
+#endif
+
+	// Number of resolutions solved coarse-to-fine, each with half the subdivisions of the next (1 = off).
+	int pyramid_levels = 1;
+
+	// Maximum number of settings combinations that are fitted in parallel (0 = number of cores).
+	int threads = 0;
+
 	// Weight of the data term.
 	std::vector<double> data_weight { 1. };
 
@@ -32,4 +45,20 @@ public:
 
 	// Weight of the prior term.
 	std::vector<double> prior_weight { 0.001 };
+
+	// Sums up the data term per mesh triangle and solves it by IRLS, instead of one residual per point.
+	bool aggregate_data_term = false;
+
+	// Fits a quadtree mesh that is only refined where there are many points or large depth changes.
+	// Uses the sparse Cholesky solver.
+	bool adaptive_mesh = false;
+
+	// Size of the coarsest adaptive mesh cells, in subdivisions.
+	int adaptive_max_cell_size = 8;
+
+	// Adaptive mesh cells with more points than this are refined.
+	int adaptive_max_points = 16;
+
+	// Adaptive mesh cells whose relative depth range is larger than this are refined.
+	double adaptive_max_depth_variation = 0.05;
 };
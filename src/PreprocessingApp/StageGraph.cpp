@@ -0,0 +1,206 @@
+#include "StageGraph.hpp"
+
+#include "3rdParty/fs_std.hpp"
+
+#include "Utils/Exceptions.hpp"
+#include "Utils/Logger.hpp"
+#include "Utils/Timer.hpp"
+#include "Utils/Trace.hpp"
+#include "Utils/Utils.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+
+using namespace std;
+
+
+namespace
+{
+	// 64-bit FNV-1a hash as a hex string.
+	std::string hashString(const std::string& text)
+	{
+		uint64_t hash = 14695981039346656037ULL;
+		for (unsigned char c : text)
+			hash = (hash ^ c) * 1099511628211ULL;
+
+		std::stringstream ss;
+		ss << std::hex << std::setw(16) << std::setfill('0') << hash;
+		return ss.str();
+	}
+} // namespace
+
+
+StageGraph::StageGraph(const std::string& _checkpointDirectory) :
+    checkpointDirectory(_checkpointDirectory)
+{
+}
+
+
+void StageGraph::addStage(const PreprocessingStage& stage)
+{
+	stages.push_back(stage);
+}
+
+
+std::string StageGraph::getCheckpointFilename(const std::string& stage) const
+{
+	return (fs::path(checkpointDirectory) / (stage + ".json")).generic_string();
+}
+
+
+void StageGraph::run(bool resume)
+{
+	executedStages.clear();
+	restoredStages.clear();
+	fingerprints.clear();
+	profiles.clear();
+	const ResourceUsage start = ResourceUsage::current();
+
+	std::error_code ec;
+	fs::create_directories(checkpointDirectory, ec);
+
+	enum class Status
+	{
+		Waiting,
+		Running,
+		Done
+	};
+	std::vector<Status> status(stages.size(), Status::Waiting);
+
+	std::mutex mutex;
+	std::condition_variable stageFinished;
+	std::exception_ptr error;
+	std::vector<std::thread> threads;
+	int running = 0;
+
+	std::map<std::string, size_t> indices;
+	for (size_t s = 0; s < stages.size(); s++)
+		indices[stages[s].name] = s;
+	for (auto& stage : stages)
+		for (const std::string& dependency : stage.dependencies)
+			if (indices.count(dependency) == 0)
+				RUNTIME_EXCEPTION("Preprocessing stage '" + stage.name + "' depends on unknown stage '" + dependency + "'.");
+
+	// Runs or restores a stage; 'inputs' already contains the fingerprints of its dependencies.
+	auto execute = [&](size_t s, std::string inputs) {
+		const PreprocessingStage& stage = stages[s];
+		TRACE_THREAD_NAME("Stage " + stage.name);
+		try
+		{
+			StageProfile profile;
+			profile.name = stage.name;
+			const ResourceUsage before = ResourceUsage::current();
+			profile.startSeconds = before.since(start).wallSeconds;
+
+			if (stage.describeInputs)
+				inputs += "\n" + stage.describeInputs();
+			const std::string fingerprint = hashString(inputs);
+			const std::string checkpointFilename = getCheckpointFilename(stage.name);
+
+			bool restored = false;
+			if (resume && stage.restore && fs::exists(checkpointFilename))
+			{
+				Json::Value checkpoint;
+				Json::Reader reader;
+				if (reader.parse(readFile(checkpointFilename), checkpoint, false)
+				    && checkpoint["Fingerprint"].asString() == fingerprint)
+					restored = stage.restore(checkpoint["Results"]);
+
+				if (restored)
+					LOG(INFO) << "Restored stage '" << stage.name << "' from its checkpoint";
+				else
+					LOG(INFO) << "Inputs of stage '" << stage.name << "' changed since its checkpoint";
+			}
+
+			if (!restored)
+			{
+				// An interrupted run must not leave a checkpoint behind.
+				std::error_code ec;
+				fs::remove(checkpointFilename, ec);
+
+				LOG(INFO) << "Running stage '" << stage.name << "'";
+				Timer timer;
+				timer.startTiming();
+				Json::Value results = stage.run();
+
+				if (!results.isNull())
+				{
+					Json::Value checkpoint;
+					checkpoint["Fingerprint"] = fingerprint;
+					checkpoint["Results"] = results;
+					std::ofstream file(checkpointFilename.c_str(), std::ios::trunc);
+					file << checkpoint;
+				}
+
+				LOG(INFO) << "Finished stage '" << stage.name << "' in " << std::fixed << std::setprecision(2)
+				          << timer.getElapsedSeconds() << "s";
+			}
+
+			profile.restored = restored;
+			profile.usage = ResourceUsage::current().since(before);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			fingerprints[stage.name] = fingerprint;
+			(restored ? restoredStages : executedStages).push_back(stage.name);
+			profiles.push_back(profile);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error)
+				error = std::current_exception();
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		status[s] = Status::Done;
+		running--;
+		stageFinished.notify_all();
+	};
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		// Start all stages whose dependencies are done, unless a stage failed.
+		for (size_t s = 0; s < stages.size() && !error; s++)
+		{
+			if (status[s] != Status::Waiting)
+				continue;
+
+			bool ready = true;
+			std::string inputs = stages[s].name;
+			for (const std::string& dependency : stages[s].dependencies)
+			{
+				ready &= status[indices[dependency]] == Status::Done;
+				inputs += "\n" + fingerprints[dependency];
+			}
+			if (!ready)
+				continue;
+
+			status[s] = Status::Running;
+			running++;
+			threads.emplace_back(execute, s, inputs);
+		}
+
+		if (running == 0)
+			break;
+		stageFinished.wait(lock);
+	}
+	lock.unlock();
+
+	for (auto& thread : threads)
+		thread.join();
+
+	if (error)
+		std::rethrow_exception(error);
+
+	for (size_t s = 0; s < stages.size(); s++)
+		if (status[s] != Status::Done)
+			RUNTIME_EXCEPTION("Preprocessing stage '" + stages[s].name + "' has cyclic dependencies.");
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "3rdParty/json/json.h"
+
+#include "Utils/ResourceUsage.hpp"
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+
+/** A step of the preprocessing, e.g. optical flow or sphere fitting. */
+struct PreprocessingStage
+{
+	std::string name;
+
+	// Stages whose results this stage needs.
+	std::vector<std::string> dependencies;
+
+	// Describes the inputs of the stage that are not results of its dependencies, e.g. its settings
+	// and input files. Called once all dependencies are done, and may be binary.
+	std::function<std::string()> describeInputs;
+
+	// Runs the stage and returns what is needed to restore its results later (e.g. the names of
+	// its output files). A null value means that the results must not be reused.
+	std::function<Json::Value()> run;
+
+	// Restores the results of an earlier run from their description. Returns false if that is not
+	// possible, e.g. because output files are missing. Stages without it always run.
+	std::function<bool(const Json::Value&)> restore;
+};
+
+
+/** Resources used by a stage while it ran or was restored. */
+struct StageProfile
+{
+	std::string name;
+	bool restored = false;
+
+	// Seconds from the start of StageGraph::run until the stage started.
+	double startSeconds = 0;
+
+	// Process-wide, so it includes concurrently running stages.
+	ResourceUsage usage;
+};
+
+
+/**
+ * Runs the preprocessing stages as a dependency graph, with checkpoints for resuming.
+ *
+ * Each stage's fingerprint is a hash of its own inputs and the fingerprints of its dependencies.
+ * After a stage has run, its fingerprint and results are saved as '<name>.json' in the checkpoint
+ * directory. When resuming, a stage whose fingerprint matches its checkpoint is restored instead
+ * of run, so only the stages whose inputs changed (directly or through a dependency) run again.
+ *
+ * Stages run as soon as all their dependencies are done, each on its own thread, so independent
+ * stages run concurrently. The resources used by each stage are recorded for profiling.
+ */
+class StageGraph
+{
+public:
+	explicit StageGraph(const std::string& _checkpointDirectory);
+
+	void addStage(const PreprocessingStage& stage);
+
+	/** Runs (or with 'resume', restores) all stages. Rethrows the first exception of a stage. */
+	void run(bool resume);
+
+	/** Names of the stages that ran, and that were restored from checkpoints, in order of completion. */
+	const std::vector<std::string>& getExecutedStages() const { return executedStages; }
+	const std::vector<std::string>& getRestoredStages() const { return restoredStages; }
+
+	/** Resources used by the stages, in order of completion. */
+	const std::vector<StageProfile>& getProfiles() const { return profiles; }
+
+private:
+	std::string getCheckpointFilename(const std::string& stage) const;
+
+	std::string checkpointDirectory;
+	std::vector<PreprocessingStage> stages;
+	std::map<std::string, std::string> fingerprints;
+
+	std::vector<std::string> executedStages;
+	std::vector<std::string> restoredStages;
+	std::vector<StageProfile> profiles;
+};
@@ -96,7 +96,7 @@ void main()
 	vec2 backwardFlowCompensated = vec2(0);
 	
 	// Apply motion compensation to flow vectors based on proxy geometry.
-	getMotionCompensatedTextureCoordinates(useOpticalFlow, flowDownsampled, dim,
+	getMotionCompensatedTextureCoordinates(useOpticalFlow, flowResolution, flowScale, flowRegion, dim,
 		forwardFlows, backwardFlows,
 		pair.x, pair.y, lTex, rTex,
 		alpha, useEquirectCamera,
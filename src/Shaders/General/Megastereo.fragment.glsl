@@ -101,7 +101,7 @@ void main()
 	vec2 forwardFlowCompensated = vec2(0);
 	vec2 backwardFlowCompensated = vec2(0);
 
-	getMotionCompensatedTextureCoordinates(useOpticalFlow, flowDownsampled, dim,
+	getMotionCompensatedTextureCoordinates(useOpticalFlow, flowResolution, flowScale, flowRegion, dim,
 		forwardFlows, backwardFlows,
 		int(leftNeighbour), int(rightNeighbour), lTex, rTex,
 		alpha, useEquirectCamera,
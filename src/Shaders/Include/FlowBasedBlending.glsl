@@ -1,7 +1,7 @@
 #include "Shaders/Include/Utils.glsl"
 
 
-void getMotionCompensatedTextureCoordinates(in int _useOpticalFlow, in int _flowDownsampled, in vec2 _dim, 
+void getMotionCompensatedTextureCoordinates(in int _useOpticalFlow, in float _flowResolution, in float _flowScale, in vec2 _flowRegion, in vec2 _dim, 
 	in sampler2DArray _forwardFlows, in sampler2DArray _backwardFlows, 
 	in int _leftNeighbour, in int _rightNeighbour, in vec2 _lTex, in vec2 _rTex, 
 	in float _alpha, in int _isEquirect,
@@ -19,16 +19,12 @@ void getMotionCompensatedTextureCoordinates(in int _useOpticalFlow, in int _flow
 
 	if (_useOpticalFlow > 0)
 	{
-		forwardFlow  = fetchFlow(_forwardFlows,  _lTex, _leftNeighbour);
-		backwardFlow = fetchFlow(_backwardFlows, _rTex, _rightNeighbour);
+		forwardFlow  = _flowScale * fetchFlow(_forwardFlows,  _flowRegion, _lTex, _leftNeighbour);
+		backwardFlow = _flowScale * fetchFlow(_backwardFlows, _flowRegion, _rTex, _rightNeighbour);
 
-		if (_flowDownsampled > 0)
-		{
-			forwardFlow.x *= 2.0;
-			forwardFlow.y *= 2.0;
-			backwardFlow.x *= 2.0;
-			backwardFlow.y *= 2.0;
-		}
+		// Flows computed at a lower resolution are shorter in pixels.
+		forwardFlow  /= _flowResolution;
+		backwardFlow /= _flowResolution;
 
 		forwardFlow.x /= _dim.x;
 		forwardFlow.y /= _dim.y;
@@ -15,7 +15,9 @@ uniform vec3 desCamView; // Desired camera viewing direction.
 uniform int displayMode;
 uniform int useEquirectCamera;
 uniform int useOpticalFlow;
-uniform int flowDownsampled;
+uniform float flowResolution; // resolution of the flows relative to the images
+uniform float flowScale; // converts flow texture values to pixels (1 for floating-point textures)
+uniform vec2 flowRegion; // rows covered by the flow textures, as [top, bottom) in texture coordinates
 uniform int raysPerPixel; // 0 = Parallax360, 1 = MegaParallax/OmniPhotos
 uniform int fadeNearBoundary;
 
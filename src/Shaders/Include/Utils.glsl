@@ -77,11 +77,15 @@ vec3 colourFetchArray(in sampler2DArray A, in vec2 tex, in int layer)
 
 
 // Fetch a flow vector from a texture2DArray.
-vec2 fetchFlow(in sampler2DArray flows, in vec2 tex, in int layer)
+vec2 fetchFlow(in sampler2DArray flows, in vec2 region, in vec2 tex, in int layer)
 {
+	// The flows may only cover the rows in 'region', e.g. a band of latitudes of equirectangular
+	// images. Clamping to the edge extrapolates the outermost rows towards the poles.
+	float v = (tex.y - region.x) / (region.y - region.x);
+
 	// Our flow fields assume the origin is at the top-left, but OpenGL assumes bottom-left.
 	// So invert the y-coordinate before lookup, and invert the y-component of the flow.
-	return texture(flows, vec3(tex.x, 1. - tex.y, layer)).xy * vec2(1., -1.);
+	return texture(flows, vec3(tex.x, 1. - v, layer)).xy * vec2(1., -1.);
 
 	// If flow fields are flipped during loading, can use this:
 	// return texture(flows, vec3(tex.x, tex.y, layer)).xy;
@@ -0,0 +1,314 @@
+#include "UnitTestHeader.hpp"
+
+#include "3rdParty/fs_std.hpp"
+
+#include "Core/OpticalFlow/DISFlow.hpp"
+#include "Core/OpticalFlow/FlowConsistency.hpp"
+#include "Core/OpticalFlow/FlowTiling.hpp"
+#include "Core/OpticalFlow/ImagePrefetcher.hpp"
+#include "Core/OpticalFlow/OpticalFlowApp.hpp"
+
+#include <gtest/gtest.h>
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+
+// Tests for the components in Core/OpticalFlow.
+
+
+namespace
+{
+	// Smooth, textured test image, shifted by (dx, dy).
+	cv::Mat createTexture(int width, int height, float dx, float dy)
+	{
+		cv::Mat image(height, width, CV_8UC1);
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const float u = x - dx;
+				const float v = y - dy;
+				const float value = 128.f + 60.f * std::sin(0.21f * u) * std::cos(0.17f * v)
+				                    + 40.f * std::sin(0.05f * u + 0.08f * v) + 20.f * std::cos(0.6f * u + 0.3f * v);
+				image.at<uchar>(y, x) = cv::saturate_cast<uchar>(value);
+			}
+		}
+		return image;
+	}
+
+	// Mean end-point error between two flows, ignoring a border of 'margin' pixels.
+	double meanEndPointError(const cv::Mat2f& flow, const cv::Mat2f& reference, int margin)
+	{
+		const cv::Rect roi(margin, margin, flow.cols - 2 * margin, flow.rows - 2 * margin);
+		cv::Mat2f difference = flow(roi) - reference(roi);
+		std::vector<cv::Mat1f> channels;
+		cv::split(difference, channels);
+		cv::Mat1f magnitude;
+		cv::magnitude(channels[0], channels[1], magnitude);
+		return cv::mean(magnitude)[0];
+	}
+} // namespace
+
+
+//////////////
+// DISFlow
+//////////////
+
+TEST(DISFlowTest, recoversTranslation)
+{
+	const float dx = 3.25f, dy = -1.5f;
+	cv::Mat from = createTexture(320, 160, 0, 0);
+	cv::Mat to = createTexture(320, 160, dx, dy);
+	cv::Mat2f groundTruth(from.size(), cv::Vec2f(dx, dy));
+
+	for (int preset = 0; preset <= 2; preset++)
+	{
+		DISFlow dis(preset);
+		cv::Mat flow;
+		dis.calc(from, to, flow);
+
+		ASSERT_EQ(flow.type(), CV_32FC2);
+		ASSERT_EQ(flow.size(), from.size());
+		EXPECT_LT(meanEndPointError(flow, groundTruth, 16), 0.25) << "preset " << preset;
+	}
+}
+
+
+TEST(DISFlowTest, matchesOpenCVWithinTolerance)
+{
+	cv::Mat from = createTexture(320, 160, 0, 0);
+	cv::Mat to = createTexture(320, 160, 2.5f, 0.75f);
+
+	for (int preset = 0; preset <= 2; preset++)
+	{
+		cv::Mat reference;
+		cv::DISOpticalFlow::create(preset)->calc(from, to, reference);
+
+		DISFlow dis(preset);
+		cv::Mat flow;
+		dis.calc(from, to, flow);
+
+		// Documented tolerance in DISFlow.hpp.
+		EXPECT_LT(meanEndPointError(flow, reference, 16), 0.5) << "preset " << preset;
+	}
+}
+
+
+TEST(DISFlowTest, sharedPyramidsGiveSameResult)
+{
+	cv::Mat from = createTexture(256, 128, 0, 0);
+	cv::Mat to = createTexture(256, 128, -1.75f, 0.5f);
+
+	DISFlow dis(2);
+	auto fromPyramid = dis.buildPyramid(from);
+	auto toPyramid = dis.buildPyramid(to);
+
+	cv::Mat flowShared, flowDirect;
+	dis.calc(*fromPyramid, *toPyramid, flowShared);
+	dis.calc(from, to, flowDirect);
+
+	EXPECT_EQ(cv::norm(flowShared, flowDirect, cv::NORM_INF), 0);
+}
+
+
+//////////////
+// OpticalFlowApp
+//////////////
+
+TEST(OpticalFlowAppTest, cropWraparoundRemovesPadding)
+{
+	// Image widths that are not multiples of 8 lead to uneven padding at some resolutions.
+	for (int width : { 2048, 1366, 1001 })
+	{
+		for (float resolution : { 1.f, 0.5f, 1.f / 3.f })
+		{
+			cv::Mat image = createTexture(width, width / 2, 0, 0);
+			OpticalFlowApp opticalFlow(FlowMethod::Farneback, resolution);
+			opticalFlow.convertToGrayscale = false;
+			opticalFlow.equirectWraparound = true;
+
+			cv::Mat prepared = opticalFlow.prepareImage(image);
+			cv::Mat cropped = prepared;
+			opticalFlow.cropWraparound(cropped);
+			ASSERT_EQ(cropped.cols, getFlowLength(width, resolution)) << width << " at " << resolution;
+			ASSERT_EQ(cropped.rows, getFlowLength(width / 2, resolution)) << width << " at " << resolution;
+
+			if (resolution == 1.f)
+				EXPECT_EQ(cv::norm(cropped, image, cv::NORM_INF), 0) << width;
+		}
+	}
+}
+
+
+//////////////
+// FlowConsistency
+//////////////
+
+TEST(FlowConsistencyTest, detectsInconsistentFlow)
+{
+	cv::Mat2f forward(64, 128, cv::Vec2f(3.f, -1.f));
+	cv::Mat2f backward(64, 128, cv::Vec2f(-3.f, 1.f));
+
+	// A block of the backward flow points elsewhere, like at an occlusion.
+	backward(cv::Rect(40, 15, 30, 30)).setTo(cv::Vec2f(10.f, 5.f));
+
+	FlowConsistencyStatistics statistics;
+	const cv::Mat1b confidence = checkFlowConsistency(forward, backward, true, statistics);
+	ASSERT_EQ(confidence.size(), forward.size());
+
+	// Pixels landing in the block are inconsistent, all others perfectly consistent,
+	// including those that wrap around the left and right border.
+	EXPECT_EQ(confidence(5, 126), 255);
+	EXPECT_EQ(confidence(30, 50 - 3), 0);
+	EXPECT_EQ(statistics.medianError, 0.f);
+	EXPECT_GT(statistics.p95Error, 10.f);
+	EXPECT_NEAR(statistics.inconsistentFraction, 900. / forward.total(), 1e-6);
+}
+
+
+TEST(FlowConsistencyTest, wrapsAroundTheSeam)
+{
+	cv::Mat2f forward(16, 64, cv::Vec2f(3.5f, 0.f));
+	cv::Mat2f backward(16, 64, cv::Vec2f(-3.5f, 0.f));
+
+	// Only the first column of the backward flow is inconsistent.
+	backward.col(0).setTo(cv::Vec2f(10.f, 0.f));
+
+	FlowConsistencyStatistics statistics;
+	const cv::Mat1b confidence = checkFlowConsistency(forward, backward, true, statistics);
+
+	// Lands at 63.5, halfway between the last and the first column.
+	EXPECT_EQ(confidence(8, 60), 0);
+
+	// Lands at 62.5, between the last two columns.
+	EXPECT_EQ(confidence(8, 59), 255);
+
+	// Lands at 67.5 - 64 = 3.5.
+	EXPECT_EQ(confidence(8, 63), 255);
+}
+
+
+//////////////
+// FlowTiling
+//////////////
+
+TEST(FlowTilingTest, blendingPreservesFlow)
+{
+	// Tiles with the same flow blend into exactly that flow, also across the overlaps.
+	FlowTiling tiling(cv::Size(500, 230), 128, 40);
+	ASSERT_GT(tiling.getTiles().size(), 4u);
+
+	std::vector<cv::Mat> tileFlows;
+	for (auto& tile : tiling.getTiles())
+	{
+		EXPECT_EQ(tile & cv::Rect(0, 0, 500, 230), tile);
+		tileFlows.push_back(cv::Mat2f(tile.size(), cv::Vec2f(1.5f, -2.f)));
+	}
+
+	const cv::Mat2f flow = tiling.blend(tileFlows);
+	EXPECT_LT(cv::norm(flow, cv::Mat2f(flow.size(), cv::Vec2f(1.5f, -2.f)), cv::NORM_INF), 1e-5);
+}
+
+
+TEST(FlowTilingTest, tiledDISRecoversTranslation)
+{
+	const float dx = 2.75f, dy = 1.25f;
+	cv::Mat from = createTexture(640, 320, 0, 0);
+	cv::Mat to = createTexture(640, 320, dx, dy);
+	cv::Mat2f groundTruth(from.size(), cv::Vec2f(dx, dy));
+
+	DISFlow dis(2);
+	FlowTiling tiling(from.size(), 192, 48);
+	const cv::Mat2f flow = tiling.computeFlow(from, to, [&](int, const cv::Mat& a, const cv::Mat& b, cv::Mat& f) { dis.calc(a, b, f); });
+
+	ASSERT_EQ(flow.size(), from.size());
+	EXPECT_LT(meanEndPointError(flow, groundTruth, 16), 0.25);
+}
+
+
+TEST(FlowTilingTest, tilesInFlightAreCapped)
+{
+	const cv::Mat image(600, 900, CV_8UC1, cv::Scalar(0));
+	for (int cap : { 1, 2 })
+	{
+		FlowTiling tiling(image.size(), 128, 32, cap);
+		ASSERT_GT(tiling.getTiles().size(), 10u);
+		ASSERT_EQ(tiling.getNumberOfSlots(), cap);
+
+		// Each slot computes one tile at a time, and all slots together at most 'cap' tiles.
+		std::atomic<int> inFlight(0), maxInFlight(0), computed(0);
+		std::vector<std::atomic<int>> slotsInFlight(cap);
+		std::atomic<bool> slotShared(false);
+		tiling.computeFlow(image, image, [&](int slot, const cv::Mat& from, const cv::Mat&, cv::Mat& flow) {
+			const int current = ++inFlight;
+			int observed = maxInFlight;
+			while (current > observed && !maxInFlight.compare_exchange_weak(observed, current))
+				;
+			if (slot < 0 || slot >= cap || ++slotsInFlight[slot] > 1)
+				slotShared = true;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			flow = cv::Mat2f(from.size(), cv::Vec2f(0.f, 0.f));
+			computed++;
+
+			if (slot >= 0 && slot < cap)
+				slotsInFlight[slot]--;
+			inFlight--;
+		});
+
+		EXPECT_EQ(computed, (int)tiling.getTiles().size());
+		EXPECT_LE(maxInFlight, cap);
+		EXPECT_FALSE(slotShared);
+	}
+}
+
+
+TEST(ImagePrefetcherTest, streamsRingWithBoundedResidency)
+{
+	const fs::path directory = fs::temp_directory_path() / "ImagePrefetcherTest";
+	fs::create_directories(directory);
+
+	// A ring of small images, each filled with its own index.
+	const int size = 12;
+	std::vector<Camera*> cameras;
+	std::vector<int> sequence;
+	for (int i = 0; i < size; i++)
+	{
+		Camera* camera = new Camera();
+		camera->imageName = (directory / ("image" + std::to_string(i) + ".png")).string();
+		cv::imwrite(camera->imageName, cv::Mat(8, 16, CV_8UC3, cv::Scalar::all(10 * i)));
+		cameras.push_back(camera);
+		sequence.push_back(i);
+		sequence.push_back((i + 1) % size);
+	}
+
+	const int prefetch = 2;
+	{
+		ImagePrefetcher prefetcher(cameras, sequence, std::vector<int>(size, 2), prefetch);
+		for (int i = 0; i < size; i++)
+		{
+			const int j = (i + 1) % size;
+			EXPECT_EQ(prefetcher.get(i).at<cv::Vec3b>(0, 0)[0], 10 * i);
+			EXPECT_EQ(prefetcher.get(j).at<cv::Vec3b>(0, 0)[0], 10 * j);
+			prefetcher.release(i);
+			prefetcher.release(j);
+		}
+
+		// Every image is decoded once; besides the current pair and the prefetched images,
+		// only the first image stays resident until the ring is closed.
+		EXPECT_EQ(prefetcher.getNumberOfDecodedImages(), size);
+		EXPECT_LE(prefetcher.getPeakNumberOfResidentImages(), 3 + prefetch);
+
+		for (Camera* camera : cameras)
+			EXPECT_TRUE(camera->getImage().empty());
+	}
+
+	for (Camera* camera : cameras)
+		delete camera;
+	fs::remove_all(directory);
+}
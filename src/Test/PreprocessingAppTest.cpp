@@ -2,9 +2,20 @@
 
 #include "3rdParty/fs_std.hpp"
 #include "PreprocessingApp/PreprocessingApp.hpp"
+#include "PreprocessingApp/StageGraph.hpp"
+#include "Utils/FlowIO.hpp"
 
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <exception>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 
 class ColmapPreprocessingAppTest : public testing::Test
@@ -19,6 +30,7 @@ public:
 	{
 		fs::remove_all(unitTestDataDirectory + "circular/rooftop/Cache/test/");
 		preprocessingApp = new PreprocessingApp(testConfig);
+		preprocessingApp->headless = true;
 	}
 
 	virtual void TearDown()
@@ -39,6 +51,7 @@ public:
 	{
 		fs::remove_all(unitTestDataDirectory + "circular/BeijingBeihai5/Cache/test/");
 		preprocessingApp = new PreprocessingApp(testConfig);
+		preprocessingApp->headless = true;
 	}
 
 	virtual void TearDown()
@@ -61,3 +74,200 @@ TEST_F(OpenvslamPreprocessingAppTest, runTest)
 	int returncode = preprocessingApp->init();
 	ASSERT_EQ(returncode, -1);
 }
+
+
+namespace
+{
+	// Copies 'config' next to it with a different cache folder, and returns the path of the copy.
+	std::string copyConfigWithCacheFolder(const std::string& config, const std::string& cacheFolder)
+	{
+		const fs::path copy = fs::path(config).parent_path() / (cacheFolder + ".yaml");
+		std::ifstream in(config);
+		std::ofstream out(copy.string());
+		std::string line;
+		while (std::getline(in, line))
+		{
+			const size_t key = line.find("CacheFolder:");
+			if (key != std::string::npos)
+				line = line.substr(0, key) + "CacheFolder: /" + cacheFolder + "/";
+			out << line << "\n";
+		}
+		return copy.generic_string();
+	}
+
+
+	// Runs the Preprocessing executable with the given arguments and returns its exit status.
+	int runPreprocessing(const std::string& arguments)
+	{
+#ifdef PREPROCESSING_EXECUTABLE
+		return std::system(("\"" + std::string(PREPROCESSING_EXECUTABLE) + "\" --headless -y " + arguments).c_str());
+#else
+		return -1;
+#endif
+	}
+
+
+	// The forward and backward flow files of each camera in Cameras.csv, relative to the cache folder.
+	std::vector<std::string> readFlowFilenames(const fs::path& cacheFolder)
+	{
+		std::vector<std::string> flows;
+		std::ifstream cameras((cacheFolder / "Cameras.csv").string());
+		std::string line;
+		while (std::getline(cameras, line))
+		{
+			std::vector<std::string> tokens;
+			std::stringstream ss(line);
+			std::string token;
+			while (std::getline(ss, token, ','))
+				tokens.push_back(token);
+			if (tokens.size() == 25)
+			{
+				flows.push_back(tokens[23]);
+				flows.push_back(tokens[24]);
+			}
+		}
+		return flows;
+	}
+} // namespace
+
+
+TEST(PreprocessingQueueTest, workersComputeTheSameFlowsAsOneProcess)
+{
+#ifndef PREPROCESSING_EXECUTABLE
+	GTEST_SKIP() << "The Preprocessing executable is not available.";
+#endif
+	const std::string config = unitTestDataDirectory + "circular/rooftop/Config/jenkins-config-test.yaml";
+	const fs::path cache = fs::path(config).parent_path().parent_path() / "Cache";
+	const std::string singleConfig = copyConfigWithCacheFolder(config, "queue-test-single");
+	const std::string queueConfig = copyConfigWithCacheFolder(config, "queue-test-queue");
+	fs::remove_all(cache / "queue-test-single");
+	fs::remove_all(cache / "queue-test-queue");
+
+	// Flows from the flow cache would not be computed by the workers.
+	fs::remove_all(cache / "FlowCache");
+	ASSERT_EQ(runPreprocessing("\"" + singleConfig + "\""), 0);
+
+	// A coordinator and two workers, as separate processes on the same config file.
+	fs::remove_all(cache / "FlowCache");
+	std::vector<int> results(3, -1);
+	std::vector<std::thread> processes;
+	processes.emplace_back([&]() { results[0] = runPreprocessing("--coordinator --queue-timeout 600 \"" + queueConfig + "\""); });
+	for (int w = 1; w <= 2; w++)
+		processes.emplace_back([&, w]() { results[w] = runPreprocessing("--worker --queue-timeout 600 \"" + queueConfig + "\""); });
+	for (auto& process : processes)
+		process.join();
+	ASSERT_EQ(results, std::vector<int>(3, 0));
+
+	const auto singleFlows = readFlowFilenames(cache / "queue-test-single");
+	const auto queueFlows = readFlowFilenames(cache / "queue-test-queue");
+	ASSERT_FALSE(singleFlows.empty());
+	ASSERT_EQ(singleFlows, queueFlows);
+	for (const auto& flow : singleFlows)
+	{
+		const cv::Mat2f single = readFlowFile((cache / "queue-test-single" / flow).string());
+		const cv::Mat2f queue = readFlowFile((cache / "queue-test-queue" / flow).string());
+		ASSERT_FALSE(single.empty()) << flow;
+		ASSERT_EQ(single.size(), queue.size()) << flow;
+		ASSERT_EQ(cv::norm(single, queue, cv::NORM_INF), 0) << flow;
+	}
+
+	fs::remove_all(cache / "queue-test-single");
+	fs::remove_all(cache / "queue-test-queue");
+	// The config copies and their log files.
+	std::vector<fs::path> copies;
+	for (const auto& entry : fs::directory_iterator(fs::path(config).parent_path()))
+		if (entry.path().filename().string().rfind("queue-test-", 0) == 0)
+			copies.push_back(entry.path());
+	for (const auto& copy : copies)
+		fs::remove(copy);
+}
+
+
+namespace
+{
+	// A stage that counts its runs and whose inputs are given by 'input'.
+	PreprocessingStage makeStage(const std::string& name, std::vector<std::string> dependencies, std::string* input, int* runs)
+	{
+		PreprocessingStage stage;
+		stage.name = name;
+		stage.dependencies = dependencies;
+		stage.describeInputs = [input]() -> std::string { return *input; };
+		stage.run = [runs]() -> Json::Value {
+			(*runs)++;
+			return Json::Value("results");
+		};
+		stage.restore = [](const Json::Value& results) -> bool { return results.asString() == "results"; };
+		return stage;
+	}
+} // namespace
+
+
+TEST(StageGraphTest, resumeOnlyRerunsChangedStages)
+{
+	const std::string checkpoints = (fs::temp_directory_path() / "StageGraphTest").string();
+	fs::remove_all(checkpoints);
+
+	// A -> B -> D and A -> C -> D.
+	std::string inputA = "a", inputB = "b", inputC = "c", inputD = "d";
+	int runsA = 0, runsB = 0, runsC = 0, runsD = 0;
+	auto runGraph = [&](bool resume) {
+		StageGraph graph(checkpoints);
+		graph.addStage(makeStage("A", {}, &inputA, &runsA));
+		graph.addStage(makeStage("B", { "A" }, &inputB, &runsB));
+		graph.addStage(makeStage("C", { "A" }, &inputC, &runsC));
+		graph.addStage(makeStage("D", { "B", "C" }, &inputD, &runsD));
+		graph.run(resume);
+		return graph.getExecutedStages().size();
+	};
+
+	ASSERT_EQ(runGraph(false), 4u);
+	ASSERT_EQ(runGraph(true), 0u);
+
+	// Changed inputs rerun the stage and all stages that depend on it.
+	inputC = "c2";
+	ASSERT_EQ(runGraph(true), 2u);
+	ASSERT_EQ(runsB, 1);
+	ASSERT_EQ(runsC, 2);
+	ASSERT_EQ(runsD, 2);
+
+	// Without resuming, everything runs again.
+	ASSERT_EQ(runGraph(false), 4u);
+	ASSERT_EQ(runsA, 2);
+
+	fs::remove_all(checkpoints);
+}
+
+
+TEST(StageGraphTest, independentStagesRunConcurrently)
+{
+	// B and C each wait until the other one has started.
+	std::atomic<int> started(0);
+	auto waitForOther = [&]() -> Json::Value {
+		started++;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (started < 2 && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		return Json::Value(started >= 2);
+	};
+
+	StageGraph graph((fs::temp_directory_path() / "StageGraphConcurrencyTest").string());
+	PreprocessingStage a, b, c;
+	a.name = "A";
+	a.run = []() -> Json::Value { return Json::Value(); };
+	b.name = "B";
+	b.dependencies = { "A" };
+	b.run = waitForOther;
+	c.name = "C";
+	c.dependencies = { "A" };
+	c.run = waitForOther;
+	graph.addStage(a);
+	graph.addStage(b);
+	graph.addStage(c);
+
+	auto startTime = std::chrono::steady_clock::now();
+	graph.run(false);
+	ASSERT_LT(std::chrono::steady_clock::now() - startTime, std::chrono::seconds(5));
+	ASSERT_EQ(graph.getExecutedStages().front(), "A");
+
+	fs::remove_all(fs::temp_directory_path() / "StageGraphConcurrencyTest");
+}
@@ -0,0 +1,369 @@
+#include "UnitTestHeader.hpp"
+
+#include "3rdParty/fs_std.hpp"
+
+#include "PreprocessingApp/SphereFitting.hpp"
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+
+
+// Tests for the sphere fitting of the scene-adaptive proxy geometry.
+
+
+namespace
+{
+	// Points on the faces of a cube (like the walls of a room) with uniform noise, plus uniformly
+	// distributed outliers. Always the same points for the same arguments.
+	std::vector<Eigen::Vector3f> generateRoomPoints(int num_points, float width, float noise, int num_outliers)
+	{
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+
+		std::vector<Eigen::Vector3f> points;
+		for (int i = 0; i < num_points; i++)
+		{
+			Eigen::Vector3f point(uniform(rng), uniform(rng), uniform(rng));
+			point *= 0.5f * width / point.cwiseAbs().maxCoeff(); // project onto the cube
+			points.push_back(point + noise * Eigen::Vector3f(uniform(rng), uniform(rng), uniform(rng)));
+		}
+		for (int i = 0; i < num_outliers; i++)
+			points.push_back(width * Eigen::Vector3f(uniform(rng), uniform(rng), uniform(rng)));
+
+		return points;
+	}
+
+
+	// Points on a sphere around the origin, with uniform radial noise.
+	std::vector<Eigen::Vector3f> generateSpherePoints(int num_points, float radius, float noise)
+	{
+		std::mt19937 rng(42);
+		std::normal_distribution<float> normal;
+		std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+
+		std::vector<Eigen::Vector3f> points;
+		for (int i = 0; i < num_points; i++)
+		{
+			const Eigen::Vector3f direction = Eigen::Vector3f(normal(rng), normal(rng), normal(rng)).normalized();
+			points.push_back((radius + noise * uniform(rng)) * direction);
+		}
+
+		return points;
+	}
+
+
+	// Depth map with a depth edge along the azimuth and one along the polar angle.
+	Eigen::MatrixXd generateSteppedDepthMap(int polar_steps, int azimuth_steps)
+	{
+		Eigen::MatrixXd depth_map = Eigen::MatrixXd::Constant(polar_steps, azimuth_steps, 300);
+		depth_map.rightCols(azimuth_steps / 3).array() += 100;
+		depth_map.bottomRows(polar_steps / 4).array() -= 50;
+		return depth_map;
+	}
+
+
+	double maxRelativeDifference(const Eigen::MatrixXd& depth_map, const Eigen::MatrixXd& reference)
+	{
+		return ((depth_map - reference).array().abs() / reference.array().abs()).maxCoeff();
+	}
+} // namespace
+
+
+//////////////
+// Data term
+//////////////
+
+#ifdef USE_CERES
+TEST(SphereFittingTest, aggregatedDataTermMatchesPointDataTerm)
+{
+	const std::vector<Eigen::Vector3f> points = generateRoomPoints(5000, 600, 5, 250);
+
+	// The IRLS fixed point of the per-triangle data term is the solution of the per-point problem
+	// (for convex losses, which have a unique solution).
+	for (auto loss : { SphereFitting::RobustLoss::None, SphereFitting::RobustLoss::Huber })
+	{
+		Eigen::MatrixXd depth_maps[2];
+		for (int aggregate = 0; aggregate < 2; aggregate++)
+		{
+			SphereFitting fit(20, 40);
+			fit.points = points;
+			fit.backend = SphereFitting::Backend::Ceres;
+			fit.robust_data_loss = loss;
+			fit.robust_data_loss_scale = 0.1;
+			fit.smoothness_weight = 100;
+			fit.prior_weight = 0.001;
+			fit.aggregate_data_term = aggregate == 1;
+			fit.irls_iterations = 50;
+			fit.irls_tolerance = 1e-6;
+			fit.log_progress = false;
+			fit.solveProblem();
+			depth_maps[aggregate] = fit.est_depth_map;
+		}
+
+		EXPECT_LT(maxRelativeDifference(depth_maps[1], depth_maps[0]), 1e-3) << "loss " << int(loss);
+	}
+}
+#endif // USE_CERES
+
+
+//////////////
+// Backends
+//////////////
+
+TEST(SphereFittingTest, sparseCholeskyRecoversSphere)
+{
+	const double radius = 300;
+	const std::vector<Eigen::Vector3f> points = generateSpherePoints(20000, radius, 15);
+
+	SphereFitting fit(20, 40);
+	fit.points = points;
+	fit.backend = SphereFitting::Backend::SparseCholesky;
+	fit.robust_data_loss = SphereFitting::RobustLoss::None;
+	fit.smoothness_weight = 100;
+	fit.prior_weight = 0;
+	fit.log_progress = false;
+	fit.solveProblem();
+
+	ASSERT_EQ(fit.est_depth_map.rows(), 20);
+	ASSERT_EQ(fit.est_depth_map.cols(), 40);
+	EXPECT_GT(fit.solver_iterations, 0);
+	EXPECT_LT(maxRelativeDifference(fit.est_depth_map, Eigen::MatrixXd::Constant(20, 40, radius)), 0.01);
+}
+
+
+TEST(SphereFittingTest, unknownBackendFallsBackToSparseCholesky)
+{
+	const std::vector<Eigen::Vector3f> points = generateSpherePoints(5000, 300, 15);
+
+	Eigen::MatrixXd depth_maps[2];
+	for (int backend : { 1, 7 })
+	{
+		SphereFitting fit(10, 20);
+		fit.points = points;
+		fit.backend = static_cast<SphereFitting::Backend>(backend);
+		fit.log_progress = false;
+		fit.solveProblem();
+		depth_maps[backend == 1 ? 0 : 1] = fit.est_depth_map;
+	}
+
+	ASSERT_EQ(depth_maps[1].rows(), 10);
+	EXPECT_EQ(depth_maps[1], depth_maps[0]);
+}
+
+
+#ifdef USE_CERES
+TEST(SphereFittingTest, sparseCholeskyMatchesCeres)
+{
+	const std::vector<Eigen::Vector3f> points = generateRoomPoints(5000, 600, 5, 0);
+
+	// Both backends minimise the same least-squares problem (L2 loss).
+	Eigen::MatrixXd depth_maps[2];
+	for (auto backend : { SphereFitting::Backend::Ceres, SphereFitting::Backend::SparseCholesky })
+	{
+		SphereFitting fit(20, 40);
+		fit.points = points;
+		fit.backend = backend;
+		fit.robust_data_loss = SphereFitting::RobustLoss::None;
+		fit.smoothness_weight = 100;
+		fit.prior_weight = 0.001;
+		fit.aggregate_data_term = false;
+		fit.log_progress = false;
+		fit.solveProblem();
+		depth_maps[int(backend)] = fit.est_depth_map;
+	}
+
+	EXPECT_LT(maxRelativeDifference(depth_maps[int(SphereFitting::Backend::SparseCholesky)], depth_maps[int(SphereFitting::Backend::Ceres)]), 1e-3);
+}
+#endif // USE_CERES
+
+
+//////////////
+// Coarse-to-fine
+//////////////
+
+TEST(SphereFittingTest, resampleDepthMapKeepsConstantDepth)
+{
+	const Eigen::MatrixXd depth_map = Eigen::MatrixXd::Constant(11, 20, 3.5);
+
+	for (auto size : { std::make_pair(21, 40), std::make_pair(6, 10), std::make_pair(17, 33) })
+	{
+		const Eigen::MatrixXd resampled = SphereFitting::resampleDepthMap(depth_map, size.first, size.second);
+		ASSERT_EQ(resampled.rows(), size.first);
+		ASSERT_EQ(resampled.cols(), size.second);
+		EXPECT_LT((resampled.array() - 3.5).abs().maxCoeff(), 1e-12);
+	}
+}
+
+
+TEST(SphereFittingTest, resampleDepthMapKeepsCoarseDepths)
+{
+	// Coarse level as in SphereFitting::solveProblem().
+	const int polar_steps = 21;
+	const int azimuth_steps = 40;
+	const int coarse_polar_steps = (polar_steps - 1) / 2 + 1;
+	const int coarse_azimuth_steps = azimuth_steps / 2;
+
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<double> uniform(1, 10);
+	Eigen::MatrixXd coarse(coarse_polar_steps, coarse_azimuth_steps);
+	for (int i = 0; i < coarse.size(); i++)
+		coarse(i) = uniform(rng);
+
+	const Eigen::MatrixXd fine = SphereFitting::resampleDepthMap(coarse, polar_steps, azimuth_steps);
+
+	// Every other row of the fine mesh lies on a row of the coarse mesh, including both poles. The
+	// azimuths are offset by half a subdivision, so each coarse vertex lies halfway between two fine
+	// vertices, a quarter of a coarse subdivision away on either side (wrapping around).
+	for (int k = 0; k < coarse_polar_steps; k++)
+	{
+		for (int m = 0; m < coarse_azimuth_steps; m++)
+		{
+			const double previous = coarse(k, (m + coarse_azimuth_steps - 1) % coarse_azimuth_steps);
+			const double next = coarse(k, (m + 1) % coarse_azimuth_steps);
+			EXPECT_NEAR(fine(2 * k, 2 * m), 0.75 * coarse(k, m) + 0.25 * previous, 1e-12) << k << ", " << m;
+			EXPECT_NEAR(fine(2 * k, 2 * m + 1), 0.75 * coarse(k, m) + 0.25 * next, 1e-12) << k << ", " << m;
+		}
+	}
+
+	// Without any variation along the azimuth, the rows are kept exactly.
+	Eigen::MatrixXd rows(coarse_polar_steps, coarse_azimuth_steps);
+	for (int k = 0; k < coarse_polar_steps; k++)
+		rows.row(k).setConstant(coarse(k, 0));
+	const Eigen::MatrixXd fine_rows = SphereFitting::resampleDepthMap(rows, polar_steps, azimuth_steps);
+	for (int k = 0; k < coarse_polar_steps; k++)
+		EXPECT_LT((fine_rows.row(2 * k).array() - coarse(k, 0)).abs().maxCoeff(), 1e-12) << k;
+}
+
+
+//////////////
+// Adaptive mesh
+//////////////
+
+TEST(SphereFittingTest, adaptiveMeshCoversEveryQuadOnce)
+{
+	const std::vector<Eigen::Vector3f> points = generateRoomPoints(3000, 600, 5, 0);
+
+	// Azimuth steps that are not a multiple of the cell size leave narrower cells at the seam.
+	for (int azimuth_steps : { 40, 30 })
+	{
+		for (int max_cell_size : { 8, 7, 1 })
+		{
+			const int polar_steps = 21;
+			const auto samples = SphereFitting::samplePoints(points, polar_steps, azimuth_steps);
+			const auto cells = SphereFitting::buildAdaptiveMesh(samples, generateSteppedDepthMap(polar_steps, azimuth_steps), max_cell_size, 16, 0.05);
+
+			Eigen::MatrixXi covered = Eigen::MatrixXi::Zero(polar_steps - 1, azimuth_steps);
+			bool wraps_around = false;
+			for (auto& cell : cells)
+			{
+				ASSERT_GE(cell.polar_size, 1);
+				ASSERT_GE(cell.azimuth_size, 1);
+				ASSERT_LE(cell.polar_size, max_cell_size);
+				ASSERT_LE(cell.azimuth_size, max_cell_size);
+				ASSERT_LE(cell.polar_index + cell.polar_size, polar_steps - 1);
+				ASSERT_LE(cell.azimuth_index + cell.azimuth_size, azimuth_steps);
+				covered.block(cell.polar_index, cell.azimuth_index, cell.polar_size, cell.azimuth_size).array() += 1;
+				wraps_around |= cell.azimuth_index + cell.azimuth_size == azimuth_steps;
+			}
+
+			EXPECT_TRUE((covered.array() == 1).all()) << azimuth_steps << " azimuth steps, cell size " << max_cell_size;
+			EXPECT_TRUE(wraps_around);
+		}
+	}
+}
+
+
+TEST(SphereFittingTest, interpolationMatrixReproducesCellCorners)
+{
+	const int polar_steps = 21;
+	const int azimuth_steps = 30;
+	const auto samples = SphereFitting::samplePoints(generateRoomPoints(3000, 600, 5, 0), polar_steps, azimuth_steps);
+	const auto cells = SphereFitting::buildAdaptiveMesh(samples, generateSteppedDepthMap(polar_steps, azimuth_steps), 8, 16, 0.05);
+	const Eigen::MatrixXi vertices = SphereFitting::getMeshVertices(cells, polar_steps, azimuth_steps);
+	const Eigen::SparseMatrix<double> P = SphereFitting::getInterpolationMatrix(cells, vertices);
+
+	ASSERT_EQ(P.rows(), polar_steps * azimuth_steps);
+	ASSERT_EQ(P.cols(), vertices.maxCoeff() + 1);
+	ASSERT_LT(P.cols(), P.rows());
+
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<double> uniform(1, 10);
+	Eigen::VectorXd z(P.cols());
+	for (int k = 0; k < z.size(); k++)
+		z(k) = uniform(rng);
+	const Eigen::VectorXd x = P * z;
+
+	// Interpolation weights sum up to one, and the mesh vertices (column-major) keep their depths.
+	EXPECT_LT((P * Eigen::VectorXd::Ones(P.cols()) - Eigen::VectorXd::Ones(P.rows())).cwiseAbs().maxCoeff(), 1e-12);
+	for (int i = 0; i < polar_steps; i++)
+		for (int j = 0; j < azimuth_steps; j++)
+			if (vertices(i, j) >= 0)
+				EXPECT_EQ(x(i + j * polar_steps), z(vertices(i, j))) << i << ", " << j;
+}
+
+
+TEST(SphereFittingTest, adaptiveMeshHasNoTJunctions)
+{
+	const int polar_steps = 21;
+	const int azimuth_steps = 30;
+	const Eigen::MatrixXd depth_map = generateSteppedDepthMap(polar_steps, azimuth_steps);
+	const auto samples = SphereFitting::samplePoints(generateRoomPoints(3000, 600, 5, 0), polar_steps, azimuth_steps);
+	const auto cells = SphereFitting::buildAdaptiveMesh(samples, depth_map, 8, 16, 0.05);
+	const Eigen::MatrixXi vertices = SphereFitting::getMeshVertices(cells, polar_steps, azimuth_steps);
+
+	const fs::path directory = fs::temp_directory_path() / "SphereFittingTest";
+	fs::create_directories(directory);
+	const std::string filename = (directory / "adaptive.obj").string();
+	SphereFitting::writeSphereMesh(depth_map, filename, cells);
+
+	// Read the faces back (1-based vertex indices).
+	int num_vertices = 0;
+	std::map<std::pair<int, int>, int> edges; // directed edge -> count
+	std::ifstream objFile(filename);
+	std::string line;
+	while (std::getline(objFile, line))
+	{
+		std::istringstream stream(line);
+		std::string type;
+		stream >> type;
+		if (type == "v")
+			num_vertices++;
+		else if (type == "f")
+		{
+			int face[3];
+			stream >> face[0] >> face[1] >> face[2];
+			for (int k = 0; k < 3; k++)
+				edges[std::make_pair(face[k] - 1, face[(k + 1) % 3] - 1)]++;
+		}
+	}
+	objFile.close();
+	fs::remove_all(directory);
+
+	ASSERT_GT(num_vertices, vertices.maxCoeff() + 1); // some cells are triangle fans
+	ASSERT_FALSE(edges.empty());
+
+	// Rows of the mesh vertices, to find the boundary at the poles.
+	std::vector<int> rows(num_vertices, -1);
+	for (int i = 0; i < polar_steps; i++)
+		for (int j = 0; j < azimuth_steps; j++)
+			if (vertices(i, j) >= 0)
+				rows[vertices(i, j)] = i;
+
+	// Every edge is shared by exactly two consistently oriented triangles, except along the poles.
+	for (auto& edge : edges)
+	{
+		const int a = edge.first.first;
+		const int b = edge.first.second;
+		ASSERT_LT(std::max(a, b), num_vertices);
+		EXPECT_EQ(edge.second, 1) << a << " -> " << b;
+		if (edges.count(std::make_pair(b, a)) == 0)
+		{
+			const bool pole = rows[a] == rows[b] && (rows[a] == 0 || rows[a] == polar_steps - 1);
+			EXPECT_TRUE(pole) << "Unmatched edge " << a << " -> " << b;
+		}
+	}
+}
@@ -2,16 +2,28 @@
 
 #include "3rdParty/fs_std.hpp"
 
+#include "Utils/FlowArchive.hpp"
+#include "Utils/FlowCompression.hpp"
 #include "Utils/FlowIO.hpp"
 #include "Utils/IOTools.hpp"
 #include "Utils/Logger.hpp"
+#include "Utils/ResourceUsage.hpp"
+#include "Utils/Trace.hpp"
 #include "Utils/Utils.hpp"
+#include "Utils/WorkQueue.hpp"
 #include "Utils/cvutils.hpp"
 
 #include <gtest/gtest.h>
 #include <opencv2/opencv.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <mutex>
 #include <string>
+#include <thread>
 
 using namespace std;
 
@@ -178,6 +190,53 @@ TEST(FlowIOTest, readWriteFlossFile)
 	ASSERT_TRUE(reread_error == 0.);
 }
 
+TEST(FlowIOTest, fixedPointFlossMatchesFloatFlow)
+{
+	string floFile = unitTestDataDirectory + "general_sphere/undistorted-1702-FlowToNext.flo";
+	string flossFile = unitTestDataDirectory + "general_sphere/testfile4.floss";
+	writeFlossFile(flossFile, readFloFile(floFile));
+
+	cv::Mat2f flow = readFlossFile(flossFile);
+	cv::Mat2s fixedPointFlow = readFlossFileFixedPoint(flossFile);
+	ASSERT_EQ(fixedPointFlow.size(), flow.size());
+
+	// Dequantise like the viewer: OpenGL normalises GL_RG16_SNORM texels to max(v / 32767, -1),
+	// and the shader multiplies the fetched flow with getSnormFlowScale().
+	const float scale = getSnormFlowScale();
+	double maxError = 0;
+	for (int y = 0; y < flow.rows; y++)
+	{
+		for (int x = 0; x < flow.cols; x++)
+		{
+			for (int c = 0; c < 2; c++)
+			{
+				const float normalised = std::max(fixedPointFlow(y, x)[c] / 32767.f, -1.f);
+				maxError = std::max(maxError, (double)std::abs(scale * normalised - flow(y, x)[c]));
+			}
+		}
+	}
+
+	// Far below the fixed-point precision of 1/8 pixel.
+	ASSERT_LT(maxError, 1e-3);
+}
+
+TEST(FlowIOTest, readWriteFlzFile)
+{
+	string floFile = unitTestDataDirectory + "general_sphere/undistorted-1702-FlowToNext.flo";
+	string flossFile = unitTestDataDirectory + "general_sphere/testfile5.floss";
+	writeFlowFile(flossFile, readFloFile(floFile));
+	auto flow_ss = readFlowFile(flossFile);
+
+	// .flz stores the same fixed-point values as .floss, so this should be lossless.
+	string flzFile = unitTestDataDirectory + "general_sphere/testfile.flz";
+	writeFlowFile(flzFile, flow_ss);
+	auto flow_z = readFlowFile(flzFile);
+	ASSERT_EQ(cv::norm(flow_ss, flow_z, cv::NORM_INF), 0.);
+	ASSERT_EQ(cv::norm(readFlossFileFixedPoint(flossFile), readFlzFileFixedPoint(flzFile), cv::NORM_INF), 0.);
+
+	ASSERT_LT(fs::file_size(flzFile), fs::file_size(flossFile));
+}
+
 TEST(FlowIOTest, readBarronFileTest)
 {
 	string barronFile = unitTestDataDirectory + "general_sphere/L0L1_t.F";
@@ -206,3 +265,255 @@ TEST(FlowIOTest, readFloGenFunction_2)
 	string floFile = unitTestDataDirectory + "general_sphere/undistorted-1702-FlowToNext.flo";
 	ASSERT_FALSE(readFlowFile(floFile).empty());
 }
+
+
+///////////////
+// FlowArchive
+///////////////
+
+TEST(FlowArchiveTest, writeReadArchive)
+{
+	// Quantise an existing flow the same way as .floss files.
+	string floFile = unitTestDataDirectory + "general_sphere/undistorted-1702-FlowToNext.flo";
+	string flossFile = unitTestDataDirectory + "general_sphere/testfile3.floss";
+	writeFlossFile(flossFile, readFloFile(floFile));
+	cv::Mat2f flow = readFlossFile(flossFile);
+
+	// Write the layers out of order, as the flow scheduler does.
+	string archiveFile = unitTestDataDirectory + "general_sphere/testfile.flowpack";
+	FlowArchiveWriter writer(archiveFile, 3);
+	ASSERT_TRUE(writer.writeLayer(2, cv::Mat2f(-flow)));
+	ASSERT_TRUE(writer.writeLayer(0, flow));
+	ASSERT_FALSE(writer.writeLayer(3, flow));
+	ASSERT_TRUE(writer.finish());
+
+	FlowArchive archive;
+	ASSERT_TRUE(archive.open(archiveFile));
+	ASSERT_EQ(archive.getNumberOfLayers(), 3);
+	ASSERT_EQ(archive.getWidth(), flow.cols);
+	ASSERT_EQ(archive.getHeight(), flow.rows);
+	ASSERT_TRUE(archive.getLayer(1) == nullptr);
+
+	// Payloads are page-aligned, and lossless for flows that were quantised before.
+	ASSERT_EQ((size_t)archive.getLayer(0) % 4096, 0u);
+	ASSERT_EQ(cv::norm(archive.getFlow(0), flow, cv::NORM_INF), 0.);
+	ASSERT_EQ(cv::norm(archive.getFlow(2), cv::Mat2f(-flow), cv::NORM_INF), 0.);
+}
+
+
+///////////////////
+// FlowCompression
+///////////////////
+
+TEST(FlowCompressionTest, losslessForExtremeValues)
+{
+	// Noise and the full int16 range exercise the escape codes of the entropy coder.
+	cv::Mat2s flow(37, 53);
+	cv::randu(flow, cv::Scalar::all(-32768), cv::Scalar::all(32768));
+	flow(0, 0) = cv::Vec2s(-32768, 32767);
+	flow(36, 52) = cv::Vec2s(32767, -32768);
+
+	// Band heights that do and do not divide the number of rows.
+	for (int bandHeight : { 1, 5, 37, 100 })
+	{
+		std::vector<unsigned char> data = compressFlow(flow, bandHeight);
+		cv::Mat2s decompressed = decompressFlow(data.data(), data.size());
+		ASSERT_EQ(decompressed.size(), flow.size());
+		ASSERT_EQ(cv::norm(decompressed, flow, cv::NORM_INF), 0.) << "band height " << bandHeight;
+
+		// Truncated streams are rejected.
+		ASSERT_TRUE(decompressFlow(data.data(), data.size() - 1).empty());
+	}
+}
+
+
+/////////////
+// WorkQueue
+/////////////
+
+TEST(WorkQueueTest, tasksAreClaimedExactlyOnce)
+{
+	const string directory = (fs::temp_directory_path() / "WorkQueueTest").string();
+	std::map<string, string> tasks;
+	for (int i = 0; i < 200; i++)
+		tasks["task-" + std::to_string(1000 + i)] = std::to_string(i);
+	ASSERT_TRUE(WorkQueue(directory).create(tasks));
+
+	// Several workers with their own queue objects, as in separate processes. Assertions only
+	// abort the current function, so the workers record their errors for the main thread.
+	std::vector<string> claimed, errors;
+	std::mutex mutex;
+	std::vector<std::thread> workers;
+	for (int w = 0; w < 4; w++)
+	{
+		workers.emplace_back([&]() {
+			WorkQueue queue(directory);
+			queue.attach();
+			string name, contents;
+			while (queue.claim(name, contents))
+			{
+				const bool completed = queue.complete(name);
+				std::lock_guard<std::mutex> lock(mutex);
+				if (contents != tasks.at(name))
+					errors.push_back("wrong contents of " + name);
+				if (!completed)
+					errors.push_back("could not complete " + name);
+				claimed.push_back(name);
+			}
+		});
+	}
+	for (auto& worker : workers)
+		worker.join();
+
+	ASSERT_TRUE(errors.empty()) << errors.front();
+
+	std::sort(claimed.begin(), claimed.end());
+	ASSERT_EQ(claimed.size(), tasks.size());
+	ASSERT_TRUE(std::adjacent_find(claimed.begin(), claimed.end()) == claimed.end());
+
+	WorkQueue queue(directory);
+	ASSERT_TRUE(queue.isFinished());
+	ASSERT_EQ(queue.getNumberOfDoneTasks(), (int)tasks.size());
+	queue.remove();
+	ASSERT_FALSE(queue.exists());
+}
+
+
+TEST(WorkQueueTest, replacedQueuesAreNotClaimedFrom)
+{
+	const string directory = (fs::temp_directory_path() / "WorkQueueRunTest").string();
+	WorkQueue coordinator(directory);
+	ASSERT_TRUE(coordinator.create({ { "a", "1" }, { "b", "2" } }));
+	ASSERT_LT(coordinator.getSecondsSinceHeartbeat(), 60);
+
+	// A worker that has not attached does not claim anything.
+	WorkQueue worker(directory);
+	string name, contents;
+	ASSERT_FALSE(worker.claim(name, contents));
+	ASSERT_TRUE(worker.attach());
+	ASSERT_TRUE(worker.isCurrent());
+	ASSERT_TRUE(worker.claim(name, contents));
+
+	// A new coordinator replaces the queue, and the worker of the old run stops claiming.
+	ASSERT_TRUE(WorkQueue(directory).create({ { "a", "1" }, { "b", "2" } }));
+	ASSERT_FALSE(worker.isCurrent());
+	ASSERT_FALSE(worker.claim(name, contents));
+	ASSERT_FALSE(coordinator.isCurrent());
+
+	coordinator.remove();
+	ASSERT_FALSE(worker.attach());
+	ASSERT_EQ(worker.getSecondsSinceHeartbeat(), std::numeric_limits<double>::infinity());
+}
+
+
+TEST(WorkQueueTest, staleTasksAreRequeued)
+{
+	WorkQueue queue((fs::temp_directory_path() / "WorkQueueStaleTest").string());
+	ASSERT_TRUE(queue.create({ { "a", "1" }, { "b", "2" } }));
+
+	string name, contents;
+	ASSERT_TRUE(queue.claim(name, contents));
+	ASSERT_EQ(name, "a");
+	ASSERT_EQ(queue.requeueStaleTasks(3600.), 0);
+	ASSERT_EQ(queue.requeueStaleTasks(0.), 1);
+	ASSERT_EQ(queue.getNumberOfPendingTasks(), 2);
+	ASSERT_FALSE(queue.isFinished());
+	queue.remove();
+}
+
+
+TEST(WorkQueueTest, refreshedTasksAreNotStale)
+{
+	WorkQueue queue((fs::temp_directory_path() / "WorkQueueRefreshTest").string());
+	ASSERT_TRUE(queue.create({ { "a", "1" } }));
+
+	string name, contents;
+	ASSERT_TRUE(queue.claim(name, contents));
+
+	// Claimed two hours ago, but the worker is still alive.
+	const fs::path claimed = fs::path(queue.getDirectory()) / "claimed" / name;
+	fs::last_write_time(claimed, fs::file_time_type::clock::now() - std::chrono::hours(2));
+	ASSERT_TRUE(queue.refresh(name));
+	ASSERT_EQ(queue.requeueStaleTasks(3600.), 0);
+	ASSERT_EQ(queue.getNumberOfClaimedTasks(), 1);
+
+	ASSERT_TRUE(queue.release(name));
+	ASSERT_FALSE(queue.refresh(name));
+	queue.remove();
+}
+
+
+TEST(WorkQueueTest, failedTasksAreNotHandedOutAgain)
+{
+	WorkQueue queue((fs::temp_directory_path() / "WorkQueueFailedTest").string());
+	ASSERT_TRUE(queue.create({ { "a", "1" }, { "b", "2" } }));
+
+	string name, contents;
+	ASSERT_TRUE(queue.claim(name, contents));
+	ASSERT_TRUE(queue.fail(name));
+	ASSERT_FALSE(queue.complete(name));
+	ASSERT_EQ(queue.requeueStaleTasks(0.), 0);
+	ASSERT_TRUE(queue.claim(name, contents));
+	ASSERT_EQ(name, "b");
+	ASSERT_TRUE(queue.complete(name));
+	ASSERT_FALSE(queue.claim(name, contents));
+
+	ASSERT_TRUE(queue.isFinished());
+	ASSERT_EQ(queue.getNumberOfDoneTasks(), 1);
+	ASSERT_EQ(queue.getNumberOfFailedTasks(), 1);
+	queue.remove();
+}
+
+
+TEST(ResourceUsageTest, measuresWorkBetweenSnapshots)
+{
+	const ResourceUsage start = ResourceUsage::current();
+	const double threadStart = getThreadCPUTime();
+
+	const string filename = (fs::temp_directory_path() / "ResourceUsageTest.bin").string();
+	{
+		std::ofstream file(filename, std::ios::binary);
+		file << string(1 << 20, 'x');
+	}
+	volatile double sum = 0;
+	for (int i = 0; i < 20000000; i++)
+		sum = sum + std::sqrt((double)i);
+
+	const ResourceUsage usage = ResourceUsage::current().since(start);
+	ASSERT_GT(usage.wallSeconds, 0.);
+	ASSERT_GT(usage.cpuSeconds, 0.);
+	ASSERT_GT(getThreadCPUTime(), threadStart);
+	ASSERT_GT(usage.peakMemory, 0u);
+#if defined(_WIN32) || defined(__linux__)
+	ASSERT_GE(usage.bytesWritten, 1u << 20);
+#endif
+
+	std::error_code ec;
+	fs::remove(filename, ec);
+}
+
+
+TEST(TraceTest, writesEventsOfAllThreads)
+{
+	// Records directly, as TRACE_SCOPE is compiled out without WITH_TRACING.
+	auto work = [](const char* name) {
+		for (int i = 0; i < 10; i++)
+		{
+			TraceScope scope(name);
+		}
+	};
+	std::thread first(work, "TraceTest::first");
+	std::thread second(work, "TraceTest::second");
+	first.join();
+	second.join();
+
+	const string filename = (fs::temp_directory_path() / "TraceTest.json").string();
+	ASSERT_TRUE(writeTrace(filename));
+	const string trace = readFile(filename);
+	ASSERT_EQ(trace.find("{\"traceEvents\":["), 0u);
+	ASSERT_NE(trace.find("\"name\":\"TraceTest::first\""), string::npos);
+	ASSERT_NE(trace.find("\"name\":\"TraceTest::second\""), string::npos);
+
+	std::error_code ec;
+	fs::remove(filename, ec);
+}
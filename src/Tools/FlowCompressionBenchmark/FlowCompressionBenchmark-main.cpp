@@ -0,0 +1,152 @@
+#include "3rdParty/fs_std.hpp"
+
+#include "Utils/FlowCompression.hpp"
+#include "Utils/FlowIO.hpp"
+#include "Utils/Logger.hpp"
+#include "Utils/Timer.hpp"
+
+#include <tclap/CmdLine.h>
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <string>
+#include <vector>
+
+
+using namespace std;
+
+
+// Compares the .flz flow format (lossless predictive compression) with .floss (raw 16-bit).
+//
+// For each input flow file, both formats are written to and read from a temporary directory, and
+// .flz is additionally compressed and decompressed in memory (i.e. without disk I/O). Throughputs
+// are reported relative to the raw 16-bit flow data in MB/s.
+int main(int argc, char* argv[])
+{
+	Logger logger(argv[0]);
+
+	// Set up command line parser TCLAP.
+	TCLAP::CmdLine cmd("FlowCompressionBenchmark - Compares .flz with .floss flow files.", ' ', "0.1");
+	TCLAP::UnlabeledMultiArg<string> flowsArg(       "flows",   "Flow files (any supported format) or directories containing them.", true, "flow files", cmd);
+	TCLAP::ValueArg<int>             repeatArg( "r", "repeat",  "Number of repetitions of each measurement (the fastest one counts). [default: 3]", false, 3, "number", cmd);
+	TCLAP::ValueArg<int>             bandArg(   "b", "band",    "Number of rows per independently coded band. [default: 32]", false, 32, "rows", cmd);
+	TCLAP::ValueArg<string>          tempArg(   "t", "temp",    "Directory for temporary files. [default: system temp directory]", false, "", "directory", cmd);
+	cmd.parse(argc, (char const* const*)argv);
+
+	// Collect the flow files.
+	vector<string> files;
+	for (const string& path : flowsArg.getValue())
+	{
+		if (fs::is_directory(path))
+		{
+			for (auto& entry : fs::directory_iterator(path))
+			{
+				const string ext = entry.path().extension().string();
+				if (entry.is_regular_file() && (ext == ".flo" || ext == ".floss" || ext == ".flz" || ext == ".F"))
+					files.push_back(entry.path().string());
+			}
+		}
+		else
+		{
+			files.push_back(path);
+		}
+	}
+	sort(files.begin(), files.end());
+
+	const fs::path tempDir = tempArg.getValue().empty() ? fs::temp_directory_path() : fs::path(tempArg.getValue());
+	const string tempFloss = (tempDir / "FlowCompressionBenchmark.floss").string();
+	const string tempFlz = (tempDir / "FlowCompressionBenchmark.flz").string();
+	const int repeats = max(1, repeatArg.getValue());
+
+	// Runs 'function' several times and returns the fastest time in seconds.
+	auto measure = [&](std::function<void()> function) -> double {
+		double best = numeric_limits<double>::max();
+		for (int r = 0; r < repeats; r++)
+		{
+			Timer timer;
+			timer.startTiming();
+			function();
+			best = min(best, timer.getElapsedSeconds());
+		}
+		return best;
+	};
+
+	// Totals over all files.
+	double rawBytes = 0, flossBytes = 0, flzBytes = 0;
+	double flossWrite = 0, flossRead = 0, flzWrite = 0, flzRead = 0, compress = 0, decompress = 0;
+
+	auto mbs = [](double bytes, double seconds) -> double { return bytes / 1e6 / max(seconds, 1e-9); };
+
+	cout << "file,width,height,floss_bytes,flz_bytes,ratio,"
+	     << "floss_write_MBps,floss_read_MBps,flz_write_MBps,flz_read_MBps,compress_MBps,decompress_MBps" << endl;
+
+	for (const string& file : files)
+	{
+		cv::Mat2f flow = readFlowFile(file);
+		if (flow.empty())
+		{
+			LOG(WARNING) << "Skipping '" << file << "', which could not be read.";
+			continue;
+		}
+
+		cv::Mat2s shortFlow;
+		flow.convertTo(shortFlow, CV_16S, flossFixedPointScale, 0.);
+		const double raw = (double)shortFlow.total() * shortFlow.elemSize();
+
+		// File round trips.
+		const double tFlossWrite = measure([&]() { writeFlossFile(tempFloss, flow); });
+		const double tFlossRead = measure([&]() { readFlossFileFixedPoint(tempFloss); });
+		const double tFlzWrite = measure([&]() { writeFlzFile(tempFlz, flow); });
+		const double tFlzRead = measure([&]() { readFlzFileFixedPoint(tempFlz); });
+
+		// In-memory coding, i.e. the cost of the codec alone.
+		vector<unsigned char> data;
+		const double tCompress = measure([&]() { data = compressFlow(shortFlow, bandArg.getValue()); });
+		cv::Mat2s decompressed;
+		const double tDecompress = measure([&]() { decompressed = decompressFlow(data.data(), data.size()); });
+
+		if (decompressed.empty() || cv::norm(decompressed, shortFlow, cv::NORM_INF) != 0)
+			LOG(WARNING) << "Compression of '" << file << "' is not lossless!";
+
+		const double sizeFloss = (double)fs::file_size(tempFloss);
+		const double sizeFlz = (double)fs::file_size(tempFlz);
+
+		cout << fs::path(file).filename().string() << "," << flow.cols << "," << flow.rows << ","
+		     << (size_t)sizeFloss << "," << (size_t)sizeFlz << "," << fixed << setprecision(3) << sizeFloss / sizeFlz << ","
+		     << setprecision(1) << mbs(raw, tFlossWrite) << "," << mbs(raw, tFlossRead) << ","
+		     << mbs(raw, tFlzWrite) << "," << mbs(raw, tFlzRead) << ","
+		     << mbs(raw, tCompress) << "," << mbs(raw, tDecompress) << endl;
+
+		rawBytes += raw;
+		flossBytes += sizeFloss;
+		flzBytes += sizeFlz;
+		flossWrite += tFlossWrite;
+		flossRead += tFlossRead;
+		flzWrite += tFlzWrite;
+		flzRead += tFlzRead;
+		compress += tCompress;
+		decompress += tDecompress;
+	}
+
+	std::error_code ec;
+	fs::remove(tempFloss, ec);
+	fs::remove(tempFlz, ec);
+
+	if (rawBytes == 0)
+	{
+		LOG(WARNING) << "No flow files were read.";
+		return 1;
+	}
+
+	LOG(INFO) << "Compression ratio over .floss: " << fixed << setprecision(3) << flossBytes / flzBytes
+	          << " (" << (size_t)flossBytes << " -> " << (size_t)flzBytes << " bytes)";
+	LOG(INFO) << ".floss write/read: " << setprecision(1) << mbs(rawBytes, flossWrite) << " / " << mbs(rawBytes, flossRead) << " MB/s";
+	LOG(INFO) << ".flz   write/read: " << mbs(rawBytes, flzWrite) << " / " << mbs(rawBytes, flzRead) << " MB/s";
+	LOG(INFO) << ".flz   compress/decompress (in memory): " << mbs(rawBytes, compress) << " / " << mbs(rawBytes, decompress) << " MB/s";
+
+	return 0;
+}
@@ -0,0 +1,347 @@
+#include "3rdParty/fs_std.hpp"
+#include "3rdParty/json/json.h"
+
+#include "Core/OpticalFlow/OpticalFlowApp.hpp"
+
+#include "Utils/FlowIO.hpp"
+#include "Utils/Logger.hpp"
+#include "Utils/Timer.hpp"
+#include "Utils/cvutils.hpp"
+
+#include <tclap/CmdLine.h>
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+using namespace std;
+
+
+namespace
+{
+	const double PI = 3.14159265358979323846;
+
+
+	// Procedural texture with detail at all scales, for when no images are given.
+	cv::Mat makeTexture(int width, int height)
+	{
+		cv::RNG rng(42);
+		cv::Mat3f texture(height, width, cv::Vec3f(0.5f, 0.5f, 0.5f));
+		for (int octave = 1; octave <= width / 8; octave *= 2)
+		{
+			cv::Mat3f noise(max(1, (height * octave) / width), octave * 2);
+			rng.fill(noise, cv::RNG::UNIFORM, -0.5, 0.5);
+			cv::resize(noise, noise, texture.size(), 0, 0, cv::INTER_CUBIC);
+			texture += noise * (0.8 / std::sqrt((double)octave));
+		}
+
+		cv::Mat image;
+		texture.convertTo(image, CV_8UC3, 255.);
+		return image;
+	}
+
+
+	// Analytic flow fields, in pixels, of an equirectangular image of the given size. Each field is
+	// scaled so that its largest displacement is 'magnitude' pixels.
+	//   rotation: the camera turns about the vertical axis, i.e. a constant horizontal shift,
+	//   parallax: the camera moves sideways in a scene whose depth varies with direction,
+	//   sine:     smooth sinusoidal flow with vertical components.
+	cv::Mat2f makeField(const string& field, int width, int height, double magnitude)
+	{
+		cv::Mat2f flow(height, width);
+		for (int y = 0; y < height; y++)
+		{
+			const double phi = PI * (0.5 - (y + 0.5) / height); // latitude
+			for (int x = 0; x < width; x++)
+			{
+				const double theta = 2 * PI * ((x + 0.5) / width - 0.5); // longitude
+				cv::Vec2f& f = flow(y, x);
+
+				if (field == "rotation")
+				{
+					f = cv::Vec2f(1.f, 0.f);
+				}
+				else if (field == "parallax")
+				{
+					// Point seen in direction d from a camera at (1, 0, 0), as seen from the origin.
+					const double depth = 10. * (1. + 0.5 * sin(3 * theta) * cos(2 * phi));
+					const cv::Vec3d d(cos(phi) * sin(theta), sin(phi), cos(phi) * cos(theta));
+					const cv::Vec3d p = cv::Vec3d(1, 0, 0) + depth * d;
+					const double theta2 = atan2(p[0], p[2]);
+					const double phi2 = asin(p[1] / cv::norm(p));
+
+					double dTheta = theta2 - theta;
+					if (dTheta > PI)
+						dTheta -= 2 * PI;
+					if (dTheta < -PI)
+						dTheta += 2 * PI;
+					f = cv::Vec2f((float)(dTheta * width / (2 * PI)), (float)(-(phi2 - phi) * height / PI));
+				}
+				else if (field == "sine")
+				{
+					f = cv::Vec2f((float)(sin(2 * theta) * cos(phi)), (float)(0.5 * sin(3 * theta) * cos(phi) * cos(phi)));
+				}
+				else
+				{
+					throw std::invalid_argument("Unknown flow field '" + field + "'.");
+				}
+			}
+		}
+
+		double maxLength = 0;
+		for (auto& f : flow)
+			maxLength = max(maxLength, (double)cv::norm(f));
+		return flow * (magnitude / max(maxLength, 1e-9));
+	}
+
+
+	// Warps 'image' by 'flow', i.e. result(x) = image(x + flow(x)), wrapping around horizontally.
+	cv::Mat warp(const cv::Mat& image, const cv::Mat2f& flow)
+	{
+		cv::Mat2f map = convertFlowToAbsolute(flow);
+		for (auto& m : map)
+			m[1] = std::min(std::max(m[1], 0.f), (float)(image.rows - 1));
+		return cv::remap(image, map, cv::INTER_LINEAR, cv::BORDER_WRAP);
+	}
+
+
+	struct Method
+	{
+		string name;
+		FlowMethod method;
+		int preset;
+	};
+} // namespace
+
+
+// Measures the speed and accuracy of the optical flow methods on synthetic equirectangular pairs.
+//
+// Each input image (or a procedural texture) is warped by analytic flow fields, so that the true
+// flow of every pair is known. Every method and preset then computes the flow using each number
+// of OpenCV threads. Reported are the time per flow field in ms per megapixel (the fastest of
+// several repetitions), the mean endpoint error and RMSE of the flow, and the PSNR of the image
+// warped by the computed flow (the PSNR with the true flow is given as a reference).
+int main(int argc, char* argv[])
+{
+	Logger logger(argv[0]);
+
+	// Set up command line parser TCLAP.
+	TCLAP::CmdLine cmd("OpticalFlowBenchmark - Compares optical flow methods on synthetic equirectangular pairs.", ' ', "0.1");
+	TCLAP::UnlabeledMultiArg<string> imagesArg(          "images",     "Equirectangular images to warp. [default: procedural texture]", false, "image files", cmd);
+	TCLAP::ValueArg<int>             widthArg(     "w",  "width",      "Width the images are resized to (height is half of it). [default: 2048]", false, 2048, "pixels", cmd);
+	TCLAP::MultiArg<string>          fieldsArg(    "f",  "field",      "Flow field: rotation, parallax or sine. [default: all]", false, "field", cmd);
+	TCLAP::ValueArg<double>          magnitudeArg( "a",  "magnitude",  "Largest displacement of the flow fields in pixels. [default: 30]", false, 30., "pixels", cmd);
+	TCLAP::MultiArg<string>          methodsArg(   "m",  "method",     "Flow method: DIS, NativeDIS or Farneback (or BroxCUDA with CUDA). [default: all CPU methods]", false, "method", cmd);
+	TCLAP::MultiArg<int>             threadsArg(   "t",  "threads",    "Number of OpenCV threads. [default: 1 and all hardware threads]", false, "number", cmd);
+	TCLAP::ValueArg<int>             repeatArg(    "r",  "repeat",     "Number of repetitions of each measurement (the fastest one counts). [default: 3]", false, 3, "number", cmd);
+	TCLAP::SwitchArg                 noWrapArg(    "",   "no-wraparound", "Do not pad the images for equirectangular wraparound.", cmd, false);
+	TCLAP::ValueArg<float>           resolutionArg("s",  "resolution", "Resolution of the flow relative to the images, like the FlowResolution setting. [default: 1]", false, 1.f, "factor", cmd);
+	TCLAP::ValueArg<string>          csvArg(       "",   "csv",        "Also write the results to this CSV file.", false, "", "file", cmd);
+	TCLAP::ValueArg<string>          jsonArg(      "",   "json",       "Also write the results to this JSON file.", false, "", "file", cmd);
+	cmd.parse(argc, (char const* const*)argv);
+
+	const int width = max(16, widthArg.getValue() / 16 * 16);
+	const int height = width / 2;
+	const int repeats = max(1, repeatArg.getValue());
+
+	vector<string> fields = fieldsArg.getValue();
+	if (fields.empty())
+		fields = { "rotation", "parallax", "sine" };
+
+	// Methods with all of their presets.
+	vector<string> methodNames = methodsArg.getValue();
+	if (methodNames.empty())
+		methodNames = { "DIS", "NativeDIS", "Farneback" };
+	vector<Method> methods;
+	for (const string& name : methodNames)
+	{
+		if (name == "DIS" || name == "NativeDIS")
+		{
+			// PRESET_ULTRAFAST, PRESET_FAST, PRESET_MEDIUM
+			for (int preset = 0; preset <= 2; preset++)
+				methods.push_back({ name, name == "DIS" ? FlowMethod::DIS : FlowMethod::NativeDIS, preset });
+		}
+		else if (name == "Farneback")
+		{
+			methods.push_back({ name, FlowMethod::Farneback, 0 });
+		}
+#ifdef USE_CUDA
+		else if (name == "BroxCUDA")
+		{
+			methods.push_back({ name, FlowMethod::BroxCUDA, 0 });
+		}
+#endif
+		else
+		{
+			LOG(ERROR) << "Unknown flow method '" << name << "'.";
+			return 1;
+		}
+	}
+
+	vector<int> threadCounts = threadsArg.getValue();
+	if (threadCounts.empty())
+	{
+		threadCounts = { 1 };
+		if (std::thread::hardware_concurrency() > 1)
+			threadCounts.push_back((int)std::thread::hardware_concurrency());
+	}
+
+	// The source images.
+	vector<pair<string, cv::Mat>> images;
+	for (const string& filename : imagesArg.getValue())
+	{
+		cv::Mat image = cv::imread(filename, cv::IMREAD_COLOR);
+		if (image.empty())
+		{
+			LOG(WARNING) << "Skipping '" << filename << "', which could not be read.";
+			continue;
+		}
+		cv::resize(image, image, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+		images.push_back({ fs::path(filename).filename().string(), image });
+	}
+	if (imagesArg.getValue().empty())
+		images.push_back({ "texture", makeTexture(width, height) });
+	if (images.empty())
+	{
+		LOG(ERROR) << "No images were read.";
+		return 1;
+	}
+
+	// Runs 'function' several times and returns the fastest time in seconds.
+	auto measure = [&](std::function<void()> function) -> double {
+		double best = numeric_limits<double>::max();
+		for (int r = 0; r < repeats; r++)
+		{
+			Timer timer;
+			timer.startTiming();
+			function();
+			best = min(best, timer.getElapsedSeconds());
+		}
+		return best;
+	};
+
+	const string header = "image,field,method,preset,threads,width,height,ms_per_MP,epe,flow_rmse,warp_psnr,true_warp_psnr";
+	cout << header << endl;
+	std::stringstream csv;
+	csv << header << endl;
+	Json::Value results(Json::arrayValue);
+
+	for (auto& image : images)
+	{
+		for (const string& field : fields)
+		{
+			// The right image is the source; the left one is the source warped by the true flow, so
+			// that the flow from left to right is exactly the analytic field.
+			const cv::Mat2f trueFlowFull = makeField(field, width, height, magnitudeArg.getValue());
+			cv::Mat right = image.second;
+			cv::Mat left = warp(right, trueFlowFull);
+
+			// Flows are evaluated at the resolution they are computed at.
+			cv::Mat2f trueFlow = trueFlowFull;
+			cv::Mat leftEval = left, rightEval = right;
+			const float resolution = resolutionArg.getValue();
+			if (resolution != 1.f)
+			{
+				const cv::Size size(getFlowLength(width, resolution), getFlowLength(height, resolution));
+				cv::resize(trueFlowFull, trueFlow, size, 0, 0, cv::INTER_AREA);
+				trueFlow *= resolution;
+				cv::resize(left, leftEval, size, 0, 0, cv::INTER_AREA);
+				cv::resize(right, rightEval, size, 0, 0, cv::INTER_AREA);
+			}
+			const double megapixels = trueFlow.total() / 1e6;
+			const double trueWarpPSNR = cv::psnr(leftEval, warp(rightEval, trueFlow));
+
+			for (const Method& method : methods)
+			{
+				OpticalFlowApp opticalFlow(method.method, method.preset, resolution);
+				opticalFlow.equirectWraparound = !noWrapArg.getValue();
+
+				const cv::Mat preparedLeft = opticalFlow.prepareImage(left);
+				const cv::Mat preparedRight = opticalFlow.prepareImage(right);
+				auto leftPyramid = opticalFlow.buildPyramid(preparedLeft);
+				auto rightPyramid = opticalFlow.buildPyramid(preparedRight);
+
+				for (int threads : threadCounts)
+				{
+					cv::setNumThreads(threads);
+
+					cv::Mat forward, backward;
+					const double seconds = measure([&]() {
+						opticalFlow.setPreparedPair(preparedLeft, preparedRight, leftPyramid, rightPyramid);
+						opticalFlow.computeFlows();
+						opticalFlow.takeFlows(forward, backward);
+					});
+					opticalFlow.cropWraparound(forward);
+
+					// Both directions are computed, so each flow field takes half of the time.
+					const double msPerMP = 1000. * seconds / 2. / megapixels;
+					const cv::Mat2f flow = forward;
+					cv::Mat difference = flow - trueFlow;
+					double epe = 0;
+					for (auto& d : cv::Mat2f(difference))
+						epe += cv::norm(d);
+					epe /= flow.total();
+					const double flowRMSE = cv::rmse(flow.reshape(1), trueFlow.reshape(1));
+					const double warpPSNR = cv::psnr(leftEval, warp(rightEval, flow));
+
+					std::stringstream row;
+					row << image.first << "," << field << "," << method.name << "," << method.preset << "," << threads << ","
+					    << flow.cols << "," << flow.rows << "," << fixed << setprecision(3) << msPerMP << ","
+					    << setprecision(4) << epe << "," << flowRMSE << "," << setprecision(2) << warpPSNR << "," << trueWarpPSNR;
+					cout << row.str() << endl;
+					csv << row.str() << endl;
+
+					Json::Value result;
+					result["Image"] = image.first;
+					result["Field"] = field;
+					result["Method"] = method.name;
+					result["Preset"] = method.preset;
+					result["Threads"] = threads;
+					result["Width"] = flow.cols;
+					result["Height"] = flow.rows;
+					result["MillisecondsPerMegapixel"] = msPerMP;
+					result["EndpointError"] = epe;
+					result["FlowRMSE"] = flowRMSE;
+					result["WarpPSNR"] = warpPSNR;
+					result["TrueWarpPSNR"] = trueWarpPSNR;
+					results.append(result);
+				}
+			}
+		}
+	}
+
+	if (!csvArg.getValue().empty())
+	{
+		std::ofstream file(csvArg.getValue().c_str(), std::ios::trunc);
+		file << csv.str();
+		if (!file)
+			LOG(WARNING) << "Could not write '" << csvArg.getValue() << "'.";
+	}
+
+	if (!jsonArg.getValue().empty())
+	{
+		Json::Value root;
+		root["Magnitude"] = magnitudeArg.getValue();
+		root["Repeats"] = repeats;
+		root["Wraparound"] = !noWrapArg.getValue();
+		root["Resolution"] = resolutionArg.getValue();
+		root["Results"] = results;
+
+		std::ofstream file(jsonArg.getValue().c_str(), std::ios::trunc);
+		file << root;
+		if (!file)
+			LOG(WARNING) << "Could not write '" << jsonArg.getValue() << "'.";
+	}
+
+	return 0;
+}
@@ -4,6 +4,7 @@
 
 #include "Utils/DepthIO.hpp"
 #include "Utils/Logger.hpp"
+#include "Utils/Timer.hpp"
 #include "Utils/Utils.hpp"
 #include "Utils/cvutils.hpp"
 
@@ -252,11 +253,27 @@ int main(int argc, char* argv[])
 		// Open the CSV log file to write our statistics to.
 		std::ofstream csvFile;
 		csvFile.open(output_path + "/_run.csv", std::fstream::out);
-		csvFile << "Run,MeshResolution,Mode,Noise,Outliers,RobustDataLoss,RobustLossScale,DataWeight,SmoothnessWeight,PriorWeight,Count,RMSE,RMSE2,RMSE_STDEV,MAE,MAE2,MAE_STDEV\n";
+		csvFile << "Run,MeshResolution,Mode,DataTerm,PyramidLevels,AdaptiveMesh,Noise,Outliers,RobustDataLoss,RobustLossScale,DataWeight,SmoothnessWeight,PriorWeight,Count,RMSE,RMSE2,RMSE_STDEV,MAE,MAE2,MAE_STDEV,Iterations,Seconds,Unknowns,Faces\n";
 
 		// Settings for various comparisons.
 		int repeats = 10;
-		std::vector<bool> depth_vs_disp { false, true };
+		struct Configuration
+		{
+			bool compute_in_disparity_space;
+			bool aggregate_data_term; // per-point vs per-triangle (IRLS) data term
+			int pyramid_levels;       // 1 = no coarse-to-fine initialisation
+			bool adaptive_mesh;       // uses the sparse Cholesky backend
+		};
+		std::vector<Configuration> configurations {
+			{ false, false, 1, false },
+			{ true, false, 1, false },
+			{ false, true, 1, false },
+			{ true, true, 1, false },
+			{ false, true, 3, false },
+			{ true, true, 3, false },
+			{ false, true, 3, true },
+			{ true, true, 3, true }
+		};
 		std::vector<int> mesh_resolutions { 80 /*16, 24, 32, 40, 50, 60, 72, 80, 100, 120, 150, 180*/ };
 		std::vector<double> noise_levels { 2 /*0, 1, 2, 5, 10, 20*/ };
 		std::vector<double> outlier_levels { 800 /*0, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000*/ };
@@ -280,8 +297,13 @@ int main(int argc, char* argv[])
 		int run = 0;
 		for (int mesh_resolution : mesh_resolutions)
 		{
-			for (bool compute_in_disparity_space : depth_vs_disp)
+			for (const Configuration& configuration : configurations)
 			{
+				const bool compute_in_disparity_space = configuration.compute_in_disparity_space;
+				const bool aggregate_data_term = configuration.aggregate_data_term;
+				const int pyramid_levels = configuration.pyramid_levels;
+				const bool adaptive_mesh = configuration.adaptive_mesh;
+
 				for (double noise_level : noise_levels)
 				{
 					for (double outlier_level : outlier_levels)
@@ -299,33 +321,41 @@ int main(int argc, char* argv[])
 										double total_rmse_squared = 0;
 										double total_mae = 0;
 										double total_mae_squared = 0;
+										double total_iterations = 0; // over all repeats, including broken solutions
+										double total_seconds = 0;
+										double total_unknowns = 0;
+										double total_faces = 0;
 
-										// clang-format off
-									#pragma omp parallel for reduction(+ : total_count, total_rmse, total_rmse_squared, total_mae, total_mae_squared)
-										// clang-format on
+										// Generate the noisy points and outliers up front, so every configuration is evaluated on the same inputs.
+										std::vector<std::vector<Eigen::Vector3f>> noisy_points(repeats);
 										for (int repeat = 0; repeat < repeats; repeat++)
 										{
-#ifdef _OPENMP
-											// Set a different random seed for every OpenMP thread, otherwise they all use the same random numbers.
-											srand(int(time(NULL)) ^ omp_get_thread_num());
-#endif // _OPENMP
-
-											SphereFitting fit(mesh_resolution, 2 * mesh_resolution);
+											srand(repeat + 1);
 
 											// Sample some random ground-truth points.
-											//fit.points = generateCubePoints(80000, 600); // 600 cm cube length = 3 m radius
-											//fit.points = generateDepthMapPoints(depth_map);
-											//fit.points = generateSpherePoints(2000, 300); // 3 m sphere radius
-											fit.points = depth_map_points; // GT depth map points
+											//noisy_points[repeat] = generateCubePoints(80000, 600); // 600 cm cube length = 3 m radius
+											//noisy_points[repeat] = generateDepthMapPoints(depth_map);
+											//noisy_points[repeat] = generateSpherePoints(2000, 300); // 3 m sphere radius
+											noisy_points[repeat] = depth_map_points; // GT depth map points
 
 											// Disturb the clean points.
-											addUniformNoiseToPoints(fit.points, noise_level);
-											//addRadialUniformNoiseToPoints(fit.points, 0.1f);
+											addUniformNoiseToPoints(noisy_points[repeat], noise_level);
+											//addRadialUniformNoiseToPoints(noisy_points[repeat], 0.1f);
 
 											// Add some random outlier points on top.
 											auto outliers = generateRandomPointsInCube(outlier_level, 1000); // 10 m cubed
 											//auto outliers = generateRandomPointsInSphere(outlier_level, 1000); // 10 m radius
-											fit.points.insert(fit.points.end(), outliers.begin(), outliers.end());
+											noisy_points[repeat].insert(noisy_points[repeat].end(), outliers.begin(), outliers.end());
+										}
+
+										// clang-format off
+									#pragma omp parallel for reduction(+ : total_count, total_rmse, total_rmse_squared, total_mae, total_mae_squared, total_iterations, total_seconds, total_unknowns, total_faces)
+										// clang-format on
+										for (int repeat = 0; repeat < repeats; repeat++)
+										{
+											SphereFitting fit(mesh_resolution, 2 * mesh_resolution);
+
+											fit.points = noisy_points[repeat];
 
 											// Convert points to disparity space.
 											if (compute_in_disparity_space)
@@ -340,8 +370,29 @@ int main(int argc, char* argv[])
 											fit.robust_data_loss_scale = robust_scale;
 											fit.smoothness_weight = smoothness_value;
 											fit.prior_weight = prior_value;
+											fit.aggregate_data_term = aggregate_data_term;
+											fit.pyramid_levels = pyramid_levels;
+											fit.adaptive_mesh = adaptive_mesh;
 
+											Timer timer;
+											timer.startTiming();
 											fit.solveProblem();
+											total_seconds += timer.getElapsedSeconds();
+											total_iterations += fit.solver_iterations;
+
+											// Size of the problem and of the exported mesh.
+											if (fit.mesh_cells.empty())
+											{
+												total_unknowns += fit.est_depth_map.size();
+												total_faces += 2 * (fit.est_depth_map.rows() - 1) * fit.est_depth_map.cols();
+											}
+											else
+											{
+												const Eigen::MatrixXi vertices = SphereFitting::getMeshVertices(fit.mesh_cells, fit.polar_steps, fit.azimuth_steps);
+												std::vector<int> centre_cells;
+												total_unknowns += vertices.maxCoeff() + 1;
+												total_faces += SphereFitting::triangulateAdaptiveMesh(fit.mesh_cells, vertices, centre_cells).size();
+											}
 
 											// Convert points and depth map back to depth from disparity.
 											if (compute_in_disparity_space)
@@ -356,6 +407,9 @@ int main(int argc, char* argv[])
 											stringstream suffix;
 											suffix << "-res" << mesh_resolution;
 											suffix << (compute_in_disparity_space ? "-disp" : "-depth");
+											suffix << (aggregate_data_term ? "-agg" : "-pts");
+											suffix << "-pyr" << pyramid_levels;
+											suffix << (adaptive_mesh ? "-adaptive" : "");
 											suffix << "-noise" << noise_level;
 											suffix << "-outliers" << outlier_level;
 											suffix << "-loss" << int(robust_loss);
@@ -366,7 +420,7 @@ int main(int argc, char* argv[])
 
 											//fit.exportSphereMesh(depth_map, basepath + "depth_map");
 											//fit.exportSphereMeshAndPoints(fit.est_depth_map, fit.points, basepath + "est_depth_map" + suffix.str(), 250, 500); // for syntheticd cube
-											fit.exportSphereMeshAndPoints(fit.est_depth_map, fit.points, output_path + "/est_depth_map" + suffix.str(), 50, 500); // for Replica depth map
+											fit.exportSphereMeshAndPoints(fit.est_depth_map, fit.points, output_path + "/est_depth_map" + suffix.str(), 50, 500, fit.mesh_cells); // for Replica depth map
 
 											// Export as result mesh + depth map.
 											//double error = computeReconstructionErrorCube(fit.est_depth_map, 600);
@@ -396,6 +450,9 @@ int main(int argc, char* argv[])
 										csvFile << run << ","
 										        << mesh_resolution << ","
 										        << (compute_in_disparity_space ? "disparity" : "depth") << ","
+										        << (aggregate_data_term ? "triangles" : "points") << ","
+										        << pyramid_levels << ","
+										        << adaptive_mesh << ","
 										        << noise_level << ","
 										        << outlier_level << ","
 										        << int(robust_loss) << ","
@@ -409,7 +466,11 @@ int main(int argc, char* argv[])
 										        << sqrt(total_rmse_squared / total_count - pow(total_rmse / total_count, 2)) << ","
 										        << total_mae / total_count << ","
 										        << total_mae_squared / total_count << ","
-										        << sqrt(total_mae_squared / total_count - pow(total_mae / total_count, 2)) << "\n";
+										        << sqrt(total_mae_squared / total_count - pow(total_mae / total_count, 2)) << ","
+										        << total_iterations / repeats << ","
+										        << total_seconds / repeats << ","
+										        << total_unknowns / repeats << ","
+										        << total_faces / repeats << "\n";
 										run++;
 									}
 								}
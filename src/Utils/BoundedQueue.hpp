@@ -0,0 +1,79 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+
+/**
+ * Thread-safe FIFO queue with a fixed capacity for producer/consumer pipelines.
+ *
+ * push() blocks while the queue is full, which throttles fast producers (back-pressure), and
+ * pop() blocks while the queue is empty. Once the queue is closed, push() fails and pop()
+ * returns the remaining items before it fails, too.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t _capacity) :
+	    capacity(_capacity > 0 ? _capacity : 1)
+	{
+	}
+
+	/** Appends an item, waiting for space if necessary. Returns false if the queue was closed. */
+	bool push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+		if (closed)
+			return false;
+
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	/** Removes the oldest item, waiting for one if necessary. Returns false once closed and drained. */
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty())
+			return false;
+
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	/** No more items will be pushed; wakes up all waiting threads. */
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+
+	/** Closes the queue and discards all remaining items, e.g. after an error. */
+	void abort()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		items.clear();
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+
+private:
+	const size_t capacity;
+	bool closed = false;
+
+	std::deque<T> items;
+	std::mutex mutex;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+};
@@ -0,0 +1,309 @@
+#include "FlowArchive.hpp"
+
+#include "3rdParty/fs_std.hpp"
+
+#include "Utils/FlowIO.hpp"
+#include "Utils/Logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_WIN64) || defined(_WIN32)
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+namespace
+{
+	const char MAGIC[8] = { 'F', 'L', 'O', 'W', 'P', 'A', 'C', 'K' };
+	const uint32_t VERSION = 1;
+	const uint32_t FIXED_POINT_SCALE = flossFixedPointScale;
+	const uint32_t ALIGNMENT = 4096;      // page size, so layers can be uploaded from mapped pages
+
+	static_assert(sizeof(FlowArchiveHeader) == 64, "FlowArchiveHeader must be 64 bytes");
+	static_assert(sizeof(FlowArchiveEntry) == 16, "FlowArchiveEntry must be 16 bytes");
+
+	inline uint64_t alignUp(uint64_t value, uint64_t alignment)
+	{
+		return ((value + alignment - 1) / alignment) * alignment;
+	}
+} // namespace
+
+
+//////////////////////
+// FlowArchiveWriter
+//////////////////////
+
+FlowArchiveWriter::FlowArchiveWriter(const std::string& _filename, int _numberOfLayers) :
+    filename(_filename),
+    tempFilename(_filename + ".tmp")
+{
+	index.assign(std::max(0, _numberOfLayers), FlowArchiveEntry { 0, 0 });
+	file.open(tempFilename, ios::in | ios::out | ios::binary | ios::trunc);
+	if (!file.is_open())
+		LOG(WARNING) << "Error in FlowArchiveWriter: could not open " << tempFilename << ".";
+}
+
+
+FlowArchiveWriter::~FlowArchiveWriter()
+{
+	// Not finished: discard the incomplete archive.
+	if (file.is_open())
+	{
+		file.close();
+		std::error_code ec;
+		fs::remove(tempFilename, ec);
+	}
+}
+
+
+bool FlowArchiveWriter::writeLayer(int layer, const cv::Mat2f& flow)
+{
+	// Same quantisation as writeFlossFile.
+	cv::Mat2s fixedPointFlow;
+	flow.convertTo(fixedPointFlow, CV_16S, FIXED_POINT_SCALE, 0.);
+	return writeLayer(layer, fixedPointFlow);
+}
+
+
+bool FlowArchiveWriter::writeLayer(int layer, const cv::Mat2s& fixedPointFlow)
+{
+	if (!file.is_open())
+		return false;
+
+	if (layer < 0 || layer >= (int)index.size())
+	{
+		LOG(WARNING) << "Error in FlowArchiveWriter(" << filename << "): layer " << layer << " out of range.";
+		return false;
+	}
+
+	// The first layer determines the size of all layers, and hence the payload offsets.
+	if (width == 0)
+	{
+		width = fixedPointFlow.cols;
+		height = fixedPointFlow.rows;
+		payloadStart = alignUp(sizeof(FlowArchiveHeader) + index.size() * sizeof(FlowArchiveEntry), ALIGNMENT);
+		payloadStride = alignUp((uint64_t)width * height * sizeof(cv::Vec2s), ALIGNMENT);
+	}
+
+	if (fixedPointFlow.cols != width || fixedPointFlow.rows != height)
+	{
+		LOG(WARNING) << "Error in FlowArchiveWriter(" << filename << "): layer " << layer << " is "
+		             << fixedPointFlow.cols << "x" << fixedPointFlow.rows << " instead of " << width << "x" << height << ".";
+		return false;
+	}
+
+	const uint64_t offset = payloadStart + (uint64_t)layer * payloadStride;
+	const size_t rowBytes = (size_t)width * sizeof(cv::Vec2s);
+
+	file.seekp((std::streamoff)offset);
+	for (int y = 0; y < height; y++)
+		file.write(fixedPointFlow.ptr<char>(y), rowBytes);
+
+	if (!file)
+	{
+		LOG(WARNING) << "Error in FlowArchiveWriter(" << filename << "): problem writing layer " << layer << ".";
+		return false;
+	}
+
+	index[layer].offset = offset;
+	index[layer].size = (uint64_t)height * rowBytes;
+	return true;
+}
+
+
+bool FlowArchiveWriter::finish()
+{
+	if (!file.is_open())
+		return false;
+
+	int missing = 0;
+	for (auto& entry : index)
+		if (entry.offset == 0)
+			missing++;
+	if (missing > 0)
+		LOG(WARNING) << "Flow archive " << filename << " is missing " << missing << " of " << index.size() << " layers.";
+
+	FlowArchiveHeader header = {};
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.numberOfLayers = (uint32_t)index.size();
+	header.width = (uint32_t)width;
+	header.height = (uint32_t)height;
+	header.fixedPointScale = FIXED_POINT_SCALE;
+	header.alignment = ALIGNMENT;
+	header.indexOffset = sizeof(FlowArchiveHeader);
+
+	file.seekp(0);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(FlowArchiveEntry));
+	const bool written = (bool)file;
+	file.close();
+
+	std::error_code ec;
+	if (written)
+		fs::rename(tempFilename, filename, ec);
+
+	if (!written || ec)
+	{
+		LOG(WARNING) << "Error in FlowArchiveWriter: could not write " << filename << ".";
+		fs::remove(tempFilename, ec);
+		return false;
+	}
+
+	return true;
+}
+
+
+//////////////////////
+// FlowArchive
+//////////////////////
+
+FlowArchive::~FlowArchive()
+{
+	close();
+}
+
+
+bool FlowArchive::open(const std::string& filename)
+{
+	close();
+
+#if defined(_WIN64) || defined(_WIN32)
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+	                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		LOG(WARNING) << "Error in FlowArchive: could not open " << filename << ".";
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!view)
+	{
+		LOG(WARNING) << "Error in FlowArchive: could not map " << filename << ".";
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	fileHandle = file;
+	mappingHandle = mapping;
+	data = static_cast<const unsigned char*>(view);
+	size = (size_t)fileSize.QuadPart;
+#else
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		LOG(WARNING) << "Error in FlowArchive: could not open " << filename << ".";
+		return false;
+	}
+
+	struct stat status;
+	void* view = MAP_FAILED;
+	if (fstat(fd, &status) == 0 && status.st_size > 0)
+		view = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd); // the mapping keeps the file open
+
+	if (view == MAP_FAILED)
+	{
+		LOG(WARNING) << "Error in FlowArchive: could not map " << filename << ".";
+		return false;
+	}
+
+	// All layers are read once, front to back.
+	madvise(view, (size_t)status.st_size, MADV_WILLNEED);
+
+	data = static_cast<const unsigned char*>(view);
+	size = (size_t)status.st_size;
+#endif
+
+	// Validate the header and index, so that layers can be accessed without further checks.
+	bool valid = size >= sizeof(FlowArchiveHeader);
+	if (valid)
+	{
+		memcpy(&header, data, sizeof(FlowArchiveHeader));
+		valid = memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && header.version == VERSION
+		        && header.fixedPointScale > 0 && header.indexOffset % alignof(FlowArchiveEntry) == 0
+		        && header.indexOffset + (uint64_t)header.numberOfLayers * sizeof(FlowArchiveEntry) <= size;
+	}
+
+	if (valid)
+	{
+		index = reinterpret_cast<const FlowArchiveEntry*>(data + header.indexOffset);
+		const uint64_t layerBytes = (uint64_t)header.width * header.height * sizeof(cv::Vec2s);
+		for (uint32_t i = 0; i < header.numberOfLayers && valid; i++)
+			valid = index[i].offset == 0 || (index[i].size == layerBytes && index[i].offset + index[i].size <= size);
+	}
+
+	if (!valid)
+	{
+		LOG(WARNING) << "Error in FlowArchive: " << filename << " is not a valid flow archive.";
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+
+void FlowArchive::close()
+{
+	if (data)
+	{
+#if defined(_WIN64) || defined(_WIN32)
+		UnmapViewOfFile(data);
+		CloseHandle(mappingHandle);
+		CloseHandle(fileHandle);
+		mappingHandle = nullptr;
+		fileHandle = nullptr;
+#else
+		munmap(const_cast<unsigned char*>(data), size);
+#endif
+	}
+
+	data = nullptr;
+	size = 0;
+	index = nullptr;
+	header = FlowArchiveHeader();
+}
+
+
+const int16_t* FlowArchive::getLayer(int layer) const
+{
+	if (!data || layer < 0 || layer >= getNumberOfLayers() || index[layer].offset == 0)
+		return nullptr;
+
+	return reinterpret_cast<const int16_t*>(data + index[layer].offset);
+}
+
+
+cv::Mat2f FlowArchive::getFlow(int layer) const
+{
+	const int16_t* payload = getLayer(layer);
+	if (!payload)
+		return cv::Mat2f();
+
+	// Wraps the mapped memory without copying.
+	const cv::Mat2s fixedPointFlow(getHeight(), getWidth(), reinterpret_cast<cv::Vec2s*>(const_cast<int16_t*>(payload)));
+
+	cv::Mat2f flow;
+	fixedPointFlow.convertTo(flow, CV_32F, 1. / getFixedPointScale(), 0.);
+	return flow;
+}
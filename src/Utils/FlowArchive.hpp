@@ -0,0 +1,132 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+/**
+ * Packed flow archive (.flowpack): all flow fields of a dataset in a single file.
+ *
+ * Layout (little-endian):
+ *   - FlowArchiveHeader (64 bytes),
+ *   - index of 'numberOfLayers' FlowArchiveEntry records,
+ *   - one payload per layer, each starting at a multiple of 'alignment' bytes.
+ *
+ * Payloads use the same 16-bit fixed-point encoding as .floss files: interleaved (x, y) pairs
+ * of int16 in row-major order, with flow = value / fixedPointScale. As payloads are page-aligned,
+ * a memory-mapped archive can be uploaded to the GPU straight from the mapped pages.
+ *
+ * For a camera ring, layer 2i holds the flow from camera i to camera i+1, and layer 2i+1 the flow
+ * from camera i+1 back to camera i (see getForwardLayer/getBackwardLayer).
+ */
+struct FlowArchiveHeader
+{
+	char magic[8];               // "FLOWPACK"
+	uint32_t version;            // currently 1
+	uint32_t numberOfLayers;
+	uint32_t width;
+	uint32_t height;
+	uint32_t fixedPointScale;    // 8, i.e. 1/8 pixel precision
+	uint32_t alignment;          // of payload offsets, in bytes
+	uint64_t indexOffset;
+	uint8_t reserved[24];
+};
+
+
+/** Location of a layer's payload in the archive; offset 0 marks a missing layer. */
+struct FlowArchiveEntry
+{
+	uint64_t offset;
+	uint64_t size;
+};
+
+
+/**
+ * Writes a flow archive layer by layer, in any order.
+ *
+ * All layers must have the same size. The archive is written to a temporary file, which only
+ * replaces the target file when finish() succeeds.
+ */
+class FlowArchiveWriter
+{
+public:
+	FlowArchiveWriter(const std::string& _filename, int _numberOfLayers);
+	~FlowArchiveWriter();
+
+	/** Quantises the flow to 16-bit fixed point and stores it as the given layer. */
+	bool writeLayer(int layer, const cv::Mat2f& flow);
+
+	/** Stores flow that is already in 16-bit fixed point (e.g. read from a .floss file). */
+	bool writeLayer(int layer, const cv::Mat2s& fixedPointFlow);
+
+	/** Writes the header and index, and moves the archive into place. */
+	bool finish();
+
+	inline const std::string& getFilename() const { return filename; }
+
+private:
+	std::string filename;
+	std::string tempFilename;
+	std::fstream file;
+
+	int width = 0;
+	int height = 0;
+	uint64_t payloadStart = 0;
+	uint64_t payloadStride = 0;
+	std::vector<FlowArchiveEntry> index;
+};
+
+
+/**
+ * Read-only, memory-mapped view of a flow archive.
+ *
+ * Layers are accessed in place, without copying them out of the mapped pages.
+ */
+class FlowArchive
+{
+public:
+	FlowArchive() = default;
+	~FlowArchive();
+
+	FlowArchive(const FlowArchive&) = delete;
+	FlowArchive& operator=(const FlowArchive&) = delete;
+
+	/** Maps the archive into memory and validates its header and index. */
+	bool open(const std::string& filename);
+	void close();
+
+	inline bool isOpen() const { return data != nullptr; }
+
+	inline int getNumberOfLayers() const { return (int)header.numberOfLayers; }
+	inline int getWidth() const { return (int)header.width; }
+	inline int getHeight() const { return (int)header.height; }
+	inline int getFixedPointScale() const { return (int)header.fixedPointScale; }
+
+	/** Fixed-point flow of a layer in the mapped memory, or nullptr if the layer is missing. */
+	const int16_t* getLayer(int layer) const;
+
+	/** Decodes a layer into a floating-point flow field (in pixels). */
+	cv::Mat2f getFlow(int layer) const;
+
+	/** Layer of the flow from camera i to camera i+1 of a ring. */
+	static inline int getForwardLayer(int camera, int numberOfCameras) { return 2 * (camera % numberOfCameras); }
+
+	/** Layer of the flow from camera i to camera i-1 of a ring. */
+	static inline int getBackwardLayer(int camera, int numberOfCameras) { return 2 * ((camera + numberOfCameras - 1) % numberOfCameras) + 1; }
+
+private:
+	FlowArchiveHeader header = {};
+	const FlowArchiveEntry* index = nullptr;
+
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+
+#if defined(_WIN64) || defined(_WIN32)
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#endif
+};
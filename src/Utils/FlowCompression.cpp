@@ -0,0 +1,333 @@
+#include "FlowCompression.hpp"
+
+#include "Utils/Logger.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+
+using namespace std;
+
+
+namespace
+{
+	const char MAGIC[4] = { 'F', 'L', 'Z', '1' };
+	const size_t HEADER_SIZE = 4 + 3 * sizeof(int32_t);
+
+	// Residuals are zigzag-mapped to unsigned values of at most 17 bits.
+	const int RAW_BITS = 17;
+
+	// Unary prefixes of this length signal a raw residual, which bounds the length of each code.
+	const int ESCAPE_LENGTH = 24;
+
+	// The adaptive statistics are halved regularly, so that they follow local changes.
+	const int RESET_COUNT = 64;
+
+
+	// Adaptive Golomb-Rice parameter estimation as in LOCO-I, one per flow component.
+	struct RiceContext
+	{
+		uint32_t sum = 4;
+		uint32_t count = 1;
+
+		inline int getParameter() const
+		{
+			int k = 0;
+			while ((count << k) < sum && k < RAW_BITS)
+				k++;
+			return k;
+		}
+
+		inline void update(uint32_t value)
+		{
+			sum += value;
+			if (++count >= RESET_COUNT)
+			{
+				sum >>= 1;
+				count >>= 1;
+			}
+		}
+	};
+
+
+	class BitWriter
+	{
+	public:
+		explicit BitWriter(std::vector<unsigned char>& _out) :
+		    out(_out) {}
+
+		// Appends the 'n' (<= 32) lowest bits of 'value', most significant bit first.
+		inline void put(uint32_t value, int n)
+		{
+			buffer = (buffer << n) | (value & (uint32_t)((1ULL << n) - 1));
+			bits += n;
+			while (bits >= 8)
+			{
+				bits -= 8;
+				out.push_back((unsigned char)(buffer >> bits));
+			}
+		}
+
+		inline void putOnes(int n)
+		{
+			for (; n > 0; n -= 16)
+				put(0xFFFF, std::min(n, 16));
+		}
+
+		inline void flush()
+		{
+			if (bits > 0)
+				out.push_back((unsigned char)(buffer << (8 - bits)));
+			bits = 0;
+		}
+
+	private:
+		std::vector<unsigned char>& out;
+		uint64_t buffer = 0;
+		int bits = 0;
+	};
+
+
+	class BitReader
+	{
+	public:
+		BitReader(const unsigned char* _data, size_t size) :
+		    data(_data), end(_data + size), available((uint64_t)size * 8) {}
+
+		// Reads 'n' (<= 32) bits.
+		inline uint32_t get(int n)
+		{
+			if (n == 0)
+				return 0;
+			refill();
+			uint32_t value = (uint32_t)(buffer >> (64 - n));
+			buffer <<= n;
+			bits -= n;
+			consumed += n;
+			return value;
+		}
+
+		// Counts (and consumes) up to 'limit' (<= 56) leading one bits.
+		inline int countOnes(int limit)
+		{
+			refill();
+			int n = 0;
+			while (n < limit && (buffer >> 63))
+			{
+				buffer <<= 1;
+				n++;
+			}
+			bits -= n;
+			consumed += n;
+			return n;
+		}
+
+		// True if more bits were consumed than the stream contains.
+		inline bool overrun() const { return consumed > available; }
+
+	private:
+		// Keeps at least 57 bits in the buffer; reading past the end yields zeros.
+		inline void refill()
+		{
+			while (bits <= 56)
+			{
+				uint64_t byte = (data < end) ? *data++ : 0;
+				buffer |= byte << (56 - bits);
+				bits += 8;
+			}
+		}
+
+		const unsigned char* data;
+		const unsigned char* end;
+		uint64_t buffer = 0;
+		int bits = 0;
+		uint64_t consumed = 0;
+		uint64_t available;
+	};
+
+
+	// Median edge detector (LOCO-I): a = left, b = above, c = upper-left.
+	inline int predict(int a, int b, int c)
+	{
+		if (c >= std::max(a, b))
+			return std::min(a, b);
+		if (c <= std::min(a, b))
+			return std::max(a, b);
+		return a + b - c;
+	}
+
+
+	// Calls 'code(value, prediction, context)' for all values of rows [y0, y1) in coding order.
+	// Pixels outside the band are never used, so that bands can be coded independently.
+	template <typename Row, typename Code>
+	inline void traverseBand(Row getRow, int width, int y0, int y1, Code code)
+	{
+		RiceContext contexts[2];
+		for (int y = y0; y < y1; y++)
+		{
+			short* row = getRow(y);
+			const short* above = (y > y0) ? getRow(y - 1) : nullptr;
+			for (int x = 0; x < 2 * width; x++)
+			{
+				const int c = x & 1;
+				const int left = (x >= 2) ? row[x - 2] : (above ? above[x] : 0);
+				const int up = above ? above[x] : left;
+				const int upLeft = (above && x >= 2) ? above[x - 2] : up;
+				code(row[x], predict(left, up, upLeft), contexts[c]);
+			}
+		}
+	}
+
+
+	void compressBand(const cv::Mat2s& flow, int y0, int y1, std::vector<unsigned char>& out)
+	{
+		BitWriter writer(out);
+		auto getRow = [&](int y) -> short* { return const_cast<short*>(flow.ptr<short>(y)); };
+
+		traverseBand(getRow, flow.cols, y0, y1, [&](short& value, int prediction, RiceContext& context) {
+			const int32_t residual = value - prediction;
+			const uint32_t mapped = ((uint32_t)residual << 1) ^ (uint32_t)(residual >> 31); // zigzag
+			const int k = context.getParameter();
+			const uint32_t quotient = mapped >> k;
+
+			if (quotient < (uint32_t)ESCAPE_LENGTH)
+			{
+				writer.putOnes((int)quotient);
+				writer.put(0, 1);
+				writer.put(mapped, k);
+			}
+			else
+			{
+				writer.putOnes(ESCAPE_LENGTH);
+				writer.put(mapped, RAW_BITS);
+			}
+
+			context.update(mapped);
+		});
+
+		writer.flush();
+	}
+
+
+	bool decompressBand(cv::Mat2s& flow, int y0, int y1, const unsigned char* data, size_t size)
+	{
+		BitReader reader(data, size);
+		auto getRow = [&](int y) -> short* { return flow.ptr<short>(y); };
+
+		traverseBand(getRow, flow.cols, y0, y1, [&](short& value, int prediction, RiceContext& context) {
+			const int k = context.getParameter();
+			const int quotient = reader.countOnes(ESCAPE_LENGTH);
+
+			uint32_t mapped;
+			if (quotient < ESCAPE_LENGTH)
+			{
+				reader.get(1);
+				mapped = ((uint32_t)quotient << k) | reader.get(k);
+			}
+			else
+			{
+				mapped = reader.get(RAW_BITS);
+			}
+
+			const int32_t residual = (int32_t)(mapped >> 1) ^ -(int32_t)(mapped & 1);
+			value = (short)(prediction + residual);
+			context.update(mapped);
+		});
+
+		return !reader.overrun();
+	}
+
+
+	inline void appendInt(std::vector<unsigned char>& out, uint32_t value)
+	{
+		for (int i = 0; i < 4; i++)
+			out.push_back((unsigned char)(value >> (8 * i)));
+	}
+
+
+	inline uint32_t readInt(const unsigned char* data)
+	{
+		return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+	}
+} // namespace
+
+
+std::vector<unsigned char> compressFlow(const cv::Mat2s& flow, int bandHeight)
+{
+	bandHeight = std::max(1, bandHeight);
+	const int numberOfBands = (flow.rows + bandHeight - 1) / bandHeight;
+
+	std::vector<std::vector<unsigned char>> bands(numberOfBands);
+	cv::parallel_for_(cv::Range(0, numberOfBands), [&](const cv::Range& range) {
+		for (int b = range.start; b < range.end; b++)
+		{
+			// Smooth flow typically needs fewer than 4 bits per value.
+			bands[b].reserve((size_t)bandHeight * flow.cols);
+			compressBand(flow, b * bandHeight, std::min(flow.rows, (b + 1) * bandHeight), bands[b]);
+		}
+	});
+
+	std::vector<unsigned char> out(MAGIC, MAGIC + 4);
+	appendInt(out, (uint32_t)flow.cols);
+	appendInt(out, (uint32_t)flow.rows);
+	appendInt(out, (uint32_t)bandHeight);
+	for (auto& band : bands)
+		appendInt(out, (uint32_t)band.size());
+	for (auto& band : bands)
+		out.insert(out.end(), band.begin(), band.end());
+
+	return out;
+}
+
+
+cv::Mat2s decompressFlow(const unsigned char* data, size_t size)
+{
+	if (size < HEADER_SIZE || memcmp(data, MAGIC, 4) != 0)
+	{
+		LOG(WARNING) << "Error in decompressFlow: not a compressed flow field.";
+		return cv::Mat2s();
+	}
+
+	const int width = (int)readInt(data + 4);
+	const int height = (int)readInt(data + 8);
+	const int bandHeight = (int)readInt(data + 12);
+	if (width < 1 || width > 99999 || height < 1 || height > 99999 || bandHeight < 1)
+	{
+		LOG(WARNING) << "Error in decompressFlow: illegal size " << width << "x" << height << " (band height " << bandHeight << ").";
+		return cv::Mat2s();
+	}
+
+	// Locate all bands before decoding them in parallel.
+	const int numberOfBands = (height + bandHeight - 1) / bandHeight;
+	std::vector<size_t> offsets(numberOfBands + 1);
+	offsets[0] = HEADER_SIZE + 4 * (size_t)numberOfBands;
+	if (offsets[0] > size)
+	{
+		LOG(WARNING) << "Error in decompressFlow: stream is too short.";
+		return cv::Mat2s();
+	}
+	for (int b = 0; b < numberOfBands; b++)
+		offsets[b + 1] = offsets[b] + readInt(data + HEADER_SIZE + 4 * b);
+	if (offsets[numberOfBands] != size)
+	{
+		LOG(WARNING) << "Error in decompressFlow: stream size does not match its band sizes.";
+		return cv::Mat2s();
+	}
+
+	cv::Mat2s flow(height, width);
+	std::vector<unsigned char> valid(numberOfBands, 0);
+	cv::parallel_for_(cv::Range(0, numberOfBands), [&](const cv::Range& range) {
+		for (int b = range.start; b < range.end; b++)
+			valid[b] = decompressBand(flow, b * bandHeight, std::min(height, (b + 1) * bandHeight),
+			                          data + offsets[b], offsets[b + 1] - offsets[b]);
+	});
+
+	if (std::find(valid.begin(), valid.end(), 0) != valid.end())
+	{
+		LOG(WARNING) << "Error in decompressFlow: corrupted stream.";
+		return cv::Mat2s();
+	}
+
+	return flow;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+#include <cstddef>
+#include <vector>
+
+
+/**
+ * Lossless compression of 16-bit fixed-point flow fields (as stored in .floss files).
+ *
+ * Each flow component is predicted from its left, upper and upper-left neighbours with the median
+ * edge detector of LOCO-I/JPEG-LS, and the prediction residuals are coded with adaptive
+ * Golomb-Rice codes. Smooth flow fields leave mostly tiny residuals, which take only a few bits.
+ *
+ * The rows are split into bands that are coded independently (each band only predicts from its
+ * own rows), so bands are compressed and decompressed in parallel.
+ *
+ * Stream layout (little-endian):
+ *   "FLZ1", int32 width, int32 height, int32 bandHeight,
+ *   uint32 compressed size of each band,
+ *   compressed bands.
+ */
+
+/** Compresses a 16-bit fixed-point flow field. */
+std::vector<unsigned char> compressFlow(const cv::Mat2s& flow, int bandHeight = 32);
+
+/** Decompresses a stream written by compressFlow. Returns an empty matrix if the stream is invalid. */
+cv::Mat2s decompressFlow(const unsigned char* data, size_t size);
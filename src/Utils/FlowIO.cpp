@@ -1,6 +1,10 @@
 #include "FlowIO.hpp"
+#include "FlowCompression.hpp"
 #include "IOTools.hpp"
 
+#include <fstream>
+#include <iterator>
+
 
 // Reads a .flo file (Middlebury format) into an OpenCV matrix.
 cv::Mat2f readFloFile(const char* filename)
@@ -153,19 +157,19 @@ void writeFloFile(std::string filename, cv::Mat2f img)
 //
 // Note that float16 (IEEE 754-2008) would only have a precision of a half pixel in [512, 1024],
 // and only a full pixel in [1024, 2048].
-cv::Mat2f readFlossFile(const std::string filename)
+cv::Mat2s readFlossFileFixedPoint(const std::string filename)
 {
 	if (filename.empty())
 	{
-		LOG(WARNING) << "Error in readFlossFile: empty filename.";
-		return cv::Mat2f();
+		LOG(WARNING) << "Error in readFlossFileFixedPoint: empty filename.";
+		return cv::Mat2s();
 	}
 
 	FILE* stream = fopen(filename.c_str(), "rb");
 	if (stream == nullptr)
 	{
-		LOG(WARNING) << "Error in readFlossFile: could not open " << filename << ".";
-		return cv::Mat2f();
+		LOG(WARNING) << "Error in readFlossFileFixedPoint: could not open " << filename << ".";
+		return cv::Mat2s();
 	}
 
 	int width, height;
@@ -175,47 +179,58 @@ cv::Mat2f readFlossFile(const std::string filename)
 	    || fread(&width, sizeof(int), 1, stream) != 1u
 	    || fread(&height, sizeof(int), 1, stream) != 1u)
 	{
-		LOG(WARNING) << "Error in readFlossFile: problem reading file " << filename << ".";
-		return cv::Mat2f();
+		LOG(WARNING) << "Error in readFlossFileFixedPoint: problem reading file " << filename << ".";
+		return cv::Mat2s();
 	}
 
 	if (strcmp(tag, "SHRT") != 0) // simple test for correct endian-ness
 	{
-		LOG(WARNING) << "Error in readFlossFile(" << filename << "): wrong tag (possibly due to big-endian machine?).";
-		return cv::Mat2f();
+		LOG(WARNING) << "Error in readFlossFileFixedPoint(" << filename << "): wrong tag (possibly due to big-endian machine?).";
+		return cv::Mat2s();
 	}
 
 	// another sanity check to see that integers were read correctly (99999 should do the trick...)
 	if (width < 1 || width > 99999)
 	{
-		LOG(WARNING) << "Error in readFlossFile(" << filename << "): illegal width " << width << ".";
-		return cv::Mat2f();
+		LOG(WARNING) << "Error in readFlossFileFixedPoint(" << filename << "): illegal width " << width << ".";
+		return cv::Mat2s();
 	}
 
 	if (height < 1 || height > 99999)
 	{
-		LOG(WARNING) << "Error in readFlossFile(" << filename << "): illegal height " << height << ".";
-		return cv::Mat2f();
+		LOG(WARNING) << "Error in readFlossFileFixedPoint(" << filename << "): illegal height " << height << ".";
+		return cv::Mat2s();
 	}
 
 	cv::Mat2s shortFlow(height, width);
 	const size_t pixels = (size_t)width * (size_t)height;
 	if (fread(shortFlow.data, 2 * sizeof(short), pixels, stream) != pixels)
 	{
-		LOG(WARNING) << "Error in readFlossFile(" << filename << "): file is too short.";
-		return cv::Mat2f();
+		LOG(WARNING) << "Error in readFlossFileFixedPoint(" << filename << "): file is too short.";
+		return cv::Mat2s();
 	}
 
 	if (fgetc(stream) != EOF)
 	{
-		LOG(WARNING) << "Error in readFlossFile(" << filename << "): file is too long.";
-		return cv::Mat2f();
+		LOG(WARNING) << "Error in readFlossFileFixedPoint(" << filename << "): file is too long.";
+		return cv::Mat2s();
 	}
 
 	fclose(stream);
 
+	return shortFlow;
+}
+
+
+// Reads a .floss file (16-bit fixed-point format) into an OpenCV matrix.
+cv::Mat2f readFlossFile(const std::string filename)
+{
+	cv::Mat2s shortFlow = readFlossFileFixedPoint(filename);
+	if (shortFlow.empty())
+		return cv::Mat2f();
+
 	cv::Mat2f flow;
-	shortFlow.convertTo(flow, CV_32F, 1. / 8., 0.);
+	shortFlow.convertTo(flow, CV_32F, 1. / flossFixedPointScale, 0.);
 
 	return flow;
 }
@@ -264,7 +279,7 @@ bool writeFlossFile(const std::string filename, cv::Mat2f flow)
 
 	// Convert single-precision floating-point flow field to signed short (16-bit) fixed-point flow.
 	cv::Mat2s shortFlow;
-	flow.convertTo(shortFlow, CV_16S, 8., 0.);
+	flow.convertTo(shortFlow, CV_16S, flossFixedPointScale, 0.);
 
 	// write the rows
 	const size_t n = (size_t)nBands * (size_t)width;
@@ -282,6 +297,98 @@ bool writeFlossFile(const std::string filename, cv::Mat2f flow)
 }
 
 
+// Reads a .flz file without converting it to floating point (see flossFixedPointScale).
+cv::Mat2s readFlzFileFixedPoint(const std::string filename)
+{
+	if (filename.empty())
+	{
+		LOG(WARNING) << "Error in readFlzFileFixedPoint: empty filename.";
+		return cv::Mat2s();
+	}
+
+	std::ifstream stream(filename, std::ios::binary);
+	if (!stream.is_open())
+	{
+		LOG(WARNING) << "Error in readFlzFileFixedPoint: could not open " << filename << ".";
+		return cv::Mat2s();
+	}
+
+	std::vector<unsigned char> data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+	cv::Mat2s shortFlow = decompressFlow(data.data(), data.size());
+	if (shortFlow.empty())
+		LOG(WARNING) << "Error in readFlzFileFixedPoint(" << filename << "): invalid file.";
+
+	return shortFlow;
+}
+
+
+// Reads a .flz file (losslessly compressed .floss, see FlowCompression.hpp) into an OpenCV matrix.
+cv::Mat2f readFlzFile(const std::string filename)
+{
+	cv::Mat2s shortFlow = readFlzFileFixedPoint(filename);
+	if (shortFlow.empty())
+		return cv::Mat2f();
+
+	cv::Mat2f flow;
+	shortFlow.convertTo(flow, CV_32F, 1. / flossFixedPointScale, 0.);
+
+	return flow;
+}
+
+
+// Writes a flow field to a .flz file (16-bit fixed point like .floss, but losslessly compressed).
+bool writeFlzFile(const std::string filename, cv::Mat2f flow)
+{
+	if (filename.empty())
+	{
+		LOG(WARNING) << "Error in writeFlzFile: empty filename.";
+		return false;
+	}
+
+	if (flow.channels() != 2)
+	{
+		LOG(WARNING) << "Error in writeFlzFile(" << filename << "): image must have 2 bands.";
+		return false;
+	}
+
+	// Same quantisation as writeFlossFile.
+	cv::Mat2s shortFlow;
+	flow.convertTo(shortFlow, CV_16S, flossFixedPointScale, 0.);
+
+	std::vector<unsigned char> data = compressFlow(shortFlow);
+
+	std::ofstream stream(filename, std::ios::binary | std::ios::trunc);
+	if (!stream.write(reinterpret_cast<const char*>(data.data()), data.size()))
+	{
+		LOG(WARNING) << "Error in writeFlzFile: could not write " << filename << ".";
+		return false;
+	}
+
+	return true;
+}
+
+
+// Reads a 16-bit fixed-point flow file (.floss or .flz) without converting it to floating point.
+cv::Mat2s readFixedPointFlowFile(const std::string filename)
+{
+	std::string extension = getFileExtension(filename);
+	if (extension == ".floss") return readFlossFileFixedPoint(filename);
+	if (extension == ".flz")   return readFlzFileFixedPoint(filename);
+
+	LOG(WARNING) << "Error in readFixedPointFlowFile: extension \'" << extension << "\' is not a fixed-point format";
+	return cv::Mat2s();
+}
+
+
+// Checks whether a flow file stores 16-bit fixed-point flow (.floss or .flz).
+bool isFixedPointFlowFile(const std::string filename)
+{
+	std::string extension = getFileExtension(filename);
+	return extension == ".floss" || extension == ".flz";
+}
+
+
 // Reads a .F file (Barron format) into an OpenCV matrix.
 cv::Mat2f readBarronFile(const char* filename)
 {
@@ -435,6 +542,7 @@ cv::Mat2f readFlowFile(const std::string filename)
 	// Use extension to pick reading function.
 	if (extension == ".flo")   return readFloFile(filename);
 	if (extension == ".floss") return readFlossFile(filename);
+	if (extension == ".flz")   return readFlzFile(filename);
 	if (extension == ".F")     return readBarronFile(filename);
 
 	LOG(WARNING) << "Error in readFlowFile: extension \'" << extension << "\' not supported";
@@ -455,6 +563,7 @@ void writeFlowFile(const std::string filename, cv::Mat2f flow)
 	// Use extension to pick reading function.
 	if      (extension == ".flo")   writeFloFile(filename, flow);
 	else if (extension == ".floss") writeFlossFile(filename, flow);
+	else if (extension == ".flz")   writeFlzFile(filename, flow);
 	else if (extension == ".F")     writeBarronFile(filename, flow);
 	else LOG(ERROR) << "Error in writeFlowFile: extension \'" << extension << "\' not supported.";
 }
@@ -17,9 +17,35 @@ void writeFloFile(const char* filename, cv::Mat2f img);
 void writeFloFile(std::string filename, cv::Mat2f img);
 
 
+// Fixed-point scale of .floss files, i.e. flow [pixels] = value / flossFixedPointScale.
+const int flossFixedPointScale = 8;
+
 // Reads a .floss file (16-bit fixed-point format) into an OpenCV matrix.
 cv::Mat2f readFlossFile(const std::string filename);
 
+// Reads a .floss file without converting it to floating point (see flossFixedPointScale).
+cv::Mat2s readFlossFileFixedPoint(const std::string filename);
+
+// Factor that converts fixed-point flow in a GL_RG16_SNORM texture (which OpenGL normalises
+// to [-1, 1] by dividing by 32767) back to pixels.
+inline float getSnormFlowScale(int fixedPointScale = flossFixedPointScale) { return 32767.f / fixedPointScale; }
+
+
+// Reads a .flz file (losslessly compressed .floss, see FlowCompression.hpp) into an OpenCV matrix.
+cv::Mat2f readFlzFile(const std::string filename);
+
+// Reads a .flz file without converting it to floating point (see flossFixedPointScale).
+cv::Mat2s readFlzFileFixedPoint(const std::string filename);
+
+// Writes a flow field to a .flz file (16-bit fixed point like .floss, but losslessly compressed).
+bool writeFlzFile(const std::string filename, cv::Mat2f flow);
+
+// Reads a 16-bit fixed-point flow file (.floss or .flz) without converting it to floating point.
+cv::Mat2s readFixedPointFlowFile(const std::string filename);
+
+// Checks whether a flow file stores 16-bit fixed-point flow (.floss or .flz).
+bool isFixedPointFlowFile(const std::string filename);
+
 // Writes a flow field to a .floss file (16-bit fixed-point format).
 bool writeFlossFile(const std::string filename, cv::Mat2f flow);
 
@@ -0,0 +1,66 @@
+#include "MemoryUsage.hpp"
+
+#include <iomanip>
+#include <sstream>
+
+#if defined(_WIN64) || defined(_WIN32)
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+	#include <psapi.h>
+#else
+	#include <sys/resource.h>
+	#include <unistd.h>
+
+	#include <fstream>
+#endif
+
+
+using namespace std;
+
+
+size_t getPeakMemoryUsage()
+{
+#if defined(_WIN64) || defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return (size_t)counters.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss; // bytes
+	#else
+	return (size_t)usage.ru_maxrss * 1024; // kilobytes
+	#endif
+#endif
+}
+
+
+size_t getCurrentMemoryUsage()
+{
+#if defined(_WIN64) || defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return (size_t)counters.WorkingSetSize;
+	return 0;
+#else
+	// Second entry of /proc/self/statm: resident set size in pages (Linux only).
+	size_t totalPages = 0, residentPages = 0;
+	std::ifstream statm("/proc/self/statm");
+	if (!(statm >> totalPages >> residentPages))
+		return 0;
+	return residentPages * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+
+std::string formatMemorySize(size_t bytes)
+{
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(1) << bytes / (1024. * 1024.) << " MB";
+	return ss.str();
+}
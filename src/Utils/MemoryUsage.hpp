@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+
+/** Peak resident memory (working set) of this process so far, in bytes; 0 if unknown. */
+size_t getPeakMemoryUsage();
+
+/** Current resident memory (working set) of this process, in bytes; 0 if unknown. */
+size_t getCurrentMemoryUsage();
+
+/** Formats a number of bytes for log messages, e.g. "1234.5 MB". */
+std::string formatMemorySize(size_t bytes);
@@ -0,0 +1,108 @@
+#include "ResourceUsage.hpp"
+
+#include "MemoryUsage.hpp"
+
+#include <chrono>
+
+#if defined(_WIN64) || defined(_WIN32)
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <sys/resource.h>
+	#include <time.h>
+
+	#include <fstream>
+	#include <string>
+#endif
+
+
+using namespace std;
+
+
+namespace
+{
+#if defined(_WIN64) || defined(_WIN32)
+	// FILETIME durations are in units of 100ns.
+	double toSeconds(const FILETIME& time)
+	{
+		ULARGE_INTEGER ticks;
+		ticks.LowPart = time.dwLowDateTime;
+		ticks.HighPart = time.dwHighDateTime;
+		return ticks.QuadPart * 1e-7;
+	}
+#else
+	double toSeconds(const timeval& time)
+	{
+		return time.tv_sec + time.tv_usec * 1e-6;
+	}
+#endif
+} // namespace
+
+
+ResourceUsage ResourceUsage::current()
+{
+	ResourceUsage usage;
+	usage.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	usage.peakMemory = getPeakMemoryUsage();
+
+#if defined(_WIN64) || defined(_WIN32)
+	FILETIME creation, exit, kernel, user;
+	if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		usage.cpuSeconds = toSeconds(kernel) + toSeconds(user);
+
+	IO_COUNTERS io;
+	if (GetProcessIoCounters(GetCurrentProcess(), &io))
+	{
+		usage.bytesRead = io.ReadTransferCount;
+		usage.bytesWritten = io.WriteTransferCount;
+	}
+#else
+	struct rusage resources;
+	if (getrusage(RUSAGE_SELF, &resources) == 0)
+		usage.cpuSeconds = toSeconds(resources.ru_utime) + toSeconds(resources.ru_stime);
+
+	// 'rchar' and 'wchar' count all bytes passed through read/write calls (Linux only).
+	std::ifstream io("/proc/self/io");
+	std::string key;
+	uint64_t value;
+	while (io >> key >> value)
+	{
+		if (key == "rchar:")
+			usage.bytesRead = value;
+		else if (key == "wchar:")
+			usage.bytesWritten = value;
+	}
+#endif
+
+	return usage;
+}
+
+
+ResourceUsage ResourceUsage::since(const ResourceUsage& start) const
+{
+	ResourceUsage usage;
+	usage.wallSeconds = wallSeconds - start.wallSeconds;
+	usage.cpuSeconds = cpuSeconds - start.cpuSeconds;
+	usage.peakMemory = peakMemory;
+	usage.bytesRead = bytesRead - start.bytesRead;
+	usage.bytesWritten = bytesWritten - start.bytesWritten;
+	return usage;
+}
+
+
+double getThreadCPUTime()
+{
+#if defined(_WIN64) || defined(_WIN32)
+	FILETIME creation, exit, kernel, user;
+	if (GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+		return toSeconds(kernel) + toSeconds(user);
+	return 0;
+#else
+	timespec time;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0)
+		return 0;
+	return time.tv_sec + time.tv_nsec * 1e-9;
+#endif
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Resources used by this process, e.g. for profiling the preprocessing stages.
+ *
+ * current() returns the totals since the process started; since() turns two of them into the
+ * usage of the code in between. The counters are process-wide, so code running concurrently on
+ * other threads is included.
+ */
+struct ResourceUsage
+{
+	double wallSeconds = 0;    // real time
+	double cpuSeconds = 0;     // user and system time of all threads
+	size_t peakMemory = 0;     // peak resident memory in bytes; not a difference
+	uint64_t bytesRead = 0;    // bytes read by system calls, including files served from the OS cache
+	uint64_t bytesWritten = 0; // bytes written by system calls
+
+	/** Usage of this process so far. Counters that are not available on this platform are 0. */
+	static ResourceUsage current();
+
+	/** Usage between 'start' (an earlier current()) and this one. */
+	ResourceUsage since(const ResourceUsage& start) const;
+};
+
+
+/** CPU time (user and system) of the calling thread so far, in seconds; 0 if unknown. */
+double getThreadCPUTime();
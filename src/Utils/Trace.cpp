@@ -0,0 +1,191 @@
+#include "Trace.hpp"
+
+#include "Utils/Logger.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+using namespace std;
+
+
+namespace
+{
+	// Fields are atomic, so that writeTrace can read a buffer while its thread records events.
+	struct TraceEvent
+	{
+		std::atomic<const char*> name;
+		std::atomic<int64_t> begin;
+		std::atomic<int64_t> end;
+	};
+
+
+	struct ThreadBuffer
+	{
+		int id = 0;
+		std::string name;                // guarded by the registry mutex
+		std::atomic<uint64_t> count{ 0 }; // number of events ever recorded
+		std::vector<TraceEvent> events;
+
+		explicit ThreadBuffer(int _id) :
+		    id(_id), events(traceEventsPerThread)
+		{
+		}
+	};
+
+
+	// All buffers ever created. Buffers of threads that have finished are reused by new threads,
+	// so that short-lived threads do not add up (their events stay in the buffer).
+	struct Registry
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+		std::vector<ThreadBuffer*> unused;
+		const int64_t start = getTraceTime();
+	};
+
+
+	Registry& getRegistry()
+	{
+		static Registry registry;
+		return registry;
+	}
+
+
+	// Owns the calling thread's buffer and returns it to the registry when the thread ends.
+	struct ThreadHandle
+	{
+		ThreadBuffer* buffer = nullptr;
+
+		ThreadHandle()
+		{
+			Registry& registry = getRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			if (registry.unused.empty())
+			{
+				registry.buffers.emplace_back(new ThreadBuffer((int)registry.buffers.size() + 1));
+				buffer = registry.buffers.back().get();
+			}
+			else
+			{
+				buffer = registry.unused.back();
+				registry.unused.pop_back();
+			}
+		}
+
+		~ThreadHandle()
+		{
+			Registry& registry = getRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.unused.push_back(buffer);
+		}
+	};
+
+
+	ThreadBuffer& getThreadBuffer()
+	{
+		thread_local ThreadHandle handle;
+		return *handle.buffer;
+	}
+
+
+	std::string escape(const std::string& text)
+	{
+		std::string escaped;
+		for (char c : text)
+		{
+			if (c == '"' || c == '\\')
+				escaped += '\\';
+			if ((unsigned char)c >= 0x20)
+				escaped += c;
+		}
+		return escaped;
+	}
+} // namespace
+
+
+void recordTraceEvent(const char* name, int64_t begin, int64_t end)
+{
+	ThreadBuffer& buffer = getThreadBuffer();
+	const uint64_t index = buffer.count.load(std::memory_order_relaxed);
+	TraceEvent& event = buffer.events[index % traceEventsPerThread];
+	event.name.store(name, std::memory_order_relaxed);
+	event.begin.store(begin, std::memory_order_relaxed);
+	event.end.store(end, std::memory_order_relaxed);
+	buffer.count.store(index + 1, std::memory_order_release);
+}
+
+
+void setTraceThreadName(const std::string& name)
+{
+	ThreadBuffer& buffer = getThreadBuffer();
+	std::lock_guard<std::mutex> lock(getRegistry().mutex);
+	buffer.name = name;
+}
+
+
+bool writeTrace(const std::string& filename)
+{
+	Registry& registry = getRegistry();
+	std::ofstream file(filename.c_str(), std::ios::trunc);
+	file << "{\"traceEvents\":[\n" << std::fixed << std::setprecision(3);
+
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	bool first = true;
+	size_t numberOfEvents = 0;
+	for (auto& buffer : registry.buffers)
+	{
+		if (!buffer->name.empty())
+		{
+			file << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->id
+			     << ",\"args\":{\"name\":\"" << escape(buffer->name) << "\"}}";
+			first = false;
+		}
+
+		// Copy the events first, as the thread may keep recording.
+		const uint64_t count = buffer->count.load(std::memory_order_acquire);
+		const uint64_t oldest = count > traceEventsPerThread ? count - traceEventsPerThread : 0;
+		struct Event
+		{
+			const char* name;
+			int64_t begin, end;
+		};
+		std::vector<Event> events;
+		for (uint64_t i = oldest; i < count; i++)
+		{
+			const TraceEvent& event = buffer->events[i % traceEventsPerThread];
+			events.push_back({ event.name.load(std::memory_order_relaxed),
+			                   event.begin.load(std::memory_order_relaxed),
+			                   event.end.load(std::memory_order_relaxed) });
+		}
+
+		// Drop the events that may have been overwritten while copying them.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		const uint64_t countAfter = buffer->count.load(std::memory_order_relaxed);
+		const uint64_t firstValid = countAfter >= traceEventsPerThread ? countAfter - traceEventsPerThread + 1 : 0;
+
+		for (uint64_t i = std::max(oldest, firstValid); i < count; i++)
+		{
+			const Event& event = events[i - oldest];
+			file << (first ? "" : ",\n") << "{\"ph\":\"X\",\"name\":\"" << escape(event.name) << "\",\"pid\":1,\"tid\":" << buffer->id
+			     << ",\"ts\":" << (event.begin - registry.start) / 1000. << ",\"dur\":" << (event.end - event.begin) / 1000. << "}";
+			first = false;
+			numberOfEvents++;
+		}
+	}
+
+	file << "\n]}\n";
+	if (!file)
+	{
+		LOG(WARNING) << "Could not write trace '" << filename << "'";
+		return false;
+	}
+
+	LOG(INFO) << "Wrote " << numberOfEvents << " trace events to '" << filename << "'";
+	return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+
+/**
+ * Low-overhead recorder of trace events, for seeing how threads overlap in Chrome's trace viewer
+ * (chrome://tracing or https://ui.perfetto.dev).
+ *
+ * Code is instrumented with TRACE_SCOPE("Class::function"), which records the time spent in the
+ * enclosing scope as an event of the calling thread. Every thread writes its events into its own
+ * ring buffer, so recording takes no locks; when a buffer is full, the oldest events are
+ * overwritten. writeTrace() can be called at any time and writes all recorded events.
+ *
+ * The macros only record events if the build has WITH_TRACING defined (CMake option of the same
+ * name). Otherwise, they compile to nothing.
+ */
+
+
+/** Maximum number of events kept per thread. */
+const size_t traceEventsPerThread = 1 << 16;
+
+/** Nanoseconds on the clock used for trace events. */
+inline int64_t getTraceTime()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** Records an event of the calling thread. Only the pointer to 'name' is stored, so it must be a string literal. */
+void recordTraceEvent(const char* name, int64_t begin, int64_t end);
+
+/** Names the calling thread in the trace, e.g. "Dataset loader". */
+void setTraceThreadName(const std::string& name);
+
+/** Writes all recorded events as a Chrome trace JSON file. Returns false on error. */
+bool writeTrace(const std::string& filename);
+
+
+/** Records the lifetime of the object as a trace event. Use TRACE_SCOPE instead. */
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* _name) :
+	    name(_name), begin(getTraceTime())
+	{
+	}
+
+	~TraceScope()
+	{
+		recordTraceEvent(name, begin, getTraceTime());
+	}
+
+private:
+	const char* name;
+	int64_t begin;
+};
+
+
+#ifdef WITH_TRACING
+	#define TRACE_CONCAT_IMPL(a, b) a##b
+	#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+	#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+	#define TRACE_THREAD_NAME(name) setTraceThreadName(name)
+#else
+	#define TRACE_SCOPE(name) (void)0
+	#define TRACE_THREAD_NAME(name) (void)0
+#endif
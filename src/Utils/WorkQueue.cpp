@@ -0,0 +1,274 @@
+#include "WorkQueue.hpp"
+
+#include "3rdParty/fs_std.hpp"
+
+#include "Utils/Logger.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <vector>
+
+
+using namespace std;
+
+
+namespace
+{
+	const char* PENDING = "pending";
+	const char* CLAIMED = "claimed";
+	const char* DONE = "done";
+	const char* FAILED = "failed";
+	const char* RUN = "run";
+
+
+	// Names of the task files in a directory, sorted.
+	std::vector<std::string> listTasks(const fs::path& path)
+	{
+		std::vector<std::string> names;
+		std::error_code ec;
+		for (fs::directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec))
+			names.push_back(it->path().filename().string());
+		std::sort(names.begin(), names.end());
+		return names;
+	}
+} // namespace
+
+
+WorkQueue::WorkQueue(const std::string& _directory) :
+    directory(_directory)
+{
+}
+
+
+bool WorkQueue::create(const std::map<std::string, std::string>& tasks)
+{
+	const fs::path temp = directory + ".tmp";
+	std::error_code ec;
+	fs::remove_all(temp, ec);
+	fs::create_directories(temp / PENDING, ec);
+	fs::create_directories(temp / CLAIMED, ec);
+	fs::create_directories(temp / DONE, ec);
+	fs::create_directories(temp / FAILED, ec);
+	if (ec)
+	{
+		LOG(WARNING) << "Error in WorkQueue: could not create " << temp.string() << ".";
+		return false;
+	}
+
+	// A new run id, so that workers of a previous run of the queue stop claiming tasks.
+	std::stringstream id;
+	id << std::chrono::system_clock::now().time_since_epoch().count() << "-" << std::random_device()();
+	{
+		std::ofstream file((temp / RUN).string(), ios::binary | ios::trunc);
+		file << id.str();
+		if (!file)
+		{
+			LOG(WARNING) << "Error in WorkQueue: could not write the run id.";
+			fs::remove_all(temp, ec);
+			return false;
+		}
+	}
+
+	for (auto& task : tasks)
+	{
+		std::ofstream file((temp / PENDING / task.first).string(), ios::binary | ios::trunc);
+		file << task.second;
+		if (!file)
+		{
+			LOG(WARNING) << "Error in WorkQueue: could not write task '" << task.first << "'.";
+			fs::remove_all(temp, ec);
+			return false;
+		}
+	}
+
+	fs::remove_all(directory, ec);
+	fs::rename(temp, directory, ec);
+	if (ec)
+	{
+		LOG(WARNING) << "Error in WorkQueue: could not move the queue to " << directory << ".";
+		return false;
+	}
+
+	runId = id.str();
+	return true;
+}
+
+
+bool WorkQueue::exists() const
+{
+	// The queue is moved into place as a whole, so the directory is complete once it exists.
+	std::error_code ec;
+	return fs::is_directory(fs::path(directory) / PENDING, ec);
+}
+
+
+bool WorkQueue::attach()
+{
+	std::ifstream file((fs::path(directory) / RUN).string(), ios::binary);
+	std::stringstream ss;
+	ss << file.rdbuf();
+	if (!file || ss.str().empty())
+		return false;
+
+	runId = ss.str();
+	return true;
+}
+
+
+bool WorkQueue::isCurrent() const
+{
+	std::ifstream file((fs::path(directory) / RUN).string(), ios::binary);
+	std::stringstream ss;
+	ss << file.rdbuf();
+	return file && !runId.empty() && ss.str() == runId;
+}
+
+
+void WorkQueue::heartbeat()
+{
+	std::error_code ec;
+	fs::last_write_time(fs::path(directory) / RUN, fs::file_time_type::clock::now(), ec);
+}
+
+
+double WorkQueue::getSecondsSinceHeartbeat() const
+{
+	std::error_code ec;
+	const auto time = fs::last_write_time(fs::path(directory) / RUN, ec);
+	if (ec)
+		return std::numeric_limits<double>::infinity();
+	return std::chrono::duration<double>(fs::file_time_type::clock::now() - time).count();
+}
+
+
+bool WorkQueue::claim(std::string& name, std::string& contents)
+{
+	if (!isCurrent())
+	{
+		LOG(WARNING) << "Not claiming tasks from " << directory << ", as the queue was replaced or removed.";
+		return false;
+	}
+
+	for (const std::string& task : listTasks(fs::path(directory) / PENDING))
+	{
+		const fs::path claimed = fs::path(directory) / CLAIMED / task;
+
+		// Fails if another worker was faster.
+		std::error_code ec;
+		fs::rename(fs::path(directory) / PENDING / task, claimed, ec);
+		if (ec)
+			continue;
+
+		// The time of the claim, for detecting workers that died.
+		fs::last_write_time(claimed, fs::file_time_type::clock::now(), ec);
+
+		std::ifstream file(claimed.string(), ios::binary);
+		std::stringstream ss;
+		ss << file.rdbuf();
+
+		name = task;
+		contents = ss.str();
+		return true;
+	}
+
+	return false;
+}
+
+
+bool WorkQueue::refresh(const std::string& name)
+{
+	std::error_code ec;
+	fs::last_write_time(fs::path(directory) / CLAIMED / name, fs::file_time_type::clock::now(), ec);
+	return !ec;
+}
+
+
+bool WorkQueue::complete(const std::string& name)
+{
+	std::error_code ec;
+	fs::rename(fs::path(directory) / CLAIMED / name, fs::path(directory) / DONE / name, ec);
+	if (ec)
+		LOG(WARNING) << "Error in WorkQueue: task '" << name << "' is no longer claimed.";
+	return !ec;
+}
+
+
+bool WorkQueue::fail(const std::string& name)
+{
+	std::error_code ec;
+	fs::rename(fs::path(directory) / CLAIMED / name, fs::path(directory) / FAILED / name, ec);
+	if (ec)
+		LOG(WARNING) << "Error in WorkQueue: task '" << name << "' is no longer claimed.";
+	return !ec;
+}
+
+
+bool WorkQueue::release(const std::string& name)
+{
+	std::error_code ec;
+	fs::rename(fs::path(directory) / CLAIMED / name, fs::path(directory) / PENDING / name, ec);
+	return !ec;
+}
+
+
+int WorkQueue::requeueStaleTasks(double timeout)
+{
+	const auto now = fs::file_time_type::clock::now();
+	int requeued = 0;
+	for (const std::string& task : listTasks(fs::path(directory) / CLAIMED))
+	{
+		std::error_code ec;
+		const auto claimTime = fs::last_write_time(fs::path(directory) / CLAIMED / task, ec);
+		if (ec || std::chrono::duration<double>(now - claimTime).count() < timeout)
+			continue;
+
+		if (release(task))
+		{
+			LOG(WARNING) << "Task '" << task << "' was claimed more than " << timeout << "s ago; returning it to the queue.";
+			requeued++;
+		}
+	}
+
+	return requeued;
+}
+
+
+int WorkQueue::getNumberOfPendingTasks() const
+{
+	return (int)listTasks(fs::path(directory) / PENDING).size();
+}
+
+
+int WorkQueue::getNumberOfClaimedTasks() const
+{
+	return (int)listTasks(fs::path(directory) / CLAIMED).size();
+}
+
+
+int WorkQueue::getNumberOfDoneTasks() const
+{
+	return (int)listTasks(fs::path(directory) / DONE).size();
+}
+
+
+int WorkQueue::getNumberOfFailedTasks() const
+{
+	return (int)listTasks(fs::path(directory) / FAILED).size();
+}
+
+
+bool WorkQueue::isFinished() const
+{
+	return getNumberOfPendingTasks() == 0 && getNumberOfClaimedTasks() == 0;
+}
+
+
+void WorkQueue::remove()
+{
+	std::error_code ec;
+	fs::remove_all(directory, ec);
+}
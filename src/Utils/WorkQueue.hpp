@@ -0,0 +1,87 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+
+/**
+ * Work queue shared by several processes through a common (network) file system, without a broker.
+ *
+ * Every task is a small text file in one of three subdirectories of the queue directory:
+ *   pending/  tasks waiting for a worker,
+ *   claimed/  tasks that are being processed,
+ *   done/     finished tasks,
+ *   failed/   tasks that were processed, but did not produce a result.
+ *
+ * A worker claims a task by renaming it from pending/ to claimed/. Renaming is atomic, so if
+ * several workers try to claim the same task at once, exactly one of them succeeds. Finished tasks
+ * are renamed to done/. Tasks of workers that crashed remain in claimed/ and can be handed out
+ * again after a timeout (see requeueStaleTasks), so workers that take longer need to refresh
+ * their claims in the meantime.
+ *
+ * Every queue has a run id in the file 'run', whose modification time is the last heartbeat of the
+ * coordinator. Queue objects only claim tasks while the run id they created or attached to is
+ * current, so workers stop once a new coordinator replaces the queue.
+ */
+class WorkQueue
+{
+public:
+	explicit WorkQueue(const std::string& _directory);
+
+	/**
+	 * Creates the queue with the given tasks (name -> contents), replacing any existing queue.
+	 * The queue is assembled next to its final location and then moved into place, so workers
+	 * never see a partially written queue.
+	 */
+	bool create(const std::map<std::string, std::string>& tasks);
+
+	/** Whether the queue has been created (by any process). */
+	bool exists() const;
+
+	/** Attaches to the current run of an existing queue. Returns false if there is none. */
+	bool attach();
+
+	/** Whether the queue still belongs to the run this object created or attached to. */
+	bool isCurrent() const;
+
+	/** Records that the coordinator of the queue is alive. */
+	void heartbeat();
+
+	/** Seconds since the last heartbeat of the coordinator (infinite if there is no queue). */
+	double getSecondsSinceHeartbeat() const;
+
+	/** Claims a pending task, in the order of their names. Returns false if none is pending or the run is not current. */
+	bool claim(std::string& name, std::string& contents);
+
+	/** Renews the claim of a task, so that it is not considered stale. Returns false if it is no longer claimed. */
+	bool refresh(const std::string& name);
+
+	/** Marks a claimed task as done. */
+	bool complete(const std::string& name);
+
+	/** Marks a claimed task as failed, so that it is not handed out again. */
+	bool fail(const std::string& name);
+
+	/** Returns a claimed task to the pending tasks, e.g. if it could not be processed. */
+	bool release(const std::string& name);
+
+	/** Returns tasks claimed (or refreshed) more than 'timeout' seconds ago to the pending tasks. Returns their number. */
+	int requeueStaleTasks(double timeout);
+
+	int getNumberOfPendingTasks() const;
+	int getNumberOfClaimedTasks() const;
+	int getNumberOfDoneTasks() const;
+	int getNumberOfFailedTasks() const;
+
+	/** True once all tasks are done or failed, i.e. none are pending or claimed. */
+	bool isFinished() const;
+
+	/** Deletes the queue directory. */
+	void remove();
+
+	inline const std::string& getDirectory() const { return directory; }
+
+private:
+	std::string directory;
+	std::string runId;
+};
@@ -6,6 +6,7 @@
 #include "Utils/Exceptions.hpp"
 #include "Utils/IOTools.hpp"
 #include "Utils/Logger.hpp"
+#include "Utils/Trace.hpp"
 
 #include "Viewer/ViewerApp.hpp"
 
@@ -30,7 +31,8 @@ int main(int argc, char* argv[])
 			("h, help", "Print help.")
 			("x, vr", "Render in VR using OpenVR.", cxxopts::value<bool>()->default_value("false"))
 			("v, verbose", "Verbose output.", cxxopts::value<bool>()->default_value("false"))
-			("t, texture-format", "Specify the texture format [GL_RGB|DXT1|DXT5].", cxxopts::value<string>()->default_value("GL_RGB"));
+			("t, texture-format", "Specify the texture format [GL_RGB|DXT1|DXT5].", cxxopts::value<string>()->default_value("GL_RGB"))
+			("trace", "Write a Chrome trace (chrome://tracing) of the threads to this file.", cxxopts::value<string>()->default_value(""));
 		// clang-format on
 
 		options.parse_positional({ "f" });
@@ -75,6 +77,13 @@ int main(int argc, char* argv[])
 			throw std::runtime_error("Support for OpenVR is not enabled. Option --vr is not available.");
 #endif
 
+		// Recording trace events is compiled out by default.
+		string traceFilename = vm["trace"].as<string>();
+#ifndef WITH_TRACING
+		if (!traceFilename.empty())
+			throw std::runtime_error("Tracing is not enabled. Option --trace is not available.");
+#endif
+
 		// Get the image texture format.
 		string textureFormat = vm["t"].as<string>();
 		if (textureFormat != "GL_RGB" && textureFormat != "DXT1" && textureFormat != "DXT5")
@@ -102,6 +111,8 @@ int main(int argc, char* argv[])
 
 		app = new ViewerApp(datasetPath, enableVR);
 		app->imageTextureFormat = textureFormat;
+		app->traceFilename = traceFilename;
+		TRACE_THREAD_NAME("Main");
 
 		glfwWindowHint(GLFW_RESIZABLE, GL_TRUE);
 		glfwSwapInterval(0);
@@ -124,6 +135,9 @@ int main(int argc, char* argv[])
 		// Save window position for next time.
 		app->getGLwindow()->writeUserFile();
 
+		if (!traceFilename.empty())
+			writeTrace(traceFilename);
+
 		// Clean up.
 		delete app;
 		LOG(INFO) << "Finished main()";
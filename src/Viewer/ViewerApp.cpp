@@ -14,6 +14,7 @@
 #include "Utils/Exceptions.hpp"
 #include "Utils/Logger.hpp"
 #include "Utils/Timer.hpp"
+#include "Utils/Trace.hpp"
 #include "Utils/Utils.hpp"
 
 #include <GitVersion.hpp>
@@ -460,9 +461,32 @@ void ViewerApp::loadDatasetCPU(const int dataset_idx)
 	FlowLoader* flowLoader = nullptr;
 	if (datasetBackSetting.useOpticalFlow)
 	{
-		flowLoader = new FlowLoader((datasetBackSetting.downsampleFlow > 0), imgLoader->getImageDims(),
-		                            &datasetBack->forwardFlows, &datasetBack->backwardFlows);
-		if (!flowLoader->checkAvailability())
+		// Prefer the packed flow archive, but fall back to the individual flow files.
+		if (!datasetBack->flowArchive.empty())
+		{
+			flowLoader = new FlowLoader(datasetBackSetting.flowResolution, imgLoader->getImageDims(), datasetBack->flowArchive);
+			flowLoader->setMaxLatitude(datasetBackSetting.flowMaxLatitude);
+			if (!flowLoader->checkAvailability())
+			{
+				LOG(WARNING) << "Flow archive '" << datasetBack->flowArchive << "' is not usable. Loading individual flow files instead.";
+				delete flowLoader;
+				flowLoader = nullptr;
+			}
+		}
+
+		if (!flowLoader)
+		{
+			flowLoader = new FlowLoader(datasetBackSetting.flowResolution, imgLoader->getImageDims(),
+			                            &datasetBack->forwardFlows, &datasetBack->backwardFlows);
+			flowLoader->setMaxLatitude(datasetBackSetting.flowMaxLatitude);
+		}
+
+		if (flowLoader->checkAvailability())
+		{
+			datasetBackSetting.flowScale = flowLoader->getFlowScale();
+			datasetBackSetting.flowRegion = flowLoader->getFlowRegion();
+		}
+		else
 		{
 			delete flowLoader;
 			flowLoader = nullptr;
@@ -488,13 +512,19 @@ void ViewerApp::loadDatasetCPU(const int dataset_idx)
 
 void ViewerApp::loadDatasetCPUAsync(const int dataset_idx)
 {
-	std::thread load([this, dataset_idx]() { loadDatasetCPU(dataset_idx); });
+	std::thread load([this, dataset_idx]() {
+		TRACE_THREAD_NAME("Dataset loader");
+		TRACE_SCOPE("ViewerApp::loadDatasetCPU");
+		loadDatasetCPU(dataset_idx);
+	});
 	load.detach();
 }
 
 
 void ViewerApp::loadDatasetGPU()
 {
+	TRACE_SCOPE("ViewerApp::loadDatasetGPU");
+
 	// 0) Clear previous dataset.
 	if (textureLoader)
 	{
@@ -129,6 +129,9 @@ public:
 	/** the RGB texture format in GPU. If specify DXT1 or DTX5, the image loader will compress the texture. */
 	std::string imageTextureFormat = "GL_RGB";
 
+	/** Chrome trace file written on exit and from the GUI (empty: none). Needs a build WITH_TRACING. */
+	std::string traceFilename;
+
 private:
 	bool checkForDatasets();
 	void updateCamPhiDirTexture();
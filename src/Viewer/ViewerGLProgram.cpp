@@ -28,7 +28,9 @@ void ViewerGLProgram::passUniforms(CameraInfo& camInfo)
 
 	setUniform("displayMode", settings->displayMode);
 	setUniform("useOpticalFlow", settings->useOpticalFlow);
-	setUniform("flowDownsampled", settings->downsampleFlow);
+	setUniform("flowResolution", settings->flowResolution);
+	setUniform("flowScale", settings->flowScale);
+	setUniform("flowRegion", settings->flowRegion);
 	setUniform("useEquirectCamera", settings->useEquirectCamera);
 	setUniform("fadeNearBoundary", settings->fadeNearBoundary);
 
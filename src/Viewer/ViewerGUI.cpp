@@ -3,6 +3,7 @@
 #include "3rdParty/fs_std.hpp"
 
 #include "Utils/Logger.hpp"
+#include "Utils/Trace.hpp"
 #include "Utils/Utils.hpp"
 
 #include "Viewer/ImGuiUtils.hpp"
@@ -111,6 +112,11 @@ void ViewerGUI::showSettingsWindow()
 
 		// Framerate estimate by Dear ImGUI
 		ImGui::BulletText("Rendering speed: %.2f ms", 1000.f / ImGui::GetIO().Framerate);
+
+#ifdef WITH_TRACING
+		if (!app->traceFilename.empty() && ImGui::Button("Write trace"))
+			writeTrace(app->traceFilename);
+#endif
 	}
 
 	ImGui::End();